@@ -0,0 +1,654 @@
+/*
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <vpn.h>
+#include <common.h>
+#include <gettime.h>
+#include <sec-mod.h>
+#include <ccan/hash/hash.h>
+#include <ccan/htable/htable.h>
+#include "auth/radius-client.h"
+#include "radius-queue.h"
+
+#if defined(HAVE_RADIUS) && !defined(LEGACY_RADIUS)
+
+/* The accounting requests are sent through this queue, without waiting
+ * for their replies. Start and Stop records are sent as soon as fewer
+ * than ACCT_MAX_INFLIGHT requests are outstanding. Interim updates are
+ * paced, so that the updates of many sessions which fall due together
+ * are spread over a few seconds; an update still queued when the next
+ * one of the same session arrives is replaced by it.
+ *
+ * A Stop record which is not acknowledged is retried every
+ * ACCT_RETRY_SECS. When a spool file is set, each Stop record is appended
+ * to it, followed by a mark once acknowledged, and the records found
+ * unacknowledged on startup are sent again. The spool is truncated
+ * whenever no record in it is pending.
+ */
+
+#define ACCT_MAX_INFLIGHT 128
+#define ACCT_INTERIM_MIN_RATE 10 /* per second */
+#define ACCT_INTERIM_SPREAD_SECS 10
+#define ACCT_RETRY_SECS 30
+
+#define ACCT_MAX_RECORD (16*1024)
+#define ACCT_MAX_ATTR_LEN 253
+
+#define SPOOL_MAGIC 0x4f435350
+#define SPOOL_ADD 1
+#define SPOOL_DONE 2
+
+struct spool_hdr_st {
+	uint32_t magic;
+	uint32_t op;
+	uint32_t seq;
+	uint32_t time;
+	uint32_t size; /* of the serialized record following a SPOOL_ADD */
+};
+
+/* the attributes of a record are kept serialized as a sequence of these
+ * headers, each followed by the value of non-integer attributes */
+struct attr_hdr_st {
+	uint32_t attribute;
+	uint32_t type;
+	uint32_t lvalue;
+};
+
+struct acct_rec_st {
+	struct list_node list; /* in one of the queue's lists unless in flight */
+	struct acct_queue_st *q;
+	unsigned status_type;
+	char *sid;
+
+	uint8_t *data;
+	unsigned data_size;
+
+	time_t created;
+	time_t retry_at;
+	uint32_t seq; /* in the spool, or zero */
+	struct rad_req_st *req;
+};
+
+struct acct_queue_st {
+	rc_handle *rh;
+	struct rad_client_st *client;
+	void *recs; /* the parent of all records */
+
+	struct list_head urgent; /* Start and Stop records */
+	struct list_head interim;
+	unsigned interim_size;
+	struct htable interim_sids; /* the queued interim updates by session */
+	struct list_head retry; /* ordered by retry time */
+	unsigned inflight;
+
+	unsigned tokens; /* interim updates which may be sent this second */
+	time_t tokens_time;
+
+	int spool_fd;
+	uint32_t next_seq;
+	unsigned spooled; /* records in the spool not acknowledged */
+
+	sec_watch_st timer;
+};
+
+static time_t now_secs(void)
+{
+	struct timespec now;
+
+	gettime(&now);
+	return now.tv_sec;
+}
+
+static size_t rehash(const void *_e, void *unused)
+{
+	const struct acct_rec_st *e = _e;
+
+	return hash_any(e->sid, strlen(e->sid), 0);
+}
+
+static bool sid_cmp(const void *_c1, void *_c2)
+{
+	const struct acct_rec_st *c1 = _c1;
+	const char *sid = _c2;
+
+	return strcmp(c1->sid, sid) == 0;
+}
+
+static unsigned attr_is_int(int type)
+{
+	return (type == PW_TYPE_INTEGER || type == PW_TYPE_IPADDR || type == PW_TYPE_DATE);
+}
+
+static int serialize(struct acct_rec_st *rec, VALUE_PAIR *send)
+{
+	struct attr_hdr_st hdr;
+	VALUE_PAIR *vp;
+	unsigned size = 0, len;
+	uint8_t *p;
+
+	for (vp = send; vp != NULL; vp = vp->next)
+		size += sizeof(hdr) + (attr_is_int(vp->type) ? 0 : vp->lvalue);
+
+	if (size > ACCT_MAX_RECORD)
+		return -1;
+
+	rec->data = talloc_size(rec, size);
+	if (rec->data == NULL)
+		return -1;
+
+	p = rec->data;
+	for (vp = send; vp != NULL; vp = vp->next) {
+		len = attr_is_int(vp->type) ? 0 : vp->lvalue;
+
+		hdr.attribute = vp->attribute;
+		hdr.type = vp->type;
+		hdr.lvalue = vp->lvalue;
+		memcpy(p, &hdr, sizeof(hdr));
+		p += sizeof(hdr);
+
+		memcpy(p, vp->strvalue, len);
+		p += len;
+	}
+	rec->data_size = size;
+
+	return 0;
+}
+
+static VALUE_PAIR *deserialize(struct acct_queue_st *q, struct acct_rec_st *rec)
+{
+	VALUE_PAIR *send = NULL;
+	struct attr_hdr_st hdr;
+	unsigned pos = 0;
+	const void *val;
+	int len;
+
+	while (pos + sizeof(hdr) <= rec->data_size) {
+		memcpy(&hdr, rec->data + pos, sizeof(hdr));
+		pos += sizeof(hdr);
+
+		if (attr_is_int(hdr.type)) {
+			val = &hdr.lvalue;
+			len = -1;
+		} else {
+			if (hdr.lvalue > ACCT_MAX_ATTR_LEN || pos + hdr.lvalue > rec->data_size)
+				goto fail;
+			val = rec->data + pos;
+			len = hdr.lvalue;
+			pos += len;
+		}
+
+		if (rc_avpair_add(q->rh, &send, hdr.attribute & 0xffff, val, len,
+				  hdr.attribute >> 16) == NULL)
+			goto fail;
+	}
+
+	if (pos != rec->data_size)
+		goto fail;
+
+	return send;
+ fail:
+	if (send != NULL)
+		rc_avpair_free(send);
+	return NULL;
+}
+
+static void spool_write(struct acct_queue_st *q, unsigned op, struct acct_rec_st *rec)
+{
+	struct spool_hdr_st hdr;
+	struct iovec iov[2];
+	ssize_t ret, size;
+	int e;
+
+	hdr.magic = SPOOL_MAGIC;
+	hdr.op = op;
+	hdr.seq = rec->seq;
+	hdr.time = rec->created;
+	hdr.size = (op == SPOOL_ADD) ? rec->data_size : 0;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = rec->data;
+	iov[1].iov_len = hdr.size;
+	size = sizeof(hdr) + hdr.size;
+
+	ret = writev(q->spool_fd, iov, (op == SPOOL_ADD) ? 2 : 1);
+	if (ret != size) {
+		e = errno;
+		syslog(LOG_ERR, "radius-acct: error writing to the spool: %s",
+		       (ret == -1) ? strerror(e) : "short write");
+	}
+}
+
+static struct acct_rec_st *new_rec(struct acct_queue_st *q, unsigned status_type, const char *sid)
+{
+	struct acct_rec_st *rec;
+
+	rec = talloc_zero(q->recs, struct acct_rec_st);
+	if (rec == NULL)
+		return NULL;
+
+	rec->q = q;
+	rec->status_type = status_type;
+	rec->created = now_secs();
+
+	if (sid != NULL) {
+		rec->sid = talloc_strdup(rec, sid);
+		if (rec->sid == NULL) {
+			talloc_free(rec);
+			return NULL;
+		}
+	}
+
+	return rec;
+}
+
+/* Removes a queued interim update */
+static void unqueue_interim(struct acct_queue_st *q, struct acct_rec_st *rec)
+{
+	list_del(&rec->list);
+	htable_del(&q->interim_sids, rehash(rec, NULL), rec);
+	q->interim_size--;
+}
+
+/* Releases a record that is acknowledged, or that cannot be sent */
+static void finish(struct acct_queue_st *q, struct acct_rec_st *rec)
+{
+	if (rec->seq != 0 && q->spool_fd != -1) {
+		spool_write(q, SPOOL_DONE, rec);
+
+		if (--q->spooled == 0 && ftruncate(q->spool_fd, 0) == -1)
+			syslog(LOG_ERR, "radius-acct: error truncating the spool");
+	}
+
+	talloc_free(rec);
+}
+
+/* Stop records are retried, and anything else is dropped */
+static void failed(struct acct_queue_st *q, struct acct_rec_st *rec)
+{
+	if (rec->status_type == PW_STATUS_STOP) {
+		rec->retry_at = now_secs() + ACCT_RETRY_SECS;
+		list_add_tail(&q->retry, &rec->list);
+	} else {
+		talloc_free(rec);
+	}
+}
+
+static void pump(struct acct_queue_st *q);
+
+static void acct_done(void *priv, int code, VALUE_PAIR *recvd)
+{
+	struct acct_rec_st *rec = priv;
+	struct acct_queue_st *q = rec->q;
+
+	rec->req = NULL;
+	q->inflight--;
+
+	if (code == PW_ACCOUNTING_RESPONSE) {
+		finish(q, rec);
+	} else {
+		syslog(LOG_INFO, "radius-acct: accounting record (%u) was not acknowledged%s",
+		       rec->status_type, (rec->status_type == PW_STATUS_STOP) ? "; will retry" : "");
+		failed(q, rec);
+	}
+
+	pump(q);
+}
+
+static void send_rec(struct acct_queue_st *q, struct acct_rec_st *rec)
+{
+	VALUE_PAIR *send;
+	uint32_t delay;
+
+	send = deserialize(q, rec);
+	if (send == NULL) {
+		syslog(LOG_ERR, "radius-acct: cannot decode accounting record; discarding it");
+		finish(q, rec);
+		return;
+	}
+
+	delay = now_secs() - rec->created;
+	if (delay > 0 && rc_avpair_add(q->rh, &send, PW_ACCT_DELAY_TIME, &delay, -1, 0) == NULL) {
+		rc_avpair_free(send);
+		failed(q, rec);
+		return;
+	}
+
+	rec->req = rad_client_send(q->client, rec, send, acct_done, rec);
+	if (rec->req == NULL) {
+		rc_avpair_free(send);
+		failed(q, rec);
+		return;
+	}
+
+	q->inflight++;
+}
+
+static void pump(struct acct_queue_st *q)
+{
+	struct acct_rec_st *rec;
+	time_t now = now_secs();
+
+	if (now != q->tokens_time) {
+		q->tokens = q->interim_size / ACCT_INTERIM_SPREAD_SECS;
+		if (q->tokens < ACCT_INTERIM_MIN_RATE)
+			q->tokens = ACCT_INTERIM_MIN_RATE;
+		q->tokens_time = now;
+	}
+
+	while (q->inflight < ACCT_MAX_INFLIGHT) {
+		rec = list_top(&q->urgent, struct acct_rec_st, list);
+		if (rec != NULL) {
+			list_del(&rec->list);
+		} else {
+			if (q->tokens == 0)
+				break;
+
+			rec = list_top(&q->interim, struct acct_rec_st, list);
+			if (rec == NULL)
+				break;
+
+			unqueue_interim(q, rec);
+			q->tokens--;
+		}
+
+		send_rec(q, rec);
+	}
+}
+
+static int timer_timeout(void *priv)
+{
+	struct acct_queue_st *q = priv;
+	struct acct_rec_st *rec;
+	struct timespec now;
+	int t = -1, r;
+
+	gettime(&now);
+
+	rec = list_top(&q->retry, struct acct_rec_st, list);
+	if (rec != NULL)
+		t = (rec->retry_at <= now.tv_sec) ? 0 : (rec->retry_at - now.tv_sec) * 1000;
+
+	/* the tokens are renewed every second */
+	if (!list_empty(&q->interim) && q->inflight < ACCT_MAX_INFLIGHT) {
+		r = (now.tv_sec != q->tokens_time) ? 0 : 1000 - now.tv_nsec / 1000000;
+		if (t == -1 || r < t)
+			t = r;
+	}
+
+	return t;
+}
+
+static void timer_process(void *priv)
+{
+	struct acct_queue_st *q = priv;
+	struct acct_rec_st *rec;
+	time_t now = now_secs();
+
+	while ((rec = list_top(&q->retry, struct acct_rec_st, list)) != NULL &&
+	       rec->retry_at <= now) {
+		list_del(&rec->list);
+		list_add_tail(&q->urgent, &rec->list);
+	}
+
+	pump(q);
+}
+
+static int read_all(int fd, void *data, size_t size)
+{
+	ssize_t ret;
+	size_t pos = 0;
+
+	while (pos < size) {
+		ret = read(fd, (uint8_t*)data + pos, size - pos);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		pos += ret;
+	}
+	return 0;
+}
+
+/* Reads the records pending in the spool, queues them, and replaces
+ * the spool with one holding only these. A truncated or corrupt
+ * entry ends the spool. */
+static int spool_load(struct acct_queue_st *q, const char *file)
+{
+	struct spool_hdr_st hdr;
+	struct acct_rec_st *rec, *pos;
+	struct list_head pending;
+	char *tmp;
+	unsigned n = 0;
+	int fd, e;
+
+	list_head_init(&pending);
+
+	fd = open(file, O_RDONLY|O_CREAT|O_CLOEXEC, 0600);
+	if (fd == -1) {
+		e = errno;
+		syslog(LOG_ERR, "radius-acct: cannot open spool %s: %s", file, strerror(e));
+		return -1;
+	}
+
+	while (read_all(fd, &hdr, sizeof(hdr)) == 0 && hdr.magic == SPOOL_MAGIC) {
+		if (hdr.op == SPOOL_ADD) {
+			if (hdr.size > ACCT_MAX_RECORD)
+				break;
+
+			rec = new_rec(q, PW_STATUS_STOP, NULL);
+			if (rec == NULL)
+				break;
+
+			rec->data = talloc_size(rec, hdr.size);
+			if (rec->data == NULL || read_all(fd, rec->data, hdr.size) < 0) {
+				talloc_free(rec);
+				break;
+			}
+			rec->data_size = hdr.size;
+			rec->seq = hdr.seq;
+			rec->created = hdr.time;
+			list_add_tail(&pending, &rec->list);
+		} else if (hdr.op == SPOOL_DONE) {
+			list_for_each(&pending, rec, list) {
+				if (rec->seq == hdr.seq) {
+					list_del(&rec->list);
+					talloc_free(rec);
+					break;
+				}
+			}
+		} else {
+			break;
+		}
+
+		if (hdr.seq >= q->next_seq)
+			q->next_seq = hdr.seq + 1;
+	}
+	close(fd);
+
+	tmp = talloc_asprintf(q, "%s.tmp", file);
+	if (tmp == NULL)
+		return -1;
+
+	q->spool_fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0600);
+	if (q->spool_fd == -1) {
+		e = errno;
+		syslog(LOG_ERR, "radius-acct: cannot open spool %s: %s", tmp, strerror(e));
+		return -1;
+	}
+
+	list_for_each_safe(&pending, rec, pos, list) {
+		list_del(&rec->list);
+		spool_write(q, SPOOL_ADD, rec);
+		q->spooled++;
+		list_add_tail(&q->urgent, &rec->list);
+		n++;
+	}
+
+	if (fsync(q->spool_fd) == -1 || rename(tmp, file) == -1) {
+		e = errno;
+		syslog(LOG_ERR, "radius-acct: cannot replace spool %s: %s", file, strerror(e));
+		return -1;
+	}
+	talloc_free(tmp);
+
+	if (n > 0)
+		syslog(LOG_INFO, "radius-acct: sending %u unacknowledged stop records from %s", n, file);
+
+	return 0;
+}
+
+struct acct_queue_st *acct_queue_init(void *pool, rc_handle *rh, const char *spool)
+{
+	struct acct_queue_st *q;
+
+	q = talloc_zero(pool, struct acct_queue_st);
+	if (q == NULL)
+		return NULL;
+
+	q->rh = rh;
+	q->spool_fd = -1;
+	q->next_seq = 1;
+	list_head_init(&q->urgent);
+	list_head_init(&q->interim);
+	list_head_init(&q->retry);
+	htable_init(&q->interim_sids, rehash, NULL);
+
+	q->recs = talloc_new(q);
+	if (q->recs == NULL)
+		goto fail;
+
+	q->client = rad_client_init(q, rh, 1);
+	if (q->client == NULL)
+		goto fail;
+
+	if (spool != NULL && spool_load(q, spool) < 0)
+		goto fail;
+
+	q->timer.fd = -1;
+	q->timer.timeout = timer_timeout;
+	q->timer.process = timer_process;
+	q->timer.priv = q;
+	sec_watch_add(&q->timer);
+
+	pump(q);
+
+	return q;
+ fail:
+	talloc_free(q->recs);
+	if (q->client != NULL)
+		rad_client_deinit(q->client);
+	if (q->spool_fd != -1)
+		close(q->spool_fd);
+	talloc_free(q);
+	return NULL;
+}
+
+/* The Stop records that are not acknowledged remain in the spool */
+void acct_queue_deinit(struct acct_queue_st *q)
+{
+	if (q == NULL)
+		return;
+
+	sec_watch_del(&q->timer);
+
+	/* the outstanding requests are released with their records */
+	talloc_free(q->recs);
+	htable_clear(&q->interim_sids);
+	rad_client_deinit(q->client);
+
+	if (q->spool_fd != -1)
+		close(q->spool_fd);
+	talloc_free(q);
+}
+
+/* Queues an accounting request of the given status type for the
+ * session. The attributes are copied, and send is released. */
+int acct_queue_add(struct acct_queue_st *q, unsigned status_type,
+		   const char *sid, VALUE_PAIR *send)
+{
+	struct acct_rec_st *rec, *old = NULL;
+	int ret;
+
+	rec = new_rec(q, status_type, sid);
+	if (rec == NULL) {
+		rc_avpair_free(send);
+		return -1;
+	}
+
+	ret = serialize(rec, send);
+	rc_avpair_free(send);
+	if (ret < 0) {
+		talloc_free(rec);
+		return -1;
+	}
+
+	if (sid != NULL)
+		old = htable_get(&q->interim_sids, hash_any(sid, strlen(sid), 0), sid_cmp, (void*)sid);
+
+	if (status_type == PW_STATUS_ALIVE && sid != NULL) {
+		if (old != NULL) {
+			/* the newer update replaces the queued one */
+			talloc_free(old->data);
+			old->data = talloc_steal(old, rec->data);
+			old->data_size = rec->data_size;
+			old->created = rec->created;
+			talloc_free(rec);
+			return 0;
+		}
+
+		if (htable_add(&q->interim_sids, rehash(rec, NULL), rec) == 0) {
+			talloc_free(rec);
+			return -1;
+		}
+		list_add_tail(&q->interim, &rec->list);
+		q->interim_size++;
+	} else {
+		if (status_type == PW_STATUS_STOP) {
+			/* superseded by the stop record */
+			if (old != NULL) {
+				unqueue_interim(q, old);
+				talloc_free(old);
+			}
+
+			if (q->spool_fd != -1) {
+				rec->seq = q->next_seq++;
+				if (q->next_seq == 0)
+					q->next_seq = 1;
+				spool_write(q, SPOOL_ADD, rec);
+				q->spooled++;
+			}
+		}
+		list_add_tail(&q->urgent, &rec->list);
+	}
+
+	pump(q);
+	return 0;
+}
+
+#endif
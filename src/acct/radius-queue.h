@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ACCT_RADIUS_QUEUE_H
+#define ACCT_RADIUS_QUEUE_H
+
+#if defined(HAVE_RADIUS) && !defined(LEGACY_RADIUS)
+
+#include <radcli/radcli.h>
+
+struct acct_queue_st;
+
+struct acct_queue_st *acct_queue_init(void *pool, rc_handle *rh, const char *spool);
+void acct_queue_deinit(struct acct_queue_st *q);
+
+int acct_queue_add(struct acct_queue_st *q, unsigned status_type,
+		   const char *sid, VALUE_PAIR *send);
+
+#endif
+
+#endif
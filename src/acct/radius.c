@@ -40,10 +40,14 @@
 #include <sec-mod-acct.h>
 #include "auth/radius.h"
 #include "acct/radius.h"
+#include "acct/radius-queue.h"
 #include "common-config.h"
 
 static rc_handle *rh = NULL;
 static char nas_identifier[64];
+#ifndef LEGACY_RADIUS
+static struct acct_queue_st *queue = NULL;
+#endif
 
 static void acct_radius_global_init(void *pool, void *additional)
 {
@@ -67,6 +71,14 @@ static void acct_radius_global_init(void *pool, void *additional)
 		exit(1);
 	}
 
+#ifndef LEGACY_RADIUS
+	queue = acct_queue_init(pool, rh, config->spool);
+	if (queue == NULL) {
+		fprintf(stderr, "error initializing the radius accounting queue\n");
+		exit(1);
+	}
+#endif
+
 	return;
  fail:
  	fprintf(stderr, "radius acct initialization error\n");
@@ -76,6 +88,10 @@ static void acct_radius_global_init(void *pool, void *additional)
 
 static void acct_radius_global_deinit(void)
 {
+#ifndef LEGACY_RADIUS
+	acct_queue_deinit(queue);
+	queue = NULL;
+#endif
 	if (rh != NULL)
 		rc_destroy(rh);
 }
@@ -188,11 +204,43 @@ static void append_acct_standard(rc_handle *rh, const common_auth_info_st *ai, V
 	return;
 }
 
+/* Sends the accounting request and releases it. Unless the legacy
+ * client is used, the request is only queued, and OK_RC is returned
+ * without waiting for the reply.
+ */
+static int acct_send(const common_auth_info_st *ai, uint32_t status_type, VALUE_PAIR *send)
+{
+#ifdef LEGACY_RADIUS
+	VALUE_PAIR *recvd = NULL;
+	int ret;
+
+	ret = rc_aaa(rh, ai->id, send, &recvd, NULL, 1, PW_ACCOUNTING_REQUEST);
+	if (recvd != NULL)
+		rc_avpair_free(recvd);
+	rc_avpair_free(send);
+
+	return ret;
+#else
+	uint32_t port = ai->id;
+
+	/* as rc_aaa() does */
+	if (port != 0 && rc_avpair_add(rh, &send, PW_NAS_PORT, &port, -1, 0) == NULL) {
+		rc_avpair_free(send);
+		return ERROR_RC;
+	}
+
+	if (acct_queue_add(queue, status_type, ai->psid, send) < 0)
+		return ERROR_RC;
+
+	return OK_RC;
+#endif
+}
+
 static void radius_acct_session_stats(unsigned auth_method, void *ctx, const common_auth_info_st *ai, stats_st *stats)
 {
 int ret;
 uint32_t status_type;
-VALUE_PAIR *send = NULL, *recvd = NULL;
+VALUE_PAIR *send = NULL;
 
 	status_type = PW_STATUS_ALIVE;
 
@@ -206,13 +254,11 @@ VALUE_PAIR *send = NULL, *recvd = NULL;
 	append_acct_standard(rh, ai, &send);
 	append_stats(rh, &send, stats);
 
-	ret = rc_aaa(rh, ai->id, send, &recvd, NULL, 1, PW_ACCOUNTING_REQUEST);
-
-	if (recvd != NULL)
-		rc_avpair_free(recvd);
+	ret = acct_send(ai, status_type, send);
+	send = NULL;
 
 	if (ret != OK_RC) {
-		syslog(LOG_AUTH, "radius-auth: radius_open_session: %d", ret);
+		syslog(LOG_AUTH, "radius-auth: radius_acct_session_stats: %d", ret);
 		goto cleanup;
 	}
 
@@ -225,7 +271,7 @@ static int radius_acct_open_session(unsigned auth_method, void *ctx, const commo
 {
 int ret;
 uint32_t status_type;
-VALUE_PAIR *send = NULL, *recvd = NULL;
+VALUE_PAIR *send = NULL;
 
 	status_type = PW_STATUS_START;
 
@@ -243,10 +289,8 @@ VALUE_PAIR *send = NULL, *recvd = NULL;
 
 	append_acct_standard(rh, ai, &send);
 
-	ret = rc_aaa(rh, ai->id, send, &recvd, NULL, 1, PW_ACCOUNTING_REQUEST);
-
-	if (recvd != NULL)
-		rc_avpair_free(recvd);
+	ret = acct_send(ai, status_type, send);
+	send = NULL;
 
 	if (ret != OK_RC) {
 		syslog(LOG_AUTH, "radius-auth: radius_open_session: %d", ret);
@@ -264,7 +308,7 @@ static void radius_acct_close_session(unsigned auth_method, void *ctx, const com
 {
 int ret;
 uint32_t status_type;
-VALUE_PAIR *send = NULL, *recvd = NULL;
+VALUE_PAIR *send = NULL;
 
 	status_type = PW_STATUS_STOP;
 
@@ -293,9 +337,8 @@ VALUE_PAIR *send = NULL, *recvd = NULL;
 	append_acct_standard(rh, ai, &send);
 	append_stats(rh, &send, stats);
 
-	ret = rc_aaa(rh, ai->id, send, &recvd, NULL, 1, PW_ACCOUNTING_REQUEST);
-	if (recvd != NULL)
-		rc_avpair_free(recvd);
+	ret = acct_send(ai, status_type, send);
+	send = NULL;
 
 	if (ret != OK_RC) {
 		syslog(LOG_INFO, "radius-auth: radius_close_session: %d", ret);
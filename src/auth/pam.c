@@ -58,6 +58,42 @@ enum {
 	PAM_S_COMPLETE,
 };
 
+#ifdef HAVE_PAM_THREADS
+# include <unistd.h>
+# include <errno.h>
+# include <signal.h>
+# include <pthread.h>
+# include <common.h>
+# include <cloexec.h>
+# include <sec-mod.h>
+
+/* When the threads option is set, the PAM transactions run on a pool of
+ * threads rather than on coroutines of sec-mod, so that modules which
+ * perform network I/O (e.g., LDAP or OTP) do not block sec-mod. A
+ * transaction is started once the first password is received, and
+ * occupies a thread until it completes. Its prompts and result are
+ * passed to the sec-mod loop over a pipe, and the thread waits for the
+ * client's reply to any further prompts. Transactions in excess of the
+ * pool size wait for a thread to become available.
+ */
+struct pam_pool_st {
+	pthread_mutex_t lock;
+	pthread_cond_t jobs_cond;
+	pthread_cond_t reply_cond;
+	struct list_head jobs; /* transactions waiting for a thread */
+	struct list_head done; /* prompts and results for sec-mod */
+	unsigned terminate;
+
+	int fd[2];
+	sec_watch_st watch;
+};
+
+static struct pam_pool_st *tpool = NULL;
+
+static int thread_wait_for_pass(struct pam_ctx_st *pctx);
+static int pam_auth_pass(void* ctx, const char* pass, unsigned pass_len);
+#endif
+
 static int ocserv_conv(int msg_size, const struct pam_message **msg, 
 		struct pam_response **resp, void *uptr)
 {
@@ -96,10 +132,21 @@ unsigned i;
 
 				syslog(LOG_DEBUG, "PAM-auth conv: echo-%s, msg: '%s'", (msg[i]->msg_style==PAM_PROMPT_ECHO_ON)?"on":"off", msg[i]->msg!=NULL?msg[i]->msg:"");
 
-				pctx->state = PAM_S_WAIT_FOR_PASS;
-				pctx->cr_ret = PAM_SUCCESS;
-				co_resume();
-				pctx->state = PAM_S_INIT;
+#ifdef HAVE_PAM_THREADS
+				if (pctx->threaded) {
+					if (thread_wait_for_pass(pctx) < 0) {
+						free(pctx->replies);
+						pctx->replies = NULL;
+						return PAM_CONV_ERR;
+					}
+				} else
+#endif
+				{
+					pctx->state = PAM_S_WAIT_FOR_PASS;
+					pctx->cr_ret = PAM_SUCCESS;
+					co_resume();
+					pctx->state = PAM_S_INIT;
+				}
 
 				pctx->replies[i].resp = strdup(pctx->password);
 				pctx->sent_msg = 0;
@@ -112,9 +159,8 @@ unsigned i;
 	return PAM_SUCCESS;  
 }
 
-static void co_auth_user(void* data)
+static void pam_transaction(struct pam_ctx_st * pctx)
 {
-struct pam_ctx_st * pctx = data;
 int pret;
 
 	pctx->state = PAM_S_INIT;
@@ -123,7 +169,7 @@ int pret;
 	if (pret != PAM_SUCCESS) {
 		syslog(LOG_INFO, "PAM authenticate error: %s", pam_strerror(pctx->ph, pret));
 		pctx->cr_ret = pret;
-		goto wait;
+		return;
 	}
 	
 	pret = pam_acct_mgmt(pctx->ph, 0);
@@ -138,18 +184,255 @@ int pret;
 	if (pret != PAM_SUCCESS) {
 		syslog(LOG_INFO, "PAM acct-mgmt error: %s", pam_strerror(pctx->ph, pret));
 		pctx->cr_ret = pret;
-		goto wait;
+		return;
 	}
 	
 	pctx->state = PAM_S_COMPLETE;
 	pctx->cr_ret = PAM_SUCCESS;
+}
+
+static void co_auth_user(void* data)
+{
+struct pam_ctx_st * pctx = data;
+
+	pam_transaction(pctx);
 
-wait:
 	while(1) {
 		co_resume();
 	}
 }
 
+/* Returns the result of the transaction once control is back to sec-mod */
+static int pam_result(struct pam_ctx_st * pctx, const char *func)
+{
+	if (pctx->cr_ret != PAM_SUCCESS) {
+		syslog(LOG_AUTH, "PAM-auth %s: %s", func, pam_strerror(pctx->ph, pctx->cr_ret));
+		return ERR_AUTH_FAIL;
+	}
+	
+	if (pctx->state != PAM_S_COMPLETE)
+		return ERR_AUTH_CONTINUE;
+
+	return 0;
+}
+
+#ifdef HAVE_PAM_THREADS
+static void pam_pool_notify(void)
+{
+	char c = 0;
+	int ret;
+
+	do {
+		ret = write(tpool->fd[1], &c, 1);
+	} while (ret == -1 && errno == EINTR);
+}
+
+/* Passes the prompt to sec-mod and waits for the client's reply.
+ * Returns -1 if the transaction was cancelled. */
+static int thread_wait_for_pass(struct pam_ctx_st *pctx)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&tpool->lock);
+	if (pctx->has_password == 0) {
+		pctx->state = PAM_S_WAIT_FOR_PASS;
+		pctx->cr_ret = PAM_SUCCESS;
+		pctx->in_done = 1;
+		list_add_tail(&tpool->done, &pctx->list);
+		pam_pool_notify();
+
+		while (pctx->has_password == 0 && pctx->cancelled == 0 && tpool->terminate == 0)
+			pthread_cond_wait(&tpool->reply_cond, &tpool->lock);
+	}
+
+	if (pctx->has_password == 0)
+		ret = -1;
+	pctx->state = PAM_S_INIT;
+	pctx->has_password = 0;
+	pthread_mutex_unlock(&tpool->lock);
+
+	return ret;
+}
+
+static void *pam_pool_thread(void *arg)
+{
+	struct pam_ctx_st *pctx;
+	sigset_t set;
+
+	/* signals are handled by sec-mod's thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, NULL);
+
+	pthread_mutex_lock(&tpool->lock);
+	for (;;) {
+		while (tpool->terminate == 0 && list_empty(&tpool->jobs))
+			pthread_cond_wait(&tpool->jobs_cond, &tpool->lock);
+
+		if (tpool->terminate != 0)
+			break;
+
+		pctx = list_top(&tpool->jobs, struct pam_ctx_st, list);
+		list_del(&pctx->list);
+		pctx->in_jobs = 0;
+		pctx->running = 1;
+		pthread_mutex_unlock(&tpool->lock);
+
+		pam_transaction(pctx);
+
+		pthread_mutex_lock(&tpool->lock);
+		pctx->running = 0;
+		if (pctx->in_done == 0) {
+			pctx->in_done = 1;
+			list_add_tail(&tpool->done, &pctx->list);
+		}
+		pam_pool_notify();
+	}
+	pthread_mutex_unlock(&tpool->lock);
+
+	return NULL;
+}
+
+static void pam_ctx_free(struct pam_ctx_st * pctx);
+
+/* Called by the sec-mod loop when the threads have prompts or results */
+static void pam_pool_process(void *priv)
+{
+	struct pam_ctx_st *pctx;
+	char buf[64];
+	unsigned running;
+	int ret;
+
+	while (read(tpool->fd[0], buf, sizeof(buf)) > 0)
+		;
+
+	for (;;) {
+		pthread_mutex_lock(&tpool->lock);
+		pctx = list_top(&tpool->done, struct pam_ctx_st, list);
+		if (pctx != NULL) {
+			list_del(&pctx->list);
+			pctx->in_done = 0;
+			running = pctx->running;
+		}
+		pthread_mutex_unlock(&tpool->lock);
+
+		if (pctx == NULL)
+			return;
+
+		if (pctx->cancelled) {
+			/* released when the thread is done with it */
+			if (running == 0)
+				pam_ctx_free(pctx);
+			continue;
+		}
+
+		ret = pam_result(pctx, __func__);
+		pctx->done(pctx->done_priv, ret);
+	}
+}
+
+static void pam_global_init(void *pool, void *additional)
+{
+	struct pam_cfg_st *config = additional;
+	pthread_t thread;
+	unsigned i;
+	int ret;
+
+	if (config == NULL || config->threads == 0)
+		return;
+
+	tpool = talloc_zero(pool, struct pam_pool_st);
+	if (tpool == NULL)
+		goto fail;
+
+	pthread_mutex_init(&tpool->lock, NULL);
+	pthread_cond_init(&tpool->jobs_cond, NULL);
+	pthread_cond_init(&tpool->reply_cond, NULL);
+	list_head_init(&tpool->jobs);
+	list_head_init(&tpool->done);
+
+	if (pipe(tpool->fd) < 0)
+		goto fail;
+
+	for (i = 0; i < 2; i++) {
+		set_cloexec_flag(tpool->fd[i], 1);
+		set_non_block(tpool->fd[i]);
+	}
+
+	for (i = 0; i < config->threads; i++) {
+		ret = pthread_create(&thread, NULL, pam_pool_thread, NULL);
+		if (ret != 0)
+			goto fail;
+		pthread_detach(thread);
+	}
+
+	tpool->watch.fd = tpool->fd[0];
+	tpool->watch.timeout = NULL;
+	tpool->watch.process = pam_pool_process;
+	tpool->watch.priv = NULL;
+	sec_watch_add(&tpool->watch);
+
+	syslog(LOG_INFO, "PAM-auth: started %u threads", config->threads);
+	return;
+ fail:
+	fprintf(stderr, "PAM thread pool initialization error\n");
+	exit(1);
+}
+
+static void pam_global_deinit(void)
+{
+	if (tpool == NULL)
+		return;
+
+	sec_watch_del(&tpool->watch);
+
+	/* the threads may be blocked by PAM modules; they are not waited for */
+	pthread_mutex_lock(&tpool->lock);
+	tpool->terminate = 1;
+	pthread_cond_broadcast(&tpool->jobs_cond);
+	pthread_cond_broadcast(&tpool->reply_cond);
+	pthread_mutex_unlock(&tpool->lock);
+}
+
+/* Starts the transaction, or resumes it with the client's reply */
+static int pam_auth_pass_async(void* ctx, const char* pass, unsigned pass_len,
+			       auth_done_func done, void *priv)
+{
+struct pam_ctx_st * pctx = ctx;
+int ret = ERR_AUTH_PENDING;
+
+	if (pctx->threaded == 0)
+		return pam_auth_pass(ctx, pass, pass_len);
+
+	if (pass == NULL || pass_len+1 > sizeof(pctx->password))
+		return -1;
+
+	pthread_mutex_lock(&tpool->lock);
+	if (pctx->started == 0) {
+		pctx->started = 1;
+		pctx->in_jobs = 1;
+		list_add_tail(&tpool->jobs, &pctx->list);
+		pthread_cond_signal(&tpool->jobs_cond);
+	} else if (pctx->running != 0 && pctx->in_done == 0 &&
+		   pctx->state == PAM_S_WAIT_FOR_PASS && pctx->has_password == 0) {
+		pthread_cond_broadcast(&tpool->reply_cond);
+	} else {
+		syslog(LOG_AUTH, "PAM auth: conversation in wrong state (%d/expecting %d)", pctx->state, PAM_S_WAIT_FOR_PASS);
+		ret = ERR_AUTH_FAIL;
+		goto cleanup;
+	}
+
+	memcpy(pctx->password, pass, pass_len);
+	pctx->password[pass_len] = 0;
+	pctx->has_password = 1;
+	pctx->done = done;
+	pctx->done_priv = priv;
+
+ cleanup:
+	pthread_mutex_unlock(&tpool->lock);
+	return ret;
+}
+#endif
+
 static int pam_auth_init(void** ctx, void *pool, const char* user, const char* ip, const char *our_ip, unsigned pid)
 {
 int pret;
@@ -175,9 +458,18 @@ struct pam_ctx_st * pctx;
 		goto fail1;
 	}
 
-	pctx->cr = co_create(co_auth_user, pctx, NULL, PAM_STACK_SIZE);
-	if (pctx->cr == NULL)
-		goto fail2;
+#ifdef HAVE_PAM_THREADS
+	if (tpool != NULL) {
+		/* the conversation messages are produced by the pool threads */
+		pctx->threaded = 1;
+		str_init(&pctx->msg, NULL);
+	} else
+#endif
+	{
+		pctx->cr = co_create(co_auth_user, pctx, NULL, PAM_STACK_SIZE);
+		if (pctx->cr == NULL)
+			goto fail2;
+	}
 
 	strlcpy(pctx->username, user, sizeof(pctx->username));
 
@@ -204,7 +496,7 @@ size_t prompt_hash = 0;
 		return 0;
 	}
 
-	if (pctx->state == PAM_S_INIT) {
+	if (pctx->state == PAM_S_INIT && pctx->threaded == 0) {
 		/* get the prompt */
 		pctx->cr_ret = PAM_CONV_ERR;
 		co_call(pctx->cr);
@@ -260,15 +552,7 @@ struct pam_ctx_st * pctx = ctx;
 	pctx->cr_ret = PAM_CONV_ERR;
 	co_call(pctx->cr);
 
-	if (pctx->cr_ret != PAM_SUCCESS) {
-		syslog(LOG_AUTH, "PAM-auth pam_auth_pass: %s", pam_strerror(pctx->ph, pctx->cr_ret));
-		return ERR_AUTH_FAIL;
-	}
-	
-	if (pctx->state != PAM_S_COMPLETE)
-		return ERR_AUTH_CONTINUE;
-
-	return 0;
+	return pam_result(pctx, __func__);
 }
 
 /* Returns 0 if the user is successfully authenticated
@@ -303,10 +587,8 @@ int pret;
 	return -1;
 }
 
-static void pam_auth_deinit(void* ctx)
+static void pam_ctx_free(struct pam_ctx_st * pctx)
 {
-struct pam_ctx_st * pctx = ctx;
-
 	pam_end(pctx->ph, pctx->cr_ret);
 	free(pctx->replies);
 	str_clear(&pctx->msg);
@@ -315,6 +597,33 @@ struct pam_ctx_st * pctx = ctx;
 	talloc_free(pctx);
 }
 
+static void pam_auth_deinit(void* ctx)
+{
+struct pam_ctx_st * pctx = ctx;
+
+#ifdef HAVE_PAM_THREADS
+	if (pctx->threaded) {
+		pthread_mutex_lock(&tpool->lock);
+		if (pctx->in_jobs) {
+			list_del(&pctx->list);
+			pctx->in_jobs = 0;
+		}
+
+		if (pctx->running || pctx->in_done) {
+			/* released by pam_pool_process() */
+			pctx->cancelled = 1;
+			pthread_cond_broadcast(&tpool->reply_cond);
+			pthread_mutex_unlock(&tpool->lock);
+			talloc_steal(tpool, pctx);
+			return;
+		}
+		pthread_mutex_unlock(&tpool->lock);
+	}
+#endif
+
+	pam_ctx_free(pctx);
+}
+
 static void pam_group_list(void *pool, void *_additional, char ***groupname, unsigned *groupname_size)
 {
 	struct pam_cfg_st *config = _additional;
@@ -328,6 +637,11 @@ static void pam_group_list(void *pool, void *_additional, char ***groupname, uns
 
 const struct auth_mod_st pam_auth_funcs = {
   .type = AUTH_TYPE_PAM | AUTH_TYPE_USERNAME_PASS,
+#ifdef HAVE_PAM_THREADS
+  .global_init = pam_global_init,
+  .global_deinit = pam_global_deinit,
+  .auth_pass_async = pam_auth_pass_async,
+#endif
   .auth_init = pam_auth_init,
   .auth_deinit = pam_auth_deinit,
   .auth_msg = pam_auth_msg,
@@ -29,6 +29,7 @@
 #include <security/pam_appl.h>
 #include <str.h>
 #include <pcl.h>
+#include <ccan/list/list.h>
 
 extern const struct auth_mod_st pam_auth_funcs;
 
@@ -47,6 +48,19 @@ struct pam_ctx_st {
 	unsigned state; /* PAM_S_ */
 	unsigned passwd_counter;
 	size_t prev_prompt_hash;
+
+	/* used when the transaction runs on the thread pool; the
+	 * flags are protected by the pool's lock */
+	unsigned threaded;
+	struct list_node list;
+	unsigned started;
+	unsigned running; /* a thread is executing the transaction */
+	unsigned in_jobs;
+	unsigned in_done;
+	unsigned has_password;
+	unsigned cancelled; /* sec-mod no longer waits for the result */
+	auth_done_func done;
+	void *done_priv;
 };
 
 #endif
@@ -27,6 +27,7 @@
 # define _XOPEN_SOURCE
 #endif
 #include <unistd.h>
+#include <sys/stat.h>
 #include <vpn.h>
 #include <c-ctype.h>
 #include "plain.h"
@@ -48,7 +49,39 @@ struct plain_ctx_st {
 	unsigned retries;
 };
 
+/* The password file is loaded into a hash table indexed by username,
+ * which is replaced once the file is modified. The file is checked for
+ * modifications before a lookup, at most every PLAIN_CHECK_SECS.
+ */
+#define PLAIN_CHECK_SECS 1
+
+struct plain_entry_st {
+	char *username;
+	char *cpass;
+	char *groupnames[MAX_GROUPS];
+	unsigned groupnames_size;
+};
+
+struct plain_db_st {
+	struct htable ht;
+	unsigned entries;
+
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	long mtime_nsec; /* 0 if not available */
+};
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+# define ST_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#else
+# define ST_MTIME_NSEC(st) 0
+#endif
+
 static char *password_file = NULL;
+static void *plain_pool = NULL;
+static struct plain_db_st *plain_db = NULL;
+static time_t plain_last_check = 0;
 
 static void plain_global_init(void *pool, void *additional)
 {
@@ -64,6 +97,7 @@ static void plain_global_init(void *pool, void *additional)
 		fprintf(stderr, "plain: memory error\n");
 		exit(1);
 	}
+	plain_pool = pool;
 
 	return;
 }
@@ -123,24 +157,99 @@ break_group_list(void *pool, char *text,
 	while (p != NULL && *elements < MAX_GROUPS);
 }
 
-/* Returns 0 if the user is successfully authenticated, and sets the appropriate group name.
- */
-static int read_auth_pass(struct plain_ctx_st *pctx)
+static size_t entry_rehash(const void *_e, void *unused)
+{
+	const struct plain_entry_st *e = _e;
+	return hash_any(e->username, strlen(e->username), 0);
+}
+
+static bool entry_cmp(const void *_e, void *username)
 {
+	const struct plain_entry_st *e = _e;
+
+	if (strcmp(e->username, username) == 0)
+		return 1;
+	return 0;
+}
+
+static int db_destructor(struct plain_db_st *db)
+{
+	htable_clear(&db->ht);
+	return 0;
+}
+
+/* Parses a "username:groupname1,groupname2:encoded-password" line
+ * into the database. The line is modified. */
+static void add_entry(struct plain_db_st *db, char *line)
+{
+	struct plain_entry_st *e;
+	char *user, *groups, *cpass, *sp;
+	size_t hval;
+
+#ifdef HAVE_STRSEP
+	sp = line;
+	user = strsep(&sp, ":");
+	groups = strsep(&sp, ":");
+	cpass = strsep(&sp, ":");
+#else
+	user = strtok_r(line, ":", &sp);
+	groups = strtok_r(NULL, ":", &sp);
+	cpass = strtok_r(NULL, ":", &sp);
+#endif
+	if (user == NULL || groups == NULL || cpass == NULL)
+		return;
+
+	/* the first entry of a user is used */
+	hval = hash_any(user, strlen(user), 0);
+	if (htable_get(&db->ht, hval, entry_cmp, user) != NULL)
+		return;
+
+	e = talloc_zero(db, struct plain_entry_st);
+	if (e == NULL)
+		return;
+
+	e->username = talloc_strdup(e, user);
+	e->cpass = talloc_strdup(e, cpass);
+	if (e->username == NULL || e->cpass == NULL)
+		goto fail;
+
+	break_group_list(e, groups, e->groupnames, &e->groupnames_size);
+
+	if (htable_add(&db->ht, hval, e) == 0)
+		goto fail;
+	db->entries++;
+	return;
+ fail:
+	talloc_free(e);
+}
+
+static struct plain_db_st *load_db(const struct stat *st)
+{
+	struct plain_db_st *db;
 	FILE *fp;
 	char line[512];
 	ssize_t ll;
-	char *p, *sp;
-	int ret;
+	char *p;
 
 	fp = fopen(password_file, "r");
 	if (fp == NULL) {
 		syslog(LOG_AUTH,
 		       "error in plain authentication; cannot open: %s",
 		       password_file);
-		return -1;
+		return NULL;
 	}
 
+	db = talloc_zero(plain_pool, struct plain_db_st);
+	if (db == NULL)
+		goto exit;
+
+	htable_init(&db->ht, entry_rehash, NULL);
+	talloc_set_destructor(db, db_destructor);
+	db->ino = st->st_ino;
+	db->size = st->st_size;
+	db->mtime = st->st_mtime;
+	db->mtime_nsec = ST_MTIME_NSEC(st);
+
 	line[sizeof(line)-1] = 0;
 	while ((p=fgets(line, sizeof(line)-1, fp)) != NULL) {
 		ll = strlen(p);
@@ -156,49 +265,81 @@ static int read_auth_pass(struct plain_ctx_st *pctx)
 			ll--;
 			line[ll] = 0;
 		}
-#ifdef HAVE_STRSEP
-		sp = line;
-		p = strsep(&sp, ":");
 
-		if (p != NULL && strcmp(pctx->username, p) == 0) {
-			p = strsep(&sp, ":");
-			if (p != NULL) {
-				break_group_list(pctx, p, pctx->groupnames, &pctx->groupnames_size);
+		add_entry(db, line);
+	}
 
-				p = strsep(&sp, ":");
-				if (p != NULL) {
-					strlcpy(pctx->cpass, p, sizeof(pctx->cpass));
-					ret = 0;
-					goto exit;
-				}
-			}
-		}
+	syslog(LOG_DEBUG, "plain-auth: loaded %u entries from %s", db->entries, password_file);
 
-#else
-		p = strtok_r(line, ":", &sp);
+ exit:
+	safe_memset(line, 0, sizeof(line));
+	fclose(fp);
+	return db;
+}
 
-		if (p != NULL && strcmp(pctx->username, p) == 0) {
-			p = strtok_r(NULL, ":", &sp);
-			if (p != NULL) {
-				break_group_list(pctx, p, pctx->groupnames, &pctx->groupnames_size);
+/* Reloads the database if the password file was modified. The new
+ * database replaces the old one only once it is completely loaded.
+ */
+static int check_db(void)
+{
+	struct plain_db_st *db;
+	struct stat st;
+	time_t now = time(0);
 
-				p = strtok_r(NULL, ":", &sp);
-				if (p != NULL) {
-					strlcpy(pctx->cpass, p, sizeof(pctx->cpass));
-					ret = 0;
-					goto exit;
-				}
-			}
-		}
-#endif
+	if (plain_db != NULL && now >= plain_last_check &&
+	    now - plain_last_check < PLAIN_CHECK_SECS)
+		return 0;
+
+	if (stat(password_file, &st) < 0) {
+		syslog(LOG_AUTH,
+		       "error in plain authentication; cannot open: %s",
+		       password_file);
+		return -1;
 	}
+	plain_last_check = now;
 
-	/* always succeed */
-	ret = 0;
- exit:
-	safe_memset(line, 0, sizeof(line));
-	fclose(fp);
-	return ret;
+	if (plain_db != NULL && plain_db->ino == st.st_ino &&
+	    plain_db->size == st.st_size && plain_db->mtime == st.st_mtime &&
+	    plain_db->mtime_nsec == ST_MTIME_NSEC(&st))
+		return 0;
+
+	db = load_db(&st);
+	if (db == NULL)
+		return -1;
+
+	talloc_free(plain_db);
+	plain_db = db;
+
+	return 0;
+}
+
+/* Returns 0 if the user is successfully authenticated, and sets the appropriate group name.
+ */
+static int read_auth_pass(struct plain_ctx_st *pctx)
+{
+	struct plain_entry_st *e;
+	unsigned i;
+
+	if (check_db() < 0)
+		return -1;
+
+	e = htable_get(&plain_db->ht, hash_any(pctx->username, strlen(pctx->username), 0),
+		       entry_cmp, pctx->username);
+	if (e == NULL) {
+		/* always succeed */
+		return 0;
+	}
+
+	/* the entry is released if the file is reloaded */
+	for (i=0;i<e->groupnames_size;i++) {
+		pctx->groupnames[i] = talloc_strdup(pctx, e->groupnames[i]);
+		if (pctx->groupnames[i] == NULL)
+			break;
+	}
+	pctx->groupnames_size = i;
+
+	strlcpy(pctx->cpass, e->cpass, sizeof(pctx->cpass));
+	return 0;
 }
 
 static int plain_auth_init(void **ctx, void *pool, const char *username, const char *ip, const char *our_ip, unsigned pid)
@@ -0,0 +1,675 @@
+/*
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <vpn.h>
+#include <common.h>
+#include <gettime.h>
+#include <sec-mod.h>
+#include <cloexec.h>
+#include "radius-client.h"
+
+#if defined(HAVE_RADIUS) && !defined(LEGACY_RADIUS)
+
+/* A non-blocking RADIUS client for the access and the accounting requests
+ * of sec-mod; a client instance sends either kind. The servers, their
+ * secrets, and the timeout and retries are read from the radcli
+ * configuration. Each server has a connected UDP socket which is
+ * monitored by the sec-mod loop, and requests outstanding on a server are
+ * identified by the RADIUS identifier; thus up to 256 requests may be
+ * outstanding per server.
+ *
+ * A request is retransmitted to the same server up to radius_retries times
+ * and then it fails over to the next server. A server which did not reply
+ * is not used for new requests, until all the others failed as well.
+ */
+
+#define RAD_HDR_SIZE 20
+#define RAD_AUTH_SIZE 16
+#define RAD_MAX_PACKET 4096
+#define RAD_MAX_ATTR_LEN 253
+#define RAD_MAX_PASS_LEN 128
+#define RAD_IDS 256
+
+#define RAD_ATTR_VENDOR(x) (((x) >> 16) & 0xffff)
+#define RAD_ATTR_ID(x) ((x) & 0xffff)
+#define RAD_VENDOR_SPECIFIC 26
+
+#define DEFAULT_RADIUS_PORT 1812
+#define DEFAULT_RADIUS_ACCT_PORT 1813
+#define DEFAULT_TIMEOUT_SECS 5
+#define DEFAULT_RETRIES 3
+
+struct rad_server_st {
+	struct rad_client_st *client;
+	char *name;
+	char *secret;
+	int fd;
+	sec_watch_st watch;
+
+	struct rad_req_st *pending[RAD_IDS];
+	unsigned next_id;
+};
+
+struct rad_req_st {
+	struct list_node list; /* in the client's list, ordered by deadline */
+	unsigned queued;
+	struct rad_client_st *client;
+	struct rad_server_st *srv;
+	unsigned id;
+	unsigned tries; /* transmissions to the current server */
+	unsigned servers_tried;
+	struct timespec deadline;
+
+	uint8_t authenticator[RAD_AUTH_SIZE];
+	uint8_t *packet;
+	unsigned packet_size;
+
+	VALUE_PAIR *send;
+	rad_done_func done;
+	void *priv;
+};
+
+struct rad_client_st {
+	rc_handle *rh;
+	unsigned acct; /* whether it sends accounting requests */
+	struct rad_server_st *servers;
+	unsigned servers_size;
+	unsigned active; /* the server new requests are sent to */
+
+	unsigned timeout_ms;
+	unsigned retries;
+
+	struct list_head reqs;
+	sec_watch_st timer;
+};
+
+static int md5(gnutls_hash_hd_t *h)
+{
+	return gnutls_hash_init(h, GNUTLS_DIG_MD5);
+}
+
+/* Hides the password as in RFC2865 5.2 */
+static int hide_password(const char *secret, const uint8_t *ra,
+			 const char *pass, unsigned pass_len,
+			 uint8_t *out, unsigned *out_len)
+{
+	gnutls_hash_hd_t h;
+	uint8_t b[RAD_AUTH_SIZE];
+	const uint8_t *prev = ra;
+	unsigned i, j, len;
+
+	if (pass_len > RAD_MAX_PASS_LEN)
+		return -1;
+
+	len = (pass_len + RAD_AUTH_SIZE - 1) & ~(RAD_AUTH_SIZE - 1);
+	if (len == 0)
+		len = RAD_AUTH_SIZE;
+
+	memset(out, 0, len);
+	memcpy(out, pass, pass_len);
+
+	for (i = 0; i < len; i += RAD_AUTH_SIZE) {
+		if (md5(&h) < 0)
+			return -1;
+		gnutls_hash(h, secret, strlen(secret));
+		gnutls_hash(h, prev, RAD_AUTH_SIZE);
+		gnutls_hash_deinit(h, b);
+
+		for (j = 0; j < RAD_AUTH_SIZE; j++)
+			out[i + j] ^= b[j];
+		prev = &out[i];
+	}
+
+	*out_len = len;
+	return 0;
+}
+
+static int append_attr(uint8_t *p, unsigned *pos, unsigned vendor,
+		       unsigned attr, const void *data, unsigned len)
+{
+	unsigned hdr = vendor ? 8 : 2;
+
+	if (len > RAD_MAX_ATTR_LEN - (vendor ? 6 : 0))
+		len = RAD_MAX_ATTR_LEN - (vendor ? 6 : 0);
+
+	if (*pos + hdr + len > RAD_MAX_PACKET)
+		return -1;
+
+	p += *pos;
+	if (vendor) {
+		p[0] = RAD_VENDOR_SPECIFIC;
+		p[1] = len + 8;
+		p[2] = 0;
+		p[3] = 0;
+		p[4] = (vendor >> 8) & 0xff;
+		p[5] = vendor & 0xff;
+		p[6] = attr;
+		p[7] = len + 2;
+	} else {
+		p[0] = attr;
+		p[1] = len + 2;
+	}
+	memcpy(p + hdr, data, len);
+
+	*pos += hdr + len;
+	return 0;
+}
+
+/* Creates the Access-Request or the Accounting-Request for the server
+ * the request is assigned to */
+static int encode_request(struct rad_req_st *req)
+{
+	uint8_t hidden[RAD_MAX_PASS_LEN];
+	unsigned pos = RAD_HDR_SIZE, vendor, attr, len;
+	const void *data;
+	uint32_t v;
+	VALUE_PAIR *vp;
+	uint16_t l16;
+	gnutls_hash_hd_t h;
+	int ret;
+
+	if (req->packet == NULL) {
+		req->packet = talloc_size(req, RAD_MAX_PACKET);
+		if (req->packet == NULL)
+			return -1;
+	}
+
+	if (req->client->acct) {
+		/* calculated over the packet, once encoded (RFC2866 3) */
+		memset(req->authenticator, 0, RAD_AUTH_SIZE);
+		req->packet[0] = PW_ACCOUNTING_REQUEST;
+	} else {
+		ret = gnutls_rnd(GNUTLS_RND_NONCE, req->authenticator, RAD_AUTH_SIZE);
+		if (ret < 0)
+			return -1;
+		req->packet[0] = PW_ACCESS_REQUEST;
+	}
+
+	req->packet[1] = req->id;
+	memcpy(&req->packet[4], req->authenticator, RAD_AUTH_SIZE);
+
+	for (vp = req->send; vp != NULL; vp = vp->next) {
+		vendor = RAD_ATTR_VENDOR(vp->attribute);
+		attr = RAD_ATTR_ID(vp->attribute);
+
+		switch (vp->type) {
+		case PW_TYPE_STRING:
+			if (vendor == 0 && attr == PW_USER_PASSWORD && !req->client->acct) {
+				if (hide_password(req->srv->secret, req->authenticator,
+						  vp->strvalue, vp->lvalue, hidden, &len) < 0) {
+					syslog(LOG_ERR, "radius: cannot encode password");
+					return -1;
+				}
+				data = hidden;
+			} else {
+				data = vp->strvalue;
+				len = vp->lvalue;
+			}
+			break;
+		case PW_TYPE_INTEGER:
+		case PW_TYPE_IPADDR:
+		case PW_TYPE_DATE:
+			v = htonl(vp->lvalue);
+			data = &v;
+			len = 4;
+			break;
+		case PW_TYPE_IPV6ADDR:
+			data = vp->strvalue;
+			len = 16;
+			break;
+		case PW_TYPE_IPV6PREFIX:
+			data = vp->strvalue;
+			len = vp->lvalue;
+			break;
+		default:
+			syslog(LOG_DEBUG, "radius: not sending attribute %u of type %u",
+			       (unsigned)vp->attribute, (unsigned)vp->type);
+			continue;
+		}
+
+		if (append_attr(req->packet, &pos, vendor, attr, data, len) < 0) {
+			syslog(LOG_ERR, "radius: too long request");
+			return -1;
+		}
+	}
+
+	l16 = htons(pos);
+	memcpy(&req->packet[2], &l16, 2);
+	req->packet_size = pos;
+
+	if (req->client->acct) {
+		if (md5(&h) < 0)
+			return -1;
+		gnutls_hash(h, req->packet, pos);
+		gnutls_hash(h, req->srv->secret, strlen(req->srv->secret));
+		gnutls_hash_deinit(h, req->authenticator);
+		memcpy(&req->packet[4], req->authenticator, RAD_AUTH_SIZE);
+	}
+
+	return 0;
+}
+
+/* Checks the response authenticator of RFC2865 3 */
+static unsigned verify_reply(struct rad_req_st *req, const uint8_t *pkt, unsigned len)
+{
+	gnutls_hash_hd_t h;
+	uint8_t b[RAD_AUTH_SIZE];
+
+	if (md5(&h) < 0)
+		return 0;
+	gnutls_hash(h, pkt, 4);
+	gnutls_hash(h, req->authenticator, RAD_AUTH_SIZE);
+	gnutls_hash(h, pkt + RAD_HDR_SIZE, len - RAD_HDR_SIZE);
+	gnutls_hash(h, req->srv->secret, strlen(req->srv->secret));
+	gnutls_hash_deinit(h, b);
+
+	return (memcmp(b, pkt + 4, RAD_AUTH_SIZE) == 0);
+}
+
+static void unqueue(struct rad_req_st *req)
+{
+	if (req->queued) {
+		list_del(&req->list);
+		req->queued = 0;
+	}
+}
+
+static void set_deadline(struct rad_req_st *req)
+{
+	gettime(&req->deadline);
+	req->deadline.tv_sec += req->client->timeout_ms / 1000;
+	req->deadline.tv_nsec += (req->client->timeout_ms % 1000) * 1000000;
+	if (req->deadline.tv_nsec >= 1000000000) {
+		req->deadline.tv_sec++;
+		req->deadline.tv_nsec -= 1000000000;
+	}
+
+	/* all requests share the same timeout, thus the list
+	 * remains ordered by deadline */
+	unqueue(req);
+	list_add_tail(&req->client->reqs, &req->list);
+	req->queued = 1;
+}
+
+static void transmit(struct rad_req_st *req)
+{
+	int ret, e;
+
+	req->tries++;
+	set_deadline(req);
+
+	ret = send(req->srv->fd, req->packet, req->packet_size, 0);
+	if (ret == -1) {
+		e = errno;
+		syslog(LOG_INFO, "radius: error sending to %s: %s",
+		       req->srv->name, strerror(e));
+	}
+}
+
+static void release_id(struct rad_req_st *req)
+{
+	if (req->srv != NULL && req->srv->pending[req->id] == req)
+		req->srv->pending[req->id] = NULL;
+	req->srv = NULL;
+}
+
+/* Assigns the request to the provided server. Returns -1 if
+ * the server has no free identifiers. */
+static int assign(struct rad_req_st *req, struct rad_server_st *srv)
+{
+	unsigned i, id;
+
+	for (i = 0; i < RAD_IDS; i++) {
+		id = (srv->next_id + i) % RAD_IDS;
+		if (srv->pending[id] == NULL)
+			break;
+	}
+	if (i == RAD_IDS)
+		return -1;
+
+	srv->next_id = (id + 1) % RAD_IDS;
+	srv->pending[id] = req;
+	req->srv = srv;
+	req->id = id;
+	req->tries = 0;
+
+	if (encode_request(req) < 0) {
+		release_id(req);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int req_destructor(struct rad_req_st *req)
+{
+	release_id(req);
+	unqueue(req);
+	if (req->send != NULL)
+		rc_avpair_free(req->send);
+	return 0;
+}
+
+static void complete(struct rad_req_st *req, int code, VALUE_PAIR *recvd)
+{
+	rad_done_func done = req->done;
+
+	release_id(req);
+	unqueue(req);
+
+	/* the callback will typically release the request's parent */
+	talloc_steal(req->client, req);
+	done(req->priv, code, recvd);
+	talloc_free(req);
+}
+
+/* Moves the request to the next server, or completes it if all
+ * of them were tried. */
+static void failover(struct rad_req_st *req)
+{
+	struct rad_client_st *client = req->client;
+	unsigned idx = req->srv - client->servers;
+
+	release_id(req);
+
+	while (++req->servers_tried < client->servers_size) {
+		idx = (idx + 1) % client->servers_size;
+		if (assign(req, &client->servers[idx]) == 0) {
+			syslog(LOG_INFO, "radius: failing over to server %s",
+			       client->servers[idx].name);
+			client->active = idx;
+			transmit(req);
+			return;
+		}
+	}
+
+	syslog(LOG_ERR, "radius: no server replied");
+	complete(req, RAD_NO_REPLY, NULL);
+}
+
+struct rad_req_st *rad_client_send(struct rad_client_st *client, void *pool,
+				   VALUE_PAIR *send, rad_done_func done, void *priv)
+{
+	struct rad_req_st *req;
+	unsigned i, idx;
+
+	if (client == NULL)
+		return NULL;
+
+	req = talloc_zero(pool, struct rad_req_st);
+	if (req == NULL)
+		return NULL;
+
+	req->client = client;
+	req->done = done;
+	req->priv = priv;
+	talloc_set_destructor(req, req_destructor);
+
+	for (i = 0; i < client->servers_size; i++) {
+		idx = (client->active + i) % client->servers_size;
+		if (assign(req, &client->servers[idx]) == 0)
+			break;
+	}
+
+	if (i == client->servers_size) {
+		syslog(LOG_ERR, "radius: too many outstanding requests");
+		talloc_free(req);
+		return NULL;
+	}
+
+	/* owned from now on */
+	req->send = send;
+	req->servers_tried = i;
+	transmit(req);
+
+	return req;
+}
+
+static void server_process(void *priv)
+{
+	struct rad_server_st *srv = priv;
+	struct rad_req_st *req;
+	VALUE_PAIR *recvd;
+	uint8_t pkt[RAD_MAX_PACKET];
+	uint16_t l16;
+	unsigned len;
+	int ret;
+
+	for (;;) {
+		ret = recv(srv->fd, pkt, sizeof(pkt), MSG_DONTWAIT);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return;
+
+		if (ret < RAD_HDR_SIZE)
+			continue;
+
+		memcpy(&l16, &pkt[2], 2);
+		len = ntohs(l16);
+		if (len < RAD_HDR_SIZE || len > (unsigned)ret) {
+			syslog(LOG_INFO, "radius: received malformed reply from %s", srv->name);
+			continue;
+		}
+
+		req = srv->pending[pkt[1]];
+		if (req == NULL)
+			continue;
+
+		if (!verify_reply(req, pkt, len)) {
+			syslog(LOG_INFO, "radius: received reply with invalid authenticator from %s", srv->name);
+			continue;
+		}
+
+		recvd = NULL;
+		if (len > RAD_HDR_SIZE)
+			recvd = rc_avpair_gen(srv->client->rh, NULL, pkt + RAD_HDR_SIZE, len - RAD_HDR_SIZE, 0);
+
+		complete(req, pkt[0], recvd);
+
+		if (recvd != NULL)
+			rc_avpair_free(recvd);
+	}
+}
+
+static int timer_timeout(void *priv)
+{
+	struct rad_client_st *client = priv;
+	struct rad_req_st *req;
+	struct timespec now;
+
+	req = list_top(&client->reqs, struct rad_req_st, list);
+	if (req == NULL)
+		return -1;
+
+	gettime(&now);
+	if (now.tv_sec > req->deadline.tv_sec ||
+	    (now.tv_sec == req->deadline.tv_sec && now.tv_nsec >= req->deadline.tv_nsec))
+		return 0;
+
+	return timespec_sub_ms(&req->deadline, &now) + 1;
+}
+
+static void timer_process(void *priv)
+{
+	struct rad_client_st *client = priv;
+	struct rad_req_st *req;
+
+	while ((req = list_top(&client->reqs, struct rad_req_st, list)) != NULL) {
+		if (timer_timeout(client) != 0)
+			return;
+
+		if (req->tries <= client->retries) {
+			transmit(req);
+		} else {
+			syslog(LOG_INFO, "radius: server %s did not reply", req->srv->name);
+			failover(req);
+		}
+	}
+}
+
+static int server_init(struct rad_client_st *client, struct rad_server_st *srv,
+		       const char *name, unsigned port, const char *secret)
+{
+	struct addrinfo hints, *res = NULL;
+	char sport[16];
+	int ret, e;
+
+	srv->fd = -1;
+	srv->client = client;
+	srv->name = talloc_strdup(client, name);
+	srv->secret = talloc_strdup(client, secret ? secret : "");
+	if (srv->name == NULL || srv->secret == NULL)
+		return -1;
+
+	if (port == 0)
+		port = client->acct ? DEFAULT_RADIUS_ACCT_PORT : DEFAULT_RADIUS_PORT;
+	snprintf(sport, sizeof(sport), "%u", port);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	ret = getaddrinfo(name, sport, &hints, &res);
+	if (ret != 0) {
+		syslog(LOG_ERR, "radius: cannot resolve %s: %s", name, gai_strerror(ret));
+		return -1;
+	}
+
+	srv->fd = socket(res->ai_family, SOCK_DGRAM, 0);
+	if (srv->fd == -1) {
+		e = errno;
+		syslog(LOG_ERR, "radius: cannot create socket: %s", strerror(e));
+		goto fail;
+	}
+	set_cloexec_flag(srv->fd, 1);
+	set_non_block(srv->fd);
+
+	ret = connect(srv->fd, res->ai_addr, res->ai_addrlen);
+	if (ret == -1) {
+		e = errno;
+		syslog(LOG_ERR, "radius: cannot connect to %s: %s", name, strerror(e));
+		goto fail;
+	}
+	freeaddrinfo(res);
+
+	srv->watch.fd = srv->fd;
+	srv->watch.timeout = NULL;
+	srv->watch.process = server_process;
+	srv->watch.priv = srv;
+	sec_watch_add(&srv->watch);
+
+	return 0;
+ fail:
+	if (srv->fd != -1)
+		close(srv->fd);
+	srv->fd = -1;
+	freeaddrinfo(res);
+	return -1;
+}
+
+/* Creates a client for the access, or if acct is set, for the
+ * accounting servers of the radcli configuration. */
+struct rad_client_st *rad_client_init(void *pool, rc_handle *rh, unsigned acct)
+{
+	struct rad_client_st *client;
+	SERVER *servers;
+	unsigned i;
+	int v;
+
+	servers = rc_conf_srv(rh, acct ? "acctserver" : "authserver");
+	if (servers == NULL || servers->max <= 0) {
+		syslog(LOG_ERR, "radius: no %s servers are configured",
+		       acct ? "accounting" : "authentication");
+		return NULL;
+	}
+
+	client = talloc_zero(pool, struct rad_client_st);
+	if (client == NULL)
+		return NULL;
+
+	client->rh = rh;
+	client->acct = acct;
+	list_head_init(&client->reqs);
+
+	v = rc_conf_int(rh, "radius_timeout");
+	client->timeout_ms = ((v > 0) ? v : DEFAULT_TIMEOUT_SECS) * 1000;
+	v = rc_conf_int(rh, "radius_retries");
+	client->retries = (v > 0) ? v : DEFAULT_RETRIES;
+
+	client->servers = talloc_zero_array(client, struct rad_server_st, servers->max);
+	if (client->servers == NULL)
+		goto fail;
+
+	for (i = 0; i < (unsigned)servers->max; i++) {
+		if (server_init(client, &client->servers[client->servers_size], servers->name[i],
+				servers->port[i], servers->secret[i]) < 0)
+			continue;
+		client->servers_size++;
+	}
+
+	if (client->servers_size == 0)
+		goto fail;
+
+	client->timer.fd = -1;
+	client->timer.timeout = timer_timeout;
+	client->timer.process = timer_process;
+	client->timer.priv = client;
+	sec_watch_add(&client->timer);
+
+	return client;
+ fail:
+	talloc_free(client);
+	return NULL;
+}
+
+void rad_client_deinit(struct rad_client_st *client)
+{
+	struct rad_req_st *req, *pos;
+	unsigned i;
+
+	if (client == NULL)
+		return;
+
+	list_for_each_safe(&client->reqs, req, pos, list) {
+		unqueue(req);
+		release_id(req);
+	}
+
+	for (i = 0; i < client->servers_size; i++) {
+		sec_watch_del(&client->servers[i].watch);
+		close(client->servers[i].fd);
+	}
+	sec_watch_del(&client->timer);
+
+	talloc_free(client);
+}
+
+#endif
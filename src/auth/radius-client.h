@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RADIUS_CLIENT_H
+#define RADIUS_CLIENT_H
+
+#if defined(HAVE_RADIUS) && !defined(LEGACY_RADIUS)
+
+#include <radcli/radcli.h>
+
+/* the code passed to rad_done_func when no server replied */
+#define RAD_NO_REPLY -1
+
+/* Called with the code of the server's reply (e.g., PW_ACCESS_ACCEPT) and
+ * its attributes, which are released after the call. */
+typedef void (*rad_done_func)(void *priv, int code, VALUE_PAIR *recvd);
+
+struct rad_req_st;
+struct rad_client_st;
+
+struct rad_client_st *rad_client_init(void *pool, rc_handle *rh, unsigned acct);
+void rad_client_deinit(struct rad_client_st *client);
+
+struct rad_req_st *rad_client_send(struct rad_client_st *client, void *pool,
+				   VALUE_PAIR *send, rad_done_func done, void *priv);
+
+#endif
+
+#endif
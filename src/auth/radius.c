@@ -27,6 +27,7 @@
 #include <c-ctype.h>
 #include <arpa/inet.h> /* inet_ntop */
 #include "radius.h"
+#include "radius-client.h"
 #include "auth/common.h"
 
 #ifdef HAVE_RADIUS
@@ -55,6 +56,9 @@
 
 static rc_handle *rh = NULL;
 static char nas_identifier[64];
+#ifndef LEGACY_RADIUS
+static struct rad_client_st *rad_client = NULL;
+#endif
 
 static void radius_global_init(void *pool, void *additional)
 {
@@ -79,6 +83,14 @@ static void radius_global_init(void *pool, void *additional)
 		exit(1);
 	}
 
+#ifndef LEGACY_RADIUS
+	rad_client = rad_client_init(pool, rh, 0);
+	if (rad_client == NULL) {
+		fprintf(stderr, "error initializing the radius client\n");
+		exit(1);
+	}
+#endif
+
 	return;
  fail:
 	fprintf(stderr, "radius initialization error\n");
@@ -87,6 +99,10 @@ static void radius_global_init(void *pool, void *additional)
 
 static void radius_global_deinit()
 {
+#ifndef LEGACY_RADIUS
+	rad_client_deinit(rad_client);
+	rad_client = NULL;
+#endif
 	if (rh != NULL)
 		rc_destroy(rh);
 }
@@ -187,16 +203,12 @@ static void append_route(struct radius_ctx_st *pctx, const char *route, unsigned
 	}
 }
 
-/* Returns 0 if the user is successfully authenticated, and sets the appropriate group name.
+/* Creates the Access-Request attributes for the provided password.
  */
-static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
+static VALUE_PAIR *radius_auth_request(struct radius_ctx_st *pctx, const char *pass)
 {
-	struct radius_ctx_st *pctx = ctx;
-	VALUE_PAIR *send = NULL, *recvd = NULL;
+	VALUE_PAIR *send = NULL;
 	uint32_t service;
-	char route[64];
-	char txt[64];
-	int ret;
 
 	/* send Access-Request */
 	syslog(LOG_DEBUG, "radius-auth: communicating username (%s) and password", pctx->username);
@@ -204,15 +216,14 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 		syslog(LOG_ERR,
 		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 		       pctx->username);
-		return ERR_AUTH_FAIL;
+		return NULL;
 	}
 
 	if (rc_avpair_add(rh, &send, PW_USER_PASSWORD, (char*)pass, -1, 0) == NULL) {
 		syslog(LOG_ERR,
 		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 		       pctx->username);
-		ret = ERR_AUTH_FAIL;
-		goto cleanup;
+		goto fail;
 	}
 
 	if (pctx->our_ip[0] != 0) {
@@ -232,8 +243,7 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 			syslog(LOG_ERR,
 			       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 			       pctx->username);
-			ret = ERR_AUTH_FAIL;
-			goto cleanup;
+			goto fail;
 		}
 	}
 
@@ -241,8 +251,7 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 		syslog(LOG_ERR,
 		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 		       pctx->username);
-		ret = ERR_AUTH_FAIL;
-		goto cleanup;
+		goto fail;
 	}
 
 	service = PW_AUTHENTICATE_ONLY;
@@ -250,8 +259,7 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 		syslog(LOG_ERR,
 		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 		       pctx->username);
-		ret = ERR_AUTH_FAIL;
-		goto cleanup;
+		goto fail;
 	}
 
 	service = PW_ASYNC;
@@ -259,11 +267,22 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 		syslog(LOG_ERR,
 		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 		       pctx->username);
-		ret = ERR_AUTH_FAIL;
-		goto cleanup;
+		goto fail;
 	}
 
-	ret = rc_aaa(rh, pctx->id, send, &recvd, NULL, 1, PW_ACCESS_REQUEST);
+	return send;
+ fail:
+	rc_avpair_free(send);
+	return NULL;
+}
+
+/* Processes the server's reply; ret is the return code of rc_aaa().
+ * Returns 0 if the user is successfully authenticated, and sets the appropriate group name.
+ */
+static int radius_auth_result(struct radius_ctx_st *pctx, int ret, VALUE_PAIR *recvd)
+{
+	char route[64];
+	char txt[64];
 
 	if (ret == OK_RC) {
 		VALUE_PAIR *vp = recvd;
@@ -341,20 +360,9 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 			vp = vp->next;
 		}
 
-		ret = 0;
- cleanup:
-		rc_avpair_free(send);
-		if (recvd != NULL)
-			rc_avpair_free(recvd);
-		return ret;
+		return 0;
 	} else {
  fail:
-		if (send != NULL)
-			rc_avpair_free(send);
-
-		if (recvd != NULL)
-			rc_avpair_free(recvd);
-
 		if (ret == PW_ACCESS_CHALLENGE) {
 			pctx->pass_msg = pass_msg_second;
 			return ERR_AUTH_CONTINUE;
@@ -370,6 +378,83 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 	}
 }
 
+static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
+{
+	struct radius_ctx_st *pctx = ctx;
+	VALUE_PAIR *send, *recvd = NULL;
+	int ret;
+
+	send = radius_auth_request(pctx, pass);
+	if (send == NULL)
+		return ERR_AUTH_FAIL;
+
+	ret = rc_aaa(rh, pctx->id, send, &recvd, NULL, 1, PW_ACCESS_REQUEST);
+	rc_avpair_free(send);
+
+	ret = radius_auth_result(pctx, ret, recvd);
+	if (recvd != NULL)
+		rc_avpair_free(recvd);
+
+	return ret;
+}
+
+#ifndef LEGACY_RADIUS
+static void radius_auth_done(void *priv, int code, VALUE_PAIR *recvd)
+{
+	struct radius_ctx_st *pctx = priv;
+	int ret;
+
+	pctx->req = NULL;
+
+	if (code == PW_ACCESS_ACCEPT)
+		ret = OK_RC;
+	else if (code == PW_ACCESS_CHALLENGE)
+		ret = PW_ACCESS_CHALLENGE;
+	else if (code == RAD_NO_REPLY)
+		ret = TIMEOUT_RC;
+	else
+		ret = REJECT_RC;
+
+	ret = radius_auth_result(pctx, ret, recvd);
+	pctx->done(pctx->done_priv, ret);
+}
+
+/* Sends the Access-Request without waiting for the reply; the
+ * result is provided to done once received.
+ */
+static int radius_auth_pass_async(void *ctx, const char *pass, unsigned pass_len,
+				  auth_done_func done, void *priv)
+{
+	struct radius_ctx_st *pctx = ctx;
+	VALUE_PAIR *send;
+	uint32_t port = pctx->id;
+
+	if (pctx->req != NULL)
+		return ERR_AUTH_FAIL;
+
+	send = radius_auth_request(pctx, pass);
+	if (send == NULL)
+		return ERR_AUTH_FAIL;
+
+	/* as rc_aaa() does */
+	if (port != 0 && rc_avpair_add(rh, &send, PW_NAS_PORT, &port, -1, 0) == NULL) {
+		rc_avpair_free(send);
+		return ERR_AUTH_FAIL;
+	}
+
+	pctx->done = done;
+	pctx->done_priv = priv;
+
+	pctx->req = rad_client_send(rad_client, pctx, send, radius_auth_done, pctx);
+	if (pctx->req == NULL) {
+		rc_avpair_free(send);
+		return radius_auth_result(pctx, ERROR_RC, NULL);
+	}
+
+	return ERR_AUTH_PENDING;
+}
+#endif
+
 static int radius_auth_msg(void *ctx, void *pool, passwd_msg_st *pst)
 {
 	struct radius_ctx_st *pctx = ctx;
@@ -396,6 +481,9 @@ const struct auth_mod_st radius_auth_funcs = {
 	.auth_deinit = radius_auth_deinit,
 	.auth_msg = radius_auth_msg,
 	.auth_pass = radius_auth_pass,
+#ifndef LEGACY_RADIUS
+	.auth_pass_async = radius_auth_pass_async,
+#endif
 	.auth_user = radius_auth_user,
 	.auth_group = radius_auth_group,
 	.group_list = NULL
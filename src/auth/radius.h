@@ -51,6 +51,11 @@ struct radius_ctx_st {
 	const char *pass_msg;
 	unsigned retries;
 	unsigned id;
+
+	/* the outstanding Access-Request, if any */
+	struct rad_req_st *req;
+	auth_done_func done;
+	void *done_priv;
 };
 
 extern const struct auth_mod_st radius_auth_funcs;
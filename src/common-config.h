@@ -46,6 +46,7 @@ typedef struct gssapi_cfg_st {
 typedef struct radius_cfg_st {
 	char *config;
 	char *nas_identifier;
+	char *spool; /* of the accounting stop records */
 } radius_cfg_st;
 
 typedef struct plain_cfg_st {
@@ -54,6 +55,7 @@ typedef struct plain_cfg_st {
 
 typedef struct pam_cfg_st {
 	int gid_min;
+	unsigned threads;
 } pam_cfg_st;
 
 #define CHECK_TRUE(str) (str != NULL && (c_strcasecmp(str, "true") == 0 || c_strcasecmp(str, "yes") == 0))?1:0
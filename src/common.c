@@ -25,6 +25,7 @@
 #include <vpn.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <poll.h>
 /* for recvmsg */
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -63,11 +64,15 @@ static char tmp[32];
 		return "ban IP";
 	case CMD_BAN_IP_REPLY:
 		return "ban IP reply";
+	case CMD_WORKER_STARTUP:
+		return "worker startup";
 
 	case SM_CMD_CLI_STATS:
 		return "sm: cli stats";
 	case SM_CMD_AUTH_CLI_STATS:
 		return "sm: auth cli stats";
+	case SM_CMD_SECMOD_STATS:
+		return "sm: sec-mod stats";
 	case SM_CMD_AUTH_INIT:
 		return "sm: auth init";
 	case SM_CMD_AUTH_CONT:
@@ -78,6 +83,10 @@ static char tmp[32];
 		return "sm: decrypt";
 	case SM_CMD_SIGN:
 		return "sm: sign";
+	case SM_CMD_SIGNER_OP:
+		return "sm: signer op";
+	case SM_CMD_SIGNER_STARTED:
+		return "sm: signer started";
 	case SM_CMD_AUTH_SESSION_CLOSE:
 		return "sm: session close";
 	case SM_CMD_AUTH_SESSION_OPEN:
@@ -146,19 +155,16 @@ ssize_t force_read_timeout(int sockfd, void *buf, size_t len, unsigned sec)
 int left = len;
 int ret;
 uint8_t * p = buf;
-struct timeval tv;
-fd_set set;
+struct pollfd pfd;
 
 	while(left > 0) {
 		if (sec > 0) {
-			tv.tv_sec = sec;
-			tv.tv_usec = 0;
-
-			FD_ZERO(&set);
-			FD_SET(sockfd, &set);
+			pfd.fd = sockfd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
 
 			do {
-				ret = select(sockfd + 1, &set, NULL, NULL, &tv);
+				ret = poll(&pfd, 1, sec * 1000);
 			} while (ret == -1 && errno == EINTR);
 
 			if (ret == -1 || ret == 0) {
@@ -204,17 +210,14 @@ int val;
 ssize_t recv_timeout(int sockfd, void *buf, size_t len, unsigned sec)
 {
 int ret;
-struct timeval tv;
-fd_set set;
-
-	tv.tv_sec = sec;
-	tv.tv_usec = 0;
+struct pollfd pfd;
 
-	FD_ZERO(&set);
-	FD_SET(sockfd, &set);
+	pfd.fd = sockfd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
 
 	do {
-		ret = select(sockfd + 1, &set, NULL, NULL, &tv);
+		ret = poll(&pfd, 1, sec * 1000);
 	} while (ret == -1 && errno == EINTR);
 
 	if (ret == -1 || ret == 0) {
@@ -228,18 +231,15 @@ fd_set set;
 ssize_t recvmsg_timeout(int sockfd, struct msghdr *msg, int flags, unsigned sec)
 {
 int ret;
-struct timeval tv;
-fd_set set;
+struct pollfd pfd;
 
 	if (sec) {
-		tv.tv_sec = sec;
-		tv.tv_usec = 0;
-
-		FD_ZERO(&set);
-		FD_SET(sockfd, &set);
+		pfd.fd = sockfd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
 
 		do {
-			ret = select(sockfd + 1, &set, NULL, NULL, &tv);
+			ret = poll(&pfd, 1, sec * 1000);
 		} while (ret == -1 && errno == EINTR);
 
 		if (ret == -1 || ret == 0) {
@@ -84,11 +84,18 @@ static struct cfg_options available_options[] = {
 	{ .name = "ban-points-wrong-password", .type = OPTION_NUMERIC, .mandatory = 0 },
 	{ .name = "ban-points-connection", .type = OPTION_NUMERIC, .mandatory = 0 },
 	{ .name = "ban-points-kkdcp", .type = OPTION_NUMERIC, .mandatory = 0 },
+	{ .name = "max-ban-prefix-score", .type = OPTION_NUMERIC, .mandatory = 0 },
+	{ .name = "ban-ipv4-prefix", .type = OPTION_NUMERIC, .mandatory = 0 },
+	{ .name = "ban-ipv6-prefix", .type = OPTION_NUMERIC, .mandatory = 0 },
 	{ .name = "udp-port", .type = OPTION_NUMERIC, .mandatory = 0 },
 	{ .name = "keepalive", .type = OPTION_NUMERIC, .mandatory = 0 },
 	{ .name = "dpd", .type = OPTION_NUMERIC, .mandatory = 0 },
 	{ .name = "mobile-dpd", .type = OPTION_NUMERIC, .mandatory = 0 },
 	{ .name = "rate-limit-ms", .type = OPTION_NUMERIC, .mandatory = 0 },
+	{ .name = "rate-limit-burst", .type = OPTION_NUMERIC, .mandatory = 0 },
+	{ .name = "prefork-min-idle", .type = OPTION_NUMERIC, .mandatory = 0 },
+	{ .name = "prefork-max-idle", .type = OPTION_NUMERIC, .mandatory = 0 },
+	{ .name = "sec-mod-signers", .type = OPTION_NUMERIC, .mandatory = 0 },
 	{ .name = "ocsp-response", .type = OPTION_STRING, .mandatory = 0 },
 	{ .name = "server-cert", .type = OPTION_STRING, .mandatory = 1 },
 	{ .name = "server-key", .type = OPTION_STRING, .mandatory = 1 },
@@ -112,6 +119,7 @@ static struct cfg_options available_options[] = {
 	{ .name = "socket-file", .type = OPTION_STRING, .mandatory = 1 },
 	{ .name = "listen-clear-file", .type = OPTION_STRING, .mandatory = 0 },
 	{ .name = "occtl-socket-file", .type = OPTION_STRING, .mandatory = 0 },
+	{ .name = "metrics-socket", .type = OPTION_STRING, .mandatory = 0 },
 	{ .name = "banner", .type = OPTION_STRING, .mandatory = 0 },
 	{ .name = "use-seccomp", .type = OPTION_BOOLEAN, .mandatory = 0 },
 	{ .name = "isolate-workers", .type = OPTION_BOOLEAN, .mandatory = 0 },
@@ -126,6 +134,7 @@ static struct cfg_options available_options[] = {
 	{ .name = "use-utmp", .type = OPTION_BOOLEAN, .mandatory = 0 },
 	{ .name = "use-dbus", .type = OPTION_BOOLEAN, .mandatory = 0 },
 	{ .name = "persistent-cookies", .type = OPTION_BOOLEAN, .mandatory = 0 },
+	{ .name = "tls-session-tickets", .type = OPTION_BOOLEAN, .mandatory = 0 },
 	{ .name = "use-occtl", .type = OPTION_BOOLEAN, .mandatory = 0 },
 	{ .name = "try-mtu-discovery", .type = OPTION_BOOLEAN, .mandatory = 0 },
 	{ .name = "ping-leases", .type = OPTION_BOOLEAN, .mandatory = 0 },
@@ -134,6 +143,9 @@ static struct cfg_options available_options[] = {
 	{ .name = "mtu", .type = OPTION_NUMERIC, .mandatory = 0 },
 	{ .name = "net-priority", .type = OPTION_STRING, .mandatory = 0 },
 	{ .name = "output-buffer", .type = OPTION_NUMERIC, .mandatory = 0 },
+	{ .name = "tun-read-batch", .type = OPTION_NUMERIC, .mandatory = 0 },
+	{ .name = "udp-gso", .type = OPTION_BOOLEAN, .mandatory = 0 },
+	{ .name = "tun-offload", .type = OPTION_BOOLEAN, .mandatory = 0 },
 	{ .name = "cookie-timeout", .type = OPTION_NUMERIC, .mandatory = 0 },
 	{ .name = "session-timeout", .type = OPTION_NUMERIC, .mandatory = 0 },
 	{ .name = "stats-report-time", .type = OPTION_NUMERIC, .mandatory = 0 },
@@ -674,6 +686,8 @@ size_t urlfw_size = 0;
 		if (perm_config->occtl_socket_file == NULL)
 			perm_config->occtl_socket_file = talloc_strdup(perm_config, OCCTL_UNIX_SOCKET);
 
+		PREAD_STRING(perm_config, "metrics-socket", perm_config->metrics_socket);
+
 		PREAD_STRING(perm_config, "chroot-dir", perm_config->chroot_dir);
 	}
 
@@ -701,6 +715,16 @@ size_t urlfw_size = 0;
 		config->mobile_dpd = config->dpd;
 
 	READ_NUMERIC("rate-limit-ms", config->rate_limit_ms);
+	READ_NUMERIC("rate-limit-burst", config->rate_limit_burst);
+	if (config->rate_limit_burst == 0)
+		config->rate_limit_burst = 1;
+
+	READ_NUMERIC("prefork-min-idle", config->prefork_min_idle);
+	READ_NUMERIC("prefork-max-idle", config->prefork_max_idle);
+	if (config->prefork_max_idle < config->prefork_min_idle)
+		config->prefork_max_idle = config->prefork_min_idle;
+
+	READ_NUMERIC("sec-mod-signers", config->sec_mod_signers);
 
 	READ_STRING("ocsp-response", config->ocsp_response);
 
@@ -777,6 +801,13 @@ size_t urlfw_size = 0;
 
 	READ_NUMERIC("output-buffer", config->output_buffer);
 
+	READ_NUMERIC("tun-read-batch", config->tun_read_batch);
+	if (config->tun_read_batch == 0)
+		config->tun_read_batch = DEFAULT_TUN_READ_BATCH;
+
+	READ_TF("udp-gso", config->udp_gso, 0);
+	READ_TF("tun-offload", config->tun_offload, 0);
+
 	READ_NUMERIC("rx-data-per-sec", config->rx_per_sec);
 	READ_NUMERIC("tx-data-per-sec", config->tx_per_sec);
 	config->rx_per_sec /= 1000; /* in kb */
@@ -808,6 +839,7 @@ size_t urlfw_size = 0;
 	if (config->cookie_timeout == 0)
 		config->cookie_timeout = DEFAULT_COOKIE_RECON_TIMEOUT;
 	READ_TF("persistent-cookies", config->persistent_cookies, 0);
+	READ_TF("tls-session-tickets", config->tls_session_tickets, 0);
 
 	READ_NUMERIC("session-timeout", config->session_timeout);
 
@@ -838,6 +870,12 @@ size_t urlfw_size = 0;
 	config->ban_points_kkdcp = DEFAULT_KKDCP_POINTS;
 	READ_NUMERIC("ban-points-kkdcp", config->ban_points_kkdcp);
 
+	READ_NUMERIC("max-ban-prefix-score", config->max_ban_prefix_score);
+	config->ban_ipv4_prefix = DEFAULT_BAN_IPV4_PREFIX;
+	READ_NUMERIC("ban-ipv4-prefix", config->ban_ipv4_prefix);
+	config->ban_ipv6_prefix = DEFAULT_BAN_IPV6_PREFIX;
+	READ_NUMERIC("ban-ipv6-prefix", config->ban_ipv6_prefix);
+
 	READ_NUMERIC("max-same-clients", config->max_same_clients);
 
 	READ_STATIC_STRING("device", config->network.name);
@@ -954,6 +992,12 @@ static void check_cfg(struct perm_cfg_st *perm_config)
 		exit(1);
 	}
 
+	if (perm_config->config->ban_ipv4_prefix == 0 || perm_config->config->ban_ipv4_prefix > 32 ||
+	    perm_config->config->ban_ipv6_prefix == 0 || perm_config->config->ban_ipv6_prefix > 128) {
+		fprintf(stderr, "Invalid ban-ipv4-prefix or ban-ipv6-prefix\n");
+		exit(1);
+	}
+
 	if (perm_config->cert_size != perm_config->key_size) {
 		fprintf(stderr, "The specified number of keys doesn't match the certificates\n");
 		exit(1);
@@ -79,13 +79,15 @@
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/icmp6.h>
-#include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
 #include <gnutls/crypto.h>
 #include <icmp-ping.h>
+#include <cloexec.h>
+#include <gettime.h>
+#include <stddef.h>
 
 #ifndef ICMP_DEST_UNREACH
 # ifdef ICMP_UNREACH
@@ -137,212 +139,319 @@ static int in_cksum(unsigned short *buf, int sz)
 	return ans;
 }
 
-inline static int retry(int e)
+#define PING_TIMEOUT 3
+
+/* The probes are sent from a single raw socket per address family,
+ * which is monitored by the main loop. Each probe is identified by its
+ * sequence number, and completes either on an echo reply from the probed
+ * address, or after PING_TIMEOUT seconds. Its callback is then called,
+ * and the probe is released.
+ */
+struct icmp_probe_st {
+	struct list_node list;
+	main_server_st *s;
+
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	uint16_t seq;
+	struct timespec expires;
+
+	icmp_probe_func cb;
+	void *priv;
+};
+
+static int timespec_cmp(const struct timespec *a, const struct timespec *b)
 {
-	if (e == EAGAIN || e == EWOULDBLOCK || e == EINTR)
-		return 1;
-	else
-		return 0;
+	if (a->tv_sec != b->tv_sec)
+		return (a->tv_sec < b->tv_sec) ? -1 : 1;
+	if (a->tv_nsec != b->tv_nsec)
+		return (a->tv_nsec < b->tv_nsec) ? -1 : 1;
+	return 0;
 }
 
-#define PING_TIMEOUT 3
-
-static
-ssize_t recvfrom_timeout(int sockfd, void *buf, size_t len, int flags,
-			 struct sockaddr *src_addr, socklen_t * addrlen)
+void icmp_ping_init(main_server_st *s)
 {
-	fd_set rfds;
-	struct timeval tv;
-	int ret;
+	s->ping.fd4 = -1;
+	s->ping.fd6 = -1;
+	list_head_init(&s->ping.probes);
+	gnutls_rnd(GNUTLS_RND_NONCE, &s->ping.id, sizeof(s->ping.id));
+	s->ping.seq = 0;
+}
 
-	FD_ZERO(&rfds);
-	FD_SET(sockfd, &rfds);
+/* Releases the sockets and any pending probes without calling their
+ * callbacks. The event loop is not touched, as this is used by the
+ * worker processes after main_ev_deinit(). */
+void icmp_ping_deinit(main_server_st *s)
+{
+	struct icmp_probe_st *p, *pos;
 
-	tv.tv_sec = 0;
-	tv.tv_usec = 250000;
+	if (s->ping.fd4 >= 0)
+		close(s->ping.fd4);
+	if (s->ping.fd6 >= 0)
+		close(s->ping.fd6);
+	s->ping.fd4 = s->ping.fd6 = -1;
 
-	ret = select(sockfd + 1, &rfds, NULL, NULL, &tv);
-	if (ret == -1)
-		return -1;
-	else if (ret > 0)
-		return recvfrom(sockfd, buf, len, 0, src_addr, addrlen);
-	else
-		return -1;
+	list_for_each_safe(&s->ping.probes, p, pos, list) {
+		icmp_probe_cancel(p);
+	}
+}
 
+static int probe_destructor(struct icmp_probe_st *p)
+{
+	if (p->cb != NULL)
+		list_del(&p->list);
+	return 0;
+}
 
+/* Cancels a pending probe; its callback will not be called */
+void icmp_probe_cancel(struct icmp_probe_st *p)
+{
+	talloc_free(p);
 }
 
-int icmp_ping4(main_server_st * s, struct sockaddr_in *addr1)
+static void probe_done(struct icmp_probe_st *p, unsigned in_use)
 {
-	struct icmp *pkt;
-	int pingsock, c, e;
-	char packet1[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
-	char buf1[64];
-	time_t now;
-	uint16_t id1;
-	unsigned gotreply = 0, unreachable = 0;
+	char buf[64];
+	icmp_probe_func cb = p->cb;
 
-	if (s->config->ping_leases == 0)
-		return 0;
+	mslog(p->s, NULL, LOG_INFO, "pinged %s and is %s",
+	      human_addr((void *) &p->addr, p->addr_len, buf, sizeof(buf)),
+	      in_use ? "in use" : "not in use");
 
-	gnutls_rnd(GNUTLS_RND_NONCE, &id1, sizeof(id1));
+	list_del(&p->list);
+	p->cb = NULL;
 
-	pingsock = socket(AF_INET, SOCK_RAW, 1);
-	if (pingsock == -1) {
-		e = errno;
-		mslog(s, NULL, LOG_INFO,
-		      "could not open raw socket for ping: %s", strerror(e));
-		return 0;
-	}
+	/* the callback may release the probe's parent */
+	talloc_steal(p->s, p);
+
+	cb(p->s, p->priv, in_use);
+	talloc_free(p);
+}
+
+static void handle_reply(main_server_st *s, struct sockaddr_storage *from,
+			 socklen_t from_len, uint16_t id, uint16_t seq)
+{
+	struct icmp_probe_st *p;
 
-	pkt = (struct icmp *) packet1;
-	memset(pkt, 0, sizeof(packet1));
-	pkt->icmp_type = ICMP_ECHO;
-	pkt->icmp_id = id1;
-	pkt->icmp_cksum =
-	    in_cksum((unsigned short *) pkt, sizeof(packet1));
+	if (id != s->ping.id)
+		return;
 
-	while ((c = sendto(pingsock, packet1, DEFDATALEN + ICMP_MINLEN, 0,
-			   (struct sockaddr *) addr1,
-			   sizeof(*addr1)) == -1) && retry(errno));
-	/* listen for replies */
+	list_for_each(&s->ping.probes, p, list) {
+		if (p->seq == seq && p->addr_len == from_len &&
+		    ip_cmp(&p->addr, from) == 0) {
+			probe_done(p, 1);
+			return;
+		}
+	}
+}
 
-	now = time(0);
-	while (time(0) - now < PING_TIMEOUT
-	       && (unreachable + gotreply) < 2) {
-		struct sockaddr_in from;
-		socklen_t fromlen = sizeof(from);
+static void ping4_ev(main_server_st *s, main_ev_st *ev, unsigned revents)
+{
+	char packet1[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	struct icmp *pkt;
+	unsigned hlen;
+	int c;
 
-		c = recvfrom_timeout(pingsock, packet1, sizeof(packet1), 0,
-				     (struct sockaddr *) &from, &fromlen);
+	for (;;) {
+		fromlen = sizeof(from);
+		c = recvfrom(s->ping.fd4, packet1, sizeof(packet1), MSG_DONTWAIT,
+			     (struct sockaddr *) &from, &fromlen);
+		if (c < 0)
+			break;
 
-		if (c < 0) {
+		if (c < 20 || fromlen != sizeof(struct sockaddr_in))
 			continue;
-		} else if (c >= 76 && fromlen == sizeof(struct sockaddr_in)) {	/* icmp6_hdr */
-			if (memcmp
-			    (SA_IN_P(&from), SA_IN_P(addr1),
-			     SA_IN_SIZE(sizeof(*addr1))) == 0) {
 
 #ifdef HAVE_STRUCT_IPHDR_IHL
-				struct iphdr *iphdr =
-				    (struct iphdr *) packet1;
-				pkt = (struct icmp *) (packet1 + (iphdr->ihl << 2));	/* skip ip hdr */
+		hlen = ((struct iphdr *) packet1)->ihl << 2;
 #else
-				pkt = (struct icmp *) (packet1 + ((packet1[0] & 0x0f) << 2));	/* skip ip hdr */
+		hlen = (packet1[0] & 0x0f) << 2;
 #endif
-				if (pkt->icmp_id == id1) {
-					if (pkt->icmp_type == ICMP_ECHOREPLY)
-						gotreply++;
-					else if (pkt->icmp_type == ICMP_DEST_UNREACH)
-						unreachable++;
-                                }
-			}
-		}
+		if (c < (int)(hlen + ICMP_MINLEN))
+			continue;
+
+		pkt = (struct icmp *) (packet1 + hlen);	/* skip ip hdr */
+		if (pkt->icmp_type == ICMP_ECHOREPLY)
+			handle_reply(s, &from, fromlen, pkt->icmp_id, pkt->icmp_seq);
 	}
+}
 
-	close(pingsock);
+static void ping6_ev(main_server_st *s, main_ev_st *ev, unsigned revents)
+{
+	char packet1[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	struct icmp6_hdr *pkt;
+	int c;
 
-	if (gotreply > 0) {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in), buf1,
-				 sizeof(buf1)));
-		return gotreply;
-	} else {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is not in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in), buf1,
-				 sizeof(buf1)));
-		return 0;
+	for (;;) {
+		fromlen = sizeof(from);
+		c = recvfrom(s->ping.fd6, packet1, sizeof(packet1), MSG_DONTWAIT,
+			     (struct sockaddr *) &from, &fromlen);
+		if (c < 0)
+			break;
+
+		if (c < (int)sizeof(struct icmp6_hdr) || fromlen != sizeof(struct sockaddr_in6))
+			continue;
+
+		pkt = (struct icmp6_hdr *) packet1;
+		if (pkt->icmp6_type == ICMP6_ECHO_REPLY)
+			handle_reply(s, &from, fromlen, pkt->icmp6_id, pkt->icmp6_seq);
 	}
 }
 
-int icmp_ping6(main_server_st * s,
-	       struct sockaddr_in6 *addr1)
+/* Opens the raw socket of the family, on first use */
+static int get_ping_socket(main_server_st *s, int family)
 {
-	struct icmp6_hdr *pkt;
-	char buf1[64];
-	int pingsock, c, e;
+	int fd, e, ret;
 	int sockopt;
-	char packet1[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
-	uint16_t id1;
-	unsigned gotreply = 0, unreachable = 0;
-	time_t now;
 
-	if (s->config->ping_leases == 0)
-		return 0;
-
-	gnutls_rnd(GNUTLS_RND_NONCE, &id1, sizeof(id1));
+	if (family == AF_INET && s->ping.fd4 >= 0)
+		return s->ping.fd4;
+	if (family == AF_INET6 && s->ping.fd6 >= 0)
+		return s->ping.fd6;
 
-	pingsock = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
-	if (pingsock == -1) {
+	if (family == AF_INET)
+		fd = socket(AF_INET, SOCK_RAW, 1);
+	else
+		fd = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+	if (fd == -1) {
 		e = errno;
 		mslog(s, NULL, LOG_INFO,
 		      "could not open raw socket for ping: %s", strerror(e));
-		return 0;
+		return -1;
 	}
+	set_cloexec_flag(fd, 1);
 
-	pkt = (struct icmp6_hdr *) packet1;
-	memset(pkt, 0, sizeof(packet1));
-	pkt->icmp6_type = ICMP6_ECHO_REQUEST;
-	pkt->icmp6_id = id1;
-
+	if (family == AF_INET6) {
 #if defined(SOL_RAW) && defined(IPV6_CHECKSUM)
-	sockopt = offsetof(struct icmp6_hdr, icmp6_cksum);
-	setsockopt(pingsock, SOL_RAW, IPV6_CHECKSUM,
-		   &sockopt, sizeof(sockopt));
+		sockopt = offsetof(struct icmp6_hdr, icmp6_cksum);
+		setsockopt(fd, SOL_RAW, IPV6_CHECKSUM,
+			   &sockopt, sizeof(sockopt));
 #endif
-	while ((c =
-		sendto(pingsock, packet1,
-		       DEFDATALEN + sizeof(struct icmp6_hdr), 0,
-		       (struct sockaddr *) addr1,
-		       sizeof(*addr1)) == -1) && retry(errno));
-
-	/* listen for replies */
-	now = time(0);
-	while (time(0) - now < PING_TIMEOUT
-	       && (unreachable + gotreply) < 2) {
-		struct sockaddr_in6 from;
-		socklen_t fromlen = sizeof(from);
-		c = recvfrom_timeout(pingsock, packet1,
-				     sizeof(packet1), 0,
-				     (struct sockaddr *)
-				     &from, &fromlen);
-		if (c < 0) {
-			continue;
-		} else if (c >= 8 && fromlen == sizeof(struct sockaddr_in6)) {	/* icmp6_hdr */
-			if (memcmp
-			    (SA_IN6_P(&from), SA_IN6_P(addr1),
-			     SA_IN_SIZE(sizeof(*addr1))) == 0) {
-
-				pkt = (struct icmp6_hdr *) packet1;
-				if (pkt->icmp6_id == id1) {
-					if (pkt->icmp6_type == ICMP6_ECHO_REPLY)
-						gotreply++;
-					else if (pkt->icmp6_type == ICMP6_DST_UNREACH)
-						unreachable++;
-				}
-			}
-		}
+		ret = main_ev_add(s, &s->ping.ev6, fd, MEV_READ, ping6_ev);
+	} else {
+		ret = main_ev_add(s, &s->ping.ev4, fd, MEV_READ, ping4_ev);
+	}
+
+	if (ret < 0) {
+		close(fd);
+		return -1;
 	}
 
-	close(pingsock);
+	if (family == AF_INET)
+		s->ping.fd4 = fd;
+	else
+		s->ping.fd6 = fd;
 
-	if (gotreply > 0) {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in6), buf1,
-				 sizeof(buf1)));
-		return gotreply;
+	return fd;
+}
+
+/* Sends an echo request to the provided address. The callback is called
+ * once it is known whether the address is in use, unless the probe is
+ * cancelled (or freed along with pool). If ping-leases is not set, or
+ * the request cannot be sent, NULL is returned.
+ */
+struct icmp_probe_st *icmp_probe_start(main_server_st *s, void *pool,
+				       const struct sockaddr_storage *addr, socklen_t addr_len,
+				       icmp_probe_func cb, void *priv)
+{
+	char packet1[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
+	struct icmp_probe_st *p;
+	struct icmp *pkt4;
+	struct icmp6_hdr *pkt6;
+	int fd, c, family;
+	size_t size;
+
+	if (s->config->ping_leases == 0)
+		return NULL;
+
+	family = ((struct sockaddr *) addr)->sa_family;
+	fd = get_ping_socket(s, family);
+	if (fd < 0)
+		return NULL;
+
+	p = talloc_zero(pool, struct icmp_probe_st);
+	if (p == NULL)
+		return NULL;
+
+	p->s = s;
+	memcpy(&p->addr, addr, addr_len);
+	p->addr_len = addr_len;
+	p->seq = s->ping.seq++;
+	p->cb = cb;
+	p->priv = priv;
+
+	memset(packet1, 0, sizeof(packet1));
+	if (family == AF_INET) {
+		pkt4 = (struct icmp *) packet1;
+		pkt4->icmp_type = ICMP_ECHO;
+		pkt4->icmp_id = s->ping.id;
+		pkt4->icmp_seq = p->seq;
+		pkt4->icmp_cksum =
+		    in_cksum((unsigned short *) pkt4, DEFDATALEN + ICMP_MINLEN);
+		size = DEFDATALEN + ICMP_MINLEN;
 	} else {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is not in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in6), buf1,
-				 sizeof(buf1)));
-		return 0;
+		pkt6 = (struct icmp6_hdr *) packet1;
+		pkt6->icmp6_type = ICMP6_ECHO_REQUEST;
+		pkt6->icmp6_id = s->ping.id;
+		pkt6->icmp6_seq = p->seq;
+		size = DEFDATALEN + sizeof(struct icmp6_hdr);
+	}
+
+	do {
+		c = sendto(fd, packet1, size, 0, (struct sockaddr *) addr, addr_len);
+	} while (c == -1 && errno == EINTR);
+
+	if (c == -1) {
+		c = errno;
+		mslog(s, NULL, LOG_INFO, "could not send ping: %s", strerror(c));
+		talloc_free(p);
+		return NULL;
+	}
+
+	gettime(&p->expires);
+	p->expires.tv_sec += PING_TIMEOUT;
+
+	list_add_tail(&s->ping.probes, &p->list);
+	talloc_set_destructor(p, probe_destructor);
+
+	return p;
+}
+
+/* Completes the probes which received no reply within the timeout */
+void icmp_ping_expire(main_server_st *s)
+{
+	struct icmp_probe_st *p;
+	struct timespec now;
+
+	gettime(&now);
+	while ((p = list_top(&s->ping.probes, struct icmp_probe_st, list)) != NULL) {
+		if (timespec_cmp(&now, &p->expires) < 0)
+			break;
+		probe_done(p, 0);
 	}
 }
+
+/* Returns the time (in ms) the main loop may wait for events, taking
+ * into account the expiration of pending probes.
+ */
+unsigned icmp_ping_timeout(main_server_st *s, unsigned timeout_ms)
+{
+	struct icmp_probe_st *p;
+	struct timespec now;
+	unsigned wait;
+
+	p = list_top(&s->ping.probes, struct icmp_probe_st, list);
+	if (p == NULL)
+		return timeout_ms;
+
+	gettime(&now);
+	if (timespec_cmp(&now, &p->expires) >= 0)
+		return 0;
+
+	wait = timespec_sub_ms(&p->expires, &now);
+	return (wait < timeout_ms) ? wait : timeout_ms;
+}
@@ -23,9 +23,20 @@
 
 #include <main.h>
 
-/* returns the number of positive replies received or
- * 0 if no host with this IP exists. */
-int icmp_ping4(main_server_st* s, struct sockaddr_in* addr1);
-int icmp_ping6(main_server_st* s, struct sockaddr_in6* addr1);
+struct icmp_probe_st;
+
+/* Called with in_use non-zero if the probed address replied */
+typedef void (*icmp_probe_func)(main_server_st *s, void *priv, unsigned in_use);
+
+void icmp_ping_init(main_server_st *s);
+void icmp_ping_deinit(main_server_st *s);
+
+struct icmp_probe_st *icmp_probe_start(main_server_st *s, void *pool,
+				       const struct sockaddr_storage *addr, socklen_t addr_len,
+				       icmp_probe_func cb, void *priv);
+void icmp_probe_cancel(struct icmp_probe_st *p);
+
+void icmp_ping_expire(main_server_st *s);
+unsigned icmp_ping_timeout(main_server_st *s, unsigned timeout_ms);
 
 #endif
@@ -52,6 +52,7 @@ void ip_lease_deinit(struct ip_lease_db_st* db)
 {
 struct ip_lease_st * cache;
 struct htable_iter iter;
+struct ip_pool_st *pool, *pos;
 
 	cache = htable_first(&db->ht, &iter);
 	while(cache != NULL) {
@@ -62,6 +63,11 @@ struct htable_iter iter;
 		cache = htable_next(&db->ht, &iter);
 	}
 	htable_clear(&db->ht);
+
+	list_for_each_safe(&db->pools, pool, pos, list) {
+		list_del(&pool->list);
+		talloc_free(pool);
+	}
 	
 	return;
 }
@@ -76,6 +82,7 @@ const struct ip_lease_st * e = _e;
 void ip_lease_init(struct ip_lease_db_st* db)
 {
 	htable_init(&db->ht, rehash, NULL);
+	list_head_init(&db->pools);
 }
 
 static bool ip_lease_cmp(const void* _c1, void* _c2)
@@ -113,6 +120,10 @@ void steal_ip_leases(struct proc_st* proc, struct proc_st *thief)
 
 	thief->ipv4 = talloc_move(thief, &proc->ipv4);
 	thief->ipv6 = talloc_move(thief, &proc->ipv6);
+	if (thief->ipv4)
+		thief->ipv4->proc = thief;
+	if (thief->ipv6)
+		thief->ipv6->proc = thief;
 }
 
 static int is_ipv6_ok(main_server_st *s, struct sockaddr_storage *ip, struct sockaddr_storage *net, struct sockaddr_storage *mask)
@@ -131,7 +142,7 @@ static int is_ipv4_ok(main_server_st *s, struct sockaddr_storage *ip, struct soc
 
 	memcpy(&broadcast, net, sizeof(broadcast));
        	for (i=0;i<sizeof(struct in_addr);i++) {
-       		SA_IN_U8_P(&broadcast)[i] |= ~(SA_IN_U8_P(&mask)[i]);
+       		SA_IN_U8_P(&broadcast)[i] |= ~(SA_IN_U8_P(mask)[i]);
 	}
 
 	if (ip_lease_exists(s, ip, sizeof(struct sockaddr_in)) != 0 ||
@@ -144,13 +155,180 @@ static int is_ipv4_ok(main_server_st *s, struct sockaddr_storage *ip, struct soc
 
 #define MAX_IP_TRIES 16
 
+static unsigned mask_to_prefix(const uint8_t *mask, unsigned size)
+{
+	unsigned i, prefix = 0;
+
+	for (i=0;i<size*8;i++) {
+		if ((mask[i/8] & (0x80 >> (i%8))) == 0)
+			break;
+		prefix++;
+	}
+	return prefix;
+}
+
+/* Returns the address pool of the given network, which is created
+ * on first use. */
+static struct ip_pool_st *get_ip_pool(main_server_st *s, int family,
+				      const uint8_t *network, const uint8_t *mask)
+{
+	struct ip_pool_st *pool;
+	unsigned size = (family == AF_INET) ? 4 : 16;
+	unsigned prefix, bits;
+
+	prefix = mask_to_prefix(mask, size);
+
+	list_for_each(&s->ip_leases.pools, pool, list) {
+		if (pool->family == family && pool->prefix == prefix &&
+		    memcmp(pool->network, network, size) == 0)
+			return pool;
+	}
+
+	/* IPv4 addresses are leased individually, while IPv6 ones
+	 * in pairs (see get_ipv6_lease()) */
+	bits = size*8 - prefix;
+	if (family == AF_INET6 && bits > 0)
+		bits--;
+
+	pool = ip_pool_new(s, (bits >= 32) ? MAX_IP_POOL_SIZE : (1U << bits));
+	if (pool == NULL)
+		return NULL;
+
+	pool->family = family;
+	pool->prefix = prefix;
+	memcpy(pool->network, network, size);
+	list_add(&s->ip_leases.pools, &pool->list);
+
+	return pool;
+}
+
+/* The offset within the pool is stored in the last 4 bytes of the address */
+static void ip_from_offset(struct sockaddr_storage *ip, int family,
+			   const struct sockaddr_storage *network, uint32_t offset)
+{
+	uint8_t *p;
+
+	memcpy(ip, network, sizeof(*ip));
+	if (family == AF_INET) {
+		p = SA_IN_U8_P(ip);
+	} else {
+		p = SA_IN6_U8_P(ip) + 12;
+		offset <<= 1;
+	}
+
+	p[0] |= offset >> 24;
+	p[1] |= (offset >> 16) & 0xff;
+	p[2] |= (offset >> 8) & 0xff;
+	p[3] |= offset & 0xff;
+}
+
+/* Returns non-zero and sets the offset, if the address is part of the pool */
+static unsigned ip_to_offset(struct ip_pool_st *pool, const struct sockaddr_storage *ip,
+			     const struct sockaddr_storage *mask, uint32_t *offset)
+{
+	const uint8_t *p, *m;
+	unsigned i, size;
+	uint32_t o;
+
+	if (pool->family == AF_INET) {
+		p = SA_IN_U8_P(ip);
+		m = SA_IN_U8_P(mask);
+		size = 4;
+	} else {
+		p = SA_IN6_U8_P(ip);
+		m = SA_IN6_U8_P(mask);
+		size = 16;
+	}
+
+	for (i=0;i<size-4;i++) {
+		if (p[i] & ~m[i])
+			return 0;
+	}
+	p += size-4;
+	m += size-4;
+
+	o = ((uint32_t)(p[0] & ~m[0]) << 24) | ((p[1] & ~m[1]) << 16) |
+	    ((p[2] & ~m[2]) << 8) | (p[3] & ~m[3]);
+	if (pool->family == AF_INET6)
+		o >>= 1;
+
+	if (o >= pool->size)
+		return 0;
+
+	*offset = o;
+	return 1;
+}
+
+struct avail_st {
+	main_server_st *s;
+	struct sockaddr_storage *network;
+	struct sockaddr_storage *mask;
+};
+
+static int is_ipv4_lease_ok(main_server_st *s, struct sockaddr_storage *ip,
+			    struct sockaddr_storage *network, struct sockaddr_storage *mask)
+{
+	struct sockaddr_storage lip;
+
+	/* LIP = network address + 1 */
+	memcpy(&lip, network, sizeof(struct sockaddr_in));
+	SA_IN_U8_P(&lip)[3] |= 1;
+
+	if (ip_cmp(ip, &lip) == 0)
+		return 0;
+
+	return is_ipv4_ok(s, ip, network, mask);
+}
+
+static int ipv4_avail(void *priv, uint32_t offset)
+{
+	struct avail_st *a = priv;
+	struct sockaddr_storage ip;
+
+	ip_from_offset(&ip, AF_INET, a->network, offset);
+	return is_ipv4_lease_ok(a->s, &ip, a->network, a->mask);
+}
+
+static int ipv6_avail(void *priv, uint32_t offset)
+{
+	struct avail_st *a = priv;
+	struct sockaddr_storage ip;
+
+	ip_from_offset(&ip, AF_INET6, a->network, offset);
+	return is_ipv6_ok(a->s, &ip, a->network, a->mask);
+}
+
+/* Obtains an address from the pool */
+static int get_ip_from_pool(main_server_st *s, struct ip_pool_st *pool,
+			    struct sockaddr_storage *network, struct sockaddr_storage *mask,
+			    struct sockaddr_storage *ip, uint32_t *offset)
+{
+	struct avail_st a;
+	int ret;
+
+	a.s = s;
+	a.network = network;
+	a.mask = mask;
+
+	ret = ip_pool_get(pool, (pool->family == AF_INET) ? ipv4_avail : ipv6_avail,
+			  &a, offset);
+	if (ret < 0)
+		return ERR_NO_IP;
+
+	ip_from_offset(ip, pool->family, network, *offset);
+	return 0;
+}
+
+/* Selects an IPv4 address for the client. The address derived from the
+ * seed is preferred, unless skip_seed is set (i.e., when it was found
+ * in use). */
 static
-int get_ipv4_lease(main_server_st* s, struct proc_st* proc)
+int get_ipv4_lease(main_server_st* s, struct proc_st* proc, unsigned skip_seed)
 {
 
 	struct sockaddr_storage tmp, mask, network, rnd;
+	struct ip_pool_st *pool;
 	unsigned i;
-	unsigned max_loops = MAX_IP_TRIES;
 	int ret;
 	const char* c_network, *c_netmask;
 	char buf[64];
@@ -231,68 +409,58 @@ int get_ipv4_lease(main_server_st* s, struct proc_st* proc)
 		return 0;
 	}
 
-	/* assign "random" IP */
+	/* assign an IP from the pool; the one derived from the seed is
+	 * preferred if available */
 	proc->ipv4 = talloc_zero(proc, struct ip_lease_st);
 	if (proc->ipv4 == NULL)
 		return ERR_MEM;
 	proc->ipv4->db = &s->ip_leases;
 
-       	memcpy(&tmp, &network, sizeof(tmp));
-     	((struct sockaddr_in*)&tmp)->sin_family = AF_INET;
-	((struct sockaddr_in*)&tmp)->sin_port = 0;
+	pool = get_ip_pool(s, AF_INET, SA_IN_U8_P(&network), SA_IN_U8_P(&mask));
+	if (pool == NULL) {
+		ret = ERR_MEM;
+		goto fail;
+	}
 
 	memset(&rnd, 0, sizeof(rnd));
 	((struct sockaddr_in*)&rnd)->sin_family = AF_INET;
 	((struct sockaddr_in*)&rnd)->sin_port = 0;
+	memcpy(SA_IN_U8_P(&rnd), proc->ipv4_seed, 4);
 
-	do {
-		if (max_loops == 0) {
-			mslog(s, proc, LOG_ERR, "could not figure out a valid IPv4 IP");
-			ret = ERR_NO_IP;
-			goto fail;
-		}
-		if (max_loops == MAX_IP_TRIES) {
-			memcpy(SA_IN_U8_P(&rnd), proc->ipv4_seed, 4);
-		} else {
-			ip_from_seed(SA_IN_U8_P(&rnd), sizeof(struct in_addr),
-					SA_IN_U8_P(&rnd), sizeof(struct in_addr));
-		}
-		max_loops--;
+	/* Mask the random number with the netmask */
+	for (i=0;i<sizeof(struct in_addr);i++) {
+		SA_IN_U8_P(&rnd)[i] &= ~(SA_IN_U8_P(&mask)[i]);
+	}
 
-		/* Mask the random number with the netmask */
-        	for (i=0;i<sizeof(struct in_addr);i++) {
-        		SA_IN_U8_P(&rnd)[i] &= ~(SA_IN_U8_P(&mask)[i]);
-		}
+	/* Now add the IP to the masked random number */
+	for (i=0;i<sizeof(struct in_addr);i++)
+		SA_IN_U8_P(&rnd)[i] |= (SA_IN_U8_P(&network)[i]);
 
-		/* Now add the IP to the masked random number */
-        	for (i=0;i<sizeof(struct in_addr);i++)
-        		SA_IN_U8_P(&rnd)[i] |= (SA_IN_U8_P(&network)[i]);
+	if (skip_seed == 0 && is_ipv4_lease_ok(s, &rnd, &network, &mask) != 0) {
+		if (ip_to_offset(pool, &rnd, &mask, &proc->ipv4->offset) != 0)
+			proc->ipv4->pool = pool;
+	} else {
+		mslog(s, proc, LOG_DEBUG, "cannot assign remote IP %s; it is in use or invalid", 
+		      human_addr((void*)&rnd, sizeof(struct sockaddr_in), buf, sizeof(buf)));
 
-		/* check if it exists in the hash table */
-		if (is_ipv4_ok(s, &rnd, &network, &mask) == 0) {
-			mslog(s, proc, LOG_DEBUG, "cannot assign remote IP %s; it is in use or invalid", 
-			      human_addr((void*)&rnd, sizeof(struct sockaddr_in), buf, sizeof(buf)));
-			continue;
+		ret = get_ip_from_pool(s, pool, &network, &mask, &rnd, &proc->ipv4->offset);
+		if (ret < 0) {
+			mslog(s, proc, LOG_ERR, "could not figure out a valid IPv4 IP");
+			goto fail;
 		}
+		proc->ipv4->pool = pool;
+	}
 
-		memcpy(&proc->ipv4->rip, &rnd, sizeof(struct sockaddr_in));
-       		proc->ipv4->rip_len = sizeof(struct sockaddr_in);
-
-       		/* LIP = network address + 1 */
-		memcpy(&proc->ipv4->lip, &network, sizeof(struct sockaddr_in));
-		proc->ipv4->lip_len = sizeof(struct sockaddr_in);
-		SA_IN_U8_P(&proc->ipv4->lip)[3] |= 1;
-
-		if (memcmp(SA_IN_U8_P(&proc->ipv4->lip), SA_IN_U8_P(&proc->ipv4->rip), sizeof(struct in_addr)) == 0) {
-			continue;
-		}
+	memcpy(&proc->ipv4->rip, &rnd, sizeof(struct sockaddr_in));
+	proc->ipv4->rip_len = sizeof(struct sockaddr_in);
 
-		mslog(s, proc, LOG_DEBUG, "selected IP: %s",
-		      human_addr((void*)&proc->ipv4->rip, proc->ipv4->rip_len, buf, sizeof(buf)));
+	/* LIP = network address + 1 */
+	memcpy(&proc->ipv4->lip, &network, sizeof(struct sockaddr_in));
+	proc->ipv4->lip_len = sizeof(struct sockaddr_in);
+	SA_IN_U8_P(&proc->ipv4->lip)[3] |= 1;
 
-       		if (icmp_ping4(s, (void*)&proc->ipv4->rip) == 0)
-       			break;
-	} while(1);
+	mslog(s, proc, LOG_DEBUG, "selected IP: %s",
+	      human_addr((void*)&proc->ipv4->rip, proc->ipv4->rip_len, buf, sizeof(buf)));
 
 	return 0;
 
@@ -304,11 +472,12 @@ fail:
 }
 
 static
-int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
+int get_ipv6_lease(main_server_st* s, struct proc_st* proc, unsigned skip_seed)
 {
 
 	struct sockaddr_storage tmp, mask, network, rnd;
-	unsigned i, max_loops = MAX_IP_TRIES;
+	struct ip_pool_st *pool;
+	unsigned i;
 	int ret;
 	const char* c_network;
 	char *c_netmask = NULL;
@@ -396,67 +565,60 @@ int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
 		return 0;
 	}
 
-	/* assign "random" IP */
+	/* assign an IP from the pool; the one derived from the seed is
+	 * preferred if available */
 	proc->ipv6 = talloc_zero(proc, struct ip_lease_st);
 	if (proc->ipv6 == NULL)
 		return ERR_MEM;
 	proc->ipv6->db = &s->ip_leases;
 
-  	memcpy(&tmp, &network, sizeof(tmp));
-       	((struct sockaddr_in6*)&tmp)->sin6_family = AF_INET6;
-       	((struct sockaddr_in6*)&tmp)->sin6_port = 0;
+	pool = get_ip_pool(s, AF_INET6, SA_IN6_U8_P(&network), SA_IN6_U8_P(&mask));
+	if (pool == NULL) {
+		ret = ERR_MEM;
+		goto fail;
+	}
 
-       	((struct sockaddr_in6*)&rnd)->sin6_family = AF_INET6;
-       	((struct sockaddr_in6*)&rnd)->sin6_port = 0;
+	memset(&rnd, 0, sizeof(rnd));
+	((struct sockaddr_in6*)&rnd)->sin6_family = AF_INET6;
+	((struct sockaddr_in6*)&rnd)->sin6_port = 0;
+	memcpy(SA_IN6_U8_P(&rnd)+sizeof(struct in6_addr)-5, proc->ipv4_seed, 4);
 
-	do {
-		if (max_loops == 0) {
-			mslog(s, NULL, LOG_ERR, "could not figure out a valid IPv6 IP");
-			ret = ERR_NO_IP;
+	/* Mask the random number with the netmask */
+	for (i=0;i<sizeof(struct in6_addr);i++)
+		SA_IN6_U8_P(&rnd)[i] &= ~(SA_IN6_U8_P(&mask)[i]);
+
+	/* Now add the network to the masked random number */
+	for (i=0;i<sizeof(struct in6_addr);i++)
+		SA_IN6_U8_P(&rnd)[i] |= (SA_IN6_U8_P(&network)[i]);
+	SA_IN6_U8_P(&rnd)[15] &= 0xfe;
+
+	if (skip_seed == 0 && is_ipv6_ok(s, &rnd, &network, &mask) != 0) {
+		if (ip_to_offset(pool, &rnd, &mask, &proc->ipv6->offset) != 0)
+			proc->ipv6->pool = pool;
+	} else {
+		mslog(s, proc, LOG_DEBUG, "cannot assign local IP %s; it is in use or invalid", 
+		      human_addr((void*)&rnd, sizeof(struct sockaddr_in6), buf, sizeof(buf)));
+
+		ret = get_ip_from_pool(s, pool, &network, &mask, &rnd, &proc->ipv6->offset);
+		if (ret < 0) {
+			mslog(s, proc, LOG_ERR, "could not figure out a valid IPv6 IP");
 			goto fail;
 		}
-		
-		if (max_loops == MAX_IP_TRIES) {
-			memset(SA_IN6_U8_P(&rnd), 0, sizeof(struct in6_addr));
-			memcpy(SA_IN6_U8_P(&rnd)+sizeof(struct in6_addr)-5, proc->ipv4_seed, 4);
-		} else {
-			ip_from_seed(SA_IN6_U8_P(&rnd), sizeof(struct in6_addr),
-					SA_IN6_U8_P(&rnd), sizeof(struct in6_addr));
-		}
-		max_loops--;
-			
-		/* Mask the random number with the netmask */
-       		for (i=0;i<sizeof(struct in6_addr);i++)
-       			SA_IN6_U8_P(&rnd)[i] &= ~(SA_IN6_U8_P(&mask)[i]);
-
-		/* Now add the network to the masked random number */
-       		for (i=0;i<sizeof(struct in6_addr);i++)
-       			SA_IN6_U8_P(&rnd)[i] |= (SA_IN6_U8_P(&network)[i]);
-        			
-		/* check if it exists in the hash table */
-		if (is_ipv6_ok(s, &rnd, &network, &mask) == 0) {
-			mslog(s, proc, LOG_DEBUG, "cannot assign local IP %s; it is in use or invalid", 
-			      human_addr((void*)&rnd, sizeof(struct sockaddr_in6), buf, sizeof(buf)));
-			continue;
-		}
-
-       		proc->ipv6->rip_len = sizeof(struct sockaddr_in6);
-       		memcpy(&proc->ipv6->rip, &rnd, proc->ipv6->rip_len);
-		SA_IN6_U8_P(&proc->ipv6->rip)[15] &= 0xfe;
+		proc->ipv6->pool = pool;
+	}
 
-		proc->ipv6->prefix = 127;
+	proc->ipv6->rip_len = sizeof(struct sockaddr_in6);
+	memcpy(&proc->ipv6->rip, &rnd, proc->ipv6->rip_len);
 
-		/* LIP = RIP + 1 */
-		memcpy(&proc->ipv6->lip, &proc->ipv6->rip, sizeof(struct sockaddr_in6));
-		proc->ipv6->lip_len = sizeof(struct sockaddr_in6);
-		SA_IN6_U8_P(&proc->ipv6->lip)[15] |= 1;
+	proc->ipv6->prefix = 127;
 
-		mslog(s, proc, LOG_DEBUG, "selected IP: %s",
-		      human_addr((void*)&proc->ipv6->rip, proc->ipv6->rip_len, buf, sizeof(buf)));
+	/* LIP = RIP + 1 */
+	memcpy(&proc->ipv6->lip, &proc->ipv6->rip, sizeof(struct sockaddr_in6));
+	proc->ipv6->lip_len = sizeof(struct sockaddr_in6);
+	SA_IN6_U8_P(&proc->ipv6->lip)[15] |= 1;
 
-        	if (icmp_ping6(s, (void*)&proc->ipv6->rip) == 0)
-        		break;
-        } while(1);
+	mslog(s, proc, LOG_DEBUG, "selected IP: %s",
+	      human_addr((void*)&proc->ipv6->rip, proc->ipv6->rip_len, buf, sizeof(buf)));
 
 	return 0;
 fail:
@@ -472,41 +634,145 @@ int unref_ip_lease(struct ip_lease_st *lease)
 {
 	if (lease->db) {
 		htable_del(&lease->db->ht, rehash(lease, NULL), lease);
+		if (lease->pool)
+			ip_pool_put(lease->pool, lease->offset);
 	}
 
 	return 0;
 }
 
+static unsigned leases_probing(struct proc_st *proc)
+{
+	return (proc->ipv4 && proc->ipv4->probe) ||
+	       (proc->ipv6 && proc->ipv6->probe);
+}
+
+static void log_leases(main_server_st *s, struct proc_st *proc)
+{
+	char buf[128];
+
+	if (proc->ipv4)
+		mslog(s, proc, LOG_DEBUG, "assigned IPv4: %s",
+			human_addr((void*)&proc->ipv4->rip, proc->ipv4->rip_len, buf, sizeof(buf)));
+
+	if (proc->ipv6)
+		mslog(s, proc, LOG_DEBUG, "assigned IPv6: %s",
+			human_addr((void*)&proc->ipv6->rip, proc->ipv6->rip_len, buf, sizeof(buf)));
+}
+
+static void lease_probe_cb(main_server_st *s, void *priv, unsigned in_use);
+
+/* Registers a lease obtained from the pool, and if ping-leases is set,
+ * starts probing its address */
+static int add_lease(main_server_st *s, struct proc_st *proc, struct ip_lease_st *lease)
+{
+	if (htable_add(&s->ip_leases.ht, rehash(lease, NULL), lease) == 0) {
+		mslog(s, proc, LOG_ERR, "could not add IP lease to hash table");
+		return -1;
+	}
+	talloc_set_destructor(lease, unref_ip_lease);
+
+	lease->proc = proc;
+	lease->probe = icmp_probe_start(s, lease, &lease->rip, lease->rip_len,
+					lease_probe_cb, lease);
+	return 0;
+}
+
+/* Called when the probe of a lease has completed. If the address is in
+ * use by some host we don't know of, another is selected. The leasing
+ * completes with ip_leases_ready() once all probes are done.
+ */
+static void lease_probe_cb(main_server_st *s, void *priv, unsigned in_use)
+{
+	struct ip_lease_st *lease = priv;
+	struct proc_st *proc = lease->proc;
+	unsigned tries = lease->tries + 1;
+	struct ip_lease_st **lp;
+	int ret = 0;
+
+	lease->probe = NULL;
+
+	if (in_use) {
+		lp = (lease == proc->ipv4) ? &proc->ipv4 : &proc->ipv6;
+
+		/* keep the address out of the pool while another is
+		 * selected; otherwise it would be selected again. If it
+		 * cannot be set aside, the destructor returns it. */
+		if (lease->pool && ip_pool_set_busy(lease->pool, lease->offset) == 0)
+			lease->pool = NULL;
+		talloc_free(*lp);
+		*lp = NULL;
+
+		if (tries >= MAX_IP_TRIES) {
+			mslog(s, proc, LOG_ERR, "could not figure out a valid IP");
+			ret = ERR_NO_IP;
+			goto fail;
+		}
+
+		if (lp == &proc->ipv4)
+			ret = get_ipv4_lease(s, proc, 1);
+		else
+			ret = get_ipv6_lease(s, proc, 1);
+		if (ret < 0)
+			goto fail;
+
+		if (*lp && (*lp)->db) {
+			(*lp)->tries = tries;
+			ret = add_lease(s, proc, *lp);
+			if (ret < 0)
+				goto fail;
+		}
+	}
+
+	if (leases_probing(proc))
+		return;
+
+	log_leases(s, proc);
+	ip_leases_ready(s, proc, 0);
+	return;
+
+ fail:
+	/* make sure we complete once */
+	if (proc->ipv4 && proc->ipv4->probe) {
+		icmp_probe_cancel(proc->ipv4->probe);
+		proc->ipv4->probe = NULL;
+	}
+	if (proc->ipv6 && proc->ipv6->probe) {
+		icmp_probe_cancel(proc->ipv6->probe);
+		proc->ipv6->probe = NULL;
+	}
+	ip_leases_ready(s, proc, ret);
+}
+
+/* Obtains the IP addresses for the client. When the addresses are to
+ * be probed (ping-leases), ERR_WAIT_FOR_PING is returned, and the
+ * result is later provided to ip_leases_ready().
+ */
 int get_ip_leases(main_server_st *s, struct proc_st *proc)
 {
 int ret;
-char buf[128];
 
 	if (proc->ipv4 == NULL) {
-		ret = get_ipv4_lease(s, proc);
+		ret = get_ipv4_lease(s, proc, 0);
 		if (ret < 0)
 			return ret;
 
 		if (proc->ipv4 && proc->ipv4->db) {
-			if (htable_add(&s->ip_leases.ht, rehash(proc->ipv4, NULL), proc->ipv4) == 0) {
-				mslog(s, proc, LOG_ERR, "could not add IPv4 lease to hash table");
-				return -1;
-			}
-			talloc_set_destructor(proc->ipv4, unref_ip_lease);
+			ret = add_lease(s, proc, proc->ipv4);
+			if (ret < 0)
+				return ret;
 		}
 	}
 
 	if (proc->ipv6 == NULL) {
-		ret = get_ipv6_lease(s, proc);
+		ret = get_ipv6_lease(s, proc, 0);
 		if (ret < 0)
 			return ret;
 
 		if (proc->ipv6 && proc->ipv6->db) {
-			if (htable_add(&s->ip_leases.ht, rehash(proc->ipv6, NULL), proc->ipv6) == 0) {
-				mslog(s, proc, LOG_ERR, "could not add IPv6 lease to hash table");
-				return -1;
-			}
-			talloc_set_destructor(proc->ipv6, unref_ip_lease);
+			ret = add_lease(s, proc, proc->ipv6);
+			if (ret < 0)
+				return ret;
 		}
 	}
 
@@ -514,14 +780,11 @@ char buf[128];
 		mslog(s, proc, LOG_ERR, "no IPv4 or IPv6 addresses are configured. Cannot obtain lease");
 		return -1;
 	}
-	
-	if (proc->ipv4)
-		mslog(s, proc, LOG_DEBUG, "assigned IPv4: %s",
-			human_addr((void*)&proc->ipv4->rip, proc->ipv4->rip_len, buf, sizeof(buf)));
 
-	if (proc->ipv6)
-		mslog(s, proc, LOG_DEBUG, "assigned IPv6: %s",
-			human_addr((void*)&proc->ipv6->rip, proc->ipv6->rip_len, buf, sizeof(buf)));
+	if (leases_probing(proc))
+		return ERR_WAIT_FOR_PING;
+
+	log_leases(s, proc);
 
 	return 0;
 }
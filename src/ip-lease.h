@@ -26,6 +26,8 @@
 #include <sys/socket.h>
 #include <ccan/hash/hash.h>
 #include <main.h>
+#include <ip-pool.h>
+#include <icmp-ping.h>
 
 struct ip_lease_st {
         struct sockaddr_storage rip;
@@ -36,6 +38,15 @@ struct ip_lease_st {
         unsigned prefix; /* in ipv6 */
 
         struct ip_lease_db_st* db;
+
+        /* the pool the address was taken from, if any */
+        struct ip_pool_st *pool;
+        uint32_t offset;
+
+        /* the pending ping probe of the address, if any */
+        struct icmp_probe_st *probe;
+        unsigned tries;
+        struct proc_st *proc;
 };
 
 void ip_lease_deinit(struct ip_lease_db_st* db);
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <ip-pool.h>
+
+/* The pool does not track the leased offsets itself; the avail callback
+ * is consulted instead, when an offset is taken. Thus offsets that were
+ * leased out of order (e.g., on a client's request), are skipped when
+ * they are reached, and released offsets that were leased again before
+ * their turn, are dropped when they are taken out of the FIFO. Every
+ * offset is skipped at most once per release, so allocation takes
+ * constant amortized time, independently of the pool utilization.
+ */
+
+#define MIN_FREED_SIZE 64
+
+struct ip_pool_st *ip_pool_new(void *pool, uint32_t size)
+{
+	struct ip_pool_st *p;
+
+	p = talloc_zero(pool, struct ip_pool_st);
+	if (p == NULL)
+		return NULL;
+
+	if (size > MAX_IP_POOL_SIZE)
+		size = MAX_IP_POOL_SIZE;
+	p->size = size;
+
+	return p;
+}
+
+static unsigned is_queued(struct ip_pool_st *p, uint32_t offset)
+{
+	if (offset / 8 >= p->queued_size)
+		return 0;
+	return p->queued[offset / 8] & (1 << (offset % 8));
+}
+
+static int set_queued(struct ip_pool_st *p, uint32_t offset, unsigned val)
+{
+	uint32_t new_size;
+	uint8_t *tmp;
+
+	if (offset / 8 >= p->queued_size) {
+		if (val == 0)
+			return 0;
+
+		new_size = p->queued_size * 2;
+		if (new_size <= offset / 8)
+			new_size = offset / 8 + MIN_FREED_SIZE;
+
+		tmp = talloc_realloc(p, p->queued, uint8_t, new_size);
+		if (tmp == NULL)
+			return -1;
+		memset(tmp + p->queued_size, 0, new_size - p->queued_size);
+		p->queued = tmp;
+		p->queued_size = new_size;
+	}
+
+	if (val)
+		p->queued[offset / 8] |= (1 << (offset % 8));
+	else
+		p->queued[offset / 8] &= ~(1 << (offset % 8));
+	return 0;
+}
+
+/* Makes room for another entry in the ring of released offsets */
+static int grow_freed(struct ip_pool_st *p)
+{
+	uint32_t new_max, tail;
+	uint32_t *tmp;
+
+	new_max = p->freed_max ? p->freed_max * 2 : MIN_FREED_SIZE;
+	tmp = talloc_realloc(p, p->freed, uint32_t, new_max);
+	if (tmp == NULL)
+		return -1;
+
+	/* unwrap the ring into the new space */
+	tail = p->freed_head + p->freed_count;
+	if (tail > p->freed_max)
+		memcpy(tmp + p->freed_max, tmp, (tail - p->freed_max) * sizeof(uint32_t));
+
+	p->freed = tmp;
+	p->freed_max = new_max;
+	return 0;
+}
+
+/* Stores in offset a free offset of the pool.
+ *
+ * Returns 0 on success, or -1 if no offset is available.
+ */
+int ip_pool_get(struct ip_pool_st *p, ip_pool_avail_func avail, void *priv,
+		uint32_t *offset)
+{
+	uint32_t o, i;
+
+	for (;;) {
+		while (p->freed_count > 0) {
+			o = p->freed[p->freed_head];
+			p->freed_head = (p->freed_head + 1) % p->freed_max;
+			p->freed_count--;
+			set_queued(p, o, 0);
+
+			if (avail(priv, o) != 0) {
+				*offset = o;
+				return 0;
+			}
+		}
+
+		while (p->next < p->size) {
+			o = p->next++;
+
+			if (avail(priv, o) != 0) {
+				*offset = o;
+				return 0;
+			}
+		}
+
+		if (p->busy_count == 0)
+			return -1;
+
+		/* give the busy offsets another chance */
+		for (i = 0; i < p->busy_count; i++)
+			ip_pool_put(p, p->busy[i]);
+		p->busy_count = 0;
+	}
+}
+
+/* Returns an offset to the pool. Offsets which were never reached
+ * need not be recorded; they are considered when the pool grows.
+ */
+void ip_pool_put(struct ip_pool_st *p, uint32_t offset)
+{
+	if (offset >= p->next || is_queued(p, offset))
+		return;
+
+	if (p->freed_count == p->freed_max && grow_freed(p) < 0)
+		return;
+
+	if (set_queued(p, offset, 1) < 0)
+		return;
+
+	p->freed[(p->freed_head + p->freed_count) % p->freed_max] = offset;
+	p->freed_count++;
+}
+
+/* Sets aside an offset which was taken, but found to be in use by some
+ * other host. It is not handed out again until the pool is exhausted.
+ *
+ * Returns 0 on success, or -1 on error, in which case the offset is
+ * not tracked until it is released with ip_pool_put().
+ */
+int ip_pool_set_busy(struct ip_pool_st *p, uint32_t offset)
+{
+	uint32_t new_max;
+	uint32_t *tmp;
+
+	if (p->busy_count == p->busy_max) {
+		new_max = p->busy_max ? p->busy_max * 2 : MIN_FREED_SIZE;
+		tmp = talloc_realloc(p, p->busy, uint32_t, new_max);
+		if (tmp == NULL)
+			return -1;
+		p->busy = tmp;
+		p->busy_max = new_max;
+	}
+
+	p->busy[p->busy_count++] = offset;
+	return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef IP_POOL_H
+# define IP_POOL_H
+
+#include <stdint.h>
+#include <talloc.h>
+#include <ccan/list/list.h>
+
+/* the maximum number of addresses tracked by a pool */
+#define MAX_IP_POOL_SIZE (1U << 24)
+
+/* An address pool; addresses are identified by their offset within
+ * the pool. Offsets are handed out from a FIFO of released offsets,
+ * and when it is empty, from the part of the pool that was never used.
+ */
+struct ip_pool_st {
+	struct list_node list;
+
+	/* identifies the network of the pool */
+	int family;
+	uint8_t network[16];
+	unsigned prefix;
+
+	uint32_t size; /* the number of offsets */
+	uint32_t next; /* offsets from that one on were never allocated */
+
+	/* released offsets; a ring */
+	uint32_t *freed;
+	uint32_t freed_max;
+	uint32_t freed_head;
+	uint32_t freed_count;
+
+	/* a bit for each offset below next, set when in freed */
+	uint8_t *queued;
+	uint32_t queued_size;
+
+	/* offsets found in use by hosts we don't know of; these are
+	 * returned to freed only once the pool is otherwise exhausted */
+	uint32_t *busy;
+	uint32_t busy_max;
+	uint32_t busy_count;
+};
+
+/* Returns non-zero if the offset can be leased */
+typedef int (*ip_pool_avail_func)(void *priv, uint32_t offset);
+
+struct ip_pool_st *ip_pool_new(void *pool, uint32_t size);
+int ip_pool_get(struct ip_pool_st *p, ip_pool_avail_func avail, void *priv,
+		uint32_t *offset);
+void ip_pool_put(struct ip_pool_st *p, uint32_t offset);
+int ip_pool_set_busy(struct ip_pool_st *p, uint32_t offset);
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <vpn.h>
+#include <main.h>
+#include <gettime.h>
+#include <ccan/list/list.h>
+
+/* Admission control of new connections (rate-limit-ms). A token bucket
+ * holds up to rate-limit-burst connections, and a token is added every
+ * rate-limit-ms milliseconds. Connections that arrive while the bucket
+ * is empty are queued, rather than delaying the main process, and are
+ * admitted from the main loop as tokens become available.
+ *
+ * Connections from addresses which have an existing session (typically
+ * clients re-connecting with their cookie) are queued ahead of new
+ * ones. When the queue is full, new clients are rejected.
+ */
+
+void admission_init(main_server_st *s)
+{
+	struct admission_st *a = &s->admission;
+
+	list_head_init(&a->prio);
+	list_head_init(&a->fresh);
+	a->total = 0;
+
+	/* the bucket is filled on first use */
+	a->credit_ms = 0;
+	a->last.tv_sec = 0;
+	a->last.tv_nsec = 0;
+}
+
+static void remove_conn(struct admission_st *a, struct pending_conn_st *c)
+{
+	list_del(&c->list);
+	a->total--;
+}
+
+void admission_deinit(main_server_st *s)
+{
+	struct admission_st *a = &s->admission;
+	struct pending_conn_st *c, *pos;
+
+	list_for_each_safe(&a->prio, c, pos, list) {
+		remove_conn(a, c);
+		close(c->fd);
+		talloc_free(c);
+	}
+
+	list_for_each_safe(&a->fresh, c, pos, list) {
+		remove_conn(a, c);
+		close(c->fd);
+		talloc_free(c);
+	}
+}
+
+static void refill(main_server_st *s)
+{
+	struct admission_st *a = &s->admission;
+	unsigned max = s->config->rate_limit_ms * s->config->rate_limit_burst;
+	struct timespec now;
+	unsigned diff;
+
+	gettime(&now);
+	if (a->last.tv_sec == 0 || now.tv_sec - a->last.tv_sec > max / 1000) {
+		a->last = now;
+		a->credit_ms = max;
+		return;
+	}
+
+	if (now.tv_sec < a->last.tv_sec ||
+	    (now.tv_sec == a->last.tv_sec && now.tv_nsec < a->last.tv_nsec)) {
+		/* the clock was set back */
+		a->last = now;
+		return;
+	}
+
+	diff = timespec_sub_ms(&now, &a->last);
+	if (diff == 0)
+		return;
+	a->last = now;
+
+	if (a->credit_ms + diff >= max)
+		a->credit_ms = max;
+	else
+		a->credit_ms += diff;
+}
+
+static unsigned take_token(main_server_st *s)
+{
+	struct admission_st *a = &s->admission;
+
+	refill(s);
+	if (a->credit_ms < s->config->rate_limit_ms)
+		return 0;
+
+	a->credit_ms -= s->config->rate_limit_ms;
+	return 1;
+}
+
+/* Returns 1 if the connection can be served now, 0 if it was queued,
+ * or -1 if it was rejected. In the last two cases the connection is
+ * owned by this module.
+ */
+int admission_check(main_server_st *s, const struct pending_conn_st *conn)
+{
+	struct admission_st *a = &s->admission;
+	struct pending_conn_st *c;
+
+	if (s->config->rate_limit_ms == 0)
+		return 1;
+
+	/* queued connections are served first; clients with an
+	 * existing session only wait for the ones of their kind */
+	if ((a->total == 0 || (conn->priority && list_empty(&a->prio))) &&
+	    take_token(s) != 0)
+		return 1;
+
+	if (a->total >= MAX_PENDING_CONNS) {
+		c = list_tail(&a->fresh, struct pending_conn_st, list);
+		if (conn->priority == 0 || c == NULL) {
+			mslog(s, NULL, LOG_INFO, "too many connections waiting for admission; rejecting");
+			s->metrics.rejected[METRICS_REJECT_ADMISSION]++;
+			close(conn->fd);
+			return -1;
+		}
+
+		/* make room by dropping the latest new client */
+		mslog(s, NULL, LOG_INFO, "too many connections waiting for admission; rejecting a new client");
+		s->metrics.rejected[METRICS_REJECT_ADMISSION]++;
+		remove_conn(a, c);
+		close(c->fd);
+		talloc_free(c);
+	}
+
+	c = talloc(s, struct pending_conn_st);
+	if (c == NULL) {
+		close(conn->fd);
+		return -1;
+	}
+	memcpy(c, conn, sizeof(*c));
+
+	if (c->priority)
+		list_add_tail(&a->prio, &c->list);
+	else
+		list_add_tail(&a->fresh, &c->list);
+	a->total++;
+
+	return 0;
+}
+
+/* Returns the next queued connection which can be served, or NULL.
+ * The returned connection must be freed by the caller.
+ */
+struct pending_conn_st *admission_next(main_server_st *s)
+{
+	struct admission_st *a = &s->admission;
+	struct pending_conn_st *c;
+
+	if (a->total == 0)
+		return NULL;
+
+	/* the limit may have been lifted on reload */
+	if (s->config->rate_limit_ms > 0 && take_token(s) == 0)
+		return NULL;
+
+	c = list_top(&a->prio, struct pending_conn_st, list);
+	if (c == NULL)
+		c = list_top(&a->fresh, struct pending_conn_st, list);
+
+	remove_conn(a, c);
+	return c;
+}
+
+/* Returns the time (in ms) the main loop may wait for events, taking
+ * into account when the next queued connection can be admitted.
+ */
+unsigned admission_timeout(main_server_st *s, unsigned timeout_ms)
+{
+	struct admission_st *a = &s->admission;
+	unsigned wait;
+
+	if (a->total == 0)
+		return timeout_ms;
+
+	refill(s);
+	if (a->credit_ms >= s->config->rate_limit_ms)
+		return 0;
+
+	wait = s->config->rate_limit_ms - a->credit_ms;
+	return (wait < timeout_ms) ? wait : timeout_ms;
+}
@@ -238,6 +238,7 @@ struct proc_st *old_proc;
 	}
 	/* this hints to call session_close() */
 	proc->active_sid = 1;
+	metrics_session_opened(s, proc);
 
 	/* Put into right cgroup */
         if (proc->config.cgroup != NULL) {
@@ -308,18 +309,17 @@ struct proc_st *old_proc;
  */
 int check_multiple_users(main_server_st *s, struct proc_st* proc)
 {
-struct proc_st *ctmp = NULL, *cpos;
+struct proc_user_st *u;
 unsigned int entries = 1; /* that one */
 
 	if (s->config->max_same_clients == 0)
 		return 0;
 
-	list_for_each_safe(&s->proc_list.head, ctmp, cpos, list) {
-		if (ctmp != proc && ctmp->pid != -1) {
-			if (strcmp(proc->username, ctmp->username) == 0) {
-				entries++;
-			}
-		}
+	u = proc_search_user(s, proc->username);
+	if (u != NULL) {
+		entries += u->procs;
+		if (proc->user == u) /* already counted */
+			entries--;
 	}
 
 	if (s->config->max_same_clients && entries > s->config->max_same_clients)
@@ -42,37 +42,172 @@
 #include <main-ban.h>
 #include <ccan/hash/hash.h>
 #include <ccan/htable/htable.h>
+#include <arpa/inet.h>
 
-static size_t rehash(const void *_e, void *unused)
+/* the maximum number of expired entries removed on each connection */
+#define BAN_EXPIRE_BATCH 4
+
+static size_t key_hash(const ban_key_st *key)
 {
-	ban_entry_st *e = (void*)_e;
-	return hash_any(e->ip, strlen(e->ip), 0);
+	return hash_any(key, sizeof(*key), 0);
+}
 
+static size_t rehash(const void *_e, void *unused)
+{
+	const ban_entry_st *e = _e;
+	return key_hash(&e->key);
 }
 
 /* The first argument is the entry from the hash, and
- * the second is the entry from check_if_banned().
+ * the second is the key looked up.
  */
 static bool ban_entry_cmp(const void *_c1, void *_c2)
 {
 	const struct ban_entry_st *c1 = _c1;
-	struct ban_entry_st *c2 = _c2;
+	const ban_key_st *key = _c2;
 
-	if (strcmp(c1->ip, c2->ip) == 0)
+	if (memcmp(&c1->key, key, sizeof(*key)) == 0)
 		return 1;
 	return 0;
 }
 
+static unsigned key_bits(unsigned family)
+{
+	return (family == AF_INET6)?128:32;
+}
+
+/* zeroes the bits after the given prefix */
+static void mask_key(ban_key_st *key, unsigned prefix)
+{
+	unsigned i;
+
+	for (i = prefix / 8; i < sizeof(key->ip); i++) {
+		if (i == prefix / 8 && prefix % 8 != 0)
+			key->ip[i] &= 0xff << (8 - prefix % 8);
+		else
+			key->ip[i] = 0;
+	}
+	key->prefix = prefix;
+}
+
+static int addr_to_key(const struct sockaddr_storage *addr, socklen_t addr_size, ban_key_st *key)
+{
+	memset(key, 0, sizeof(*key));
+
+	if (addr->ss_family == AF_INET && addr_size >= sizeof(struct sockaddr_in)) {
+		memcpy(key->ip, &((struct sockaddr_in*)addr)->sin_addr, 4);
+	} else if (addr->ss_family == AF_INET6 && addr_size >= sizeof(struct sockaddr_in6)) {
+		memcpy(key->ip, &((struct sockaddr_in6*)addr)->sin6_addr, 16);
+	} else {
+		return -1;
+	}
+
+	key->family = addr->ss_family;
+	key->prefix = key_bits(key->family);
+	return 0;
+}
+
+/* Parses an address, or a network in the address/prefix form */
+static int str_to_key(const char *ip, ban_key_st *key)
+{
+	char str[MAX_BAN_IP_STR];
+	char *p;
+	unsigned prefix = 0;
+
+	memset(key, 0, sizeof(*key));
+	strlcpy(str, ip, sizeof(str));
+
+	p = strchr(str, '/');
+	if (p != NULL) {
+		*p = 0;
+		prefix = atoi(p+1);
+	}
+
+	if (inet_pton(AF_INET, str, key->ip) == 1)
+		key->family = AF_INET;
+	else if (inet_pton(AF_INET6, str, key->ip) == 1)
+		key->family = AF_INET6;
+	else
+		return -1;
+
+	if (p == NULL || prefix > key_bits(key->family))
+		prefix = key_bits(key->family);
+	mask_key(key, prefix);
+
+	return 0;
+}
+
+static void key_to_str(const ban_key_st *key, char *str, size_t str_size)
+{
+	size_t len;
+
+	if (inet_ntop(key->family, key->ip, str, str_size) == NULL) {
+		str[0] = 0;
+		return;
+	}
+
+	if (key->prefix < key_bits(key->family)) {
+		len = strlen(str);
+		snprintf(str+len, str_size-len, "/%u", (unsigned)key->prefix);
+	}
+}
+
+/* Sets the prefix key that the address belongs to; returns -1 if the
+ * addresses are not scored per prefix. */
+static int prefix_key(main_server_st *s, const ban_key_st *key, ban_key_st *pkey)
+{
+	unsigned prefix;
+
+	if (s->config->max_ban_prefix_score <= 0)
+		return -1;
+
+	prefix = (key->family == AF_INET6)?s->config->ban_ipv6_prefix:s->config->ban_ipv4_prefix;
+	if (prefix >= key->prefix)
+		return -1;
+
+	memcpy(pkey, key, sizeof(*pkey));
+	mask_key(pkey, prefix);
+	return 0;
+}
+
+static void remove_entry(ban_db_st *db, ban_entry_st *e)
+{
+	htable_del(&db->ht, rehash(e, NULL), e);
+	list_del(&e->list);
+	talloc_free(e);
+}
+
+/* Removes up to max entries (or all if zero) that neither ban, nor keep
+ * score. The least recently updated entries are checked first, and the
+ * search stops at the first entry still in use; that may keep a few
+ * stale entries for longer, but never requires walking the table. */
+static void expire_entries(main_server_st *s, time_t now, unsigned max)
+{
+	ban_db_st *db = s->ban_db;
+	ban_entry_st *e, *tmp;
+	unsigned removed = 0;
+
+	list_for_each_safe(&db->list, e, tmp, list) {
+		if (now < e->expires || now <= e->last_reset + s->config->ban_reset_time)
+			break;
+
+		remove_entry(db, e);
+
+		if (max != 0 && ++removed >= max)
+			break;
+	}
+}
 
 void *main_ban_db_init(main_server_st *s)
 {
-	struct htable *db = talloc(s, struct htable);
+	ban_db_st *db = talloc(s, ban_db_st);
 	if (db == NULL) {
 		fprintf(stderr, "error initializing ban DB\n");
 		exit(1);
 	}
 
-	htable_init(db, rehash, NULL);
+	htable_init(&db->ht, rehash, NULL);
+	list_head_init(&db->list);
 	s->ban_db = db;
 
 	return db;
@@ -80,105 +215,137 @@ void *main_ban_db_init(main_server_st *s)
 
 void main_ban_db_deinit(main_server_st *s)
 {
-struct htable *db = s->ban_db;
+ban_db_st *db = s->ban_db;
 
 	if (db != NULL) {
-		htable_clear(db);
+		htable_clear(&db->ht);
 		talloc_free(db);
 	}
 }
 
 unsigned main_ban_db_elems(main_server_st *s)
 {
-struct htable *db = s->ban_db;
+ban_db_st *db = s->ban_db;
 
 	if (db)
-		return db->elems;
+		return db->ht.elems;
 	else
 		return 0;
 }
 
-/* returns -1 if the user is already banned, and zero otherwise */
-int add_ip_to_ban_list(main_server_st *s, const char *ip, unsigned score)
+/* Adds the given score to the entry of the key, creating it if needed.
+ * Returns the entry or NULL on error.
+ */
+static ban_entry_st *add_key_score(main_server_st *s, const ban_key_st *key,
+				   unsigned score, int max_score, time_t now)
 {
-	struct htable *db = s->ban_db;
+	ban_db_st *db = s->ban_db;
 	struct ban_entry_st *e;
-	ban_entry_st t;
-	time_t now = time(0);
-	time_t expiration = now + s->config->min_reauth_time;
-	int ret = 0;
+	size_t hash = key_hash(key);
 	unsigned print_msg;
 
-	if (db == NULL || s->config->max_ban_score == 0 || ip == NULL || ip[0] == 0)
-		return 0;
-
-	/* check if the IP is already there */
-	/* pass the current time somehow */
-	strlcpy(t.ip, ip, sizeof(t.ip));
-
-	e = htable_get(db, rehash(&t, NULL), ban_entry_cmp, &t);
+	e = htable_get(&db->ht, hash, ban_entry_cmp, key);
 	if (e == NULL) { /* new entry */
 		e = talloc_zero(db, ban_entry_st);
 		if (e == NULL) {
-			return 0;
+			return NULL;
 		}
 
-		strlcpy(e->ip, ip, sizeof(e->ip));
+		memcpy(&e->key, key, sizeof(*key));
+		key_to_str(key, e->ip, sizeof(e->ip));
 		e->last_reset = now;
 
-		if (htable_add(db, rehash(e, NULL), e) == 0) {
+		if (htable_add(&db->ht, hash, e) == 0) {
 			mslog(s, NULL, LOG_INFO,
 			       "could not add ban entry to hash table");
-			goto fail;
+			talloc_free(e);
+			return NULL;
 		}
 	} else {
 		if (now > e->last_reset + s->config->ban_reset_time) {
 			e->score = 0;
 			e->last_reset = now;
 		}
+		list_del(&e->list);
 	}
 
+	/* keep the list ordered by the time of the last update */
+	e->last_update = now;
+	list_add_tail(&db->list, &e->list);
+
 	/* if the user is already banned, don't increase the expiration time
 	 * on further attempts, or the user will never be unbanned if he
 	 * periodically polls the server */
-	if (e->score < s->config->max_ban_score) {
-		e->expires = expiration;
+	if (e->score < max_score) {
+		e->expires = now + s->config->min_reauth_time;
 		print_msg = 0;
 	} else
 		print_msg = 1;
 	e->score += score;
 
-	if (s->config->max_ban_score > 0 && e->score >= s->config->max_ban_score) {
+	if (e->score >= max_score) {
 		if (print_msg)
-			mslog(s, NULL, LOG_INFO, "added IP '%s' (with score %d) to ban list, will be reset at: %s", ip, e->score, ctime(&e->expires));
-		ret = -1;
+			mslog(s, NULL, LOG_INFO, "added IP '%s' (with score %d) to ban list, will be reset at: %s", e->ip, e->score, ctime(&e->expires));
 	} else {
-		mslog(s, NULL, LOG_DEBUG, "added %d points (total %d) for IP '%s' to ban list", score, e->score, ip);
-		ret = 0;
+		mslog(s, NULL, LOG_DEBUG, "added %d points (total %d) for IP '%s' to ban list", score, e->score, e->ip);
+	}
+
+	return e;
+}
+
+/* Adds the score to the address, and to its prefix when enabled.
+ * Returns -1 if either is banned, and zero otherwise.
+ */
+static int add_addr_to_ban_list(main_server_st *s, const ban_key_st *key, unsigned score, time_t now)
+{
+	ban_entry_st *e;
+	ban_key_st pkey;
+	int ret = 0;
+
+	e = add_key_score(s, key, score, s->config->max_ban_score, now);
+	if (e != NULL && e->score >= s->config->max_ban_score)
+		ret = -1;
+
+	if (prefix_key(s, key, &pkey) == 0) {
+		e = add_key_score(s, &pkey, score, s->config->max_ban_prefix_score, now);
+		if (e != NULL && e->score >= s->config->max_ban_prefix_score)
+			ret = -1;
 	}
 
 	return ret;
- fail:
-	talloc_free(e);
-	return ret;
+}
+
+/* returns -1 if the user is already banned, and zero otherwise */
+int add_ip_to_ban_list(main_server_st *s, const char *ip, unsigned score)
+{
+	ban_key_st key;
+
+	if (s->ban_db == NULL || s->config->max_ban_score == 0 || ip == NULL || ip[0] == 0)
+		return 0;
+
+	if (str_to_key(ip, &key) < 0) {
+		mslog(s, NULL, LOG_INFO, "cannot parse IP '%s' to ban", ip);
+		return 0;
+	}
+
+	return add_addr_to_ban_list(s, &key, score, time(0));
 }
 
 /* returns non-zero if there is an IP removed */
 int remove_ip_from_ban_list(main_server_st *s, const char *ip)
 {
-	struct htable *db = s->ban_db;
+	ban_db_st *db = s->ban_db;
 	struct ban_entry_st *e;
-	ban_entry_st t;
+	ban_key_st key;
 
 	if (db == NULL || ip == NULL || ip[0] == 0)
 		return 0;
 
-	/* check if the IP is already there */
-	/* pass the current time somehow */
-	strlcpy(t.ip, ip, sizeof(t.ip));
+	if (str_to_key(ip, &key) < 0)
+		return 0;
 
-	e = htable_get(db, rehash(&t, NULL), ban_entry_cmp, &t);
-	if (e != NULL) { /* new entry */
+	e = htable_get(&db->ht, key_hash(&key), ban_entry_cmp, &key);
+	if (e != NULL) {
 		e->score = 0;
 		e->expires = 0;
 		return 1;
@@ -187,52 +354,51 @@ int remove_ip_from_ban_list(main_server_st *s, const char *ip)
 	return 0;
 }
 
+static unsigned is_banned(ban_entry_st *e, int max_score, time_t now)
+{
+	if (e == NULL || now > e->expires)
+		return 0;
+
+	return (e->score >= max_score)?1:0;
+}
+
 unsigned check_if_banned(main_server_st *s, struct sockaddr_storage *addr, socklen_t addr_size)
 {
-	struct htable *db = s->ban_db;
 	time_t now;
-	ban_entry_st t, *e;
+	ban_entry_st *e;
+	ban_key_st key, pkey;
 
-	if (db == NULL || s->config->max_ban_score == 0)
+	if (s->ban_db == NULL || s->config->max_ban_score == 0)
 		return 0;
 
-	if (human_addr2((struct sockaddr*)addr, addr_size, t.ip, sizeof(t.ip), 0) != NULL) {
-		/* add its current connection points */
-		add_ip_to_ban_list(s, t.ip, s->config->ban_points_connect);
+	if (addr_to_key(addr, addr_size, &key) < 0)
+		return 0;
 
-		now = time(0);
-		e = htable_get(db, rehash(&t, NULL), ban_entry_cmp, &t);
-		if (e != NULL) {
-			if (now > e->expires)
-				return 0;
+	now = time(0);
+	expire_entries(s, now, BAN_EXPIRE_BATCH);
+
+	/* add its current connection points */
+	e = add_key_score(s, &key, s->config->ban_points_connect, s->config->max_ban_score, now);
+	if (is_banned(e, s->config->max_ban_score, now)) {
+		mslog(s, NULL, LOG_INFO, "rejected connection from banned IP: %s", e->ip);
+		return 1;
+	}
 
-			if (e->score >= s->config->max_ban_score) {
-			    	mslog(s, NULL, LOG_INFO, "rejected connection from banned IP: %s", t.ip);
-				return 1;
-			}
+	if (prefix_key(s, &key, &pkey) == 0) {
+		e = add_key_score(s, &pkey, s->config->ban_points_connect, s->config->max_ban_prefix_score, now);
+		if (is_banned(e, s->config->max_ban_prefix_score, now)) {
+			mslog(s, NULL, LOG_INFO, "rejected connection from banned network: %s", e->ip);
+			return 1;
 		}
 	}
+
 	return 0;
 }
 
 void cleanup_banned_entries(main_server_st *s)
 {
-	struct htable *db = s->ban_db;
-	ban_entry_st *t;
-	struct htable_iter iter;
-	time_t now = time(0);
-
-	if (db == NULL)
+	if (s->ban_db == NULL)
 		return;
 
-	t = htable_first(db, &iter);
-	while (t != NULL) {
-		if (now >= t->expires && now > t->last_reset + s->config->ban_reset_time) {
-			htable_delval(db, &iter);
-			talloc_free(t);
-		}
-		t = htable_next(db, &iter);
-
-	}
+	expire_entries(s, time(0), 0);
 }
-
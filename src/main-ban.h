@@ -22,15 +22,42 @@
 # define MAIN_BAN_H
 
 # include "main.h"
+# include <ccan/htable/htable.h>
+# include <ccan/list/list.h>
+
+/* the address an entry applies to; either a single address, or
+ * a prefix when prefix is less than the address length. The unused
+ * bits are zero. */
+typedef struct ban_key_st {
+	uint8_t family;
+	uint8_t prefix;
+	uint8_t ip[16];
+} ban_key_st;
+
+/* the largest string representation of a key, i.e., an IPv6 prefix */
+#define MAX_BAN_IP_STR (MAX_IP_STR+5)
 
 typedef struct ban_entry_st {
-	char ip[MAX_IP_STR];
+	ban_key_st key;
+	char ip[MAX_BAN_IP_STR]; /* the key as text, for logging and occtl */
 	unsigned score;
 
 	time_t last_reset; /* the time its score counting started */
 	time_t expires; /* the time after the client is allowed to login */
+
+	time_t last_update;
+	struct list_node list; /* in ban_db_st->list */
 } ban_entry_st;
 
+/* The entries are kept in the order they were last updated, so that
+ * expired entries are found at the head of the list without walking
+ * the whole table.
+ */
+typedef struct ban_db_st {
+	struct htable ht;
+	struct list_head list;
+} ban_db_st;
+
 void cleanup_banned_entries(main_server_st *s);
 unsigned check_if_banned(main_server_st *s, struct sockaddr_storage *addr, socklen_t addr_size);
 int add_ip_to_ban_list(main_server_st *s, const char *ip, unsigned score);
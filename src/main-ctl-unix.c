@@ -32,39 +32,70 @@
 
 #include <errno.h>
 #include <system.h>
+#include <cloexec.h>
 #include <main-ctl.h>
 #include <main-ban.h>
+#include <proc-search.h>
 
 #include <ctl.pb-c.h>
 #include <str.h>
 
+/* the maximum number of concurrent connections */
+#define CTL_MAX_CONNS 16
+/* seconds after which an incomplete connection may be closed */
+#define CTL_CONN_TIMEOUT 10
+
+/* A connection of occtl. It is served from the main loop without
+ * blocking; the request is read into rbuf, and the reply is written
+ * from wbuf as the socket becomes writable. */
+struct ctl_conn_st {
+	struct list_node list;
+	main_ev_st ev;
+	time_t time; /* the time it was accepted */
+
+	uint8_t rbuf[256];
+	unsigned rsize;
+
+	uint8_t *wbuf;
+	size_t wsize;
+	size_t wpos;
+};
+
 typedef struct method_ctx {
 	main_server_st *s;
+	struct ctl_conn_st *conn;
 	void *pool;
 } method_ctx;
 
-static void method_status(method_ctx *ctx, int cfd, uint8_t * msg,
+static void ctl_handle_commands(main_server_st * s);
+
+static void ctl_ev(main_server_st *s, main_ev_st *ev, unsigned revents)
+{
+	ctl_handle_commands(s);
+}
+
+static void method_status(method_ctx *ctx, uint8_t * msg,
 			  unsigned msg_size);
-static void method_list_users(method_ctx *ctx, int cfd, uint8_t * msg,
+static void method_list_users(method_ctx *ctx, uint8_t * msg,
 			      unsigned msg_size);
-static void method_disconnect_user_name(method_ctx *ctx, int cfd,
+static void method_disconnect_user_name(method_ctx *ctx,
 					uint8_t * msg, unsigned msg_size);
-static void method_disconnect_user_id(method_ctx *ctx, int cfd,
+static void method_disconnect_user_id(method_ctx *ctx,
 				      uint8_t * msg, unsigned msg_size);
-static void method_unban_ip(method_ctx *ctx, int cfd,
+static void method_unban_ip(method_ctx *ctx,
 				      uint8_t * msg, unsigned msg_size);
-static void method_stop(method_ctx *ctx, int cfd, uint8_t * msg,
+static void method_stop(method_ctx *ctx, uint8_t * msg,
 			unsigned msg_size);
-static void method_reload(method_ctx *ctx, int cfd, uint8_t * msg,
+static void method_reload(method_ctx *ctx, uint8_t * msg,
 			  unsigned msg_size);
-static void method_user_info(method_ctx *ctx, int cfd, uint8_t * msg,
+static void method_user_info(method_ctx *ctx, uint8_t * msg,
 			     unsigned msg_size);
-static void method_id_info(method_ctx *ctx, int cfd, uint8_t * msg,
+static void method_id_info(method_ctx *ctx, uint8_t * msg,
 			   unsigned msg_size);
-static void method_list_banned(method_ctx *ctx, int cfd, uint8_t * msg,
+static void method_list_banned(method_ctx *ctx, uint8_t * msg,
 			   unsigned msg_size);
 
-typedef void (*method_func) (method_ctx *ctx, int cfd, uint8_t * msg,
+typedef void (*method_func) (method_ctx *ctx, uint8_t * msg,
 			     unsigned msg_size);
 
 typedef struct {
@@ -90,11 +121,65 @@ static const ctl_method_st methods[] = {
 	{NULL, 0, NULL}
 };
 
+static void ctl_conn_close(main_server_st * s, struct ctl_conn_st *conn)
+{
+	main_ev_del(s, &conn->ev);
+	close(conn->ev.fd);
+	list_del(&conn->list);
+	s->ctl_conns_size--;
+	talloc_free(conn);
+}
+
+/* Queues a reply to the request of the connection; it is sent
+ * once the request's method returns. */
+static int ctl_reply(method_ctx *ctx, uint8_t cmd, const void *msg,
+		     pack_size_func get_size, pack_func pack)
+{
+	struct ctl_conn_st *conn = ctx->conn;
+	size_t length = get_size(msg);
+	uint16_t length16;
+	uint8_t *p;
+
+	if (length > UINT16_MAX) {
+		mslog(ctx->s, NULL, LOG_ERR, "ctl reply is too large (%u bytes)",
+		      (unsigned)length);
+		return -1;
+	}
+
+	p = talloc_realloc_size(conn, conn->wbuf, conn->wsize + 3 + length);
+	if (p == NULL)
+		return -1;
+	conn->wbuf = p;
+
+	p += conn->wsize;
+	p[0] = cmd;
+	length16 = length;
+	memcpy(&p[1], &length16, 2);
+
+	if (length > 0 && pack(msg, p + 3) == 0) {
+		mslog(ctx->s, NULL, LOG_ERR, "ctl reply packing error");
+		return -1;
+	}
+	conn->wsize += 3 + length;
+
+	return 0;
+}
+
 void ctl_handler_deinit(main_server_st * s)
 {
+	struct ctl_conn_st *conn, *cpos;
+
 	if (s->config->use_occtl == 0)
 		return;
 
+	/* in the child processes the descriptors are only closed */
+	list_for_each_safe(&s->ctl_conns, conn, cpos, list) {
+		close(conn->ev.fd);
+		list_del(&conn->list);
+		talloc_free(conn);
+	}
+	s->ctl_conns_size = 0;
+
 	if (s->ctl_fd >= 0) {
 		/*mslog(s, NULL, LOG_DEBUG, "closing unix socket connection");*/
 		close(s->ctl_fd);
@@ -153,11 +238,19 @@ int ctl_handler_init(main_server_st * s)
 		return -1;
 	}
 
+	set_non_block(sd);
+
+	ret = main_ev_add(s, &s->ctl_ev, sd, MEV_READ, ctl_ev);
+	if (ret < 0) {
+		close(sd);
+		return -1;
+	}
+
 	s->ctl_fd = sd;
 	return sd;
 }
 
-static void method_status(method_ctx *ctx, int cfd, uint8_t * msg,
+static void method_status(method_ctx *ctx, uint8_t * msg,
 			  unsigned msg_size)
 {
 	StatusRep rep = STATUS_REP__INIT;
@@ -174,9 +267,9 @@ static void method_status(method_ctx *ctx, int cfd, uint8_t * msg,
 	rep.stored_tls_sessions = ctx->s->tls_db.entries;
 	rep.banned_ips = main_ban_db_elems(ctx->s);
 
-	ret = send_msg(ctx->pool, cfd, CTL_CMD_STATUS_REP, &rep,
-		       (pack_size_func) status_rep__get_packed_size,
-		       (pack_func) status_rep__pack);
+	ret = ctl_reply(ctx, CTL_CMD_STATUS_REP, &rep,
+		        (pack_size_func) status_rep__get_packed_size,
+		        (pack_func) status_rep__pack);
 	if (ret < 0) {
 		mslog(ctx->s, NULL, LOG_ERR, "error sending ctl reply");
 	}
@@ -184,7 +277,7 @@ static void method_status(method_ctx *ctx, int cfd, uint8_t * msg,
 	return;
 }
 
-static void method_reload(method_ctx *ctx, int cfd, uint8_t * msg,
+static void method_reload(method_ctx *ctx, uint8_t * msg,
 			  unsigned msg_size)
 {
 	BoolMsg rep = BOOL_MSG__INIT;
@@ -196,9 +289,9 @@ static void method_reload(method_ctx *ctx, int cfd, uint8_t * msg,
 
 	rep.status = 1;
 
-	ret = send_msg(ctx->pool, cfd, CTL_CMD_RELOAD_REP, &rep,
-		       (pack_size_func) bool_msg__get_packed_size,
-		       (pack_func) bool_msg__pack);
+	ret = ctl_reply(ctx, CTL_CMD_RELOAD_REP, &rep,
+		        (pack_size_func) bool_msg__get_packed_size,
+		        (pack_func) bool_msg__pack);
 	if (ret < 0) {
 		mslog(ctx->s, NULL, LOG_ERR, "error sending ctl reply");
 	}
@@ -206,7 +299,7 @@ static void method_reload(method_ctx *ctx, int cfd, uint8_t * msg,
 	return;
 }
 
-static void method_stop(method_ctx *ctx, int cfd, uint8_t * msg,
+static void method_stop(method_ctx *ctx, uint8_t * msg,
 			unsigned msg_size)
 {
 	BoolMsg rep = BOOL_MSG__INIT;
@@ -218,9 +311,9 @@ static void method_stop(method_ctx *ctx, int cfd, uint8_t * msg,
 
 	rep.status = 1;
 
-	ret = send_msg(ctx->pool, cfd, CTL_CMD_STOP_REP, &rep,
-		       (pack_size_func) bool_msg__get_packed_size,
-		       (pack_func) bool_msg__pack);
+	ret = ctl_reply(ctx, CTL_CMD_STOP_REP, &rep,
+		        (pack_size_func) bool_msg__get_packed_size,
+		        (pack_func) bool_msg__pack);
 	if (ret < 0) {
 		mslog(ctx->s, NULL, LOG_ERR, "error sending ctl reply");
 	}
@@ -359,6 +452,12 @@ static int append_user_info(method_ctx *ctx,
 		rep->has_mtu = 1;
 	}
 
+	if (stats_table_read(&ctx->s->stats_table, ctmp->stats_slot,
+			     &rep->bytes_in, &rep->bytes_out) == 0) {
+		rep->has_bytes_in = 1;
+		rep->has_bytes_out = 1;
+	}
+
 	if (ctmp->config.rx_per_sec > 0)
 		tmp = ctmp->config.rx_per_sec;
 	else
@@ -416,28 +515,65 @@ static int append_user_info(method_ctx *ctx,
 	return 0;
 }
 
-static void method_list_users(method_ctx *ctx, int cfd, uint8_t * msg,
+/* The users are listed in pages of about that size, so that the reply
+ * fits the 16-bit length of a message, and a listing of many users is
+ * served over multiple requests rather than blocking main. */
+#define LIST_USERS_PAGE_SIZE (32*1024)
+/* the tag and length of a user entry in the reply */
+#define LIST_USERS_ENTRY_OVERHEAD 8
+
+static void method_list_users(method_ctx *ctx, uint8_t * msg,
 			      unsigned msg_size)
 {
 	UserListRep rep = USER_LIST_REP__INIT;
+	UserListReq *req;
 	struct proc_st *ctmp = NULL;
+	uint64_t cursor = 0, last = 0;
+	size_t size = 0;
 	int ret;
 
 	mslog(ctx->s, NULL, LOG_DEBUG, "ctl: list-users");
 
+	/* older clients send no request, and receive the first page */
+	if (msg_size > 0) {
+		req = user_list_req__unpack(NULL, msg_size, msg);
+		if (req == NULL) {
+			mslog(ctx->s, NULL, LOG_ERR, "error parsing list-users request");
+			return;
+		}
+		if (req->has_cursor)
+			cursor = req->cursor;
+		user_list_req__free_unpacked(req, NULL);
+	}
 
+	/* the list is ordered by seq; the users up to the cursor have
+	 * been sent in previous pages */
 	list_for_each(&ctx->s->proc_list.head, ctmp, list) {
+		if (ctmp->seq <= cursor)
+			continue;
+
 		ret = append_user_info(ctx, &rep, ctmp);
 		if (ret < 0) {
 			mslog(ctx->s, NULL, LOG_ERR,
 			      "error appending user info to reply");
 			goto error;
 		}
+
+		size += user_info_rep__get_packed_size(rep.user[rep.n_user-1]) +
+			LIST_USERS_ENTRY_OVERHEAD;
+		if (size > LIST_USERS_PAGE_SIZE && rep.n_user > 1) {
+			/* this user is sent in the next page */
+			rep.n_user--;
+			rep.next_cursor = last;
+			rep.has_next_cursor = 1;
+			break;
+		}
+		last = ctmp->seq;
 	}
 
-	ret = send_msg(ctx->pool, cfd, CTL_CMD_LIST_REP, &rep,
-		       (pack_size_func) user_list_rep__get_packed_size,
-		       (pack_func) user_list_rep__pack);
+	ret = ctl_reply(ctx, CTL_CMD_LIST_REP, &rep,
+		        (pack_size_func) user_list_rep__get_packed_size,
+		        (pack_func) user_list_rep__pack);
 	if (ret < 0) {
 		mslog(ctx->s, NULL, LOG_ERR, "error sending ctl reply");
 	}
@@ -475,31 +611,28 @@ static int append_ban_info(method_ctx *ctx,
 	return 0;
 }
 
-static void method_list_banned(method_ctx *ctx, int cfd, uint8_t * msg,
+static void method_list_banned(method_ctx *ctx, uint8_t * msg,
 			      unsigned msg_size)
 {
 	BanListRep rep = BAN_LIST_REP__INIT;
 	struct ban_entry_st *e = NULL;
-	struct htable *db = ctx->s->ban_db;
+	struct ban_db_st *db = ctx->s->ban_db;
 	int ret;
-	struct htable_iter iter;
 
 	mslog(ctx->s, NULL, LOG_DEBUG, "ctl: list-banned-ips");
 
-	e = htable_first(db, &iter);
-	while (e != NULL) {
+	list_for_each(&db->list, e, list) {
 		ret = append_ban_info(ctx, &rep, e);
 		if (ret < 0) {
 			mslog(ctx->s, NULL, LOG_ERR,
 			      "error appending ban info to reply");
 			goto error;
 		}
-		e = htable_next(db, &iter);
 	}
 
-	ret = send_msg(ctx->pool, cfd, CTL_CMD_LIST_BANNED_REP, &rep,
-		       (pack_size_func) ban_list_rep__get_packed_size,
-		       (pack_func) ban_list_rep__pack);
+	ret = ctl_reply(ctx, CTL_CMD_LIST_BANNED_REP, &rep,
+		        (pack_size_func) ban_list_rep__get_packed_size,
+		        (pack_func) ban_list_rep__pack);
 	if (ret < 0) {
 		mslog(ctx->s, NULL, LOG_ERR, "error sending ban list reply");
 	}
@@ -508,7 +641,7 @@ static void method_list_banned(method_ctx *ctx, int cfd, uint8_t * msg,
 	return;
 }
 
-static void single_info_common(method_ctx *ctx, int cfd, uint8_t * msg,
+static void single_info_common(method_ctx *ctx, uint8_t * msg,
 			       unsigned msg_size, const char *user, unsigned id)
 {
 	UserListRep rep = USER_LIST_REP__INIT;
@@ -553,9 +686,9 @@ static void single_info_common(method_ctx *ctx, int cfd, uint8_t * msg,
 			mslog(ctx->s, NULL, LOG_INFO, "could not find ID '%u'", id);
 	}
 
-	ret = send_msg(ctx->pool, cfd, CTL_CMD_LIST_REP, &rep,
-		       (pack_size_func) user_list_rep__get_packed_size,
-		       (pack_func) user_list_rep__pack);
+	ret = ctl_reply(ctx, CTL_CMD_LIST_REP, &rep,
+		        (pack_size_func) user_list_rep__get_packed_size,
+		        (pack_func) user_list_rep__pack);
 	if (ret < 0) {
 		mslog(ctx->s, NULL, LOG_ERR, "error sending ctl reply");
 	}
@@ -564,7 +697,7 @@ static void single_info_common(method_ctx *ctx, int cfd, uint8_t * msg,
 	return;
 }
 
-static void method_user_info(method_ctx *ctx, int cfd, uint8_t * msg,
+static void method_user_info(method_ctx *ctx, uint8_t * msg,
 			     unsigned msg_size)
 {
 	UsernameReq *req;
@@ -577,13 +710,13 @@ static void method_user_info(method_ctx *ctx, int cfd, uint8_t * msg,
 		return;
 	}
 
-	single_info_common(ctx, cfd, msg, msg_size, req->username, 0);
+	single_info_common(ctx, msg, msg_size, req->username, 0);
 	username_req__free_unpacked(req, NULL);
 
 	return;
 }
 
-static void method_id_info(method_ctx *ctx, int cfd, uint8_t * msg,
+static void method_id_info(method_ctx *ctx, uint8_t * msg,
 			   unsigned msg_size)
 {
 	IdReq *req;
@@ -596,14 +729,14 @@ static void method_id_info(method_ctx *ctx, int cfd, uint8_t * msg,
 		return;
 	}
 
-	single_info_common(ctx, cfd, msg, msg_size, NULL, req->id);
+	single_info_common(ctx, msg, msg_size, NULL, req->id);
 	id_req__free_unpacked(req, NULL);
 
 	return;
 }
 
 static void method_unban_ip(method_ctx *ctx,
-			    int cfd, uint8_t * msg,
+			    uint8_t * msg,
 			    unsigned msg_size)
 {
 	UnbanReq *req;
@@ -628,9 +761,9 @@ static void method_unban_ip(method_ctx *ctx,
 
 	unban_req__free_unpacked(req, NULL);
 
-	ret = send_msg(ctx->pool, cfd, CTL_CMD_UNBAN_IP_REP, &rep,
-		       (pack_size_func) bool_msg__get_packed_size,
-		       (pack_func) bool_msg__pack);
+	ret = ctl_reply(ctx, CTL_CMD_UNBAN_IP_REP, &rep,
+		        (pack_size_func) bool_msg__get_packed_size,
+		        (pack_func) bool_msg__pack);
 	if (ret < 0) {
 		mslog(ctx->s, NULL, LOG_ERR, "error sending unban IP ctl reply");
 	}
@@ -639,13 +772,15 @@ static void method_unban_ip(method_ctx *ctx,
 }
 
 static void method_disconnect_user_name(method_ctx *ctx,
-					int cfd, uint8_t * msg,
+					uint8_t * msg,
 					unsigned msg_size)
 {
 	UsernameReq *req;
 	BoolMsg rep = BOOL_MSG__INIT;
+	struct proc_user_st *u;
 	struct proc_st *cpos;
 	struct proc_st *ctmp = NULL;
+	unsigned last;
 	int ret;
 
 	mslog(ctx->s, NULL, LOG_DEBUG, "ctl: disconnect_name");
@@ -658,18 +793,25 @@ static void method_disconnect_user_name(method_ctx *ctx,
 	}
 
 	/* got the name. Try to disconnect */
-	list_for_each_safe(&ctx->s->proc_list.head, ctmp, cpos, list) {
-		if (strcmp(ctmp->username, req->username) == 0) {
+	u = proc_search_user(ctx->s, req->username);
+	if (u != NULL) {
+		list_for_each_safe(&u->head, ctmp, cpos, user_list) {
+			/* the entry is released with its last session */
+			last = (u->procs == 1);
+
 			terminate_proc(ctx->s, ctmp);
 			rep.status = 1;
+
+			if (last)
+				break;
 		}
 	}
 
 	username_req__free_unpacked(req, NULL);
 
-	ret = send_msg(ctx->pool, cfd, CTL_CMD_DISCONNECT_NAME_REP, &rep,
-		       (pack_size_func) bool_msg__get_packed_size,
-		       (pack_func) bool_msg__pack);
+	ret = ctl_reply(ctx, CTL_CMD_DISCONNECT_NAME_REP, &rep,
+		        (pack_size_func) bool_msg__get_packed_size,
+		        (pack_func) bool_msg__pack);
 	if (ret < 0) {
 		mslog(ctx->s, NULL, LOG_ERR, "error sending ctl reply");
 	}
@@ -677,7 +819,7 @@ static void method_disconnect_user_name(method_ctx *ctx,
 	return;
 }
 
-static void method_disconnect_user_id(method_ctx *ctx, int cfd,
+static void method_disconnect_user_id(method_ctx *ctx,
 				      uint8_t * msg, unsigned msg_size)
 {
 	IdReq *req;
@@ -707,9 +849,9 @@ static void method_disconnect_user_id(method_ctx *ctx, int cfd,
 	/* reply */
 	id_req__free_unpacked(req, NULL);
 
-	ret = send_msg(ctx->pool, cfd, CTL_CMD_DISCONNECT_ID_REP, &rep,
-		       (pack_size_func) bool_msg__get_packed_size,
-		       (pack_func) bool_msg__pack);
+	ret = ctl_reply(ctx, CTL_CMD_DISCONNECT_ID_REP, &rep,
+		        (pack_size_func) bool_msg__get_packed_size,
+		        (pack_func) bool_msg__pack);
 	if (ret < 0) {
 		mslog(ctx->s, NULL, LOG_ERR, "error sending ctl reply");
 	}
@@ -717,96 +859,200 @@ static void method_disconnect_user_id(method_ctx *ctx, int cfd,
 	return;
 }
 
-static void ctl_handle_commands(main_server_st * s)
+/* Reads the request of the connection.
+ *
+ * Returns 1 when the request is complete, 0 if more data are
+ * expected, or -1 on error.
+ */
+static int ctl_conn_read(main_server_st * s, struct ctl_conn_st *conn)
 {
-	int cfd = -1, e, ret;
-	unsigned i;
-	struct sockaddr_un sa;
-	socklen_t sa_len;
 	uint16_t length;
-	uint8_t buffer[256];
-	unsigned buffer_size;
-	method_ctx ctx;
-	void *pool = talloc_new(s);
-
-	if (pool == NULL) {
-		mslog(s, NULL, LOG_ERR, "memory allocation error");
-		return;
-	}
+	int ret, e;
 
-	ctx.s = s;
-	ctx.pool = pool;
-
-	sa_len = sizeof(sa);
-	cfd = accept(s->ctl_fd, (struct sockaddr *)&sa, &sa_len);
-	if (cfd == -1) {
+	ret = recv(conn->ev.fd, conn->rbuf + conn->rsize, sizeof(conn->rbuf) - conn->rsize, 0);
+	if (ret == -1) {
 		e = errno;
-		mslog(s, NULL, LOG_ERR,
-		      "error accepting control connection: %s", strerror(e));
-		goto cleanup;
+		if (e == EAGAIN || e == EWOULDBLOCK || e == EINTR)
+			return 0;
+		mslog(s, NULL, LOG_ERR, "error receiving ctl data: %s",
+		      strerror(e));
+		return -1;
 	}
 
-	ret = check_upeer_id("ctl", s->config->debug, cfd, 0, 0, NULL, NULL);
-	if (ret < 0) {
-		mslog(s, NULL, LOG_ERR, "ctl: unauthorized connection");
-		goto cleanup;
+	if (ret == 0) {
+		mslog(s, NULL, LOG_ERR, "received ctl data: %u bytes",
+		      conn->rsize);
+		return -1;
 	}
+	conn->rsize += ret;
 
-	/* read request */
-	ret = recv(cfd, buffer, sizeof(buffer), 0);
-	if (ret < 3) {
-		if (ret == -1) {
-			e = errno;
-			mslog(s, NULL, LOG_ERR, "error receiving ctl data: %s",
-			      strerror(e));
-		} else {
-			mslog(s, NULL, LOG_ERR, "received ctl data: %d bytes",
-			      ret);
-		}
-		goto cleanup;
-	}
-	memcpy(&length, &buffer[1], 2);
-	buffer_size = ret - 3;
+	if (conn->rsize < 3)
+		return 0;
 
-	if (length != buffer_size) {
+	memcpy(&length, &conn->rbuf[1], 2);
+	if (conn->rsize - 3 > length || 3 + (unsigned)length > sizeof(conn->rbuf)) {
 		mslog(s, NULL, LOG_ERR,
 		      "received data length doesn't match received data (%d/%d)",
-		      buffer_size, (int)length);
-		goto cleanup;
+		      conn->rsize - 3, (int)length);
+		return -1;
+	}
+
+	return (conn->rsize - 3 == length) ? 1 : 0;
+}
+
+/* Runs the method of a complete request; its reply is queued
+ * in the connection. */
+static void ctl_conn_dispatch(main_server_st * s, struct ctl_conn_st *conn)
+{
+	method_ctx ctx;
+	unsigned i;
+
+	ctx.s = s;
+	ctx.conn = conn;
+	ctx.pool = talloc_new(conn);
+	if (ctx.pool == NULL) {
+		mslog(s, NULL, LOG_ERR, "memory allocation error");
+		return;
 	}
 
 	for (i = 0;; i++) {
 		if (methods[i].cmd == 0) {
 			mslog(s, NULL, LOG_INFO,
 			      "unknown unix ctl message: 0x%.1x",
-			      (unsigned)buffer[0]);
+			      (unsigned)conn->rbuf[0]);
 			break;
-		} else if (methods[i].cmd == buffer[0]) {
-			methods[i].func(&ctx, cfd, buffer + 3, buffer_size);
+		} else if (methods[i].cmd == conn->rbuf[0]) {
+			methods[i].func(&ctx, conn->rbuf + 3, conn->rsize - 3);
 			break;
 		}
 	}
- cleanup:
- 	talloc_free(pool);
-	if (cfd != -1)
-		close(cfd);
+
+	talloc_free(ctx.pool);
 }
 
-int ctl_handler_set_fds(main_server_st * s, fd_set * rd_set, fd_set * wr_set)
+/* Writes as much of the reply as the socket accepts.
+ *
+ * Returns 1 when the reply is sent, 0 if it is pending, or -1 on error.
+ */
+static int ctl_conn_write(main_server_st * s, struct ctl_conn_st *conn)
 {
-	if (s->config->use_occtl == 0)
-		return -1;
+	ssize_t ret;
+	int e;
+
+	while (conn->wpos < conn->wsize) {
+		ret = write(conn->ev.fd, conn->wbuf + conn->wpos, conn->wsize - conn->wpos);
+		if (ret == -1) {
+			e = errno;
+			if (e == EAGAIN || e == EWOULDBLOCK)
+				return 0;
+			if (e == EINTR)
+				continue;
+			mslog(s, NULL, LOG_ERR, "error sending ctl reply: %s",
+			      strerror(e));
+			return -1;
+		}
+		conn->wpos += ret;
+	}
 
-	FD_SET(s->ctl_fd, rd_set);
-	return s->ctl_fd;
+	return 1;
 }
 
-void ctl_handler_run_pending(main_server_st* s, fd_set *rd_set, fd_set *wr_set)
+/* Each connection carries a single request; it is closed once the
+ * reply is sent. */
+static void ctl_conn_ev(main_server_st *s, main_ev_st *ev, unsigned revents)
 {
-	if (s->config->use_occtl == 0)
+	struct ctl_conn_st *conn = container_of(ev, struct ctl_conn_st, ev);
+	int ret;
+
+	if (conn->wbuf == NULL) {
+		ret = ctl_conn_read(s, conn);
+		if (ret <= 0) {
+			if (ret < 0)
+				ctl_conn_close(s, conn);
+			return;
+		}
+
+		ctl_conn_dispatch(s, conn);
+		if (conn->wbuf == NULL) {
+			ctl_conn_close(s, conn);
+			return;
+		}
+	}
+
+	ret = ctl_conn_write(s, conn);
+	if (ret != 0) {
+		ctl_conn_close(s, conn);
 		return;
+	}
+
+	main_ev_mod(s, &conn->ev, MEV_WRITE);
+}
+
+/* Closes the connections which did not complete within
+ * CTL_CONN_TIMEOUT; these are in the order of acceptance. */
+static void ctl_conn_expire(main_server_st * s)
+{
+	struct ctl_conn_st *conn;
+	time_t now = time(0);
+
+	while ((conn = list_top(&s->ctl_conns, struct ctl_conn_st, list)) != NULL) {
+		if (now - conn->time <= CTL_CONN_TIMEOUT)
+			break;
+		mslog(s, NULL, LOG_INFO, "ctl: closing stalled connection");
+		ctl_conn_close(s, conn);
+	}
+}
+
+static void ctl_handle_commands(main_server_st * s)
+{
+	struct ctl_conn_st *conn;
+	int cfd, e, ret;
+	unsigned i;
+	struct sockaddr_un sa;
+	socklen_t sa_len;
+
+	for (i = 0; i < CTL_MAX_CONNS; i++) {
+		sa_len = sizeof(sa);
+		cfd = accept(s->ctl_fd, (struct sockaddr *)&sa, &sa_len);
+		if (cfd == -1) {
+			e = errno;
+			if (e != EAGAIN && e != EWOULDBLOCK && e != EINTR)
+				mslog(s, NULL, LOG_ERR,
+				      "error accepting control connection: %s", strerror(e));
+			return;
+		}
+
+		ret = check_upeer_id("ctl", s->config->debug, cfd, 0, 0, NULL, NULL);
+		if (ret < 0) {
+			mslog(s, NULL, LOG_ERR, "ctl: unauthorized connection");
+			close(cfd);
+			continue;
+		}
+
+		ctl_conn_expire(s);
+		if (s->ctl_conns_size >= CTL_MAX_CONNS) {
+			mslog(s, NULL, LOG_INFO, "ctl: too many connections");
+			close(cfd);
+			continue;
+		}
+
+		conn = talloc_zero(s, struct ctl_conn_st);
+		if (conn == NULL) {
+			mslog(s, NULL, LOG_ERR, "memory allocation error");
+			close(cfd);
+			return;
+		}
+		conn->time = time(0);
+
+		set_cloexec_flag(cfd, 1);
+		set_non_block(cfd);
+		if (main_ev_add(s, &conn->ev, cfd, MEV_READ, ctl_conn_ev) < 0) {
+			close(cfd);
+			talloc_free(conn);
+			return;
+		}
 
-	if (FD_ISSET(s->ctl_fd, rd_set)) {
-		ctl_handle_commands(s);
+		list_add_tail(&s->ctl_conns, &conn->list);
+		s->ctl_conns_size++;
 	}
 }
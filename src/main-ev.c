@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <cloexec.h>
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+
+#include <main.h>
+#include <main-ev.h>
+
+/* The main process event loop. On systems with epoll() every
+ * descriptor is registered once and only the ready ones are returned
+ * on each iteration. Otherwise we fall back to pselect(), which is
+ * limited to FD_SETSIZE descriptors.
+ *
+ * Callbacks may remove any entry (including ones that are ready on the
+ * same iteration); main_ev_del() takes care of dropping such entries
+ * from the ready list, so that freed objects are never dispatched.
+ */
+
+#define MAX_READY_EVENTS 64
+
+int main_ev_init(main_server_st *s)
+{
+	struct main_ev_loop_st *loop = &s->ev_loop;
+
+	list_head_init(&loop->head);
+	loop->total = 0;
+	loop->ready_size = 0;
+	loop->ready_max = MAX_READY_EVENTS;
+	loop->ready = talloc_zero_array(s, main_ev_st*, loop->ready_max);
+	if (loop->ready == NULL)
+		return -1;
+
+#ifdef HAVE_SYS_EPOLL_H
+	loop->epfd = epoll_create(MAX_READY_EVENTS);
+	if (loop->epfd == -1) {
+		int e = errno;
+		mslog(s, NULL, LOG_ERR, "error in epoll_create(): %s", strerror(e));
+		return -1;
+	}
+	set_cloexec_flag(loop->epfd, 1);
+	mslog(s, NULL, LOG_DEBUG, "using epoll() for the main event loop");
+#else
+	loop->epfd = -1;
+#endif
+	return 0;
+}
+
+/* Releases the loop; to be used by children after fork() */
+void main_ev_deinit(main_server_st *s)
+{
+	struct main_ev_loop_st *loop = &s->ev_loop;
+
+	if (loop->epfd >= 0)
+		close(loop->epfd);
+	loop->epfd = -1;
+
+	/* the entries are owned (and freed) by their containers */
+	list_head_init(&loop->head);
+	loop->total = 0;
+	loop->ready_size = 0;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static unsigned to_epoll_events(unsigned events)
+{
+	unsigned e = 0;
+
+	if (events & MEV_READ)
+		e |= EPOLLIN;
+	if (events & MEV_WRITE)
+		e |= EPOLLOUT;
+	return e;
+}
+#endif
+
+int main_ev_add(main_server_st *s, main_ev_st *ev, int fd, unsigned events, main_ev_cb cb)
+{
+	struct main_ev_loop_st *loop = &s->ev_loop;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ee;
+	int e;
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = to_epoll_events(events);
+	ee.data.ptr = ev;
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ee) == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "error adding fd %d to epoll: %s", fd, strerror(e));
+		return -1;
+	}
+#else
+	if (fd >= FD_SETSIZE) {
+		mslog(s, NULL, LOG_ERR, "cannot monitor fd %d; it exceeds FD_SETSIZE (%d)",
+		      fd, (int)FD_SETSIZE);
+		return -1;
+	}
+#endif
+
+	ev->fd = fd;
+	ev->events = events;
+	ev->cb = cb;
+	ev->ready_idx = 0;
+
+	list_add(&loop->head, &ev->list);
+	loop->total++;
+
+	return 0;
+}
+
+int main_ev_mod(main_server_st *s, main_ev_st *ev, unsigned events)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ee;
+	int e;
+
+	if (ev->events == events)
+		return 0;
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = to_epoll_events(events);
+	ee.data.ptr = ev;
+
+	if (epoll_ctl(s->ev_loop.epfd, EPOLL_CTL_MOD, ev->fd, &ee) == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "error modifying fd %d in epoll: %s", ev->fd, strerror(e));
+		return -1;
+	}
+#endif
+	ev->events = events;
+	return 0;
+}
+
+/* Must be called before the descriptor is closed */
+void main_ev_del(main_server_st *s, main_ev_st *ev)
+{
+	struct main_ev_loop_st *loop = &s->ev_loop;
+
+	if (ev->cb == NULL)
+		return;
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (loop->epfd >= 0)
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, ev->fd, NULL);
+#endif
+
+	if (ev->ready_idx > 0 && ev->ready_idx <= loop->ready_size)
+		loop->ready[ev->ready_idx-1] = NULL;
+	ev->ready_idx = 0;
+
+	list_del(&ev->list);
+	loop->total--;
+	ev->cb = NULL;
+}
+
+static void dispatch_ready(main_server_st *s, unsigned *revents)
+{
+	struct main_ev_loop_st *loop = &s->ev_loop;
+	main_ev_st *ev;
+	unsigned i;
+
+	for (i = 0; i < loop->ready_size; i++) {
+		ev = loop->ready[i];
+		if (ev == NULL)
+			continue;
+
+		loop->ready[i] = NULL;
+		ev->ready_idx = 0;
+		ev->cb(s, ev, revents[i]);
+	}
+	loop->ready_size = 0;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+int main_ev_run_once(main_server_st *s, unsigned timeout_ms, const sigset_t *sigmask)
+{
+	struct main_ev_loop_st *loop = &s->ev_loop;
+	struct epoll_event events[MAX_READY_EVENTS];
+	unsigned revents[MAX_READY_EVENTS];
+	main_ev_st *ev;
+	int ret, i;
+
+	ret = epoll_pwait(loop->epfd, events, MAX_READY_EVENTS, timeout_ms, sigmask);
+	if (ret <= 0)
+		return ret;
+
+	for (i = 0; i < ret; i++) {
+		ev = events[i].data.ptr;
+
+		revents[i] = 0;
+		if (events[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP))
+			revents[i] |= MEV_READ;
+		if (events[i].events & (EPOLLOUT|EPOLLERR))
+			revents[i] |= MEV_WRITE;
+		revents[i] &= ev->events;
+
+		loop->ready[i] = ev;
+		ev->ready_idx = i+1;
+	}
+	loop->ready_size = ret;
+
+	dispatch_ready(s, revents);
+
+	return ret;
+}
+#else
+int main_ev_run_once(main_server_st *s, unsigned timeout_ms, const sigset_t *sigmask)
+{
+	struct main_ev_loop_st *loop = &s->ev_loop;
+	fd_set rd_set, wr_set;
+	main_ev_st *ev;
+	unsigned *revents;
+	int n = 0, ret;
+#ifdef HAVE_PSELECT
+	struct timespec ts;
+#else
+	struct timeval ts;
+	sigset_t origmask;
+#endif
+
+	FD_ZERO(&rd_set);
+	FD_ZERO(&wr_set);
+
+	list_for_each(&loop->head, ev, list) {
+		if (ev->events & MEV_READ)
+			FD_SET(ev->fd, &rd_set);
+		if (ev->events & MEV_WRITE)
+			FD_SET(ev->fd, &wr_set);
+		n = MAX(n, ev->fd);
+	}
+
+#ifdef HAVE_PSELECT
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000 * 1000;
+	ret = pselect(n + 1, &rd_set, &wr_set, NULL, &ts, sigmask);
+#else
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_usec = (timeout_ms % 1000) * 1000;
+	sigprocmask(SIG_SETMASK, sigmask, &origmask);
+	ret = select(n + 1, &rd_set, &wr_set, NULL, &ts);
+	sigprocmask(SIG_SETMASK, &origmask, NULL);
+#endif
+	if (ret <= 0)
+		return ret;
+
+	if (loop->ready_max < loop->total) {
+		main_ev_st **tmp;
+
+		tmp = talloc_realloc(s, loop->ready, main_ev_st*, loop->total);
+		if (tmp == NULL)
+			return -1;
+		loop->ready = tmp;
+		loop->ready_max = loop->total;
+	}
+
+	revents = talloc_array(s, unsigned, loop->ready_max);
+	if (revents == NULL)
+		return -1;
+
+	loop->ready_size = 0;
+	list_for_each(&loop->head, ev, list) {
+		unsigned r = 0;
+
+		if (FD_ISSET(ev->fd, &rd_set))
+			r |= MEV_READ;
+		if (FD_ISSET(ev->fd, &wr_set))
+			r |= MEV_WRITE;
+		if (r == 0)
+			continue;
+
+		revents[loop->ready_size] = r;
+		loop->ready[loop->ready_size++] = ev;
+		ev->ready_idx = loop->ready_size;
+	}
+
+	dispatch_ready(s, revents);
+	talloc_free(revents);
+
+	return ret;
+}
+#endif
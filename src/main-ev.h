@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MAIN_EV_H
+# define MAIN_EV_H
+
+#include <config.h>
+#include <signal.h>
+#include <ccan/list/list.h>
+
+struct main_server_st;
+struct main_ev_st;
+
+#define MEV_READ 1
+#define MEV_WRITE (1<<1)
+
+typedef void (*main_ev_cb)(struct main_server_st *s, struct main_ev_st *ev, unsigned revents);
+
+/* A file descriptor monitored by the main process loop. The structure
+ * is embedded into the object owning the descriptor (e.g., a proc_st
+ * or a listener_st) and the callback uses container_of() to obtain it.
+ */
+typedef struct main_ev_st {
+	struct list_node list;
+	int fd;
+	unsigned events; /* MEV_READ | MEV_WRITE */
+	main_ev_cb cb;
+
+	/* non-zero when the entry is in the ready list of the
+	 * current iteration; that's its index plus one */
+	unsigned ready_idx;
+} main_ev_st;
+
+struct main_ev_loop_st {
+	int epfd;
+	/* all registered entries; used by the select() backend */
+	struct list_head head;
+	unsigned total;
+
+	/* the entries found ready in the current iteration */
+	struct main_ev_st **ready;
+	unsigned ready_size;
+	unsigned ready_max;
+};
+
+int main_ev_init(struct main_server_st *s);
+void main_ev_deinit(struct main_server_st *s);
+
+int main_ev_add(struct main_server_st *s, main_ev_st *ev, int fd, unsigned events, main_ev_cb cb);
+int main_ev_mod(struct main_server_st *s, main_ev_st *ev, unsigned events);
+void main_ev_del(struct main_server_st *s, main_ev_st *ev);
+
+int main_ev_run_once(struct main_server_st *s, unsigned timeout_ms, const sigset_t *sigmask);
+
+#endif
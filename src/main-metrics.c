@@ -0,0 +1,558 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include <vpn.h>
+#include <main.h>
+#include <main-ban.h>
+#include <ip-pool.h>
+#include <gettime.h>
+#include <cloexec.h>
+#include <system.h>
+#include <str.h>
+#include <ccan/list/list.h>
+
+/* The metrics exporter (metrics-socket). The counters of struct
+ * metrics_st are updated by main as the events occur, and the gauges
+ * are taken from the totals it already keeps, so that serving a scrape
+ * costs the same regardless of the number of sessions. The metrics are
+ * served over HTTP in the Prometheus text format; each connection
+ * carries a single request, and is served from the main loop without
+ * blocking.
+ */
+
+/* the maximum number of concurrent connections */
+#define METRICS_MAX_CONNS 8
+/* seconds after which an incomplete connection may be closed */
+#define METRICS_CONN_TIMEOUT 10
+
+struct metrics_conn_st {
+	struct list_node list;
+	main_ev_st ev;
+	time_t time; /* the time it was accepted */
+
+	char rbuf[1024];
+	unsigned rsize;
+
+	str_st reply; /* empty until the request is read */
+	size_t wpos;
+};
+
+static const char *reject_reasons[METRICS_REJECT_MAX] = {
+	[METRICS_REJECT_TCP_WRAPPERS] = "tcp-wrappers",
+	[METRICS_REJECT_BANNED] = "banned",
+	[METRICS_REJECT_ADMISSION] = "admission",
+	[METRICS_REJECT_MAX_CLIENTS] = "max-clients",
+};
+
+static const unsigned setup_buckets[METRICS_SETUP_BUCKETS_SIZE] = METRICS_SETUP_BUCKETS;
+
+void metrics_init(main_server_st *s)
+{
+	memset(&s->metrics, 0, sizeof(s->metrics));
+	s->metrics.fd = -1;
+	list_head_init(&s->metrics.conns);
+}
+
+/* Records the setup time of a session which was just opened */
+void metrics_session_opened(main_server_st *s, struct proc_st *proc)
+{
+	struct metrics_st *m = &s->metrics;
+	struct timespec now;
+	unsigned ms, i;
+
+	gettime(&now);
+	ms = timespec_sub_ms(&now, &proc->conn_ts);
+
+	for (i = 0; i < METRICS_SETUP_BUCKETS_SIZE; i++) {
+		if (ms <= setup_buckets[i])
+			break;
+	}
+	m->setup_buckets[i]++;
+	m->setup_ms_sum += ms;
+	m->sessions_opened++;
+}
+
+static void metrics_conn_close(main_server_st *s, struct metrics_conn_st *conn)
+{
+	main_ev_del(s, &conn->ev);
+	close(conn->ev.fd);
+	list_del(&conn->list);
+	s->metrics.conns_size--;
+	talloc_free(conn);
+}
+
+void metrics_deinit(main_server_st *s)
+{
+	struct metrics_conn_st *conn, *cpos;
+
+	/* in the child processes the descriptors are only closed */
+	list_for_each_safe(&s->metrics.conns, conn, cpos, list) {
+		close(conn->ev.fd);
+		list_del(&conn->list);
+		talloc_free(conn);
+	}
+	s->metrics.conns_size = 0;
+
+	if (s->metrics.fd >= 0) {
+		close(s->metrics.fd);
+		s->metrics.fd = -1;
+	}
+}
+
+#define HEADER(str, name, type, help) \
+	str_append_str(str, "# HELP " name " " help "\n# TYPE " name " " type "\n")
+
+static void render_ip_pools(main_server_st *s, str_st *str)
+{
+	struct ip_pool_st *pool;
+	char net[MAX_IP_STR];
+
+	if (list_empty(&s->ip_leases.pools))
+		return;
+
+	HEADER(str, "ocserv_ip_pool_size", "gauge", "The number of addresses of the pool.");
+	list_for_each(&s->ip_leases.pools, pool, list) {
+		if (inet_ntop(pool->family, pool->network, net, sizeof(net)) == NULL)
+			continue;
+		str_append_printf(str, "ocserv_ip_pool_size{pool=\"%s/%u\"} %u\n",
+				  net, pool->prefix, (unsigned)pool->size);
+	}
+
+	HEADER(str, "ocserv_ip_pool_allocated", "gauge",
+	       "The number of addresses of the pool that are not available for leasing.");
+	list_for_each(&s->ip_leases.pools, pool, list) {
+		if (inet_ntop(pool->family, pool->network, net, sizeof(net)) == NULL)
+			continue;
+		str_append_printf(str, "ocserv_ip_pool_allocated{pool=\"%s/%u\"} %u\n",
+				  net, pool->prefix, (unsigned)(pool->next - pool->freed_count));
+	}
+}
+
+/* Appends the metrics to str */
+static void render_metrics(main_server_st *s, str_st *str)
+{
+	struct metrics_st *m = &s->metrics;
+	uint64_t count;
+	unsigned i;
+
+	HEADER(str, "ocserv_uptime_seconds", "gauge", "The time since the server was started.");
+	str_append_printf(str, "ocserv_uptime_seconds %lu\n",
+			  (unsigned long)(time(0) - s->start_time));
+
+	HEADER(str, "ocserv_connections_accepted_total", "counter", "The accepted TCP connections.");
+	str_append_printf(str, "ocserv_connections_accepted_total %lu\n",
+			  (unsigned long)m->accepted);
+
+	HEADER(str, "ocserv_connections_rejected_total", "counter",
+	       "The TCP connections which were closed before reaching a worker.");
+	for (i = 0; i < METRICS_REJECT_MAX; i++) {
+		str_append_printf(str, "ocserv_connections_rejected_total{reason=\"%s\"} %lu\n",
+				  reject_reasons[i], (unsigned long)m->rejected[i]);
+	}
+
+	HEADER(str, "ocserv_active_clients", "gauge", "The connected clients.");
+	str_append_printf(str, "ocserv_active_clients %u\n", s->active_clients);
+
+	HEADER(str, "ocserv_admission_queue", "gauge", "The connections waiting for admission.");
+	str_append_printf(str, "ocserv_admission_queue %u\n", s->admission.total);
+
+	HEADER(str, "ocserv_prefork_idle", "gauge", "The idle pre-forked workers.");
+	str_append_printf(str, "ocserv_prefork_idle %u\n", s->prefork_list.total);
+
+	HEADER(str, "ocserv_sec_mod_entries", "gauge",
+	       "The client entries of the security module, as last reported.");
+	str_append_printf(str, "ocserv_sec_mod_entries %u\n", s->secmod_client_entries);
+
+	HEADER(str, "ocserv_sec_mod_pending_ops", "gauge",
+	       "The key operations waiting for a signer in the security module, as last reported.");
+	str_append_printf(str, "ocserv_sec_mod_pending_ops %u\n", s->secmod_pending_ops);
+
+	HEADER(str, "ocserv_ban_db_entries", "gauge", "The addresses with a ban score.");
+	str_append_printf(str, "ocserv_ban_db_entries %u\n", main_ban_db_elems(s));
+
+	HEADER(str, "ocserv_sessions_opened_total", "counter", "The opened sessions.");
+	str_append_printf(str, "ocserv_sessions_opened_total %lu\n",
+			  (unsigned long)m->sessions_opened);
+
+	HEADER(str, "ocserv_sessions_closed_total", "counter", "The closed sessions.");
+	str_append_printf(str, "ocserv_sessions_closed_total %lu\n",
+			  (unsigned long)m->sessions_closed);
+
+	HEADER(str, "ocserv_session_setup_seconds", "histogram",
+	       "The time from the TCP connection to the session open.");
+	for (i = 0, count = 0; i < METRICS_SETUP_BUCKETS_SIZE; i++) {
+		count += m->setup_buckets[i];
+		str_append_printf(str, "ocserv_session_setup_seconds_bucket{le=\"%u.%.3u\"} %lu\n",
+				  setup_buckets[i] / 1000, setup_buckets[i] % 1000,
+				  (unsigned long)count);
+	}
+	count += m->setup_buckets[i];
+	str_append_printf(str, "ocserv_session_setup_seconds_bucket{le=\"+Inf\"} %lu\n",
+			  (unsigned long)count);
+	str_append_printf(str, "ocserv_session_setup_seconds_sum %lu.%.3u\n",
+			  (unsigned long)(m->setup_ms_sum / 1000),
+			  (unsigned)(m->setup_ms_sum % 1000));
+	str_append_printf(str, "ocserv_session_setup_seconds_count %lu\n",
+			  (unsigned long)count);
+
+	HEADER(str, "ocserv_session_bytes_total", "counter",
+	       "The bytes transferred by the closed sessions.");
+	str_append_printf(str, "ocserv_session_bytes_total{direction=\"in\"} %lu\n",
+			  (unsigned long)m->bytes_in);
+	str_append_printf(str, "ocserv_session_bytes_total{direction=\"out\"} %lu\n",
+			  (unsigned long)m->bytes_out);
+
+	HEADER(str, "ocserv_tls_db_entries", "gauge", "The stored TLS sessions.");
+	str_append_printf(str, "ocserv_tls_db_entries %u\n", s->tls_db.entries);
+
+	HEADER(str, "ocserv_tls_resumptions_total", "counter", "The TLS session resumption requests.");
+	str_append_printf(str, "ocserv_tls_resumptions_total{result=\"hit\"} %lu\n",
+			  (unsigned long)m->resume_hits);
+	str_append_printf(str, "ocserv_tls_resumptions_total{result=\"miss\"} %lu\n",
+			  (unsigned long)m->resume_misses);
+
+	render_ip_pools(s, str);
+}
+
+/* Prepares the reply to the request of the connection.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+static int metrics_conn_reply(main_server_st *s, struct metrics_conn_st *conn)
+{
+	str_st body;
+	int ret;
+
+	str_init(&body, conn);
+
+	if (strncmp(conn->rbuf, "GET ", 4) != 0) {
+		ret = str_append_str(&conn->reply,
+			"HTTP/1.0 405 Method Not Allowed\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n\r\n");
+		return (ret < 0) ? -1 : 0;
+	}
+
+	render_metrics(s, &body);
+
+	ret = str_append_printf(&conn->reply,
+				"HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %u\r\n"
+				"Connection: close\r\n\r\n",
+				(unsigned)body.length);
+	if (ret >= 0)
+		ret = str_append_data(&conn->reply, body.data, body.length);
+	str_clear(&body);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+/* Reads the request headers of the connection.
+ *
+ * Returns 1 when they are complete, 0 if more data are expected,
+ * or -1 on error.
+ */
+static int metrics_conn_read(main_server_st *s, struct metrics_conn_st *conn)
+{
+	ssize_t ret;
+	int e;
+
+	while (conn->rsize < sizeof(conn->rbuf) - 1) {
+		ret = read(conn->ev.fd, conn->rbuf + conn->rsize,
+			   sizeof(conn->rbuf) - 1 - conn->rsize);
+		if (ret == -1) {
+			e = errno;
+			if (e == EAGAIN || e == EWOULDBLOCK)
+				return 0;
+			if (e == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			return -1;
+
+		conn->rsize += ret;
+		conn->rbuf[conn->rsize] = 0;
+
+		if (strstr(conn->rbuf, "\r\n\r\n") != NULL ||
+		    strstr(conn->rbuf, "\n\n") != NULL)
+			return 1;
+	}
+
+	mslog(s, NULL, LOG_DEBUG, "metrics: request is too large");
+	return -1;
+}
+
+/* Writes as much of the reply as the socket accepts.
+ *
+ * Returns 1 when the reply is sent, 0 if it is pending, or -1 on error.
+ */
+static int metrics_conn_write(main_server_st *s, struct metrics_conn_st *conn)
+{
+	ssize_t ret;
+	int e;
+
+	while (conn->wpos < conn->reply.length) {
+		ret = write(conn->ev.fd, conn->reply.data + conn->wpos,
+			    conn->reply.length - conn->wpos);
+		if (ret == -1) {
+			e = errno;
+			if (e == EAGAIN || e == EWOULDBLOCK)
+				return 0;
+			if (e == EINTR)
+				continue;
+			return -1;
+		}
+		conn->wpos += ret;
+	}
+
+	return 1;
+}
+
+static void metrics_conn_ev(main_server_st *s, main_ev_st *ev, unsigned revents)
+{
+	struct metrics_conn_st *conn = container_of(ev, struct metrics_conn_st, ev);
+	int ret;
+
+	if (conn->reply.length == 0) {
+		ret = metrics_conn_read(s, conn);
+		if (ret <= 0) {
+			if (ret < 0)
+				metrics_conn_close(s, conn);
+			return;
+		}
+
+		if (metrics_conn_reply(s, conn) < 0) {
+			mslog(s, NULL, LOG_ERR, "metrics: could not prepare the reply");
+			metrics_conn_close(s, conn);
+			return;
+		}
+	}
+
+	ret = metrics_conn_write(s, conn);
+	if (ret != 0) {
+		metrics_conn_close(s, conn);
+		return;
+	}
+
+	main_ev_mod(s, &conn->ev, MEV_WRITE);
+}
+
+/* Closes the connections which did not complete within
+ * METRICS_CONN_TIMEOUT; these are in the order of acceptance. */
+static void metrics_conn_expire(main_server_st *s)
+{
+	struct metrics_conn_st *conn;
+	time_t now = time(0);
+
+	while ((conn = list_top(&s->metrics.conns, struct metrics_conn_st, list)) != NULL) {
+		if (now - conn->time <= METRICS_CONN_TIMEOUT)
+			break;
+		metrics_conn_close(s, conn);
+	}
+}
+
+static void metrics_accept_ev(main_server_st *s, main_ev_st *ev, unsigned revents)
+{
+	struct metrics_conn_st *conn;
+	int cfd, e;
+	unsigned i;
+
+	for (i = 0; i < METRICS_MAX_CONNS; i++) {
+		cfd = accept(s->metrics.fd, NULL, NULL);
+		if (cfd == -1) {
+			e = errno;
+			if (e != EAGAIN && e != EWOULDBLOCK && e != EINTR)
+				mslog(s, NULL, LOG_ERR,
+				      "error accepting metrics connection: %s", strerror(e));
+			return;
+		}
+
+		metrics_conn_expire(s);
+		if (s->metrics.conns_size >= METRICS_MAX_CONNS) {
+			mslog(s, NULL, LOG_INFO, "metrics: too many connections");
+			close(cfd);
+			continue;
+		}
+
+		conn = talloc_zero(s, struct metrics_conn_st);
+		if (conn == NULL) {
+			mslog(s, NULL, LOG_ERR, "memory allocation error");
+			close(cfd);
+			return;
+		}
+		conn->time = time(0);
+		str_init(&conn->reply, conn);
+
+		set_cloexec_flag(cfd, 1);
+		set_non_block(cfd);
+		if (main_ev_add(s, &conn->ev, cfd, MEV_READ, metrics_conn_ev) < 0) {
+			close(cfd);
+			talloc_free(conn);
+			return;
+		}
+
+		list_add_tail(&s->metrics.conns, &conn->list);
+		s->metrics.conns_size++;
+	}
+}
+
+static int listen_unix(main_server_st *s, const char *path)
+{
+	struct sockaddr_un sa;
+	int sd, ret, e;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strlcpy(sa.sun_path, path, sizeof(sa.sun_path));
+	remove(path);
+
+	sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sd == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not create socket '%s': %s",
+		      path, strerror(e));
+		return -1;
+	}
+
+	umask(066);
+	ret = bind(sd, (struct sockaddr *)&sa, SUN_LEN(&sa));
+	if (ret == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not bind socket '%s': %s",
+		      path, strerror(e));
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+/* Listens on host:port, where host may be an IPv6 address in brackets */
+static int listen_tcp(main_server_st *s, const char *addr)
+{
+	struct addrinfo hints, *res;
+	char host[MAX_HOSTNAME_SIZE];
+	const char *port;
+	int sd, ret, e, y = 1;
+
+	port = strrchr(addr, ':');
+	if (port == NULL || port == addr || port[1] == 0) {
+		mslog(s, NULL, LOG_ERR, "metrics-socket: expected a path or host:port, got '%s'", addr);
+		return -1;
+	}
+
+	if (addr[0] == '[' && port[-1] == ']')
+		snprintf(host, sizeof(host), "%.*s", (int)(port - addr - 2), addr + 1);
+	else
+		snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+	port++;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret != 0) {
+		mslog(s, NULL, LOG_ERR, "metrics-socket: could not resolve '%s': %s",
+		      addr, gai_strerror(ret));
+		return -1;
+	}
+
+	sd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (sd == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not create socket '%s': %s",
+		      addr, strerror(e));
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(y));
+
+	ret = bind(sd, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+	if (ret == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not bind socket '%s': %s",
+		      addr, strerror(e));
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+/* Starts listening on the metrics-socket, if set.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int metrics_listen(main_server_st *s)
+{
+	const char *addr = s->perm_config->metrics_socket;
+	int sd, ret, e;
+
+	if (addr == NULL)
+		return 0;
+
+	mslog(s, NULL, LOG_DEBUG, "initializing metrics socket: %s", addr);
+
+	if (addr[0] == '/')
+		sd = listen_unix(s, addr);
+	else
+		sd = listen_tcp(s, addr);
+	if (sd < 0)
+		return -1;
+
+	ret = listen(sd, 64);
+	if (ret == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not listen to socket '%s': %s",
+		      addr, strerror(e));
+		close(sd);
+		return -1;
+	}
+
+	set_cloexec_flag(sd, 1);
+	set_non_block(sd);
+
+	ret = main_ev_add(s, &s->metrics.ev, sd, MEV_READ, metrics_accept_ev);
+	if (ret < 0) {
+		close(sd);
+		return -1;
+	}
+
+	s->metrics.fd = sd;
+	return 0;
+}
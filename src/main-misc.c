@@ -57,7 +57,9 @@
 #include <tun.h>
 #include <main.h>
 #include <main-ban.h>
+#include <gettime.h>
 #include <ccan/list/list.h>
+#include <ccan/container_of/container_of.h>
 
 int set_tun_mtu(main_server_st * s, struct proc_st *proc, unsigned mtu)
 {
@@ -139,6 +141,17 @@ int handle_script_exit(main_server_st *s, struct proc_st *proc, int code)
 	return ret;
 }
 
+static void proc_cmd_ev(main_server_st *s, main_ev_st *ev, unsigned revents)
+{
+	struct proc_st *proc = container_of(ev, struct proc_st, ev);
+	int ret;
+
+	ret = handle_commands(s, proc);
+	if (ret < 0) {
+		remove_proc(s, proc, (ret!=ERR_WORKER_TERMINATED)?RPROC_KILL:0);
+	}
+}
+
 struct proc_st *new_proc(main_server_st * s, pid_t pid, int cmd_fd,
 			struct sockaddr_storage *remote_addr, socklen_t remote_addr_len,
 			struct sockaddr_storage *our_addr, socklen_t our_addr_len,
@@ -152,9 +165,16 @@ struct proc_st *ctmp;
 
 	ctmp->pid = pid;
 	ctmp->tun_lease.fd = -1;
+	ctmp->stats_slot = -1;
 	ctmp->fd = cmd_fd;
 	set_cloexec_flag (cmd_fd, 1);
 	ctmp->conn_time = time(0);
+	gettime(&ctmp->conn_ts);
+
+	if (main_ev_add(s, &ctmp->ev, cmd_fd, MEV_READ, proc_cmd_ev) < 0) {
+		talloc_free(ctmp);
+		return NULL;
+	}
 
 	memcpy(&ctmp->remote_addr, remote_addr, remote_addr_len);
 	ctmp->remote_addr_len = remote_addr_len;
@@ -162,7 +182,8 @@ struct proc_st *ctmp;
 	memcpy(&ctmp->our_addr, our_addr, our_addr_len);
 	ctmp->our_addr_len = our_addr_len;
 
-	list_add(&s->proc_list.head, &(ctmp->list));
+	ctmp->seq = ++s->proc_list.last_seq;
+	list_add_tail(&s->proc_list.head, &(ctmp->list));
 	put_into_cgroup(s, s->config->cgroup, pid);
 	s->active_clients++;
 
@@ -184,6 +205,10 @@ void remove_proc(main_server_st * s, struct proc_st *proc, unsigned flags)
 	/* close any pending sessions */
 	if (proc->active_sid && !(flags & RPROC_QUIT)) {
 		session_close(s, proc);
+
+		s->metrics.sessions_closed++;
+		s->metrics.bytes_in += proc->bytes_in;
+		s->metrics.bytes_out += proc->bytes_out;
 	}
 
 	remove_from_script_list(s, proc);
@@ -192,6 +217,7 @@ void remove_proc(main_server_st * s, struct proc_st *proc, unsigned flags)
 	}
 
 	/* close the intercomm fd */
+	main_ev_del(s, &proc->ev);
 	if (proc->fd >= 0)
 		close(proc->fd);
 	proc->fd = -1;
@@ -204,15 +230,50 @@ void remove_proc(main_server_st * s, struct proc_st *proc, unsigned flags)
 
 	close_tun(s, proc);
 	proc_table_del(s, proc);
+	stats_table_put(&s->stats_table, proc->stats_slot);
 
 	talloc_free(proc);
 }
 
+/* Continues accept_user() once the IP leases are available */
+static int accept_user_cont(main_server_st * s, struct proc_st *proc)
+{
+	int ret;
+	const char *group;
+
+	ret = open_tun(s, proc);
+	if (ret < 0) {
+		return -1;
+	}
+
+	if (proc->groupname[0] == 0)
+		group = "[unknown]";
+	else
+		group = proc->groupname;
+
+	mslog(s, proc, LOG_DEBUG,
+	      "user of group '%s' authenticated (using cookie)",
+	      group);
+
+	/* do scripts and utmp */
+	ret = user_connected(s, proc);
+	if (ret < 0 && ret != ERR_WAIT_FOR_SCRIPT) {
+		mslog(s, proc, LOG_INFO, "user disconnected due to script");
+	}
+
+	return ret;
+}
+
 /* This is the function after which proc is populated */
 static int accept_user(main_server_st * s, struct proc_st *proc, unsigned cmd)
 {
 	int ret;
-	const char *group;
+
+	if (cmd != AUTH_COOKIE_REQ) {
+		mslog(s, proc, LOG_INFO,
+		      "user authenticated but from unknown state! rejecting.");
+		return ERR_BAD_COMMAND;
+	}
 
 	/* check for multiple connections */
 	ret = check_multiple_users(s, proc);
@@ -223,31 +284,33 @@ static int accept_user(main_server_st * s, struct proc_st *proc, unsigned cmd)
 		return ret;
 	}
 
-	ret = open_tun(s, proc);
+	ret = get_ip_leases(s, proc);
 	if (ret < 0) {
-		return -1;
+		/* on ERR_WAIT_FOR_PING we continue in ip_leases_ready() */
+		return ret;
 	}
 
-	if (proc->groupname[0] == 0)
-		group = "[unknown]";
+	return accept_user_cont(s, proc);
+}
+
+/* Completes the authentication, given the result of accept_user() */
+static int finish_cookie_auth(main_server_st *s, struct proc_st *proc, int ret)
+{
+	if (ret < 0)
+		proc->status = PS_AUTH_FAILED;
 	else
-		group = proc->groupname;
+		proc->status = PS_AUTH_COMPLETED;
 
-	if (cmd == AUTH_COOKIE_REQ) {
-		mslog(s, proc, LOG_DEBUG,
-		      "user of group '%s' authenticated (using cookie)",
-		      group);
+	if (ret == ERR_WAIT_FOR_SCRIPT) {
+		/* we will wait for script termination to send our reply.
+		 * The notification of peer will be done in handle_script_exit().
+		 */
+		ret = 0;
 	} else {
-		mslog(s, proc, LOG_INFO,
-		      "user of group '%s' authenticated but from unknown state! rejecting.",
-		      group);
-		return ERR_BAD_COMMAND;
-	}
-
-	/* do scripts and utmp */
-	ret = user_connected(s, proc);
-	if (ret < 0 && ret != ERR_WAIT_FOR_SCRIPT) {
-		mslog(s, proc, LOG_INFO, "user disconnected due to script");
+		/* no script was called. Handle it as a successful script call. */
+		ret = handle_script_exit(s, proc, ret);
+		if (ret < 0)
+			proc->status = PS_AUTH_FAILED;
 	}
 
 	return ret;
@@ -266,34 +329,32 @@ static int handle_cookie_auth_res(main_server_st *s, struct proc_st *proc,
 
 	if (result == 0) {
 		ret = accept_user(s, proc, cmd);
-		if (ret < 0) {
-			proc->status = PS_AUTH_FAILED;
-			goto finished;
+		if (ret == ERR_WAIT_FOR_PING) {
+			/* the reply is sent once the addresses are probed */
+			return 0;
 		}
-		proc->status = PS_AUTH_COMPLETED;
 	} else if (result < 0) {
-		proc->status = PS_AUTH_FAILED;
 		ret = result;
 	} else {
-		proc->status = PS_AUTH_FAILED;
 		mslog(s, proc, LOG_ERR, "unexpected auth result: %d\n", result);
 		ret = ERR_BAD_COMMAND;
 	}
 
- finished:
-	if (ret == ERR_WAIT_FOR_SCRIPT) {
-		/* we will wait for script termination to send our reply.
-		 * The notification of peer will be done in handle_script_exit().
-		 */
-		ret = 0;
-	} else {
-		/* no script was called. Handle it as a successful script call. */
-		ret = handle_script_exit(s, proc, ret);
-		if (ret < 0)
-			proc->status = PS_AUTH_FAILED;
-	}
+	return finish_cookie_auth(s, proc, ret);
+}
 
-	return ret;
+/* Called by get_ip_leases() when the leases of the client were
+ * obtained asynchronously */
+void ip_leases_ready(main_server_st *s, struct proc_st *proc, int result)
+{
+	int ret = result;
+
+	if (ret == 0)
+		ret = accept_user_cont(s, proc);
+
+	ret = finish_cookie_auth(s, proc, ret);
+	if (ret < 0)
+		remove_proc(s, proc, RPROC_KILL);
 }
 
 int handle_commands(main_server_st * s, struct proc_st *proc)
@@ -668,7 +729,8 @@ int run_sec_mod(main_server_st * s, int *sync_fd)
 		close(sfd[1]);
 		set_cloexec_flag (fd[0], 1);
 		set_cloexec_flag (sfd[0], 1);
-		sec_mod_server(s->main_pool, s->perm_config, p, s->cookie_key, fd[0], sfd[0]);
+		sec_mod_server(s->main_pool, s->perm_config, p, s->cookie_key, &s->stats_table,
+			       fd[0], sfd[0]);
 		exit(0);
 	} else if (pid > 0) {	/* parent */
 		close(fd[0]);
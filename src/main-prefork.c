@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <cloexec.h>
+
+#include <vpn.h>
+#include <main.h>
+#include <common.h>
+#include <ccan/list/list.h>
+
+/* The pool of pre-forked workers. These are forked from the main
+ * process while it is idle, and block waiting for a CMD_WORKER_STARTUP
+ * message. On a new connection, the accepted socket is passed to an
+ * idle worker over its command socket, so that the accept path does
+ * not include a fork() of the main process.
+ *
+ * Idle workers are not clients; they are not present in the proc
+ * list until a connection is handed over to them.
+ */
+
+void prefork_init(main_server_st *s)
+{
+	list_head_init(&s->prefork_list.head);
+	s->prefork_list.total = 0;
+	s->prefork_list.filling = 0;
+}
+
+static void prefork_remove(main_server_st *s, struct prefork_st *p)
+{
+	list_del(&p->list);
+	s->prefork_list.total--;
+	close(p->fd);
+	talloc_free(p);
+}
+
+/* Releases the pool without terminating the workers; used by
+ * the worker processes themselves. */
+void prefork_deinit(main_server_st *s)
+{
+	struct prefork_st *p, *pos;
+
+	list_for_each_safe(&s->prefork_list.head, p, pos, list) {
+		prefork_remove(s, p);
+	}
+}
+
+void prefork_kill_all(main_server_st *s)
+{
+	struct prefork_st *p, *pos;
+
+	list_for_each_safe(&s->prefork_list.head, p, pos, list) {
+		kill(p->pid, SIGTERM);
+		prefork_remove(s, p);
+	}
+	s->prefork_list.filling = 0;
+}
+
+/* Called when a child process has terminated */
+void prefork_reaped(main_server_st *s, pid_t pid)
+{
+	struct prefork_st *p, *pos;
+
+	list_for_each_safe(&s->prefork_list.head, p, pos, list) {
+		if (p->pid == pid) {
+			mslog(s, NULL, LOG_DEBUG, "idle worker %u has terminated", (unsigned)pid);
+			prefork_remove(s, p);
+			return;
+		}
+	}
+}
+
+static int prefork_one(main_server_st *s)
+{
+	struct prefork_st *p;
+	int cmd_fd[2];
+	pid_t pid;
+	int ret;
+
+	p = talloc_zero(s, struct prefork_st);
+	if (p == NULL)
+		return -1;
+
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, cmd_fd);
+	if (ret < 0) {
+		mslog(s, NULL, LOG_ERR, "error creating command socket");
+		talloc_free(p);
+		return -1;
+	}
+
+	pid = fork();
+	if (pid == 0) {	/* child */
+		close(cmd_fd[0]);
+		run_worker(s, cmd_fd[1], -1, 0);
+	} else if (pid == -1) {
+		mslog(s, NULL, LOG_ERR, "fork failed");
+		close(cmd_fd[0]);
+		close(cmd_fd[1]);
+		talloc_free(p);
+		return -1;
+	}
+
+	close(cmd_fd[1]);
+	set_cloexec_flag(cmd_fd[0], 1);
+
+	p->pid = pid;
+	p->fd = cmd_fd[0];
+	list_add_tail(&s->prefork_list.head, &p->list);
+	s->prefork_list.total++;
+
+	return 0;
+}
+
+/* Forks a single idle worker if the pool needs one. Once the pool
+ * drops below prefork-min-idle, it is refilled up to prefork-max-idle;
+ * a worker is forked per call, so that the main loop can handle its
+ * events in between.
+ *
+ * Returns non-zero if more workers are to be forked.
+ */
+unsigned prefork_fill(main_server_st *s)
+{
+	struct prefork_list_st *l = &s->prefork_list;
+
+	if (s->config->prefork_min_idle == 0)
+		return 0;
+
+	if (l->total < s->config->prefork_min_idle)
+		l->filling = 1;
+
+	if (l->filling == 0)
+		return 0;
+
+	if (l->total >= s->config->prefork_max_idle ||
+	    prefork_one(s) < 0) {
+		l->filling = 0;
+		return 0;
+	}
+
+	return (l->total < s->config->prefork_max_idle);
+}
+
+/* Hands over the provided connection, and its stats slot unless -1, to
+ * an idle worker. On success the worker's pid is returned, and its
+ * command socket is stored in cmd_fd.
+ * Returns -1 if no idle worker is available.
+ */
+pid_t prefork_take(main_server_st *s, int conn_fd, sock_type_t stype,
+		   const struct sockaddr_storage *remote_addr, socklen_t remote_addr_len,
+		   const struct sockaddr_storage *our_addr, socklen_t our_addr_len,
+		   int stats_slot, int *cmd_fd)
+{
+	WorkerStartupMsg msg = WORKER_STARTUP_MSG__INIT;
+	struct prefork_st *p;
+	pid_t pid;
+	int ret;
+
+	msg.remote_addr.data = (void*)remote_addr;
+	msg.remote_addr.len = remote_addr_len;
+	msg.our_addr.data = (void*)our_addr;
+	msg.our_addr.len = our_addr_len;
+	msg.sock_type = stype;
+	if (stats_slot >= 0) {
+		msg.stats_slot = stats_slot;
+		msg.has_stats_slot = 1;
+	}
+
+	while ((p = list_top(&s->prefork_list.head, struct prefork_st, list)) != NULL) {
+		ret = send_socket_msg(s, p->fd, CMD_WORKER_STARTUP, conn_fd, &msg,
+				      (pack_size_func)worker_startup_msg__get_packed_size,
+				      (pack_func)worker_startup_msg__pack);
+		if (ret >= 0) {
+			pid = p->pid;
+			*cmd_fd = p->fd;
+
+			list_del(&p->list);
+			s->prefork_list.total--;
+			talloc_free(p);
+			return pid;
+		}
+
+		mslog(s, NULL, LOG_INFO, "could not pass connection to idle worker %u",
+		      (unsigned)p->pid);
+		kill(p->pid, SIGTERM);
+		prefork_remove(s, p);
+	}
+
+	return -1;
+}
@@ -38,33 +38,59 @@
 #include <common.h>
 #include <tlslib.h>
 
-int handle_resume_delete_req(main_server_st * s, struct proc_st *proc,
-			     const SessionResumeFetchMsg * req)
+/* The TLS session cache. Sessions are kept in a hash table, as well as in
+ * a list in the order they were last used, and a list in the order they
+ * were stored. When the cache is full, the least recently used session is
+ * evicted, and since all sessions have the same lifetime, the expired
+ * sessions are at the head of the storage list. The session data are
+ * allocated from a slab of size classes, so that each session occupies
+ * memory close to its actual size.
+ */
+
+static void remove_session(main_server_st * s, tls_cache_st *cache)
+{
+	htable_del(s->tls_db.ht, hash_any(cache->session_id, cache->session_id_size, 0), cache);
+	list_del(&cache->lru);
+	list_del(&cache->expiry);
+
+	safe_memset(cache->session_data, 0, cache->session_data_size);
+	slab_free(s->tls_db.slab, cache->session_data, cache->session_data_size);
+	cache->session_data_size = 0;
+	cache->session_id_size = 0;
+
+	talloc_free(cache);
+	s->tls_db.entries--;
+}
+
+static tls_cache_st *find_session(main_server_st * s, const uint8_t *id, unsigned id_size)
 {
 	tls_cache_st *cache;
 	struct htable_iter iter;
 	size_t key;
 
-	key = hash_any(req->session_id.data, req->session_id.len, 0);
+	key = hash_any(id, id_size, 0);
 
 	cache = htable_firstval(s->tls_db.ht, &iter, key);
 	while (cache != NULL) {
-		if (req->session_id.len == cache->session_id_size &&
-		    memcmp(req->session_id.data, cache->session_id,
-			   req->session_id.len) == 0) {
-
-			cache->session_data_size = 0;
-			cache->session_id_size = 0;
-
-			htable_delval(s->tls_db.ht, &iter);
-			talloc_free(cache);
-			s->tls_db.entries--;
-			return 0;
-		}
+		if (id_size == cache->session_id_size &&
+		    memcmp(id, cache->session_id, id_size) == 0)
+			return cache;
 
 		cache = htable_nextval(s->tls_db.ht, &iter, key);
 	}
 
+	return NULL;
+}
+
+int handle_resume_delete_req(main_server_st * s, struct proc_st *proc,
+			     const SessionResumeFetchMsg * req)
+{
+	tls_cache_st *cache;
+
+	cache = find_session(s, req->session_id.data, req->session_id.len);
+	if (cache != NULL)
+		remove_session(s, cache);
+
 	return 0;
 }
 
@@ -73,45 +99,55 @@ int handle_resume_fetch_req(main_server_st * s, struct proc_st *proc,
 			    SessionResumeReplyMsg * rep)
 {
 	tls_cache_st *cache;
-	struct htable_iter iter;
-	size_t key;
 
 	rep->reply = SESSION_RESUME_REPLY_MSG__RESUME__REP__FAILED;
 
-	key = hash_any(req->session_id.data, req->session_id.len, 0);
-
-	cache = htable_firstval(s->tls_db.ht, &iter, key);
-	while (cache != NULL) {
-		if (req->session_id.len == cache->session_id_size &&
-		    memcmp(req->session_id.data, cache->session_id,
-			   req->session_id.len) == 0) {
-
-			if (proc->remote_addr_len == cache->remote_addr_len &&
-			    ip_cmp(&proc->remote_addr, &cache->remote_addr) == 0) {
+	cache = find_session(s, req->session_id.data, req->session_id.len);
+	if (cache == NULL) {
+		s->metrics.resume_misses++;
+		return 0;
+	}
 
-				rep->reply =
-				    SESSION_RESUME_REPLY_MSG__RESUME__REP__OK;
+	if (proc->remote_addr_len == cache->remote_addr_len &&
+	    ip_cmp(&proc->remote_addr, &cache->remote_addr) == 0) {
 
-				rep->has_session_data = 1;
+		rep->reply =
+		    SESSION_RESUME_REPLY_MSG__RESUME__REP__OK;
 
-				rep->session_data.data =
-				    (void *)cache->session_data;
-				rep->session_data.len =
-				    cache->session_data_size;
+		rep->has_session_data = 1;
 
-				mslog_hex(s, proc, LOG_DEBUG, "TLS session DB resuming",
-					  req->session_id.data,
-					  req->session_id.len, 0);
+		rep->session_data.data =
+		    (void *)cache->session_data;
+		rep->session_data.len =
+		    cache->session_data_size;
 
-				return 0;
-			}
-		}
+		/* move to the most recently used end */
+		list_del(&cache->lru);
+		list_add_tail(&s->tls_db.lru, &cache->lru);
 
-		cache = htable_nextval(s->tls_db.ht, &iter, key);
+		mslog_hex(s, proc, LOG_DEBUG, "TLS session DB resuming",
+			  req->session_id.data,
+			  req->session_id.len, 0);
+		s->metrics.resume_hits++;
+	} else {
+		s->metrics.resume_misses++;
 	}
 
 	return 0;
+}
+
+/* Removes the expired sessions; these are at the head of the
+ * expiry list */
+static void expire_sessions(main_server_st * s, time_t now)
+{
+	tls_cache_st *cache;
 
+	while ((cache = list_top(&s->tls_db.expiry, tls_cache_st, expiry)) != NULL) {
+		if (now - cache->stored <= TLS_SESSION_EXPIRATION_TIME(s->config))
+			break;
+
+		remove_session(s, cache);
+	}
 }
 
 int handle_resume_store_req(main_server_st * s, struct proc_st *proc,
@@ -120,19 +156,30 @@ int handle_resume_store_req(main_server_st * s, struct proc_st *proc,
 	tls_cache_st *cache;
 	size_t key;
 	unsigned int max;
+	time_t now;
 
 	if (req->session_id.len > GNUTLS_MAX_SESSION_ID)
 		return -1;
 	if (req->session_data.len > MAX_SESSION_DATA_SIZE)
 		return -1;
 
+	now = time(0);
+	expire_sessions(s, now);
+
+	/* a session re-stored replaces the previous one */
+	cache = find_session(s, req->session_id.data, req->session_id.len);
+	if (cache != NULL)
+		remove_session(s, cache);
+
 	max = MAX(2 * s->config->max_clients, DEFAULT_MAX_CACHED_TLS_SESSIONS);
-	if (s->tls_db.entries >= max) {
-		mslog(s, NULL, LOG_INFO,
-		      "maximum number of stored TLS sessions reached (%u)",
-		      max);
-		need_maintenance = 1;
-		return -1;
+	while (s->tls_db.entries >= max) {
+		cache = list_top(&s->tls_db.lru, tls_cache_st, lru);
+		if (cache == NULL)
+			break;
+
+		mslog_hex(s, NULL, LOG_DEBUG, "TLS session DB evicting",
+			  (void*)cache->session_id, cache->session_id_size, 0);
+		remove_session(s, cache);
 	}
 
 	key = hash_any(req->session_id.data, req->session_id.len, 0);
@@ -141,16 +188,29 @@ int handle_resume_store_req(main_server_st * s, struct proc_st *proc,
 	if (cache == NULL)
 		return -1;
 
+	cache->session_data = slab_alloc(s->tls_db.slab, req->session_data.len);
+	if (cache->session_data == NULL) {
+		talloc_free(cache);
+		return -1;
+	}
+
 	cache->session_id_size = req->session_id.len;
 	cache->session_data_size = req->session_data.len;
 	cache->remote_addr_len = proc->remote_addr_len;
+	cache->stored = now;
 
 	memcpy(cache->session_id, req->session_id.data, req->session_id.len);
 	memcpy(cache->session_data, req->session_data.data,
 	       req->session_data.len);
 	memcpy(&cache->remote_addr, &proc->remote_addr, proc->remote_addr_len);
 
-	htable_add(s->tls_db.ht, key, cache);
+	if (htable_add(s->tls_db.ht, key, cache) == 0) {
+		slab_free(s->tls_db.slab, cache->session_data, cache->session_data_size);
+		talloc_free(cache);
+		return -1;
+	}
+	list_add_tail(&s->tls_db.lru, &cache->lru);
+	list_add_tail(&s->tls_db.expiry, &cache->expiry);
 	s->tls_db.entries++;
 
 	mslog_hex(s, proc, LOG_DEBUG, "TLS session DB storing",
@@ -162,32 +222,5 @@ int handle_resume_store_req(main_server_st * s, struct proc_st *proc,
 
 void expire_tls_sessions(main_server_st * s)
 {
-	tls_cache_st *cache;
-	struct htable_iter iter;
-	time_t now, exp;
-
-	now = time(0);
-
-	cache = htable_first(s->tls_db.ht, &iter);
-	while (cache != NULL) {
-		gnutls_datum_t d;
-
-		d.data = (void *)cache->session_data;
-		d.size = cache->session_data_size;
-
-		exp = gnutls_db_check_entry_time(&d);
-
-		if (now - exp > TLS_SESSION_EXPIRATION_TIME(s->config)) {
-			cache->session_id_size = 0;
-
-			htable_delval(s->tls_db.ht, &iter);
-
-			safe_memset(cache->session_data, 0, cache->session_data_size);
-			talloc_free(cache);
-			s->tls_db.entries--;
-		}
-		cache = htable_next(s->tls_db.ht, &iter);
-	}
-
-	return;
+	expire_sessions(s, time(0));
 }
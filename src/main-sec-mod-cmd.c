@@ -153,6 +153,20 @@ int handle_sec_mod_commands(main_server_st * s)
 			}
 		}
 
+		break;
+	case SM_CMD_SECMOD_STATS:{
+			SecmodStatsMsg *smsg;
+
+			smsg = secmod_stats_msg__unpack(&pa, raw_len, raw);
+			if (smsg == NULL) {
+				mslog(s, NULL, LOG_ERR, "error unpacking sec-mod data");
+				ret = ERR_BAD_COMMAND;
+				goto cleanup;
+			}
+			s->secmod_pending_ops = smsg->pending_ops;
+			secmod_stats_msg__free_unpacked(smsg, &pa);
+		}
+
 		break;
 	default:
 		mslog(s, NULL, LOG_ERR, "unknown CMD from sec-mod 0x%x.", (unsigned)cmd);
@@ -189,6 +203,11 @@ int session_open(main_server_st * s, struct proc_st *proc, const uint8_t *cookie
 	ireq.sid.data = proc->sid;
 	ireq.sid.len = sizeof(proc->sid);
 
+	if (proc->stats_slot >= 0) {
+		ireq.stats_slot = proc->stats_slot;
+		ireq.has_stats_slot = 1;
+	}
+
 	if (proc->ipv4 && 
 	    human_addr2((struct sockaddr *)&proc->ipv4->rip, proc->ipv4->rip_len,
 	    str_ipv4, sizeof(str_ipv4), 0) != NULL) {
@@ -331,6 +350,15 @@ int session_close(main_server_st * s, struct proc_st *proc)
 	SecAuthSessionMsg ireq = SEC_AUTH_SESSION_MSG__INIT;
 	CliStatsMsg *msg = NULL;
 	PROTOBUF_ALLOCATOR(pa, proc);
+	uint64_t bytes_in, bytes_out;
+
+	/* the worker may not have reported its final counters yet */
+	if (stats_table_read(&s->stats_table, proc->stats_slot, &bytes_in, &bytes_out) == 0) {
+		if (bytes_in > proc->bytes_in)
+			proc->bytes_in = bytes_in;
+		if (bytes_out > proc->bytes_out)
+			proc->bytes_out = bytes_out;
+	}
 
 	ireq.uptime = time(0)-proc->conn_time;
 	ireq.has_uptime = 1;
@@ -341,6 +369,11 @@ int session_close(main_server_st * s, struct proc_st *proc)
 	ireq.sid.data = proc->sid;
 	ireq.sid.len = sizeof(proc->sid);
 
+	if (proc->stats_slot >= 0) {
+		ireq.stats_slot = proc->stats_slot;
+		ireq.has_stats_slot = 1;
+	}
+
 	mslog(s, proc, LOG_DEBUG, "sending msg %s to sec-mod", cmd_request_to_str(SM_CMD_AUTH_SESSION_CLOSE));
 
 	ret = send_msg(proc, s->sec_mod_fd_sync, SM_CMD_AUTH_SESSION_CLOSE,
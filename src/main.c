@@ -61,6 +61,7 @@
 #include <grp.h>
 #include <ip-lease.h>
 #include <ccan/list/list.h>
+#include <ccan/container_of/container_of.h>
 
 #ifdef HAVE_GSSAPI
 # include <libtasn1.h>
@@ -495,6 +496,8 @@ struct script_wait_st *stmp = NULL, *spos;
 			terminate = 1;
 		}
 
+		prefork_reaped(s, pid);
+
 		/* check if someone was waiting for that pid */
 		list_for_each_safe(&s->script_list.head, stmp, spos, list) {
 			if (stmp->pid == pid) {
@@ -624,6 +627,8 @@ void clear_lists(main_server_st *s)
 	struct proc_st *ctmp = NULL, *cpos;
 	struct script_wait_st *script_tmp = NULL, *script_pos;
 
+	main_ev_deinit(s);
+
 	list_for_each_safe(&s->listen_list.head, ltmp, lpos, list) {
 		close(ltmp->fd);
 		list_del(&ltmp->list);
@@ -647,10 +652,15 @@ void clear_lists(main_server_st *s)
 		talloc_free(script_tmp);
 	}
 
+	prefork_deinit(s);
+	admission_deinit(s);
+	icmp_ping_deinit(s);
+
 	tls_cache_deinit(&s->tls_db);
 	ip_lease_deinit(&s->ip_leases);
 	proc_table_deinit(s);
 	ctl_handler_deinit(s);
+	metrics_deinit(s);
 	main_ban_db_deinit(s);
 }
 
@@ -660,6 +670,7 @@ static void kill_children(main_server_st* s)
 
 	/* kill the security module server */
 	kill(s->sec_mod_pid, SIGTERM);
+	prefork_kill_all(s);
 	list_for_each_safe(&s->proc_list.head, ctmp, cpos, list) {
 		if (ctmp->pid != -1) {
 			remove_proc(s, ctmp, RPROC_KILL|RPROC_QUIT);
@@ -846,8 +857,12 @@ unsigned total = 10;
 		mslog(s, NULL, LOG_INFO, "reloading configuration");
 		reload_cfg_file(s->main_pool, s->perm_config);
 		tls_reload_crl(s, s->creds);
+		tls_update_ticket_key(s, s->creds);
 		reload_conf = 0;
 		kill(s->sec_mod_pid, SIGHUP);
+
+		/* the idle workers hold the old configuration */
+		prefork_kill_all(s);
 	}
 
 	if (need_children_cleanup != 0) {
@@ -888,6 +903,10 @@ unsigned total = 10;
 		mslog(s, NULL, LOG_DEBUG, "performing maintenance (banned IPs: %d)", main_ban_db_elems(s));
 		expire_tls_sessions(s);
 		cleanup_banned_entries(s);
+
+		/* the idle workers would issue tickets under the old key */
+		if (tls_update_ticket_key(s, s->creds) != 0)
+			prefork_kill_all(s);
 		alarm(MAINTAINANCE_TIME(s));
 	}
 }
@@ -910,24 +929,237 @@ static int check_tcp_wrapper(int fd)
 # define check_tcp_wrapper(x) 0
 #endif
 
+/* the worker structure template; populated by the accept path
+ * prior to fork() */
+static struct worker_st *ws = NULL;
+
+/* Runs a worker process in a newly forked child. When conn_fd is -1,
+ * the worker is pre-forked and waits for the connection to be passed
+ * over cmd_fd. */
+void run_worker(main_server_st *s, int cmd_fd, int conn_fd, sock_type_t stype)
+{
+	/* close any open descriptors, and erase
+	 * sensitive data before running the worker
+	 */
+	sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
+	clear_lists(s);
+	close(s->sec_mod_fd);
+	close(s->sec_mod_fd_sync);
+
+	/* clear the cookie key */
+	safe_memset(s->cookie_key, 0, sizeof(s->cookie_key));
+
+	setproctitle(PACKAGE_NAME"-worker");
+	kill_on_parent_kill(SIGTERM);
+
+	/* write sec-mod's address */
+	memcpy(&ws->secmod_addr, &s->secmod_addr, s->secmod_addr_len);
+	ws->secmod_addr_len = s->secmod_addr_len;
+
+	ws->main_pool = s->main_pool;
+	ws->config = s->config;
+	ws->perm_config = s->perm_config;
+	ws->cmd_fd = cmd_fd;
+	ws->tun_fd = -1;
+	ws->dtls_tptr.fd = -1;
+	ws->ev_fd = -1;
+	ws->timer_fd = -1;
+	ws->ev_dtls_fd = -1;
+	ws->conn_fd = conn_fd;
+	ws->conn_type = stype;
+	ws->creds = s->creds;
+	ws->stats_table = s->stats_table;
+	if (conn_fd == -1)
+		ws->stats_slot = -1;
+
+	/* Drop privileges after this point */
+	drop_privileges(s);
+
+	/* creds and config are not allocated
+	 * under s.
+	 */
+	talloc_free(s);
+#ifdef HAVE_MALLOC_TRIM
+	/* try to return all the pages we've freed to
+	 * the operating system, to prevent the child from
+	 * accessing them. That's totally unreliable, so
+	 * sensitive data have to be overwritten anyway. */
+	malloc_trim(0);
+#endif
+
+	if (conn_fd == -1 && worker_recv_startup(ws) < 0)
+		exit(1);
+
+	ws->stats = stats_table_restrict(&ws->stats_table, ws->stats_slot);
+
+	vpn_server(ws);
+	exit(0);
+}
+
+/* Starts a worker process for an admitted connection */
+static void spawn_worker(main_server_st *s, struct pending_conn_st *conn)
+{
+	int ret, pid;
+	int cmd_fd[2];
+	int fd = conn->fd;
+	struct proc_st *ctmp;
+
+	if (s->config->max_clients > 0 && s->active_clients >= s->config->max_clients) {
+		s->metrics.rejected[METRICS_REJECT_MAX_CLIENTS]++;
+		close(fd);
+		mslog(s, NULL, LOG_INFO, "reached maximum client limit (active: %u)", s->active_clients);
+		return;
+	}
+
+	memcpy(&ws->remote_addr, &conn->remote_addr, conn->remote_addr_len);
+	ws->remote_addr_len = conn->remote_addr_len;
+	memcpy(&ws->our_addr, &conn->our_addr, conn->our_addr_len);
+	ws->our_addr_len = conn->our_addr_len;
+
+	/* without a free slot, the worker reports its counters over IPC */
+	ws->stats_slot = stats_table_get(&s->stats_table);
+
+	/* prefer an idle pre-forked worker */
+	pid = prefork_take(s, fd, conn->stype, &ws->remote_addr, ws->remote_addr_len,
+			   &ws->our_addr, ws->our_addr_len, ws->stats_slot, &cmd_fd[0]);
+	if (pid == -1) {
+		/* Create a command socket */
+		ret = socketpair(AF_UNIX, SOCK_STREAM, 0, cmd_fd);
+		if (ret < 0) {
+			mslog(s, NULL, LOG_ERR, "error creating command socket");
+			stats_table_put(&s->stats_table, ws->stats_slot);
+			close(fd);
+			return;
+		}
+
+		pid = fork();
+		if (pid == 0) {	/* child */
+			close(cmd_fd[0]);
+			run_worker(s, cmd_fd[1], fd, conn->stype);
+		}
+		close(cmd_fd[1]);
+	}
+
+	if (pid == -1) {
+fork_failed:
+		mslog(s, NULL, LOG_ERR, "fork failed");
+		stats_table_put(&s->stats_table, ws->stats_slot);
+		close(cmd_fd[0]);
+	} else { /* parent */
+		/* add_proc */
+		ctmp = new_proc(s, pid, cmd_fd[0],
+				&ws->remote_addr, ws->remote_addr_len,
+				&ws->our_addr, ws->our_addr_len,
+				ws->sid, sizeof(ws->sid));
+		if (ctmp == NULL) {
+			kill(pid, SIGTERM);
+			goto fork_failed;
+		}
+		ctmp->stats_slot = ws->stats_slot;
+
+	}
+	close(fd);
+}
+
+static void accept_tcp_conn(main_server_st *s, struct listener_st *ltmp)
+{
+	struct pending_conn_st conn;
+	int fd, ret;
+
+	memset(&conn, 0, sizeof(conn));
+	conn.stype = ltmp->sock_type;
+
+	conn.remote_addr_len = sizeof(conn.remote_addr);
+	fd = accept(ltmp->fd, (void*)&conn.remote_addr, &conn.remote_addr_len);
+	if (fd < 0) {
+		mslog(s, NULL, LOG_ERR,
+		       "error in accept(): %s", strerror(errno));
+		return;
+	}
+	set_cloexec_flag (fd, 1);
+#ifndef __linux__
+	/* OpenBSD sets the non-blocking flag if accept's fd is non-blocking */
+	set_block(fd);
+#endif
+	conn.fd = fd;
+	s->metrics.accepted++;
+
+	if (check_tcp_wrapper(fd) < 0) {
+		s->metrics.rejected[METRICS_REJECT_TCP_WRAPPERS]++;
+		close(fd);
+		mslog(s, NULL, LOG_INFO, "TCP wrappers rejected the connection (see /etc/hosts->[allow|deny])");
+		return;
+	}
+
+	if (conn.stype != SOCK_TYPE_UNIX && !s->config->listen_proxy_proto) {
+		conn.our_addr_len = sizeof(conn.our_addr);
+		if (getsockname(fd, (struct sockaddr*)&conn.our_addr, &conn.our_addr_len) < 0)
+			conn.our_addr_len = 0;
+
+		if (check_if_banned(s, &conn.remote_addr, conn.remote_addr_len) != 0) {
+			s->metrics.rejected[METRICS_REJECT_BANNED]++;
+			close(fd);
+			return;
+		}
+
+		/* clients re-connecting to an existing session get precedence */
+		if (proc_search_ip(s, &conn.remote_addr, conn.remote_addr_len) != NULL)
+			conn.priority = 1;
+	}
+
+	ret = admission_check(s, &conn);
+	if (ret <= 0) /* queued or rejected */
+		return;
+
+	spawn_worker(s, &conn);
+}
+
+/* Serves the queued connections as the rate limit allows */
+static void admit_pending_conns(main_server_st *s)
+{
+	struct pending_conn_st *conn;
+
+	while ((conn = admission_next(s)) != NULL) {
+		spawn_worker(s, conn);
+		talloc_free(conn);
+	}
+}
+
+static void listener_ev(main_server_st *s, main_ev_st *ev, unsigned revents)
+{
+	struct listener_st *ltmp = container_of(ev, struct listener_st, ev);
+
+	if (ltmp->sock_type == SOCK_TYPE_TCP || ltmp->sock_type == SOCK_TYPE_UNIX) {
+		/* connection on TCP port */
+		accept_tcp_conn(s, ltmp);
+	} else if (ltmp->sock_type == SOCK_TYPE_UDP) {
+		/* connection on UDP port; these are only forwarded to
+		 * existing sessions, and are not rate limited */
+		forward_udp_to_owner(s, ltmp);
+	}
+}
+
+static void sec_mod_ev(main_server_st *s, main_ev_st *ev, unsigned revents)
+{
+	int ret;
+
+	ret = handle_sec_mod_commands(s);
+	if (ret < 0) { /* bad commands from sec-mod are unacceptable */
+		mslog(s, NULL, LOG_ERR,
+		       "error in command from sec-mod");
+		terminate = 1;
+	}
+}
+
 int main(int argc, char** argv)
 {
-	int fd, pid, e;
+	int e;
 	struct listener_st *ltmp = NULL;
-	struct proc_st *ctmp = NULL, *cpos;
-	fd_set rd_set, wr_set;
-	int n = 0, ret, flags;
+	int ret, flags;
+	unsigned timeout;
 	char *p;
-#ifdef HAVE_PSELECT
-	struct timespec ts;
-#else
-	struct timeval ts;
-#endif
-	int cmd_fd[2];
-	struct worker_st *ws;
 	void *worker_pool;
 	void *main_pool;
-	unsigned set;
 	main_server_st *s;
 	sigset_t emptyset, blockset;
 	/* tls credentials */
@@ -957,6 +1189,11 @@ int main(int argc, char** argv)
 
 	list_head_init(&s->proc_list.head);
 	list_head_init(&s->script_list.head);
+	list_head_init(&s->ctl_conns);
+	prefork_init(s);
+	admission_init(s);
+	icmp_ping_init(s);
+	metrics_init(s);
 	tls_cache_init(s, &s->tls_db);
 	ip_lease_init(&s->ip_leases);
 	proc_table_init(s);
@@ -1032,14 +1269,47 @@ int main(int argc, char** argv)
 
 	write_pid_file();
 
+	/* the table is shared with sec-mod and the workers; without it the
+	 * workers report their counters over IPC */
+	ret = stats_table_init(s, &s->stats_table, (s->config->max_clients > 0) ?
+			       s->config->max_clients + STATS_TABLE_SLACK : STATS_TABLE_DEFAULT_SIZE);
+	if (ret < 0)
+		mslog(s, NULL, LOG_WARNING, "could not allocate the stats table");
+
 	s->sec_mod_fd = run_sec_mod(s, &s->sec_mod_fd_sync);
 
+	ret = main_ev_init(s);
+	if (ret < 0) {
+		fprintf(stderr, "Cannot initialize the event loop\n");
+		exit(1);
+	}
+
 	ret = ctl_handler_init(s);
 	if (ret < 0) {
 		fprintf(stderr, "Cannot create command handler\n");
 		exit(1);
 	}
 
+	ret = metrics_listen(s);
+	if (ret < 0) {
+		fprintf(stderr, "Cannot create the metrics socket\n");
+		exit(1);
+	}
+
+	list_for_each(&s->listen_list.head, ltmp, list) {
+		ret = main_ev_add(s, &ltmp->ev, ltmp->fd, MEV_READ, listener_ev);
+		if (ret < 0) {
+			fprintf(stderr, "Cannot monitor listening socket\n");
+			exit(1);
+		}
+	}
+
+	ret = main_ev_add(s, &s->sec_mod_ev, s->sec_mod_fd, MEV_READ, sec_mod_ev);
+	if (ret < 0) {
+		fprintf(stderr, "Cannot monitor sec-mod socket\n");
+		exit(1);
+	}
+
 	mslog(s, NULL, LOG_INFO, "initialized %s", PACKAGE_STRING);
 
 	/* chdir to our chroot directory, to allow opening the sec-mod
@@ -1055,6 +1325,7 @@ int main(int argc, char** argv)
 
 	/* Initialize certificates */
 	tls_load_certs(s, &creds);
+	tls_update_ticket_key(s, &creds);
 
 	s->secmod_addr.sun_family = AF_UNIX;
 	p = s->socket_file;
@@ -1096,207 +1367,27 @@ int main(int argc, char** argv)
 
 	for (;;) {
 		check_other_work(s);
+		admit_pending_conns(s);
+		icmp_ping_expire(s);
 
-		/* initialize select */
-		n = 0;
-		FD_ZERO(&rd_set);
-		FD_ZERO(&wr_set);
-
-		list_for_each(&s->listen_list.head, ltmp, list) {
-			if (ltmp->fd == -1) continue;
-
-			FD_SET(ltmp->fd, &rd_set);
-			n = MAX(n, ltmp->fd);
-		}
-
-		list_for_each(&s->proc_list.head, ctmp, list) {
-			if (ctmp->fd > 0) {
-				FD_SET(ctmp->fd, &rd_set);
-				n = MAX(n, ctmp->fd);
-			}
-		}
-
-		FD_SET(s->sec_mod_fd, &rd_set);
-		n = MAX(n, s->sec_mod_fd);
-
-		ret = ctl_handler_set_fds(s, &rd_set, &wr_set);
-		n = MAX(n, ret);
-
-#ifdef HAVE_PSELECT
-		ts.tv_nsec = 0;
-		ts.tv_sec = 30;
-		ret = pselect(n + 1, &rd_set, NULL/*&wr_set*/, NULL, &ts, &emptyset);
-#else
-		ts.tv_usec = 0;
-		ts.tv_sec = 30;
-		sigprocmask(SIG_UNBLOCK, &blockset, NULL);
-		ret = select(n + 1, &rd_set, NULL/*&wr_set*/, NULL, &ts);
-		sigprocmask(SIG_BLOCK, &blockset, NULL);
-#endif
+		/* the pool of idle workers is refilled one at a time,
+		 * without blocking, while there are workers to fork */
+		timeout = prefork_fill(s) ? 0 : 30*1000;
+		timeout = admission_timeout(s, timeout);
+		timeout = icmp_ping_timeout(s, timeout);
 
+		ret = main_ev_run_once(s, timeout, &emptyset);
 		if (ret == -1 && errno == EINTR)
 			continue;
 
 		if (ret < 0) {
 			e = errno;
-			mslog(s, NULL, LOG_ERR, "Error in pselect(): %s",
+			mslog(s, NULL, LOG_ERR, "Error in main loop: %s",
 			       strerror(e));
 			terminate = 1;
 			continue;
 		}
 
-		/* Check for new connections to accept */
-		list_for_each(&s->listen_list.head, ltmp, list) {
-			set = FD_ISSET(ltmp->fd, &rd_set);
-			if (set && (ltmp->sock_type == SOCK_TYPE_TCP || ltmp->sock_type == SOCK_TYPE_UNIX)) {
-				/* connection on TCP port */
-				int stype = ltmp->sock_type;
-
-				ws->remote_addr_len = sizeof(ws->remote_addr);
-				fd = accept(ltmp->fd, (void*)&ws->remote_addr, &ws->remote_addr_len);
-				if (fd < 0) {
-					mslog(s, NULL, LOG_ERR,
-					       "error in accept(): %s", strerror(errno));
-					continue;
-				}
-				set_cloexec_flag (fd, 1);
-#ifndef __linux__
-				/* OpenBSD sets the non-blocking flag if accept's fd is non-blocking */
-				set_block(fd);
-#endif
-
-				if (s->config->max_clients > 0 && s->active_clients >= s->config->max_clients) {
-					close(fd);
-					mslog(s, NULL, LOG_INFO, "reached maximum client limit (active: %u)", s->active_clients);
-					break;
-				}
-
-				if (check_tcp_wrapper(fd) < 0) {
-					close(fd);
-					mslog(s, NULL, LOG_INFO, "TCP wrappers rejected the connection (see /etc/hosts->[allow|deny])");
-					break;
-				}
-
-				if (ws->conn_type != SOCK_TYPE_UNIX && !s->config->listen_proxy_proto) {
-					memset(&ws->our_addr, 0, sizeof(ws->our_addr));
-					ws->our_addr_len = sizeof(ws->our_addr);
-					if (getsockname(fd, (struct sockaddr*)&ws->our_addr, &ws->our_addr_len) < 0)
-						ws->our_addr_len = 0;
-
-					if (check_if_banned(s, &ws->remote_addr, ws->remote_addr_len) != 0) {
-						close(fd);
-						break;
-					}
-				}
-
-				/* Create a command socket */
-				ret = socketpair(AF_UNIX, SOCK_STREAM, 0, cmd_fd);
-				if (ret < 0) {
-					mslog(s, NULL, LOG_ERR, "error creating command socket");
-					close(fd);
-					break;
-				}
-
-				pid = fork();
-				if (pid == 0) {	/* child */
-					/* close any open descriptors, and erase
-					 * sensitive data before running the worker
-					 */
-					sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
-					close(cmd_fd[0]);
-					clear_lists(s);
-					close(s->sec_mod_fd);
-					close(s->sec_mod_fd_sync);
-
-					/* clear the cookie key */
-					safe_memset(s->cookie_key, 0, sizeof(s->cookie_key));
-
-					setproctitle(PACKAGE_NAME"-worker");
-					kill_on_parent_kill(SIGTERM);
-
-					/* write sec-mod's address */
-					memcpy(&ws->secmod_addr, &s->secmod_addr, s->secmod_addr_len);
-					ws->secmod_addr_len = s->secmod_addr_len;
-
-					ws->main_pool = main_pool;
-					ws->config = s->config;
-					ws->perm_config = s->perm_config;
-					ws->cmd_fd = cmd_fd[1];
-					ws->tun_fd = -1;
-					ws->dtls_tptr.fd = -1;
-					ws->conn_fd = fd;
-					ws->conn_type = stype;
-					ws->creds = &creds;
-
-					/* Drop privileges after this point */
-					drop_privileges(s);
-
-					/* creds and config are not allocated
-					 * under s.
-					 */
-					talloc_free(s);
-#ifdef HAVE_MALLOC_TRIM
-					/* try to return all the pages we've freed to
-					 * the operating system, to prevent the child from
-					 * accessing them. That's totally unreliable, so
-					 * sensitive data have to be overwritten anyway. */
-					malloc_trim(0);
-#endif
-					vpn_server(ws);
-					exit(0);
-				} else if (pid == -1) {
-fork_failed:
-					mslog(s, NULL, LOG_ERR, "fork failed");
-					close(cmd_fd[0]);
-				} else { /* parent */
-					/* add_proc */
-					ctmp = new_proc(s, pid, cmd_fd[0], 
-							&ws->remote_addr, ws->remote_addr_len,
-							&ws->our_addr, ws->our_addr_len,
-							ws->sid, sizeof(ws->sid));
-					if (ctmp == NULL) {
-						kill(pid, SIGTERM);
-						goto fork_failed;
-					}
-
-				}
-				close(cmd_fd[1]);
-				close(fd);
-
-				if (s->config->rate_limit_ms > 0)
-					ms_sleep(s->config->rate_limit_ms);
-			} else if (set && ltmp->sock_type == SOCK_TYPE_UDP) {
-				/* connection on UDP port */
-				forward_udp_to_owner(s, ltmp);
-
-				if (s->config->rate_limit_ms > 0)
-					ms_sleep(s->config->rate_limit_ms);
-			}
-		}
-
-		/* Check for any pending commands */
-		list_for_each_safe(&s->proc_list.head, ctmp, cpos, list) {
-			if (ctmp->fd >= 0 && FD_ISSET(ctmp->fd, &rd_set)) {
-				ret = handle_commands(s, ctmp);
-				if (ret < 0) {
-					remove_proc(s, ctmp, (ret!=ERR_WORKER_TERMINATED)?RPROC_KILL:0);
-				}
-			}
-		}
-
-		if (FD_ISSET(s->sec_mod_fd, &rd_set)) {
-			ret = handle_sec_mod_commands(s);
-			if (ret < 0) { /* bad commands from sec-mod are unacceptable */
-				mslog(s, NULL, LOG_ERR,
-				       "error in command from sec-mod");
-				terminate = 1;
-				continue;
-			}
-		}
-
-		/* Check for pending control commands */
-		ctl_handler_run_pending(s, &rd_set, &wr_set);
-
 #ifdef DEBUG_LEAKS
 		talloc_report_full(s, stderr);
 #endif
@@ -31,6 +31,8 @@
 #include <common.h>
 #include <sys/un.h>
 #include <sys/uio.h>
+#include <main-ev.h>
+#include <stats-table.h>
 
 #if defined(__FreeBSD__) || defined(__OpenBSD__)
 # include <limits.h>
@@ -52,6 +54,7 @@ extern unsigned int need_maintenance;
 struct listener_st {
 	struct list_node list;
 	int fd;
+	main_ev_st ev;
 	sock_type_t sock_type;
 
 	struct sockaddr_storage addr; /* local socket address */
@@ -86,10 +89,12 @@ enum {
 typedef struct proc_st {
 	struct list_node list;
 	int fd; /* the command file descriptor */
+	main_ev_st ev; /* the registration of fd in the main loop */
 	pid_t pid;
 	time_t udp_fd_receive_time; /* when the corresponding process has received a UDP fd */
 	
 	time_t conn_time; /* the time the user connected */
+	struct timespec conn_ts; /* the same, for the session setup time */
 
 	/* the tun lease this process has */
 	struct tun_lease_st tun_lease;
@@ -117,6 +122,10 @@ typedef struct proc_st {
 	char groupname[MAX_GROUPNAME_SIZE]; /* the owner's group */
 	char hostname[MAX_HOSTNAME_SIZE]; /* the requested hostname */
 
+	/* the entry of username in proc_table, and the node in its list */
+	struct proc_user_st *user;
+	struct list_node user_list;
+
 	/* the following are copied here from the worker process for reporting
 	 * purposes (from main-ctl-handler). */
 	char user_agent[MAX_AGENT_NAME];
@@ -135,8 +144,15 @@ typedef struct proc_st {
 	unsigned status; /* PS_AUTH_ */
 	unsigned resume_reqs; /* the number of requests received */
 
+	/* the order of creation; the cursor of the paged user listing */
+	uint64_t seq;
+
+	/* the slot of the session in the stats table, or -1; the worker
+	 * updates it in place */
+	int stats_slot;
+
 	/* these are filled in after the worker process dies, using the
-	 * Cli stats message. */
+	 * Cli stats message, or the stats table slot. */
 	uint64_t bytes_in;
 	uint64_t bytes_out;
 	
@@ -146,21 +162,119 @@ typedef struct proc_st {
 
 struct ip_lease_db_st {
 	struct htable ht;
+	struct list_head pools; /* struct ip_pool_st */
 };
 
 struct proc_list_st {
-	struct list_head head;
+	struct list_head head; /* in the order of creation */
 	unsigned int total;
+	uint64_t last_seq;
 };
 
 struct script_list_st {
 	struct list_head head;
 };
 
+/* An idle pre-forked worker; see main-prefork.c */
+struct prefork_st {
+	struct list_node list;
+	pid_t pid;
+	int fd; /* the command socket */
+};
+
+struct prefork_list_st {
+	struct list_head head;
+	unsigned int total;
+	unsigned filling; /* non-zero while refilling up to max */
+};
+
+/* A connection waiting for admission; see main-admission.c */
+struct pending_conn_st {
+	struct list_node list;
+	int fd;
+	sock_type_t stype;
+	unsigned priority; /* non-zero for clients with an existing session */
+
+	struct sockaddr_storage remote_addr;
+	socklen_t remote_addr_len;
+	struct sockaddr_storage our_addr;
+	socklen_t our_addr_len;
+};
+
+/* the maximum number of connections waiting for admission */
+#define MAX_PENDING_CONNS 64
+
+struct admission_st {
+	/* the token bucket; in milliseconds of accumulated credit */
+	unsigned credit_ms;
+	struct timespec last;
+
+	struct list_head prio; /* connections of existing clients */
+	struct list_head fresh;
+	unsigned total;
+};
+
+enum metrics_reject_reason {
+	METRICS_REJECT_TCP_WRAPPERS,
+	METRICS_REJECT_BANNED,
+	METRICS_REJECT_ADMISSION,
+	METRICS_REJECT_MAX_CLIENTS,
+	METRICS_REJECT_MAX
+};
+
+/* the upper bounds of the session setup histogram, in milliseconds */
+#define METRICS_SETUP_BUCKETS {100, 250, 500, 1000, 2500, 5000, 10000}
+#define METRICS_SETUP_BUCKETS_SIZE 7
+
+/* The counters of the metrics exporter; see main-metrics.c. They are
+ * updated as the events occur, so that a scrape needs not walk the
+ * proc list. */
+struct metrics_st {
+	uint64_t accepted;
+	uint64_t rejected[METRICS_REJECT_MAX];
+	uint64_t sessions_opened;
+	uint64_t sessions_closed;
+	uint64_t resume_hits;
+	uint64_t resume_misses;
+	/* of the closed sessions */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+
+	/* the time from the TCP connection to the session open; the
+	 * last bucket is +Inf */
+	uint64_t setup_buckets[METRICS_SETUP_BUCKETS_SIZE+1];
+	uint64_t setup_ms_sum;
+
+	int fd;
+	main_ev_st ev;
+	struct list_head conns; /* struct metrics_conn_st */
+	unsigned conns_size;
+};
+
+/* The ICMP probes of addresses prior to leasing; see icmp-ping.c */
+struct icmp_ping_st {
+	int fd4;
+	int fd6;
+	main_ev_st ev4;
+	main_ev_st ev6;
+
+	uint16_t id;
+	uint16_t seq;
+	struct list_head probes; /* in order of expiration */
+};
+
+/* The sessions of a single user */
+struct proc_user_st {
+	char username[MAX_USERNAME_SIZE];
+	struct list_head head; /* of proc_st */
+	unsigned procs;
+};
+
 struct proc_hash_db_st {
 	struct htable *db_ip;
 	struct htable *db_dtls_id;
 	struct htable *db_sid;
+	struct htable *db_username; /* of proc_user_st */
 	unsigned total;
 };
 
@@ -171,7 +285,7 @@ typedef struct main_server_st {
 	struct ip_lease_db_st ip_leases;
 
 	tls_sess_db_st tls_db;
-	struct htable *ban_db;
+	struct ban_db_st *ban_db;
 
 	tls_st *creds;
 	
@@ -180,8 +294,14 @@ typedef struct main_server_st {
 	struct listen_list_st listen_list;
 	struct proc_list_st proc_list;
 	struct script_list_st script_list;
+	struct prefork_list_st prefork_list;
+	struct admission_st admission;
+	struct icmp_ping_st ping;
+	struct metrics_st metrics;
 	/* maps DTLS session IDs to proc entries */
 	struct proc_hash_db_st proc_table;
+	/* the live counters of the sessions */
+	struct stats_table_st stats_table;
 	
 	char socket_file[_POSIX_PATH_MAX];
 	char full_socket_file[_POSIX_PATH_MAX];
@@ -194,6 +314,9 @@ typedef struct main_server_st {
 	/* updated on the cli_stats_msg from sec-mod. 
 	 * Holds the number of entries in secmod list of users */
 	unsigned secmod_client_entries;
+	/* updated on the secmod_stats_msg; the operations waiting
+	 * for a signer in sec-mod */
+	unsigned secmod_pending_ops;
 	time_t start_time;
 
 	void * auth_extra;
@@ -202,17 +325,51 @@ typedef struct main_server_st {
 	void * ctl_ctx;
 #else
 	int ctl_fd;
+	main_ev_st ctl_ev;
 #endif
+	/* the open occtl connections (struct ctl_conn_st) */
+	struct list_head ctl_conns;
+	unsigned ctl_conns_size;
+	struct main_ev_loop_st ev_loop;
 	int sec_mod_fd; /* messages are sent and received async */
+	main_ev_st sec_mod_ev;
 	int sec_mod_fd_sync; /* messages are send in a sync order (ping-pong). Only main sends. */
 	void *main_pool; /* talloc main pool */
 } main_server_st;
 
 void clear_lists(main_server_st *s);
 
+void run_worker(main_server_st *s, int cmd_fd, int conn_fd, sock_type_t stype) __attribute__((noreturn));
+
+/* main-prefork.c */
+void prefork_init(main_server_st *s);
+void prefork_deinit(main_server_st *s);
+unsigned prefork_fill(main_server_st *s);
+pid_t prefork_take(main_server_st *s, int conn_fd, sock_type_t stype,
+		   const struct sockaddr_storage *remote_addr, socklen_t remote_addr_len,
+		   const struct sockaddr_storage *our_addr, socklen_t our_addr_len,
+		   int stats_slot, int *cmd_fd);
+void prefork_reaped(main_server_st *s, pid_t pid);
+void prefork_kill_all(main_server_st *s);
+
+/* main-admission.c */
+void admission_init(main_server_st *s);
+void admission_deinit(main_server_st *s);
+int admission_check(main_server_st *s, const struct pending_conn_st *conn);
+struct pending_conn_st *admission_next(main_server_st *s);
+unsigned admission_timeout(main_server_st *s, unsigned timeout_ms);
+
+/* main-metrics.c */
+void metrics_init(main_server_st *s);
+int metrics_listen(main_server_st *s);
+void metrics_deinit(main_server_st *s);
+void metrics_session_opened(main_server_st *s, struct proc_st *proc);
+
 int handle_commands(main_server_st *s, struct proc_st* cur);
 int handle_sec_mod_commands(main_server_st *s);
 
+void ip_leases_ready(main_server_st *s, struct proc_st *proc, int result);
+
 int user_connected(main_server_st *s, struct proc_st* cur);
 void user_disconnected(main_server_st *s, struct proc_st* cur);
 
@@ -42,6 +42,9 @@
 
 static
 int common_info_cmd(UserListRep *args, FILE *out, cmd_params_st *params);
+static
+int print_users_info(UserListRep *args, FILE *out, cmd_params_st *params,
+		     unsigned *printed);
 
 struct unix_ctx {
 	int fd;
@@ -528,7 +531,8 @@ int handle_list_users_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *
 	int ret;
 	struct cmd_reply_st raw;
 	UserListRep *rep = NULL;
-	unsigned i;
+	UserListReq req = USER_LIST_REQ__INIT;
+	unsigned i, printed = 0;
 	const char *vpn_ip, *groupname, *username;
 	const char *dtls_ciphersuite;
 	char tmpbuf[MAX_TMPSTR_SIZE];
@@ -544,58 +548,90 @@ int handle_list_users_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *
 
 	out = pager_start(params);
 
-	ret = send_cmd(ctx, CTL_CMD_LIST, NULL, NULL, NULL, &raw);
-	if (ret < 0) {
-		goto error;
-	}
-
-	rep = user_list_rep__unpack(&pa, raw.data_size, raw.data);
-	if (rep == NULL)
-		goto error;
+	if (HAVE_JSON(params))
+		fprintf(out, "[\n");
 
-	if (HAVE_JSON(params)) {
-		common_info_cmd(rep, out, params);
-	} else for (i=0;i<rep->n_user;i++) {
-		username = rep->user[i]->username;
-		if (username == NULL || username[0] == 0)
-			username = NO_USER;
+	/* the users are received in pages, each requested over a new
+	 * connection with the cursor of the previous one; each page is
+	 * printed before the next is requested */
+	for (;;) {
+		ret = send_cmd(ctx, CTL_CMD_LIST, &req,
+			       (pack_size_func) user_list_req__get_packed_size,
+			       (pack_func) user_list_req__pack, &raw);
+		if (ret < 0) {
+			goto error;
+		}
 
-		if (rep->user[i]->local_ip != NULL && rep->user[i]->local_ip[0] != 0)
-			vpn_ip = rep->user[i]->local_ip;
-		else
-			vpn_ip = rep->user[i]->local_ip6;
+		rep = user_list_rep__unpack(&pa, raw.data_size, raw.data);
+		if (rep == NULL)
+			goto error;
+
+		if (HAVE_JSON(params)) {
+			if (print_users_info(rep, out, params, &printed) < 0)
+				goto error;
+		} else for (i=0;i<rep->n_user;i++) {
+			username = rep->user[i]->username;
+			if (username == NULL || username[0] == 0)
+				username = NO_USER;
+
+			if (rep->user[i]->local_ip != NULL && rep->user[i]->local_ip[0] != 0)
+				vpn_ip = rep->user[i]->local_ip;
+			else
+				vpn_ip = rep->user[i]->local_ip6;
+
+			/* add header */
+			if (printed++ == 0) {
+				fprintf(out, "%8s %8s %8s %14s %14s %6s %7s %14s %9s\n",
+					"id", "user", "group", "ip", "vpn-ip", "device",
+					"since", "dtls-cipher", "status");
+			}
 
-		/* add header */
-		if (i == 0) {
-			fprintf(out, "%8s %8s %8s %14s %14s %6s %7s %14s %9s\n",
-				"id", "user", "group", "ip", "vpn-ip", "device",
-				"since", "dtls-cipher", "status");
-		}
+			t = rep->user[i]->conn_time;
+			tm = localtime(&t);
+			strftime(str_since, sizeof(str_since), DATE_TIME_FMT, tm);
 
-		t = rep->user[i]->conn_time;
-		tm = localtime(&t);
-		strftime(str_since, sizeof(str_since), DATE_TIME_FMT, tm);
+			groupname = rep->user[i]->groupname;
+			if (groupname == NULL || groupname[0] == 0)
+				groupname = NO_GROUP;
 
-		groupname = rep->user[i]->groupname;
-		if (groupname == NULL || groupname[0] == 0)
-			groupname = NO_GROUP;
+			print_time_ival7(tmpbuf, time(0), t);
 
-		print_time_ival7(tmpbuf, time(0), t);
+			fprintf(out, "%8d %8s %8s %14s %14s %6s ",
+				(int)rep->user[i]->id, username, groupname, rep->user[i]->ip, vpn_ip, rep->user[i]->tun);
 
-		fprintf(out, "%8d %8s %8s %14s %14s %6s ",
-			(int)rep->user[i]->id, username, groupname, rep->user[i]->ip, vpn_ip, rep->user[i]->tun);
+			dtls_ciphersuite = rep->user[i]->dtls_ciphersuite;
+			if (dtls_ciphersuite != NULL && dtls_ciphersuite[0] != 0) {
+				if (strlen(dtls_ciphersuite) > 16 && strncmp(dtls_ciphersuite, "(DTLS", 5) == 0 &&
+				    strncmp(&dtls_ciphersuite[8], ")-(RSA)-", 8) == 0)
+					dtls_ciphersuite += 16;
+				fprintf(out, "%s %14s %9s\n", tmpbuf, dtls_ciphersuite, rep->user[i]->status);
+			} else {
+				fprintf(out, "%s %14s %9s\n", tmpbuf, "(no dtls)", rep->user[i]->status);
+			}
 
-		dtls_ciphersuite = rep->user[i]->dtls_ciphersuite;
-		if (dtls_ciphersuite != NULL && dtls_ciphersuite[0] != 0) {
-			if (strlen(dtls_ciphersuite) > 16 && strncmp(dtls_ciphersuite, "(DTLS", 5) == 0 &&
-			    strncmp(&dtls_ciphersuite[8], ")-(RSA)-", 8) == 0)
-				dtls_ciphersuite += 16;
-			fprintf(out, "%s %14s %9s\n", tmpbuf, dtls_ciphersuite, rep->user[i]->status);
-		} else {
-			fprintf(out, "%s %14s %9s\n", tmpbuf, "(no dtls)", rep->user[i]->status);
+			entries_add(ctx, username, strlen(username), rep->user[i]->id);
 		}
 
-		entries_add(ctx, username, strlen(username), rep->user[i]->id);
+		if (rep->has_next_cursor == 0)
+			break;
+
+		req.cursor = rep->next_cursor;
+		req.has_cursor = 1;
+
+		user_list_rep__free_unpacked(rep, &pa);
+		rep = NULL;
+		free_reply(&raw);
+		init_reply(&raw);
+
+		conn_posthandle(ctx);
+		if (conn_prehandle(ctx) < 0)
+			goto error;
+	}
+
+	if (HAVE_JSON(params)) {
+		if (printed > 0)
+			print_end_block(out, params, 0);
+		fprintf(out, "]\n");
 	}
 
 	ret = 0;
@@ -735,8 +771,15 @@ static char *int2str(char tmpbuf[MAX_TMPSTR_SIZE], int i)
 	return tmpbuf;
 }
 
+/* Prints the information of the users in args. The number of users
+ * printed so far is kept in printed, so that a list received in multiple
+ * pages is output as a single one. The block of the last user printed
+ * is left open, and is to be closed by the caller once it is known that
+ * no more users follow.
+ */
 static
-int common_info_cmd(UserListRep * args, FILE *out, cmd_params_st *params)
+int print_users_info(UserListRep * args, FILE *out, cmd_params_st *params,
+		     unsigned *printed)
 {
 	char *username = "";
 	char *groupname = "";
@@ -744,22 +787,14 @@ int common_info_cmd(UserListRep * args, FILE *out, cmd_params_st *params)
 	char tmpbuf[MAX_TMPSTR_SIZE];
 	struct tm *tm;
 	time_t t;
-	unsigned at_least_one = 0;
-	int ret = 1, r;
+	int r;
 	unsigned i;
-	unsigned init_pager = 0;
-
-	if (out == NULL) {
-		out = pager_start(params);
-		init_pager = 1;
-	}
-
-	if (HAVE_JSON(params))
-		fprintf(out, "[\n");
 
 	for (i=0;i<args->n_user;i++) {
-		if (at_least_one > 0)
+		if (*printed > 0) {
+			print_end_block(out, params, 1);
 			fprintf(out, "\n");
+		}
 
 		print_start_block(out, params);
 
@@ -816,6 +851,15 @@ int common_info_cmd(UserListRep * args, FILE *out, cmd_params_st *params)
 			}
 		}
 
+		if (args->user[i]->has_bytes_in && args->user[i]->has_bytes_out) {
+			char buf1[32];
+			char buf2[32];
+
+			bytes2human(args->user[i]->bytes_in, buf1, sizeof(buf1), NULL);
+			bytes2human(args->user[i]->bytes_out, buf2, sizeof(buf2), NULL);
+			print_pair_value(out, params, "Session RX", buf1, "TX", buf2, 1);
+		}
+
 		print_iface_stats(args->user[i]->tun, args->user[i]->conn_time, out, params, 1);
 
 		print_single_value(out, params, "Hostname", args->user[i]->hostname, 1);
@@ -850,22 +894,44 @@ int common_info_cmd(UserListRep * args, FILE *out, cmd_params_st *params)
 		if (print_list_entries(out, params, "iRoutes", args->user[i]->iroutes, args->user[i]->n_iroutes, 0) < 0)
 			goto error_parse;
 
-		print_end_block(out, params, i<(args->n_user-1)?1:0);
+		(*printed)++;
+	}
 
-		at_least_one = 1;
+	return 0;
+
+ error_parse:
+	fprintf(stderr, "%s: message parsing error\n", __func__);
+	return -1;
+}
+
+static
+int common_info_cmd(UserListRep * args, FILE *out, cmd_params_st *params)
+{
+	unsigned printed = 0;
+	int ret = 1;
+	unsigned init_pager = 0;
+
+	if (out == NULL) {
+		out = pager_start(params);
+		init_pager = 1;
 	}
 
+	if (HAVE_JSON(params))
+		fprintf(out, "[\n");
+
+	if (print_users_info(args, out, params, &printed) < 0)
+		goto cleanup;
+
+	if (printed > 0)
+		print_end_block(out, params, 0);
+
 	if (HAVE_JSON(params))
 		fprintf(out, "]\n");
 
 	ret = 0;
-	goto cleanup;
 
- error_parse:
-	fprintf(stderr, "%s: message parsing error\n", __func__);
-	goto cleanup;
  cleanup:
-	if (at_least_one == 0) {
+	if (printed == 0) {
 		if (NO_JSON(params))
 			fprintf(out, "user or ID not found\n");
 		ret = 2;
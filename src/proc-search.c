@@ -39,6 +39,13 @@ struct find_sid_st {
 };
 
 
+static size_t rehash_username(const void* _p, void* unused)
+{
+const struct proc_user_st * u = _p;
+
+	return hash_any(u->username, strlen(u->username), 0);
+}
+
 static size_t rehash_ip(const void* _p, void* unused)
 {
 const struct proc_st * proc = _p;
@@ -67,9 +74,11 @@ void proc_table_init(main_server_st *s)
 	s->proc_table.db_ip = talloc(s, struct htable);
 	s->proc_table.db_dtls_id = talloc(s, struct htable);
 	s->proc_table.db_sid = talloc(s, struct htable);
+	s->proc_table.db_username = talloc(s, struct htable);
 	htable_init(s->proc_table.db_ip, rehash_ip, NULL);
 	htable_init(s->proc_table.db_dtls_id, rehash_dtls_id, NULL);
 	htable_init(s->proc_table.db_sid, rehash_sid, NULL);
+	htable_init(s->proc_table.db_username, rehash_username, NULL);
 	s->proc_table.total = 0;
 }
 
@@ -78,9 +87,74 @@ void proc_table_deinit(main_server_st *s)
 	htable_clear(s->proc_table.db_ip);
 	htable_clear(s->proc_table.db_dtls_id);
 	htable_clear(s->proc_table.db_sid);
+	htable_clear(s->proc_table.db_username);
 	talloc_free(s->proc_table.db_dtls_id);
 	talloc_free(s->proc_table.db_ip);
 	talloc_free(s->proc_table.db_sid);
+	talloc_free(s->proc_table.db_username);
+}
+
+static bool username_cmp(const void* _c1, void* _c2)
+{
+const struct proc_user_st* c1 = _c1;
+const char* c2 = _c2;
+
+	if (strcmp(c1->username, c2) == 0)
+		return 1;
+
+	return 0;
+}
+
+/* Returns the sessions of the given user, or NULL if there are none */
+struct proc_user_st *proc_search_user(struct main_server_st *s,
+				      const char *username)
+{
+	return htable_get(s->proc_table.db_username,
+			  hash_any(username, strlen(username), 0),
+			  username_cmp, (void*)username);
+}
+
+static int proc_user_add(main_server_st *s, struct proc_st *proc)
+{
+	struct proc_user_st *u;
+
+	u = proc_search_user(s, proc->username);
+	if (u == NULL) {
+		u = talloc_zero(s->proc_table.db_username, struct proc_user_st);
+		if (u == NULL)
+			return -1;
+
+		strlcpy(u->username, proc->username, sizeof(u->username));
+		list_head_init(&u->head);
+
+		if (htable_add(s->proc_table.db_username, rehash_username(u, NULL), u) == 0) {
+			talloc_free(u);
+			return -1;
+		}
+	}
+
+	list_add_tail(&u->head, &proc->user_list);
+	u->procs++;
+	proc->user = u;
+
+	return 0;
+}
+
+/* the entry of the user is released with its last session */
+static void proc_user_del(main_server_st *s, struct proc_st *proc)
+{
+	struct proc_user_st *u = proc->user;
+
+	if (u == NULL)
+		return;
+
+	list_del(&proc->user_list);
+	proc->user = NULL;
+
+	if (--u->procs == 0) {
+		htable_del(s->proc_table.db_username, rehash_username(u, NULL), u);
+		talloc_free(u);
+	}
 }
 
 int proc_table_add(main_server_st *s, struct proc_st *proc)
@@ -103,6 +177,13 @@ int proc_table_add(main_server_st *s, struct proc_st *proc)
 		return -1;
 	}
 
+	if (proc_user_add(s, proc) < 0) {
+		htable_del(s->proc_table.db_ip, ip_hash, proc);
+		htable_del(s->proc_table.db_dtls_id, dtls_id_hash, proc);
+		htable_del(s->proc_table.db_sid, rehash_sid(proc, NULL), proc);
+		return -1;
+	}
+
 	s->proc_table.total++;
 
 	return 0;
@@ -113,6 +194,7 @@ void proc_table_del(main_server_st *s, struct proc_st *proc)
 	htable_del(s->proc_table.db_ip, rehash_ip(proc, NULL), proc);
 	htable_del(s->proc_table.db_dtls_id, rehash_dtls_id(proc, NULL), proc);
 	htable_del(s->proc_table.db_sid, rehash_sid(proc, NULL), proc);
+	proc_user_del(s, proc);
 }
 
 static bool local_ip_cmp(const void* _c1, void* _c2)
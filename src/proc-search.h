@@ -33,6 +33,8 @@ struct proc_st *proc_search_ip(struct main_server_st *s,
 struct proc_st *proc_search_dtls_id(struct main_server_st *s, const uint8_t *id, unsigned id_size);
 struct proc_st *proc_search_sid(struct main_server_st *s,
 			        const uint8_t id[SID_SIZE]);
+struct proc_user_st *proc_search_user(struct main_server_st *s,
+				      const char *username);
 
 void proc_table_init(main_server_st *s);
 void proc_table_deinit(main_server_st *s);
@@ -57,10 +57,18 @@
 # include <gssapi/gssapi_ext.h>
 #endif
 
+/* used by the completion of asynchronous operations */
+static sec_mod_st *auth_sec = NULL;
+
+static int stats_watch_timeout(void *priv);
+static void stats_watch_process(void *priv);
+
 void sec_auth_init(sec_mod_st * sec, struct perm_cfg_st *config)
 {
 	unsigned i;
 
+	auth_sec = sec;
+
 	for (i=0;i<config->auth_methods;i++) {
 		if (config->auth[i].enabled && config->auth[i].amod && config->auth[i].amod->global_init)
 			config->auth[i].amod->global_init(sec, config->auth[i].additional);
@@ -68,6 +76,13 @@ void sec_auth_init(sec_mod_st * sec, struct perm_cfg_st *config)
 
 	if (config->acct.amod && config->acct.amod->global_init)
 		config->acct.amod->global_init(sec, config->acct.additional);
+
+	list_head_init(&sec->stats_sessions);
+	sec->stats_watch.fd = -1;
+	sec->stats_watch.timeout = stats_watch_timeout;
+	sec->stats_watch.process = stats_watch_process;
+	sec->stats_watch.priv = sec;
+	sec_watch_add(&sec->stats_watch);
 }
 
 /* returns a negative number if we have reached the score for this client.
@@ -374,6 +389,100 @@ static void stats_add_to(stats_st *dst, stats_st *src1, stats_st *src2)
 	dst->uptime = src1->uptime + src2->uptime;
 }
 
+/* Passes the totals of the session to the accounting module */
+static void report_session_stats(sec_mod_st *sec, client_entry_st *e)
+{
+	stats_st totals;
+
+	if (sec->perm_config->acct.amod == NULL || sec->perm_config->acct.amod->session_stats == NULL)
+		return;
+
+	stats_add_to(&totals, &e->stats, &e->saved_stats);
+	sec->perm_config->acct.amod->session_stats(e->auth_type, e->auth_ctx, &e->auth_info, &totals);
+}
+
+/* The sessions with a stats slot are not sent periodic stats by their
+ * workers; their counters are read from the stats table, and reported
+ * at the interim update interval of each session.
+ */
+static void stats_session_del(sec_mod_st *sec, client_entry_st *e)
+{
+	if (e->stats_slot == -1)
+		return;
+
+	list_del(&e->stats_list);
+	e->stats_slot = -1;
+}
+
+static void stats_session_add(sec_mod_st *sec, client_entry_st *e, unsigned slot,
+			      unsigned interval)
+{
+	/* only the latest session of the entry is tracked */
+	stats_session_del(sec, e);
+
+	if (interval == 0)
+		interval = sec->config->stats_report_time;
+
+	if (slot >= sec->stats_table.size || interval == 0 ||
+	    sec->perm_config->acct.amod == NULL || sec->perm_config->acct.amod->session_stats == NULL)
+		return;
+
+	list_add_tail(&sec->stats_sessions, &e->stats_list);
+	e->stats_slot = slot;
+	e->stats_interval = interval;
+	e->stats_start = time(0);
+	e->stats_next = e->stats_start + interval;
+}
+
+/* Copies the counters of the session from its slot */
+static void stats_session_read(sec_mod_st *sec, client_entry_st *e, time_t now)
+{
+	uint64_t bytes_in, bytes_out;
+
+	if (stats_table_read(&sec->stats_table, e->stats_slot, &bytes_in, &bytes_out) < 0)
+		return;
+
+	/* stats only increase */
+	if (bytes_in > e->stats.bytes_in)
+		e->stats.bytes_in = bytes_in;
+	if (bytes_out > e->stats.bytes_out)
+		e->stats.bytes_out = bytes_out;
+	if (now - e->stats_start > e->stats.uptime)
+		e->stats.uptime = now - e->stats_start;
+}
+
+static int stats_watch_timeout(void *priv)
+{
+	sec_mod_st *sec = priv;
+	time_t now;
+
+	if (list_empty(&sec->stats_sessions))
+		return -1;
+
+	now = time(0);
+	if (now >= sec->stats_tick)
+		return 0;
+	return (sec->stats_tick - now) * 1000;
+}
+
+static void stats_watch_process(void *priv)
+{
+	sec_mod_st *sec = priv;
+	client_entry_st *e;
+	time_t now = time(0);
+
+	sec->stats_tick = now + 1;
+
+	list_for_each(&sec->stats_sessions, e, stats_list) {
+		if (e->stats_interval == 0 || now < e->stats_next)
+			continue;
+
+		e->stats_next = now + e->stats_interval;
+		stats_session_read(sec, e, now);
+		report_session_stats(sec, e);
+	}
+}
+
 static
 int send_failed_session_open_reply(sec_mod_st *sec, int fd)
 {
@@ -485,6 +594,9 @@ int handle_sec_auth_session_open(sec_mod_st *sec, int fd, const SecAuthSessionMs
 	e->time = -1;
 	e->in_use++;
 
+	if (req->has_stats_slot)
+		stats_session_add(sec, e, req->stats_slot, rep.interim_update_secs);
+
 	return 0;
 }
 
@@ -529,6 +641,10 @@ int handle_sec_auth_session_close(sec_mod_st *sec, int fd, const SecAuthSessionM
 			e->stats.bytes_out = req->bytes_out;
 	}
 
+	/* a later session of this entry may still be using its slot */
+	if (req->has_stats_slot && (int)req->stats_slot == e->stats_slot)
+		stats_session_del(sec, e);
+
 	/* send reply */
 	rep.bytes_in = e->stats.bytes_in;
 	rep.bytes_out = e->stats.bytes_out;
@@ -586,7 +702,6 @@ void handle_sec_auth_ban_ip_reply(sec_mod_st *sec, const BanIpReplyMsg *msg)
 int handle_sec_auth_stats_cmd(sec_mod_st * sec, const CliStatsMsg * req)
 {
 	client_entry_st *e;
-	stats_st totals;
 
 	if (req->sid.len != SID_SIZE) {
 		seclog(sec, LOG_ERR, "auth session stats but with illegal sid size (%d)!",
@@ -619,10 +734,6 @@ int handle_sec_auth_stats_cmd(sec_mod_st * sec, const CliStatsMsg * req)
 		e->discon_reason = req->discon_reason;
 	}
 
-	if (sec->perm_config->acct.amod == NULL || sec->perm_config->acct.amod->session_stats == NULL)
-		return 0;
-
-	stats_add_to(&totals, &e->stats, &e->saved_stats);
 	if (req->remote_ip)
 		strlcpy(e->auth_info.remote_ip, req->remote_ip, sizeof(e->auth_info.remote_ip));
 	if (req->ipv4)
@@ -630,12 +741,43 @@ int handle_sec_auth_stats_cmd(sec_mod_st * sec, const CliStatsMsg * req)
 	if (req->ipv6)
 		strlcpy(e->auth_info.ipv6, req->ipv6, sizeof(e->auth_info.ipv6));
 
-	sec->perm_config->acct.amod->session_stats(e->auth_type, e->auth_ctx, &e->auth_info, &totals);
+	report_session_stats(sec, e);
 
 	return 0;
 }
 
-int handle_sec_auth_cont(int cfd, sec_mod_st * sec, const SecAuthContMsg * req)
+/* Completes an auth cont request for which the module returned
+ * ERR_AUTH_PENDING.
+ */
+static void auth_pass_done(void *priv, int result)
+{
+	client_entry_st *e = priv;
+	struct sec_conn_st *conn = e->pending_conn;
+	sec_mod_st *sec = auth_sec;
+	int ret;
+
+	if (conn == NULL) {
+		seclog(sec, LOG_DEBUG, "worker of user '%s' "SESSION_STR" is gone; ignoring authentication result",
+		       e->auth_info.username, e->auth_info.psid);
+		e->status = PS_AUTH_FAILED;
+		return;
+	}
+
+	e->pending_conn = NULL;
+	conn->pending = NULL;
+
+	if (result < 0 && result != ERR_AUTH_CONTINUE) {
+		seclog(sec, LOG_DEBUG,
+		       "error in password given in auth cont for user '%s' "SESSION_STR,
+		       e->auth_info.username, e->auth_info.psid);
+	}
+
+	ret = handle_sec_auth_res(conn->fd, sec, e, result);
+	if (ret < 0)
+		sec_mod_close_conn(sec, conn);
+}
+
+int handle_sec_auth_cont(struct sec_conn_st *conn, sec_mod_st * sec, const SecAuthContMsg * req)
 {
 	client_entry_st *e;
 	int ret;
@@ -659,6 +801,12 @@ int handle_sec_auth_cont(int cfd, sec_mod_st * sec, const SecAuthContMsg * req)
 		goto cleanup;
 	}
 
+	if (e->pending_conn != NULL) {
+		seclog(sec, LOG_ERR, "auth cont received for %s "SESSION_STR" while the previous is pending!",
+		       e->auth_info.username, e->auth_info.psid);
+		return -1;
+	}
+
 	seclog(sec, LOG_DEBUG, "auth cont for user '%s' "SESSION_STR, e->auth_info.username, e->auth_info.psid);
 
 	if (req->password == NULL) {
@@ -676,9 +824,23 @@ int handle_sec_auth_cont(int cfd, sec_mod_st * sec, const SecAuthContMsg * req)
 
 	e->status = PS_AUTH_CONT;
 
-	ret =
-	    e->module->auth_pass(e->auth_ctx, req->password,
-			      strlen(req->password));
+	if (e->module->auth_pass_async != NULL) {
+		ret =
+		    e->module->auth_pass_async(e->auth_ctx, req->password,
+					       strlen(req->password),
+					       auth_pass_done, e);
+		if (ret == ERR_AUTH_PENDING) {
+			/* the reply is sent by auth_pass_done() */
+			e->pending_conn = conn;
+			conn->pending = e;
+			return 0;
+		}
+	} else {
+		ret =
+		    e->module->auth_pass(e->auth_ctx, req->password,
+				      strlen(req->password));
+	}
+
 	if (ret < 0) {
 		if (ret != ERR_AUTH_CONTINUE) {
 			seclog(sec, LOG_DEBUG,
@@ -689,7 +851,7 @@ int handle_sec_auth_cont(int cfd, sec_mod_st * sec, const SecAuthContMsg * req)
 	}
 
  cleanup:
-	return handle_sec_auth_res(cfd, sec, e, ret);
+	return handle_sec_auth_res(conn->fd, sec, e, ret);
 }
 
 static
@@ -812,6 +974,8 @@ int handle_sec_auth_init(int cfd, sec_mod_st *sec, const SecAuthInitMsg *req, pi
 void sec_auth_user_deinit(sec_mod_st *sec, client_entry_st *e)
 {
 	seclog(sec, LOG_DEBUG, "permamently closing session of user '%s' "SESSION_STR, e->auth_info.username, e->auth_info.psid);
+	stats_session_del(sec, e);
+
 	if (sec->perm_config->acct.amod != NULL && sec->perm_config->acct.amod->close_session != NULL && e->session_is_open != 0) {
 		sec->perm_config->acct.amod->close_session(e->auth_type, e->auth_ctx, &e->auth_info, &e->saved_stats, e->discon_reason);
 	}
@@ -32,6 +32,9 @@ typedef struct passwd_msg_st {
 	unsigned counter;
 } passwd_msg_st;
 
+/* Called by a module with the result of an asynchronous auth_pass */
+typedef void (*auth_done_func)(void *priv, int result);
+
 typedef struct auth_mod_st {
 	unsigned int type;
 	unsigned int allows_retries; /* whether the module allows retries of the same password */
@@ -40,6 +43,10 @@ typedef struct auth_mod_st {
 	int (*auth_init)(void** ctx, void *pool, const char* username, const char *remote_ip, const char *our_ip, unsigned id);
 	int (*auth_msg)(void* ctx, void *pool, passwd_msg_st *);
 	int (*auth_pass)(void* ctx, const char* pass, unsigned pass_len);
+	/* optional; like auth_pass but it may return ERR_AUTH_PENDING, and
+	 * call done with the result later, from the sec-mod loop */
+	int (*auth_pass_async)(void* ctx, const char* pass, unsigned pass_len,
+			       auth_done_func done, void *priv);
 	int (*auth_group)(void* ctx, const char *suggested, char *groupname, int groupname_size);
 	int (*auth_user)(void* ctx, char *groupname, int groupname_size);
 
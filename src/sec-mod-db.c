@@ -97,6 +97,7 @@ client_entry_st *new_client_entry(sec_mod_st *sec, const char *ip, unsigned pid)
 
 	strlcpy(e->auth_info.remote_ip, ip, sizeof(e->auth_info.remote_ip));
 	e->auth_info.id = pid;
+	e->stats_slot = -1;
 
 	do {
 		ret = gnutls_rnd(GNUTLS_RND_RANDOM, e->sid, sizeof(e->sid));
@@ -153,6 +154,9 @@ client_entry_st *find_client_entry(sec_mod_st *sec, uint8_t sid[SID_SIZE])
 
 static void clean_entry(sec_mod_st *sec, client_entry_st * e)
 {
+	if (e->pending_conn != NULL)
+		e->pending_conn->pending = NULL;
+
 	sec_auth_user_deinit(sec, e);
 	talloc_free(e->msg_str);
 	talloc_free(e);
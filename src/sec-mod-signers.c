@@ -0,0 +1,562 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <system.h>
+#include <common.h>
+#include <vpn.h>
+#include <sec-mod.h>
+#include <tlslib.h>
+#include <ipc.pb-c.h>
+#include <cloexec.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+
+/* The signer processes (sec-mod-signers). These perform the sign and
+ * decrypt operations requested by the workers, so that the handshakes
+ * served per second scale with the available cores. They are forked by
+ * a launcher process, which is forked from sec-mod after the private
+ * keys are loaded, but before the authentication modules start any
+ * threads or open any descriptors; sec-mod itself never forks a signer.
+ *
+ * The workers still connect to the sec-mod socket. Sec-mod reads the
+ * request and passes it, together with the worker's socket, to an idle
+ * signer, which replies to the worker directly and then writes a
+ * single byte to sec-mod to indicate that it is idle again. When all
+ * signers are busy, requests are queued. The authentication state stays
+ * in sec-mod, and the keys remain out of reach of the workers.
+ */
+
+#define MAX_PENDING_OPS 256
+/* seconds to wait for the launcher to start a signer */
+#define SIGNER_START_TIMEOUT 2
+/* minimum seconds between the reports of the queue length to main */
+#define PENDING_REPORT_TIME 1
+
+static void signer_close(sec_mod_st *sec, struct sec_signer_st *s)
+{
+	if (s->fd != -1)
+		close(s->fd);
+	s->fd = -1;
+	s->pid = -1;
+	s->busy = 0;
+}
+
+static void __attribute__ ((noreturn))
+signer_loop(sec_mod_st *sec, int fd)
+{
+	SecSignerOpMsg *msg;
+	gnutls_datum_t data;
+	void *pool;
+	int cfd, ret;
+	uint8_t c = 0;
+
+	for (;;) {
+		pool = talloc_new(sec);
+		if (pool == NULL)
+			exit(1);
+
+		cfd = -1;
+		msg = NULL;
+		ret = recv_socket_msg(pool, fd, SM_CMD_SIGNER_OP, &cfd, (void*)&msg,
+				      (unpack_func)sec_signer_op_msg__unpack, 0);
+		if (ret == ERR_PEER_TERMINATED)
+			exit(0);
+		if (ret < 0)
+			exit(1);
+
+		if (cfd == -1 || msg == NULL || msg->key_idx >= sec->key_size ||
+		    (msg->cmd != SM_CMD_SIGN && msg->cmd != SM_CMD_DECRYPT)) {
+			seclog(sec, LOG_ERR, "signer received invalid request");
+			exit(1);
+		}
+
+		data.data = msg->data.data;
+		data.size = msg->data.len;
+		sec_mod_key_op(pool, cfd, sec, msg->cmd, msg->key_idx, &data);
+		close(cfd);
+		talloc_free(pool);
+
+		if (force_write(fd, &c, 1) != 1)
+			exit(1);
+	}
+}
+
+/* Runs in a new signer process, forked by the launcher */
+static void __attribute__ ((noreturn))
+signer_start(sec_mod_st *sec, int fd)
+{
+#ifdef HAVE_PKCS11
+	int ret;
+#endif
+
+	/* sec-mod terminates us by closing the socket */
+	ocsignal(SIGCHLD, SIG_DFL);
+
+#ifdef HAVE_PKCS11
+	ret = gnutls_pkcs11_reinit();
+	if (ret < 0) {
+		seclog(sec, LOG_WARNING, "error in PKCS #11 reinitialization: %s",
+		       gnutls_strerror(ret));
+	}
+#endif
+	load_keys(sec, 1);
+
+	signer_loop(sec, fd);
+}
+
+/* The signer launcher. It is forked before the authentication modules
+ * are initialized, and thus it remains single-threaded and holds none
+ * of their descriptors. It forks a signer for each byte received, and
+ * passes the signer's socket and pid back to sec-mod.
+ */
+static void __attribute__ ((noreturn))
+launcher_loop(sec_mod_st *sec, int fd)
+{
+	SecSignerStartedMsg msg = SEC_SIGNER_STARTED_MSG__INIT;
+	int sfd[2];
+	pid_t pid;
+	uint8_t c;
+	int ret;
+
+	for (;;) {
+		do {
+			ret = read(fd, &c, 1);
+		} while (ret == -1 && errno == EINTR);
+
+		if (ret <= 0) /* sec-mod has terminated */
+			exit(0);
+
+		ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sfd);
+		if (ret < 0) {
+			seclog(sec, LOG_ERR, "error creating signer socket");
+			exit(1);
+		}
+
+		pid = fork();
+		if (pid == 0) {	/* child */
+			close(fd);
+			close(sfd[0]);
+			signer_start(sec, sfd[1]);
+		} else if (pid == -1) {
+			seclog(sec, LOG_ERR, "fork failed");
+			exit(1);
+		}
+		close(sfd[1]);
+
+		msg.pid = pid;
+		ret = send_socket_msg(sec, fd, SM_CMD_SIGNER_STARTED, sfd[0], &msg,
+				      (pack_size_func)sec_signer_started_msg__get_packed_size,
+				      (pack_func)sec_signer_started_msg__pack);
+		close(sfd[0]);
+		if (ret < 0)
+			exit(1);
+	}
+}
+
+/* Forks the signer launcher; returns 0 on success */
+static int launcher_spawn(sec_mod_st *sec)
+{
+	int lfd[2];
+	pid_t pid;
+	int ret;
+
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, lfd);
+	if (ret < 0) {
+		seclog(sec, LOG_ERR, "error creating signer launcher socket");
+		return -1;
+	}
+
+	pid = fork();
+	if (pid == 0) {	/* child */
+		close(lfd[0]);
+		close(sec->sd);
+		close(sec->cmd_fd);
+		close(sec->cmd_fd_sync);
+
+		ocsignal(SIGHUP, SIG_IGN);
+		ocsignal(SIGINT, SIG_IGN);
+		ocsignal(SIGALRM, SIG_IGN);
+		ocsignal(SIGTERM, SIG_DFL);
+		/* the signers are reaped automatically */
+		ocsignal(SIGCHLD, SIG_IGN);
+		alarm(0);
+		sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
+
+		launcher_loop(sec, lfd[1]);
+	} else if (pid == -1) {
+		seclog(sec, LOG_ERR, "fork failed");
+		close(lfd[0]);
+		close(lfd[1]);
+		return -1;
+	}
+
+	close(lfd[1]);
+	set_cloexec_flag(lfd[0], 1);
+
+	sec->launcher_pid = pid;
+	sec->launcher_fd = lfd[0];
+	return 0;
+}
+
+/* Obtains a new signer process from the launcher; returns 0 on success */
+static int signer_spawn(sec_mod_st *sec, struct sec_signer_st *s)
+{
+	SecSignerStartedMsg *msg = NULL;
+	void *pool;
+	uint8_t c = 0;
+	int sfd = -1;
+	int ret;
+
+	if (sec->launcher_fd == -1)
+		return -1;
+
+	pool = talloc_new(sec);
+	if (pool == NULL)
+		return -1;
+
+	if (force_write(sec->launcher_fd, &c, 1) != 1)
+		goto fail;
+
+	ret = recv_socket_msg(pool, sec->launcher_fd, SM_CMD_SIGNER_STARTED, &sfd,
+			      (void*)&msg, (unpack_func)sec_signer_started_msg__unpack,
+			      SIGNER_START_TIMEOUT);
+	if (ret < 0 || sfd == -1) {
+		if (sfd != -1)
+			close(sfd);
+		goto fail;
+	}
+
+	set_cloexec_flag(sfd, 1);
+	s->pid = msg->pid;
+	s->fd = sfd;
+	s->busy = 0;
+	talloc_free(pool);
+
+	seclog(sec, LOG_DEBUG, "started signer process %u", (unsigned)s->pid);
+	return 0;
+
+ fail:
+	/* the signers that remain keep serving; new ones cannot be started */
+	seclog(sec, LOG_ERR, "the signer launcher is not available");
+	close(sec->launcher_fd);
+	sec->launcher_fd = -1;
+	talloc_free(pool);
+	return -1;
+}
+
+/* The length of the queue is reported to main when it changes, at
+ * most once every PENDING_REPORT_TIME seconds. */
+static int pending_watch_timeout(void *priv)
+{
+	sec_mod_st *sec = priv;
+	time_t now;
+
+	if (sec->pending_ops_size == sec->pending_ops_reported)
+		return -1;
+
+	now = time(0);
+	if (now >= sec->pending_tick)
+		return 0;
+	return (sec->pending_tick - now) * 1000;
+}
+
+static void pending_watch_process(void *priv)
+{
+	sec_mod_st *sec = priv;
+	SecmodStatsMsg msg = SECMOD_STATS_MSG__INIT;
+	int ret, e;
+
+	sec->pending_tick = time(0) + PENDING_REPORT_TIME;
+	sec->pending_ops_reported = sec->pending_ops_size;
+
+	msg.pending_ops = sec->pending_ops_size;
+
+	ret = send_msg(sec, sec->cmd_fd, SM_CMD_SECMOD_STATS, &msg,
+		       (pack_size_func) secmod_stats_msg__get_packed_size,
+		       (pack_func) secmod_stats_msg__pack);
+	if (ret < 0) {
+		e = errno;
+		seclog(sec, LOG_WARNING, "error in sending sec-mod stats: %s", strerror(e));
+	}
+}
+
+int sec_signers_init(sec_mod_st *sec, int sd)
+{
+	unsigned i;
+
+	sec->sd = sd;
+	list_head_init(&sec->pending_ops);
+	sec->pending_ops_size = 0;
+	sec->launcher_fd = -1;
+	sec->launcher_pid = -1;
+
+	if (sec->config->sec_mod_signers == 0)
+		return 0;
+
+	if (launcher_spawn(sec) < 0)
+		return -1;
+
+	sec->pending_ops_reported = 0;
+	sec->pending_tick = 0;
+	sec->pending_watch.fd = -1;
+	sec->pending_watch.timeout = pending_watch_timeout;
+	sec->pending_watch.process = pending_watch_process;
+	sec->pending_watch.priv = sec;
+	sec_watch_add(&sec->pending_watch);
+
+	sec->signers = talloc_array(sec, struct sec_signer_st, sec->config->sec_mod_signers);
+	if (sec->signers == NULL)
+		return -1;
+
+	for (i = 0; i < sec->config->sec_mod_signers; i++) {
+		sec->signers[i].pid = -1;
+		sec->signers[i].fd = -1;
+		sec->signers[i].busy = 0;
+	}
+	sec->signers_size = sec->config->sec_mod_signers;
+
+	for (i = 0; i < sec->signers_size; i++) {
+		if (signer_spawn(sec, &sec->signers[i]) < 0)
+			return -1;
+	}
+
+	seclog(sec, LOG_INFO, "started %u signer processes", sec->signers_size);
+	return 0;
+}
+
+void sec_signers_deinit(sec_mod_st *sec)
+{
+	struct sec_pending_op_st *op, *pos;
+	unsigned i;
+
+	for (i = 0; i < sec->signers_size; i++) {
+		if (sec->signers[i].pid != -1)
+			kill(sec->signers[i].pid, SIGTERM);
+		signer_close(sec, &sec->signers[i]);
+	}
+
+	list_for_each_safe(&sec->pending_ops, op, pos, list) {
+		list_del(&op->list);
+		close(op->cfd);
+		talloc_free(op);
+	}
+	sec->pending_ops_size = 0;
+
+	/* the launcher exits once its socket is closed */
+	if (sec->launcher_fd != -1)
+		close(sec->launcher_fd);
+	sec->launcher_fd = -1;
+}
+
+/* Fills in an entry of pfd for each signer */
+void sec_signers_set_fds(sec_mod_st *sec, struct pollfd *pfd)
+{
+	unsigned i;
+
+	for (i = 0; i < sec->signers_size; i++) {
+		pfd[i].fd = sec->signers[i].fd;
+		pfd[i].events = POLLIN;
+		pfd[i].revents = 0;
+	}
+}
+
+/* The signers are children of the launcher, which reaps them; thus
+ * there is no wait here, and a signer that is stuck cannot delay
+ * sec-mod. */
+static void signer_restart(sec_mod_st *sec, struct sec_signer_st *s)
+{
+	kill(s->pid, SIGKILL);
+	signer_close(sec, s);
+
+	signer_spawn(sec, s);
+}
+
+/* Passes the operation to the signer; returns 0 on success */
+static int signer_send(sec_mod_st *sec, struct sec_signer_st *s, int cfd,
+		       unsigned cmd, unsigned key_idx,
+		       const uint8_t *data, size_t data_size)
+{
+	SecSignerOpMsg msg = SEC_SIGNER_OP_MSG__INIT;
+	int ret;
+
+	msg.cmd = cmd;
+	msg.key_idx = key_idx;
+	msg.data.data = (void*)data;
+	msg.data.len = data_size;
+
+	ret = send_socket_msg(sec, s->fd, SM_CMD_SIGNER_OP, cfd, &msg,
+			      (pack_size_func)sec_signer_op_msg__get_packed_size,
+			      (pack_func)sec_signer_op_msg__pack);
+	if (ret < 0) {
+		seclog(sec, LOG_ERR, "could not pass request to signer %u",
+		       (unsigned)s->pid);
+		return -1;
+	}
+
+	s->busy = 1;
+	return 0;
+}
+
+static struct sec_signer_st *find_idle(sec_mod_st *sec, unsigned *running)
+{
+	unsigned i;
+
+	*running = 0;
+	for (i = 0; i < sec->signers_size; i++) {
+		if (sec->signers[i].fd == -1)
+			continue;
+		(*running)++;
+		if (sec->signers[i].busy == 0)
+			return &sec->signers[i];
+	}
+	return NULL;
+}
+
+/* the signers tried for an operation, before it is performed by sec-mod */
+#define MAX_SIGNER_TRIES 2
+
+/* Hands the operation over to an idle signer, or queues it if all are busy.
+ * The caller retains ownership of cfd. If no signer is running, or the
+ * signers could not be reached, the operation is performed by sec-mod
+ * itself.
+ */
+int sec_signer_dispatch(sec_mod_st *sec, int cfd, unsigned cmd, unsigned key_idx,
+			const uint8_t *data, size_t data_size)
+{
+	struct sec_pending_op_st *op;
+	struct sec_signer_st *s;
+	gnutls_datum_t d;
+	unsigned running, tries;
+
+	for (tries = 0;; tries++) {
+		s = find_idle(sec, &running);
+		if (s == NULL || tries == MAX_SIGNER_TRIES)
+			break;
+
+		if (signer_send(sec, s, cfd, cmd, key_idx, data, data_size) == 0)
+			return 0;
+
+		/* the operation is passed to the replacement of the
+		 * signer, which is idle, or to another idle one */
+		signer_restart(sec, s);
+	}
+
+	if (running == 0 || s != NULL) {
+		d.data = (void*)data;
+		d.size = data_size;
+		return sec_mod_key_op(sec, cfd, sec, cmd, key_idx, &d);
+	}
+
+	if (sec->pending_ops_size >= MAX_PENDING_OPS) {
+		seclog(sec, LOG_INFO, "too many operations waiting for a signer; rejecting");
+		return -1;
+	}
+
+	op = talloc(sec, struct sec_pending_op_st);
+	if (op == NULL)
+		return -1;
+
+	op->data = talloc_memdup(op, data, data_size);
+	if (op->data == NULL && data_size > 0) {
+		talloc_free(op);
+		return -1;
+	}
+	op->data_size = data_size;
+	op->cmd = cmd;
+	op->key_idx = key_idx;
+
+	op->cfd = dup(cfd);
+	if (op->cfd == -1) {
+		talloc_free(op);
+		return -1;
+	}
+	set_cloexec_flag(op->cfd, 1);
+
+	list_add_tail(&sec->pending_ops, &op->list);
+	sec->pending_ops_size++;
+
+	return 0;
+}
+
+static void run_pending(sec_mod_st *sec)
+{
+	struct sec_pending_op_st *op;
+	struct sec_signer_st *s;
+	unsigned running;
+
+	while ((op = list_top(&sec->pending_ops, struct sec_pending_op_st, list)) != NULL) {
+		s = find_idle(sec, &running);
+		if (s == NULL && running > 0)
+			return;
+
+		list_del(&op->list);
+		sec->pending_ops_size--;
+
+		sec_signer_dispatch(sec, op->cfd, op->cmd, op->key_idx,
+				    op->data, op->data_size);
+		close(op->cfd);
+		talloc_free(op);
+	}
+}
+
+/* Handles the completion notices of the signers, restarts the signers
+ * which terminated, and passes queued operations to the idle ones.
+ */
+void sec_signers_handle(sec_mod_st *sec, const struct pollfd *pfd)
+{
+	struct sec_signer_st *s;
+	unsigned i;
+	uint8_t c;
+	int ret;
+
+	for (i = 0; i < sec->signers_size; i++) {
+		s = &sec->signers[i];
+		if (s->fd == -1 || pfd[i].revents == 0)
+			continue;
+
+		do {
+			ret = read(s->fd, &c, 1);
+		} while (ret == -1 && errno == EINTR);
+
+		if (ret == 1) {
+			s->busy = 0;
+			continue;
+		}
+
+		seclog(sec, LOG_ERR, "signer %u has terminated; restarting",
+		       (unsigned)s->pid);
+		signer_restart(sec, s);
+	}
+
+	run_pending(sec);
+}
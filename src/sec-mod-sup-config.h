@@ -32,6 +32,8 @@
 struct config_mod_st {
 	int (*get_sup_config)(struct cfg_st *perm_config, client_entry_st *entry,
 	                      SecAuthSessionReplyMsg *msg, void *pool);
+	/* optional; called on reload */
+	void (*clear_cache)(void);
 };
 
 void sup_config_init(sec_mod_st *sec);
@@ -24,7 +24,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -50,6 +50,9 @@
 #define MAX_PIN_SIZE GNUTLS_PKCS11_MAX_PIN_LEN
 #define MAINTAINANCE_TIME 310
 
+/* cmd_fd_sync, cmd_fd and the listening socket */
+#define SEC_MOD_FIXED_FDS 3
+
 static int need_maintainance = 0;
 static int need_reload = 0;
 static int need_exit = 0;
@@ -59,6 +62,10 @@ struct pin_st {
 	char srk_pin[MAX_PIN_SIZE];
 };
 
+/* the PINs are kept for the signer processes which re-import
+ * the keys that are not files */
+static struct pin_st pins;
+
 static
 int pin_callback(void *user, int attempt, const char *token_url,
 		 const char *token_label, unsigned int flags, char *pin,
@@ -195,12 +202,49 @@ static int handle_op(void *pool, int cfd, sec_mod_st * sec, uint8_t type, uint8_
 	return 0;
 }
 
+/* Performs a sign or decrypt operation with the key at key_idx and
+ * sends the result to cfd */
+int sec_mod_key_op(void *pool, int cfd, sec_mod_st * sec, unsigned cmd,
+		   unsigned key_idx, const gnutls_datum_t *data)
+{
+	gnutls_datum_t out;
+	int ret;
+
+	if (cmd == SM_CMD_DECRYPT) {
+		ret =
+		    gnutls_privkey_decrypt_data(sec->key[key_idx], 0, data,
+						&out);
+	} else {
+#if GNUTLS_VERSION_NUMBER >= 0x030200
+		ret =
+		    gnutls_privkey_sign_hash(sec->key[key_idx], 0,
+					     GNUTLS_PRIVKEY_SIGN_FLAG_TLS1_RSA,
+					     data, &out);
+#else
+		ret =
+		    gnutls_privkey_sign_raw_data(sec->key[key_idx], 0, data,
+						 &out);
+#endif
+	}
+
+	if (ret < 0) {
+		seclog(sec, LOG_INFO, "error in crypto operation: %s",
+		       gnutls_strerror(ret));
+		return -1;
+	}
+
+	ret = handle_op(pool, cfd, sec, cmd, out.data, out.size);
+	gnutls_free(out.data);
+
+	return ret;
+}
+
 static
-int process_packet(void *pool, int cfd, pid_t pid, sec_mod_st * sec, cmd_request_t cmd,
+int process_packet(void *pool, struct sec_conn_st *conn, sec_mod_st * sec, cmd_request_t cmd,
 		   uint8_t * buffer, size_t buffer_size)
 {
-	unsigned i;
-	gnutls_datum_t data, out;
+	int cfd = conn->fd;
+	gnutls_datum_t data;
 	int ret;
 	SecOpMsg *op;
 	PROTOBUF_ALLOCATOR(pa, pool);
@@ -219,43 +263,22 @@ int process_packet(void *pool, int cfd, pid_t pid, sec_mod_st * sec, cmd_request
 			return -1;
 		}
 
-		i = op->key_idx;
-		if (op->has_key_idx == 0 || i >= sec->key_size) {
+		if (op->has_key_idx == 0 || op->key_idx >= sec->key_size) {
 			seclog(sec, LOG_INFO,
-			       "received out-of-bounds key index (%d)", i);
+			       "received out-of-bounds key index (%d)", op->key_idx);
 			return -1;
 		}
 
-		data.data = op->data.data;
-		data.size = op->data.len;
-
-		if (cmd == SM_CMD_DECRYPT) {
-			ret =
-			    gnutls_privkey_decrypt_data(sec->key[i], 0, &data,
-							&out);
+		if (sec->signers_size > 0) {
+			ret = sec_signer_dispatch(sec, cfd, cmd, op->key_idx,
+						  op->data.data, op->data.len);
 		} else {
-#if GNUTLS_VERSION_NUMBER >= 0x030200
-			ret =
-			    gnutls_privkey_sign_hash(sec->key[i], 0,
-						     GNUTLS_PRIVKEY_SIGN_FLAG_TLS1_RSA,
-						     &data, &out);
-#else
-			ret =
-			    gnutls_privkey_sign_raw_data(sec->key[i], 0, &data,
-							 &out);
-#endif
+			data.data = op->data.data;
+			data.size = op->data.len;
+			ret = sec_mod_key_op(pool, cfd, sec, cmd, op->key_idx, &data);
 		}
 		sec_op_msg__free_unpacked(op, &pa);
 
-		if (ret < 0) {
-			seclog(sec, LOG_INFO, "error in crypto operation: %s",
-			       gnutls_strerror(ret));
-			return -1;
-		}
-
-		ret = handle_op(pool, cfd, sec, cmd, out.data, out.size);
-		gnutls_free(out.data);
-
 		return ret;
 
 	case SM_CMD_CLI_STATS:{
@@ -284,7 +307,7 @@ int process_packet(void *pool, int cfd, pid_t pid, sec_mod_st * sec, cmd_request
 				return -1;
 			}
 
-			ret = handle_sec_auth_init(cfd, sec, auth_init, pid);
+			ret = handle_sec_auth_init(cfd, sec, auth_init, conn->pid);
 			sec_auth_init_msg__free_unpacked(auth_init, &pa);
 			return ret;
 		}
@@ -299,7 +322,7 @@ int process_packet(void *pool, int cfd, pid_t pid, sec_mod_st * sec, cmd_request
 				return -1;
 			}
 
-			ret = handle_sec_auth_cont(cfd, sec, auth_cont);
+			ret = handle_sec_auth_cont(conn, sec, auth_cont);
 			sec_auth_cont_msg__free_unpacked(auth_cont, &pa);
 			return ret;
 		}
@@ -390,6 +413,7 @@ static void check_other_work(sec_mod_st *sec)
 			gnutls_privkey_deinit(sec->key[i]);
 		}
 
+		sec_signers_deinit(sec);
 		sec_mod_client_db_deinit(sec);
 		talloc_free(sec);
 		exit(0);
@@ -398,6 +422,8 @@ static void check_other_work(sec_mod_st *sec)
 	if (need_reload) {
 		seclog(sec, LOG_DEBUG, "reloading configuration");
 		reload_cfg_file(sec, sec->perm_config);
+		if (sec->config_module && sec->config_module->clear_cache)
+			sec->config_module->clear_cache();
 		need_reload = 0;
 	}
 
@@ -468,8 +494,9 @@ int serve_request_main(sec_mod_st *sec, int fd, uint8_t *buffer, unsigned buffer
 }
 
 static
-int serve_request(sec_mod_st *sec, int cfd, pid_t pid, uint8_t *buffer, unsigned buffer_size)
+int serve_request(sec_mod_st *sec, struct sec_conn_st *conn, uint8_t *buffer, unsigned buffer_size)
 {
+	int cfd = conn->fd;
 	int ret, e;
 	unsigned cmd, length;
 	uint16_t l16;
@@ -477,8 +504,10 @@ int serve_request(sec_mod_st *sec, int cfd, pid_t pid, uint8_t *buffer, unsigned
 
 	/* read request */
 	ret = force_read_timeout(cfd, buffer, 3, MAX_WAIT_SECS);
-	if (ret == 0)
+	if (ret == 0) {
+		ret = ERR_PEER_TERMINATED;
 		goto leave;
+	}
 	else if (ret < 3) {
 		e = errno;
 		seclog(sec, LOG_INFO, "error receiving msg head: %s",
@@ -507,7 +536,7 @@ int serve_request(sec_mod_st *sec, int cfd, pid_t pid, uint8_t *buffer, unsigned
 		goto leave;
 	}
 
-	ret = process_packet(pool, cfd, pid, sec, cmd, buffer, ret);
+	ret = process_packet(pool, conn, sec, cmd, buffer, ret);
 	if (ret < 0) {
 		seclog(sec, LOG_INFO, "error processing data for '%s' command (%d)", cmd_request_to_str(cmd), ret);
 	}
@@ -516,16 +545,137 @@ int serve_request(sec_mod_st *sec, int cfd, pid_t pid, uint8_t *buffer, unsigned
 	return ret;
 }
 
+/* The descriptors and timeouts registered by the modules which perform
+ * their work asynchronously (e.g., the radius client). */
+static struct list_head watches = LIST_HEAD_INIT(watches);
+static unsigned watches_size = 0;
+
+void sec_watch_add(sec_watch_st *w)
+{
+	list_add_tail(&watches, &w->list);
+	watches_size++;
+}
+
+void sec_watch_del(sec_watch_st *w)
+{
+	list_del(&w->list);
+	watches_size--;
+}
+
+/* Returns the time in ms until the closest timeout of a watch, or -1 */
+static int watches_timeout(void)
+{
+	sec_watch_st *w;
+	int t, min = -1;
+
+	list_for_each(&watches, w, list) {
+		if (w->timeout == NULL)
+			continue;
+		t = w->timeout(w->priv);
+		if (t >= 0 && (min == -1 || t < min))
+			min = t;
+	}
+	return min;
+}
+
+/* Each worker keeps a single connection to sec-mod, over which it
+ * sends all of its requests; its credentials are checked once, when
+ * the connection is accepted. */
+static int add_conn(sec_mod_st *sec, int fd, pid_t pid)
+{
+	struct sec_conn_st *conn;
+
+	conn = talloc(sec, struct sec_conn_st);
+	if (conn == NULL)
+		return -1;
+
+	conn->fd = fd;
+	conn->pid = pid;
+	conn->pending = NULL;
+	list_add_tail(&sec->conns, &conn->list);
+	sec->conns_size++;
+
+	return 0;
+}
+
+void sec_mod_close_conn(sec_mod_st *sec, struct sec_conn_st *conn)
+{
+	/* an asynchronous operation completing later has no one to reply to */
+	if (conn->pending != NULL)
+		conn->pending->pending_conn = NULL;
+
+	list_del(&conn->list);
+	sec->conns_size--;
+	close(conn->fd);
+	talloc_free(conn);
+}
+
+/* Imports the private keys. When url_only is set, only the keys which
+ * are not files (i.e., PKCS #11 objects) are re-imported; these cannot be
+ * used after a fork().
+ */
+void load_keys(sec_mod_st *sec, unsigned url_only)
+{
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < sec->key_size; i++) {
+		if (gnutls_url_is_supported(sec->perm_config->key[i]) != 0) {
+			if (url_only)
+				gnutls_privkey_deinit(sec->key[i]);
+
+			ret = gnutls_privkey_init(&sec->key[i]);
+			GNUTLS_FATAL_ERR(ret);
+
+			gnutls_privkey_set_pin_function(sec->key[i],
+							pin_callback, &pins);
+			ret =
+			    gnutls_privkey_import_url(sec->key[i],
+						      sec->perm_config->key[i], 0);
+			GNUTLS_FATAL_ERR(ret);
+		} else if (url_only == 0) {
+			gnutls_datum_t data;
+
+			ret = gnutls_privkey_init(&sec->key[i]);
+			GNUTLS_FATAL_ERR(ret);
+
+			ret = gnutls_load_file(sec->perm_config->key[i], &data);
+			if (ret < 0) {
+				seclog(sec, LOG_ERR, "error loading file '%s'",
+				       sec->perm_config->key[i]);
+				GNUTLS_FATAL_ERR(ret);
+			}
+
+			ret =
+			    gnutls_privkey_import_x509_raw(sec->key[i], &data,
+							   GNUTLS_X509_FMT_PEM,
+							   NULL, 0);
+			if (ret == GNUTLS_E_DECRYPTION_FAILED && pins.pin[0]) {
+				ret =
+				    gnutls_privkey_import_x509_raw(sec->key[i], &data,
+								   GNUTLS_X509_FMT_PEM,
+								   pins.pin, 0);
+			}
+			GNUTLS_FATAL_ERR(ret);
+
+			gnutls_free(data.data);
+		}
+	}
+}
+
 /* sec_mod_server:
  * @config: server configuration
  * @socket_file: the name of the socket
+ * @stats_table: the table of the sessions' counters
  * @cmd_fd: socket to exchange commands with main
  * @cmd_fd_sync: socket to received sync commands from main
  *
  * This is the main part of the security module.
  * It creates the unix domain socket identified by @socket_file
- * and then accepts connections from the workers to it. Then 
- * it serves commands requested on the server's private key.
+ * and then accepts connections from the workers to it. Each
+ * worker keeps its connection open and sends over it all of its
+ * requests, i.e., the authentication messages, its statistics and
+ * the operations on the server's private key.
  *
  * When the operation is decrypt the provided data are
  * decrypted and sent back to worker. The sign operation
@@ -544,21 +694,32 @@ int serve_request(sec_mod_st *sec, int cfd, pid_t pid, uint8_t *buffer, unsigned
  * Other than that it allows the main server to spawn
  * clients fast without becoming a bottleneck due to private 
  * key operations.
+ *
+ * When sec-mod-signers is set, the key operations are passed
+ * to a pool of signer processes (see sec-mod-signers.c).
  */
 void sec_mod_server(void *main_pool, struct perm_cfg_st *perm_config, const char *socket_file,
-		    uint8_t cookie_key[COOKIE_KEY_SIZE], int cmd_fd, int cmd_fd_sync)
+		    uint8_t cookie_key[COOKIE_KEY_SIZE], const struct stats_table_st *stats_table,
+		    int cmd_fd, int cmd_fd_sync)
 {
 	struct sockaddr_un sa;
 	socklen_t sa_len;
-	int cfd, ret, e, n;
-	unsigned i, buffer_size;
+	int cfd, ret, e;
+	unsigned i, n, buffer_size;
 	uid_t uid;
 	uint8_t *buffer;
-	struct pin_st pins;
 	int sd;
 	sec_mod_st *sec;
 	void *sec_mod_pool;
-	fd_set rd_set;
+	struct pollfd *pfd = NULL;
+	unsigned pfd_size = 0;
+	struct sec_conn_st *conn, *cpos;
+	sec_watch_st *w, *wpos;
+	unsigned watches_base;
+	int timeout;
+#ifdef HAVE_PPOLL
+	struct timespec ts;
+#endif
 	pid_t pid;
 	sigset_t emptyset, blockset;
 
@@ -590,6 +751,11 @@ void sec_mod_server(void *main_pool, struct perm_cfg_st *perm_config, const char
 	sec->perm_config = talloc_steal(sec, perm_config);
 	sec->config = sec->perm_config->config;
 
+	/* the slots are only handed out by main */
+	sec->stats_table = *stats_table;
+	sec->stats_table.free = NULL;
+	stats_table_readonly(&sec->stats_table);
+
 	sup_config_init(sec);
 
 	memset(&sa, 0, sizeof(sa));
@@ -607,9 +773,9 @@ void sec_mod_server(void *main_pool, struct perm_cfg_st *perm_config, const char
 	ocsignal(SIGTERM, handle_sigterm);
 	ocsignal(SIGALRM, handle_alarm);
 
-	sec_auth_init(sec, perm_config);
 	sec->cmd_fd = cmd_fd;
 	sec->cmd_fd_sync = cmd_fd_sync;
+	list_head_init(&sec->conns);
 
 #ifdef HAVE_PKCS11
 	ret = gnutls_pkcs11_reinit();
@@ -671,45 +837,20 @@ void sec_mod_server(void *main_pool, struct perm_cfg_st *perm_config, const char
 		exit(1);
 	}
 
-	/* read private keys */
-	for (i = 0; i < sec->key_size; i++) {
-		ret = gnutls_privkey_init(&sec->key[i]);
-		GNUTLS_FATAL_ERR(ret);
-
-		/* load the private key */
-		if (gnutls_url_is_supported(sec->perm_config->key[i]) != 0) {
-			gnutls_privkey_set_pin_function(sec->key[i],
-							pin_callback, &pins);
-			ret =
-			    gnutls_privkey_import_url(sec->key[i],
-						      sec->perm_config->key[i], 0);
-			GNUTLS_FATAL_ERR(ret);
-		} else {
-			gnutls_datum_t data;
-			ret = gnutls_load_file(sec->perm_config->key[i], &data);
-			if (ret < 0) {
-				seclog(sec, LOG_ERR, "error loading file '%s'",
-				       sec->perm_config->key[i]);
-				GNUTLS_FATAL_ERR(ret);
-			}
+	load_keys(sec, 0);
 
-			ret =
-			    gnutls_privkey_import_x509_raw(sec->key[i], &data,
-							   GNUTLS_X509_FMT_PEM,
-							   NULL, 0);
-			if (ret == GNUTLS_E_DECRYPTION_FAILED && pins.pin[0]) {
-				ret =
-				    gnutls_privkey_import_x509_raw(sec->key[i], &data,
-								   GNUTLS_X509_FMT_PEM,
-								   pins.pin, 0);
-			}
-			GNUTLS_FATAL_ERR(ret);
+	sigprocmask(SIG_BLOCK, &blockset, &sig_default_set);
 
-			gnutls_free(data.data);
-		}
+	ret = sec_signers_init(sec, sd);
+	if (ret < 0) {
+		seclog(sec, LOG_ERR, "error starting the signer processes");
+		exit(1);
 	}
 
-	sigprocmask(SIG_BLOCK, &blockset, &sig_default_set);
+	/* the modules may start threads; the signers are forked by a
+	 * process which is forked above, prior to that */
+	sec_auth_init(sec, perm_config);
+
 	alarm(MAINTAINANCE_TIME);
 	seclog(sec, LOG_INFO, "sec-mod initialized (socket: %s)", SOCKET_FILE);
 
@@ -717,23 +858,49 @@ void sec_mod_server(void *main_pool, struct perm_cfg_st *perm_config, const char
 	for (;;) {
 		check_other_work(sec);
 
-		FD_ZERO(&rd_set);
-		n = 0;
+		n = SEC_MOD_FIXED_FDS + sec->signers_size + sec->conns_size + watches_size;
+		if (n > pfd_size) {
+			pfd = talloc_realloc(sec, pfd, struct pollfd, n);
+			if (pfd == NULL) {
+				seclog(sec, LOG_ERR, "error in memory allocation");
+				exit(1);
+			}
+			pfd_size = n;
+		}
 
-		FD_SET(cmd_fd, &rd_set);
-		n = MAX(n, cmd_fd);
+		pfd[0].fd = cmd_fd_sync;
+		pfd[1].fd = cmd_fd;
+		pfd[2].fd = sd;
+		for (i = 0; i < SEC_MOD_FIXED_FDS; i++)
+			pfd[i].events = POLLIN;
 
-		FD_SET(cmd_fd_sync, &rd_set);
-		n = MAX(n, cmd_fd_sync);
+		sec_signers_set_fds(sec, &pfd[SEC_MOD_FIXED_FDS]);
 
-		FD_SET(sd, &rd_set);
-		n = MAX(n, sd);
+		i = SEC_MOD_FIXED_FDS + sec->signers_size;
+		list_for_each(&sec->conns, conn, list) {
+			pfd[i].fd = conn->fd;
+			pfd[i].events = POLLIN;
+			i++;
+		}
+
+		watches_base = i;
+		list_for_each(&watches, w, list) {
+			pfd[i].fd = w->fd;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+			i++;
+		}
 
-#ifdef HAVE_PSELECT
-		ret = pselect(n + 1, &rd_set, NULL, NULL, NULL, &emptyset);
+		timeout = watches_timeout();
+#ifdef HAVE_PPOLL
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000;
+		}
+		ret = ppoll(pfd, n, (timeout >= 0) ? &ts : NULL, &emptyset);
 #else
 		sigprocmask(SIG_UNBLOCK, &blockset, NULL);
-		ret = select(n + 1, &rd_set, NULL, NULL, NULL);
+		ret = poll(pfd, n, timeout);
 		sigprocmask(SIG_BLOCK, &blockset, NULL);
 #endif
 		if (ret == -1 && errno == EINTR)
@@ -741,7 +908,7 @@ void sec_mod_server(void *main_pool, struct perm_cfg_st *perm_config, const char
 
 		if (ret < 0) {
 			e = errno;
-			seclog(sec, LOG_ERR, "Error in pselect(): %s",
+			seclog(sec, LOG_ERR, "Error in poll(): %s",
 			       strerror(e));
 			exit(1);
 		}
@@ -755,7 +922,7 @@ void sec_mod_server(void *main_pool, struct perm_cfg_st *perm_config, const char
 			exit(1);
 		}
 
-		if (FD_ISSET(cmd_fd_sync, &rd_set)) {
+		if (pfd[0].revents) {
 			ret = serve_request_main(sec, cmd_fd_sync, buffer, buffer_size);
 			if (ret < 0 && ret == ERR_BAD_COMMAND) {
 				seclog(sec, LOG_ERR, "error processing sync command from main");
@@ -763,25 +930,40 @@ void sec_mod_server(void *main_pool, struct perm_cfg_st *perm_config, const char
 			}
 		}
 
-		if (FD_ISSET(cmd_fd, &rd_set)) {
+		if (pfd[1].revents) {
 			ret = serve_request_main(sec, cmd_fd, buffer, buffer_size);
 			if (ret < 0 && ret == ERR_BAD_COMMAND) {
 				seclog(sec, LOG_ERR, "error processing async command from main");
 				exit(1);
 			}
 		}
-		
-		if (FD_ISSET(sd, &rd_set)) {
+
+		sec_signers_handle(sec, &pfd[SEC_MOD_FIXED_FDS]);
+
+		/* the requests of the connected workers; the connections
+		 * accepted below are not part of this iteration */
+		i = SEC_MOD_FIXED_FDS + sec->signers_size;
+		list_for_each_safe(&sec->conns, conn, cpos, list) {
+			if (i >= watches_base)
+				break;
+			if (pfd[i++].revents == 0)
+				continue;
+
+			memset(buffer, 0, buffer_size);
+			ret = serve_request(sec, conn, buffer, buffer_size);
+			if (ret < 0)
+				sec_mod_close_conn(sec, conn);
+		}
+
+		if (pfd[2].revents) {
 			sa_len = sizeof(sa);
 			cfd = accept(sd, (struct sockaddr *)&sa, &sa_len);
 			if (cfd == -1) {
 				e = errno;
-				if (e != EINTR) {
-					seclog(sec, LOG_DEBUG,
-					       "sec-mod error accepting connection: %s",
-					       strerror(e));
-					goto cont;
-				}
+				seclog(sec, LOG_DEBUG,
+				       "sec-mod error accepting connection: %s",
+				       strerror(e));
+				goto cont;
 			}
 			set_cloexec_flag (cfd, 1);
 
@@ -790,11 +972,20 @@ void sec_mod_server(void *main_pool, struct perm_cfg_st *perm_config, const char
 			ret = check_upeer_id("sec-mod", sec->config->debug, cfd, perm_config->uid, perm_config->gid, &uid, &pid);
 			if (ret < 0) {
 				seclog(sec, LOG_INFO, "rejected unauthorized connection");
-			} else {
-				memset(buffer, 0, buffer_size);
-				serve_request(sec, cfd, pid, buffer, buffer_size);
+				close(cfd);
+			} else if (add_conn(sec, cfd, pid) < 0) {
+				close(cfd);
 			}
-			close(cfd);
+		}
+
+		/* a watch may only remove itself when processed */
+		i = watches_base;
+		list_for_each_safe(&watches, w, wpos, list) {
+			if (i >= n)
+				break;
+			if (pfd[i++].revents != 0 ||
+			    (w->timeout != NULL && w->timeout(w->priv) == 0))
+				w->process(w->priv);
 		}
  cont:
 		talloc_free(buffer);
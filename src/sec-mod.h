@@ -25,9 +25,52 @@
 #include <gnutls/abstract.h>
 #include <ccan/htable/htable.h>
 #include <base64.h>
+#include <ccan/list/list.h>
+#include <poll.h>
+#include <stats-table.h>
 
 #define SESSION_STR "(session: %.5s)"
 
+/* a process holding a copy of the private keys */
+struct sec_signer_st {
+	pid_t pid; /* -1 if not running */
+	int fd;	/* the command socket; -1 if not running */
+	unsigned busy;
+};
+
+/* the connection of a worker */
+struct sec_conn_st {
+	struct list_node list;
+	int fd;
+	pid_t pid; /* the worker's pid */
+	/* the client entry whose asynchronous authentication will be
+	 * replied to over this connection */
+	struct client_entry_st *pending;
+};
+
+/* A descriptor, and optionally a timeout, monitored by the sec-mod loop
+ * on behalf of a module which performs its work asynchronously.
+ */
+typedef struct sec_watch_st {
+	struct list_node list;
+	int fd; /* may be -1 if only the timeout is used */
+	/* returns the time in ms after which process must be called, or -1 */
+	int (*timeout)(void *priv);
+	/* called when fd is readable, or the timeout has expired */
+	void (*process)(void *priv);
+	void *priv;
+} sec_watch_st;
+
+/* an operation waiting for an idle signer */
+struct sec_pending_op_st {
+	struct list_node list;
+	int cfd;
+	unsigned cmd;
+	unsigned key_idx;
+	uint8_t *data;
+	size_t data_size;
+};
+
 typedef struct sec_mod_st {
 	gnutls_datum_t dcookie_key; /* the key to generate cookies */
 	uint8_t cookie_key[COOKIE_KEY_SIZE];
@@ -39,8 +82,30 @@ typedef struct sec_mod_st {
 	struct htable *client_db;
 	int cmd_fd;
 	int cmd_fd_sync;
+	int sd; /* the socket accepting worker connections */
+	struct list_head conns; /* the connected workers */
+	unsigned conns_size;
+
+	/* the signer processes, if any */
+	struct sec_signer_st *signers;
+	unsigned signers_size;
+	int launcher_fd; /* the socket to the process forking the signers */
+	pid_t launcher_pid;
+	struct list_head pending_ops;
+	unsigned pending_ops_size;
+	/* the pending_ops_size last reported to main */
+	unsigned pending_ops_reported;
+	sec_watch_st pending_watch;
+	time_t pending_tick;
 
 	struct config_mod_st *config_module;
+
+	/* the counters of the sessions, updated in place by the workers;
+	 * the sessions which have a slot are in stats_sessions */
+	struct stats_table_st stats_table;
+	struct list_head stats_sessions;
+	sec_watch_st stats_watch;
+	time_t stats_tick;
 } sec_mod_st;
 
 typedef struct stats_st {
@@ -98,6 +163,17 @@ typedef struct client_entry_st {
 
 	/* the module this entry is using */
 	const struct auth_mod_st *module;
+
+	/* the connection waiting for the result of an asynchronous
+	 * password check; NULL if none */
+	struct sec_conn_st *pending_conn;
+
+	/* the stats table slot of the latest session, or -1 */
+	int stats_slot;
+	struct list_node stats_list;
+	unsigned stats_interval; /* seconds between interim updates */
+	time_t stats_next;
+	time_t stats_start;
 } client_entry_st;
 
 void *sec_mod_client_db_init(sec_mod_st *sec);
@@ -128,12 +204,28 @@ void sec_auth_init(sec_mod_st *sec, struct perm_cfg_st *config);
 
 void handle_sec_auth_ban_ip_reply(sec_mod_st *sec, const BanIpReplyMsg *msg);
 int handle_sec_auth_init(int cfd, sec_mod_st *sec, const SecAuthInitMsg * req, pid_t pid);
-int handle_sec_auth_cont(int cfd, sec_mod_st *sec, const SecAuthContMsg * req);
+int handle_sec_auth_cont(struct sec_conn_st *conn, sec_mod_st *sec, const SecAuthContMsg * req);
 int handle_sec_auth_session_cmd(sec_mod_st *sec, int fd, const SecAuthSessionMsg *req, unsigned cmd);
 int handle_sec_auth_stats_cmd(sec_mod_st * sec, const CliStatsMsg * req);
 void sec_auth_user_deinit(sec_mod_st * sec, client_entry_st * e);
 
+void sec_watch_add(sec_watch_st *w);
+void sec_watch_del(sec_watch_st *w);
+void sec_mod_close_conn(sec_mod_st *sec, struct sec_conn_st *conn);
+
+void load_keys(sec_mod_st *sec, unsigned url_only);
+int sec_mod_key_op(void *pool, int cfd, sec_mod_st * sec, unsigned cmd,
+		   unsigned key_idx, const gnutls_datum_t *data);
+
+int sec_signers_init(sec_mod_st *sec, int sd);
+void sec_signers_deinit(sec_mod_st *sec);
+void sec_signers_set_fds(sec_mod_st *sec, struct pollfd *pfd);
+void sec_signers_handle(sec_mod_st *sec, const struct pollfd *pfd);
+int sec_signer_dispatch(sec_mod_st *sec, int cfd, unsigned cmd, unsigned key_idx,
+			const uint8_t *data, size_t data_size);
+
 void sec_mod_server(void *main_pool, struct perm_cfg_st *config, const char *socket_file,
-		    uint8_t cookie_key[COOKIE_KEY_SIZE], int cmd_fd, int cmd_fd_sync);
+		    uint8_t cookie_key[COOKIE_KEY_SIZE], const struct stats_table_st *stats_table,
+		    int cmd_fd, int cmd_fd_sync);
 
 #endif
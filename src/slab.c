@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <slab.h>
+
+struct slab_st *slab_new(void *pool, size_t max_size)
+{
+	struct slab_st *slab;
+	size_t size;
+
+	slab = talloc_zero(pool, struct slab_st);
+	if (slab == NULL)
+		return NULL;
+
+	for (size = SLAB_MIN_SIZE; slab->classes_size < SLAB_MAX_CLASSES; size *= 2) {
+		slab->classes[slab->classes_size++].size = size;
+		if (size >= max_size)
+			break;
+	}
+
+	return slab;
+}
+
+static struct slab_class_st *find_class(struct slab_st *slab, size_t size)
+{
+	unsigned i;
+
+	for (i = 0; i < slab->classes_size; i++) {
+		if (size <= slab->classes[i].size)
+			return &slab->classes[i];
+	}
+	return NULL;
+}
+
+/* Returns a buffer of at least size bytes, or NULL */
+void *slab_alloc(struct slab_st *slab, size_t size)
+{
+	struct slab_class_st *c;
+	size_t page_size;
+	void *p;
+
+	c = find_class(slab, size);
+	if (c == NULL)
+		return NULL;
+
+	if (c->free != NULL) {
+		p = c->free;
+		memcpy(&c->free, p, sizeof(void*));
+		c->used++;
+		return p;
+	}
+
+	if (c->page_avail < c->size) {
+		page_size = SLAB_PAGE_SIZE;
+		if (page_size < c->size)
+			page_size = c->size;
+
+		/* the remainder of the previous page, if any, is lost */
+		c->page = talloc_size(slab, page_size);
+		if (c->page == NULL) {
+			c->page_avail = 0;
+			return NULL;
+		}
+		c->page_avail = page_size;
+		slab->pages += page_size;
+	}
+
+	p = c->page;
+	c->page += c->size;
+	c->page_avail -= c->size;
+	c->used++;
+
+	return p;
+}
+
+/* Releases a buffer; size must be the one it was allocated with */
+void slab_free(struct slab_st *slab, void *p, size_t size)
+{
+	struct slab_class_st *c;
+
+	if (p == NULL)
+		return;
+
+	c = find_class(slab, size);
+	if (c == NULL)
+		return;
+
+	memcpy(p, &c->free, sizeof(void*));
+	c->free = p;
+	c->used--;
+}
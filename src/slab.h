@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SLAB_H
+# define SLAB_H
+
+#include <stddef.h>
+#include <talloc.h>
+
+/* the smallest size class; classes double up to the maximum size */
+#define SLAB_MIN_SIZE 256
+#define SLAB_MAX_CLASSES 16
+
+/* chunks are carved out of pages of this size */
+#define SLAB_PAGE_SIZE (64*1024)
+
+struct slab_class_st {
+	size_t size;
+	void *free; /* released chunks; linked through their first bytes */
+	char *page; /* the unused part of the current page */
+	size_t page_avail;
+	size_t used; /* chunks in use */
+};
+
+/* An allocator of buffers of up to max_size bytes, which are served
+ * from the smallest power-of-two size class that fits them. The memory
+ * of released buffers is re-used within their class, and is released
+ * to the system only with the allocator.
+ */
+struct slab_st {
+	struct slab_class_st classes[SLAB_MAX_CLASSES];
+	unsigned classes_size;
+	size_t pages; /* allocated memory in bytes */
+};
+
+struct slab_st *slab_new(void *pool, size_t max_size);
+void *slab_alloc(struct slab_st *slab, size_t size);
+void slab_free(struct slab_st *slab, void *p, size_t size);
+
+#endif
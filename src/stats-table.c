@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <talloc.h>
+#include <stats-table.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MAP_NORESERVE
+# define MAP_NORESERVE 0
+#endif
+
+/* a reader gives up after that many concurrent updates */
+#define STATS_READ_RETRIES 64
+
+#define SLOT(t, i) ((struct stats_slot_st *)((t)->base + (size_t)(i) * (t)->slot_size))
+
+int stats_table_init(void *pool, struct stats_table_st *t, unsigned size)
+{
+	long page_size;
+	void *p;
+	unsigned i;
+
+	memset(t, 0, sizeof(*t));
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size < (long)sizeof(struct stats_slot_st))
+		page_size = 4096;
+
+	t->free = talloc_array(pool, unsigned, size);
+	if (t->free == NULL)
+		return -1;
+
+	p = mmap(NULL, (size_t)page_size * size, PROT_READ|PROT_WRITE,
+		 MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		talloc_free(t->free);
+		t->free = NULL;
+		return -1;
+	}
+
+	t->base = p;
+	t->slot_size = page_size;
+	t->size = size;
+
+	for (i = 0; i < size; i++)
+		t->free[i] = i;
+	t->free_size = size;
+
+	return 0;
+}
+
+void stats_table_deinit(struct stats_table_st *t)
+{
+	if (t->base != NULL)
+		munmap(t->base, t->slot_size * t->size);
+	talloc_free(t->free);
+	memset(t, 0, sizeof(*t));
+}
+
+/* Returns a zeroed slot, or -1 if none is free. Main only. */
+int stats_table_get(struct stats_table_st *t)
+{
+	unsigned slot;
+
+	if (t->free_size == 0)
+		return -1;
+
+	slot = t->free[t->free_head];
+	t->free_head = (t->free_head + 1) % t->size;
+	t->free_size--;
+
+	memset(SLOT(t, slot), 0, sizeof(struct stats_slot_st));
+	return slot;
+}
+
+void stats_table_put(struct stats_table_st *t, int slot)
+{
+	if (slot < 0 || (unsigned)slot >= t->size || t->free_size >= t->size)
+		return;
+
+	t->free[(t->free_head + t->free_size) % t->size] = slot;
+	t->free_size++;
+}
+
+/* Copies the counters of a slot without blocking its writer.
+ *
+ * Returns 0 on success, or -1 if the slot is invalid or no consistent
+ * snapshot could be read.
+ */
+int stats_table_read(const struct stats_table_st *t, int slot,
+		     uint64_t *bytes_in, uint64_t *bytes_out)
+{
+	const struct stats_slot_st *p;
+	unsigned retries = STATS_READ_RETRIES;
+	uint32_t seq;
+
+	if (t->base == NULL || slot < 0 || (unsigned)slot >= t->size)
+		return -1;
+
+	p = SLOT(t, slot);
+	do {
+		seq = p->seq;
+		__sync_synchronize();
+		*bytes_in = p->bytes_in;
+		*bytes_out = p->bytes_out;
+		__sync_synchronize();
+
+		if ((seq & 1) == 0 && p->seq == seq)
+			return 0;
+	} while (--retries > 0);
+
+	return -1;
+}
+
+/* Used by the processes which only read the table */
+void stats_table_readonly(struct stats_table_st *t)
+{
+	if (t->base != NULL)
+		mprotect(t->base, t->slot_size * t->size, PROT_READ);
+}
+
+/* Unmaps every slot but the provided one; used by the worker which
+ * updates that slot, so that it has no access to the counters of the
+ * other sessions. Returns the slot, or NULL if slot is -1.
+ */
+struct stats_slot_st *stats_table_restrict(struct stats_table_st *t, int slot)
+{
+	struct stats_slot_st *p;
+
+	if (t->base == NULL)
+		return NULL;
+
+	if (slot < 0 || (unsigned)slot >= t->size) {
+		munmap(t->base, t->slot_size * t->size);
+		t->base = NULL;
+		return NULL;
+	}
+
+	if (slot > 0)
+		munmap(t->base, t->slot_size * slot);
+	if ((unsigned)slot + 1 < t->size)
+		munmap(t->base + t->slot_size * (slot + 1),
+		       t->slot_size * (t->size - slot - 1));
+
+	p = SLOT(t, slot);
+	t->base = NULL;
+	return p;
+}
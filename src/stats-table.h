@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STATS_TABLE_H
+# define STATS_TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* the number of slots when max-clients is unlimited */
+#define STATS_TABLE_DEFAULT_SIZE 4096
+/* slots in addition to max-clients; as freed slots are re-used last,
+ * these keep the slots of terminating workers unused a little longer */
+#define STATS_TABLE_SLACK 64
+
+/* The counters of a session. The worker is the only writer; readers
+ * retry while seq is odd, or has changed while reading. */
+struct stats_slot_st {
+	volatile uint32_t seq;
+	volatile uint64_t bytes_in;
+	volatile uint64_t bytes_out;
+};
+
+/* A table of session counters in memory shared by main, sec-mod and the
+ * workers; it is created by main prior to forking any of them. Each slot
+ * occupies its own page, so that a worker can keep mapped only the
+ * slot it updates.
+ *
+ * The slots are handed out by main; the free slots are kept in a FIFO
+ * (which is not shared) so that a released slot is re-used as late
+ * as possible.
+ */
+struct stats_table_st {
+	uint8_t *base;
+	size_t slot_size;
+	unsigned size;
+
+	unsigned *free;
+	unsigned free_head;
+	unsigned free_size;
+};
+
+int stats_table_init(void *pool, struct stats_table_st *t, unsigned size);
+void stats_table_deinit(struct stats_table_st *t);
+
+int stats_table_get(struct stats_table_st *t);
+void stats_table_put(struct stats_table_st *t, int slot);
+
+int stats_table_read(const struct stats_table_st *t, int slot,
+		     uint64_t *bytes_in, uint64_t *bytes_out);
+
+void stats_table_readonly(struct stats_table_st *t);
+struct stats_slot_st *stats_table_restrict(struct stats_table_st *t, int slot);
+
+inline static
+void stats_slot_update(struct stats_slot_st *p, uint64_t bytes_in, uint64_t bytes_out)
+{
+	p->seq++;
+	__sync_synchronize();
+	p->bytes_in = bytes_in;
+	p->bytes_out = bytes_out;
+	__sync_synchronize();
+	p->seq++;
+}
+
+#endif
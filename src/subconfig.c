@@ -242,6 +242,9 @@ void *radius_get_brackets_string(struct perm_cfg_st *config, const char *str)
 			} else if (c_strcasecmp(vals[i].name, "nas-identifier") == 0) {
 				additional->nas_identifier = vals[i].value;
 				vals[i].value = NULL;
+			} else if (c_strcasecmp(vals[i].name, "spool") == 0) {
+				additional->spool = vals[i].value;
+				vals[i].value = NULL;
 			} else if (c_strcasecmp(vals[i].name, "groupconfig") == 0) {
 				if (CHECK_TRUE(vals[i].value))
 					config->sup_config_type = SUP_CONFIG_RADIUS;
@@ -283,6 +286,16 @@ void *pam_get_brackets_string(struct perm_cfg_st *config, const char *str)
 				fprintf(stderr, "error in gid-min value: %d\n", additional->gid_min);
 				exit(1);
 			}
+		} else if (c_strcasecmp(vals[i].name, "threads") == 0) {
+			if (atoi(vals[i].value) < 0) {
+				fprintf(stderr, "error in threads value: %s\n", vals[i].value);
+				exit(1);
+			}
+			additional->threads = atoi(vals[i].value);
+#ifndef HAVE_PAM_THREADS
+			if (additional->threads > 0)
+				fprintf(stderr, "the PAM threads option is not supported in this build; ignoring\n");
+#endif
 		} else {
 			fprintf(stderr, "unknown option '%s'\n", vals[i].name);
 			exit(1);
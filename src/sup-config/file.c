@@ -23,6 +23,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <pwd.h>
 #include <grp.h>
 #include <fcntl.h>
@@ -31,6 +32,8 @@
 #include <limits.h>
 #include <common.h>
 #include <c-strcase.h>
+#include <ccan/htable/htable.h>
+#include <ccan/hash/hash.h>
 
 #include <vpn.h>
 #include <main.h>
@@ -138,17 +141,36 @@ unsigned j;
 	return 0;
 }
 
-/* This will parse the configuration file and append/replace data into
- * config. The provided config must either be memset to zero, or be
- * already allocated using this function.
+/* The parsed files are cached, keyed by path, and are re-parsed only if
+ * their inode, size or modification time changes. Each cached entry holds
+ * the values set by its file alone, which merge_sup_config() applies to the
+ * reply the same way parsing the files in sequence would; the reply refers
+ * to the cached strings, as it is sent before the cache is modified again.
+ * The cache is cleared on reload.
+ */
+struct sup_cfg_cache_st {
+	char *path;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	int ret;
+	unsigned loaded; /* the file was loaded and its values read */
+	unsigned dns_alias; /* the dns entries were read from ipv4/ipv6-dns */
+	unsigned nbns_alias; /* the nbns entries were read from ipv4/ipv6-nbns */
+	SecAuthSessionReplyMsg msg;
+};
+
+/* This will parse the configuration file into the cache entry, whose
+ * message must be initialized and empty.
  */
 static
 int parse_group_cfg_file(struct cfg_st *global_config,
-			 SecAuthSessionReplyMsg *msg, void *pool,
-			 const char* file)
+			 struct sup_cfg_cache_st *e, const char* file)
 {
 tOptionValue const * pov;
 const tOptionValue* val, *prev;
+SecAuthSessionReplyMsg *msg = &e->msg;
+void *pool = e;
 unsigned prefix = 0;
 
 	pov = configFileLoad(file);
@@ -171,6 +193,8 @@ unsigned prefix = 0;
 		prev = val;
 	} while((val = optionNextValue(pov, prev)) != NULL);
 
+	e->loaded = 1;
+
 	READ_TF("no-udp", msg->no_udp, msg->has_no_udp);
 	READ_TF("deny-roaming", msg->deny_roaming, msg->has_deny_roaming);
 
@@ -183,6 +207,7 @@ unsigned prefix = 0;
 		/* try aliases */
 		READ_RAW_MULTI_LINE("ipv6-dns", msg->dns, msg->n_dns);
 		READ_RAW_MULTI_LINE("ipv4-dns", msg->dns, msg->n_dns);
+		e->dns_alias = 1;
 	}
 
 	READ_RAW_MULTI_LINE("nbns", msg->nbns, msg->n_nbns);
@@ -190,6 +215,7 @@ unsigned prefix = 0;
 		/* try aliases */
 		READ_RAW_MULTI_LINE("ipv6-nbns", msg->nbns, msg->n_nbns);
 		READ_RAW_MULTI_LINE("ipv4-nbns", msg->nbns, msg->n_nbns);
+		e->nbns_alias = 1;
 	}
 
 	READ_RAW_STRING("cgroup", msg->cgroup);
@@ -231,29 +257,217 @@ unsigned prefix = 0;
 	return 0;
 }
 
+static void *cache_pool = NULL;
+static struct htable cache;
+
+static size_t cache_rehash(const void *_e, void *unused)
+{
+	const struct sup_cfg_cache_st *e = _e;
+	return hash_any(e->path, strlen(e->path), 0);
+}
+
+static bool cache_cmp(const void *_e, void *path)
+{
+	const struct sup_cfg_cache_st *e = _e;
+
+	if (strcmp(e->path, path) == 0)
+		return 1;
+	return 0;
+}
+
+static void clear_cache(void)
+{
+	if (cache_pool == NULL)
+		return;
+
+	htable_clear(&cache);
+	talloc_free(cache_pool);
+	cache_pool = NULL;
+}
+
+/* Returns the cached entry for the file, parsing it if it is not
+ * cached or was modified, or NULL if it does not exist. */
+static struct sup_cfg_cache_st *get_cached(struct cfg_st *global_config,
+					   const char *file)
+{
+	struct sup_cfg_cache_st *e;
+	struct stat st;
+	size_t hval;
+
+	if (stat(file, &st) < 0 || access(file, R_OK) != 0)
+		return NULL;
+
+	if (cache_pool == NULL) {
+		cache_pool = talloc_init("sup-config");
+		if (cache_pool == NULL)
+			return NULL;
+		htable_init(&cache, cache_rehash, NULL);
+	}
+
+	hval = hash_any(file, strlen(file), 0);
+	e = htable_get(&cache, hval, cache_cmp, file);
+	if (e != NULL) {
+		if (e->ino == st.st_ino && e->size == st.st_size && e->mtime == st.st_mtime)
+			return e;
+
+		htable_del(&cache, hval, e);
+		talloc_free(e);
+	}
+
+	e = talloc_zero(cache_pool, struct sup_cfg_cache_st);
+	if (e == NULL)
+		return NULL;
+
+	e->path = talloc_strdup(e, file);
+	if (e->path == NULL)
+		goto fail;
+	e->ino = st.st_ino;
+	e->size = st.st_size;
+	e->mtime = st.st_mtime;
+
+	sec_auth_session_reply_msg__init(&e->msg);
+	e->ret = parse_group_cfg_file(global_config, e, file);
+
+	if (htable_add(&cache, hval, e) == 0)
+		goto fail;
+
+	return e;
+ fail:
+	talloc_free(e);
+	return NULL;
+}
+
+static int append_lines(void *pool, char ***s_name, size_t *num,
+			char **src, size_t src_num)
+{
+	char **tmp;
+
+	if (src_num == 0)
+		return 0;
+
+	if (*num == 0) {
+		*s_name = src;
+		*num = src_num;
+		return 0;
+	}
+
+	tmp = talloc_array(pool, char*, *num + src_num + 1);
+	if (tmp == NULL)
+		return -1;
+
+	memcpy(tmp, *s_name, *num * sizeof(char*));
+	memcpy(tmp + *num, src, src_num * sizeof(char*));
+	*num += src_num;
+	tmp[*num] = NULL;
+	*s_name = tmp;
+
+	return 0;
+}
+
+#define MERGE_STRING(s_name) \
+	if (c->s_name != NULL) \
+		msg->s_name = c->s_name
+
+#define MERGE_VALUE(s_name, def) \
+	if (c->def != 0) { \
+		msg->s_name = c->s_name; \
+		msg->def = 1; \
+	}
+
+/* A boolean that is not present in a file is unset, as READ_TF() does */
+#define MERGE_TF(s_name, def) \
+	if (c->def != 0) \
+		msg->s_name = c->s_name; \
+	msg->def = c->def
+
+/* Applies the values of a cached file to msg, as parse_group_cfg_file()
+ * would when reading that file into msg. */
+static int merge_sup_config(SecAuthSessionReplyMsg *msg, void *pool,
+			    const struct sup_cfg_cache_st *e)
+{
+	const SecAuthSessionReplyMsg *c = &e->msg;
+
+	if (e->loaded == 0)
+		return 0;
+
+	MERGE_TF(no_udp, has_no_udp);
+	MERGE_TF(deny_roaming, has_deny_roaming);
+
+	if (append_lines(pool, &msg->routes, &msg->n_routes, c->routes, c->n_routes) < 0 ||
+	    append_lines(pool, &msg->no_routes, &msg->n_no_routes, c->no_routes, c->n_no_routes) < 0 ||
+	    append_lines(pool, &msg->iroutes, &msg->n_iroutes, c->iroutes, c->n_iroutes) < 0)
+		return -1;
+
+	/* the aliases are only read when no dns (or nbns) entry is set */
+	if (e->dns_alias == 0 || msg->n_dns == 0) {
+		if (append_lines(pool, &msg->dns, &msg->n_dns, c->dns, c->n_dns) < 0)
+			return -1;
+	}
+
+	if (e->nbns_alias == 0 || msg->n_nbns == 0) {
+		if (append_lines(pool, &msg->nbns, &msg->n_nbns, c->nbns, c->n_nbns) < 0)
+			return -1;
+	}
+
+	MERGE_STRING(cgroup);
+	MERGE_STRING(ipv4_net);
+	MERGE_STRING(ipv6_net);
+	MERGE_STRING(ipv4_netmask);
+	MERGE_STRING(explicit_ipv4);
+	MERGE_STRING(explicit_ipv6);
+
+	/* The parser strips the prefix from the network it reads, so only
+	 * a network set by this file provides one, which was then recorded
+	 * in place of its ipv6-prefix. */
+	msg->ipv6_prefix = 0;
+	MERGE_VALUE(ipv6_prefix, has_ipv6_prefix);
+
+	/* the values read are scaled when parsed; the parser scales the
+	 * previous values again when the file does not set them */
+	if (c->has_rx_per_sec == 0)
+		msg->rx_per_sec /= 1000;
+	if (c->has_tx_per_sec == 0)
+		msg->tx_per_sec /= 1000;
+	MERGE_VALUE(rx_per_sec, has_rx_per_sec);
+	MERGE_VALUE(tx_per_sec, has_tx_per_sec);
+
+	MERGE_VALUE(interim_update_secs, has_interim_update_secs);
+	MERGE_VALUE(session_timeout_secs, has_session_timeout_secs);
+	MERGE_VALUE(net_priority, has_net_priority);
+
+	MERGE_STRING(xml_config_file);
+
+	return 0;
+}
+
 static int read_sup_config_file(struct cfg_st *global_config,
 				SecAuthSessionReplyMsg *msg, void *pool,
 				const char *file, const char *fallback, const char *type)
 {
-	int ret;
+	struct sup_cfg_cache_st *e;
 
-	if (access(file, R_OK) == 0) {
+	e = get_cached(global_config, file);
+	if (e != NULL) {
 		syslog(LOG_DEBUG, "Loading %s configuration '%s'", type,
 		      file);
+	} else if (fallback != NULL) {
+		syslog(LOG_DEBUG, "Loading default %s configuration '%s'", type, fallback);
 
-		ret = parse_group_cfg_file(global_config, msg, pool, file);
-		if (ret < 0)
-			return ERR_READ_CONFIG;
-	} else {
-		if (fallback != NULL) {
-			syslog(LOG_DEBUG, "Loading default %s configuration '%s'", type, fallback);
-
-			ret = parse_group_cfg_file(global_config, msg, pool, fallback);
-			if (ret < 0)
-				return ERR_READ_CONFIG;
+		e = get_cached(global_config, fallback);
+		if (e == NULL) {
+			syslog(LOG_ERR, "cannot load config file %s", fallback);
+			return 0;
 		}
+	} else {
+		return 0;
 	}
 
+	if (e->ret < 0)
+		return ERR_READ_CONFIG;
+
+	if (merge_sup_config(msg, pool, e) < 0)
+		return ERR_READ_CONFIG;
+
 	return 0;
 }
 
@@ -285,4 +499,5 @@ static int get_sup_config(struct cfg_st *cfg, client_entry_st *entry,
 
 struct config_mod_st file_sup_config = {
 	.get_sup_config = get_sup_config,
+	.clear_cache = clear_cache,
 };
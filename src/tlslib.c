@@ -49,6 +49,7 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <c-ctype.h>
+#include <cloexec.h>
 
 void cstp_cork(worker_st *ws)
 {
@@ -284,7 +285,13 @@ void tls_cache_init(void *pool, tls_sess_db_st* db)
 	if (db->ht == NULL)
 		exit(1);
 
+	db->slab = slab_new(pool, MAX_SESSION_DATA_SIZE);
+	if (db->slab == NULL)
+		exit(1);
+
 	htable_init(db->ht, rehash, NULL);
+	list_head_init(&db->lru);
+	list_head_init(&db->expiry);
 	db->entries = 0;
 }
 
@@ -306,7 +313,10 @@ struct htable_iter iter;
         }
         htable_clear(db->ht);
 	db->entries = 0;
+	list_head_init(&db->lru);
+	list_head_init(&db->expiry);
 	talloc_free(db->ht);
+	talloc_free(db->slab);
 
         return;
 }
@@ -430,6 +440,10 @@ void tls_global_deinit(tls_st *creds)
 		gnutls_certificate_free_credentials(creds->xcred);
 	if (creds->cprio != NULL)
 		gnutls_priority_deinit(creds->cprio);
+	if (creds->ticket_key.data != NULL) {
+		safe_memset(creds->ticket_key.data, 0, creds->ticket_key.size);
+		gnutls_free(creds->ticket_key.data);
+	}
 
 	gnutls_global_deinit();
 
@@ -509,31 +523,65 @@ struct key_cb_data {
 	unsigned sa_len;
 };
 
+/* The connection of a worker to sec-mod. It is established on first use
+ * and carries all of the worker's requests; the private key operations,
+ * the authentication messages and the statistics.
+ */
+static int secmod_fd = -1;
+
+/* Returns the connected socket, or -1 with errno set */
+int secmod_channel(const struct sockaddr_un *sa, socklen_t sa_len)
+{
+	int sd, ret, e;
+
+	if (secmod_fd != -1)
+		return secmod_fd;
+
+	sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sd == -1)
+		return -1;
+
+	ret = connect(sd, (struct sockaddr *)sa, sa_len);
+	if (ret == -1) {
+		e = errno;
+		close(sd);
+		errno = e;
+		return -1;
+	}
+	set_cloexec_flag(sd, 1);
+
+	secmod_fd = sd;
+	return sd;
+}
+
+/* Closes the connection after a failed request, so that a late reply
+ * is never received as the reply to a subsequent request. */
+void secmod_channel_close(void)
+{
+	if (secmod_fd != -1) {
+		close(secmod_fd);
+		secmod_fd = -1;
+	}
+}
+
 static
 int key_cb_common_func (gnutls_privkey_t key, void* userdata, const gnutls_datum_t * raw_data,
 	gnutls_datum_t * output, unsigned type)
 {
 	struct key_cb_data* cdata = userdata;
-	int sd = -1, ret, e;
+	int sd, ret, e;
 	SecOpMsg msg = SEC_OP_MSG__INIT;
 	SecOpMsg *reply = NULL;
 	PROTOBUF_ALLOCATOR(pa, userdata);
 
 	output->data = NULL;
 
-	sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sd = secmod_channel(&cdata->sa, cdata->sa_len);
 	if (sd == -1) {
-		e = errno;
-		syslog(LOG_ERR, "error opening socket: %s", strerror(e));
-		return GNUTLS_E_INTERNAL_ERROR;
-	}
-
-	ret = connect(sd, (struct sockaddr *)&cdata->sa, cdata->sa_len);
-	if (ret == -1) {
 		e = errno;
 		syslog(LOG_ERR, "error connecting to sec-mod socket '%s': %s", 
 			cdata->sa.sun_path, strerror(e));
-		goto error;
+		return GNUTLS_E_INTERNAL_ERROR;
 	}
 
 	msg.has_key_idx = 1;
@@ -545,6 +593,7 @@ int key_cb_common_func (gnutls_privkey_t key, void* userdata, const gnutls_datum
 			(pack_size_func)sec_op_msg__get_packed_size,
 			(pack_func)sec_op_msg__pack);
 	if (ret < 0) {
+		secmod_channel_close();
 		goto error;
 	}
 
@@ -555,10 +604,9 @@ int key_cb_common_func (gnutls_privkey_t key, void* userdata, const gnutls_datum
 		e = errno;
 		syslog(LOG_ERR, "error receiving sec-mod reply: %s", 
 				strerror(e));
+		secmod_channel_close();
 		goto error;
 	}
-	close(sd);
-	sd = -1;
 
 	output->size = reply->data.len;
 	output->data = gnutls_malloc(reply->data.len);
@@ -573,8 +621,6 @@ int key_cb_common_func (gnutls_privkey_t key, void* userdata, const gnutls_datum
 	return 0;
 
 error:
-	if (sd != -1)
-		close(sd);
 	gnutls_free(output->data);
 	if (reply != NULL)
 		sec_op_msg__free_unpacked(reply, &pa);
@@ -760,6 +806,45 @@ int ret;
 	}
 }
 
+/* Generates the session ticket key when tickets are enabled, and
+ * replaces it once it is older than TLS_TICKET_KEY_LIFETIME(). The key
+ * is removed when tickets are disabled. Returns non-zero if the key
+ * changed; the workers forked before that hold the previous key.
+ */
+unsigned tls_update_ticket_key(main_server_st* s, tls_st *creds)
+{
+	time_t now = time(0);
+	int ret;
+
+	if (creds->ticket_key.data != NULL) {
+		if (s->config->tls_session_tickets != 0 &&
+		    now - creds->ticket_key_time < TLS_TICKET_KEY_LIFETIME(s->config))
+			return 0;
+
+		safe_memset(creds->ticket_key.data, 0, creds->ticket_key.size);
+		gnutls_free(creds->ticket_key.data);
+		creds->ticket_key.data = NULL;
+		creds->ticket_key.size = 0;
+	} else if (s->config->tls_session_tickets == 0) {
+		return 0;
+	}
+
+	if (s->config->tls_session_tickets != 0) {
+		ret = gnutls_session_ticket_key_generate(&creds->ticket_key);
+		if (ret < 0) {
+			mslog(s, NULL, LOG_ERR, "error generating the session ticket key: %s",
+			      gnutls_strerror(ret));
+			creds->ticket_key.data = NULL;
+			creds->ticket_key.size = 0;
+		} else {
+			creds->ticket_key_time = now;
+			mslog(s, NULL, LOG_DEBUG, "generated a new session ticket key");
+		}
+	}
+
+	return 1;
+}
+
 void tls_cork(gnutls_session_t session)
 {
 	gnutls_record_cork(session);
@@ -25,7 +25,11 @@
 #include <gnutls/pkcs11.h>
 #include <vpn.h>
 #include <ccan/htable/htable.h>
+#include <ccan/list/list.h>
+#include <slab.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 # if GNUTLS_VERSION_NUMBER < 0x030200
 #  define GNUTLS_DTLS1_2 202
@@ -35,6 +39,10 @@ typedef struct
 {
 	struct htable *ht;
 	unsigned int entries;
+
+	struct list_head lru; /* least recently used first */
+	struct list_head expiry; /* in the order of storage */
+	struct slab_st *slab; /* the session data */
 } tls_sess_db_st;
 
 #if 0
@@ -60,12 +68,21 @@ typedef struct tls_st {
 	gnutls_certificate_credentials_t xcred;
 	gnutls_priority_t cprio;
 	gnutls_dh_params_t dh_params;
+
+	/* the key encrypting the session tickets; when set it is
+	 * inherited by the workers */
+	gnutls_datum_t ticket_key;
+	time_t ticket_key_time;
 } tls_st;
 
 void tls_reload_crl(struct main_server_st* s, struct tls_st *creds);
 void tls_global_init(struct tls_st *creds);
 void tls_global_deinit(struct tls_st *creds);
 void tls_load_certs(struct main_server_st* s, struct tls_st *creds);
+unsigned tls_update_ticket_key(struct main_server_st* s, struct tls_st *creds);
+
+int secmod_channel(const struct sockaddr_un *sa, socklen_t sa_len);
+void secmod_channel_close(void);
 
 size_t tls_get_overhead(gnutls_protocol_t, gnutls_cipher_algorithm_t, gnutls_mac_algorithm_t);
 
@@ -117,6 +134,10 @@ void tls_fatal_close(gnutls_session_t session,
 
 typedef struct
 {
+  struct list_node lru;
+  struct list_node expiry;
+  time_t stored;
+
   /* does not allow resumption from different address
    * than the original */
   struct sockaddr_storage remote_addr;
@@ -125,11 +146,16 @@ typedef struct
   char session_id[GNUTLS_MAX_SESSION_ID];
   unsigned int session_id_size;
 
-  char session_data[MAX_SESSION_DATA_SIZE];
+  char *session_data; /* allocated from the db's slab */
   unsigned int session_data_size;
 } tls_cache_st;
 
 #define TLS_SESSION_EXPIRATION_TIME(config) ((config)->cookie_timeout)
+
+/* how often the session ticket key is replaced; it must outlive the
+ * tickets by enough that few of them are lost on rotation */
+#define TLS_TICKET_KEY_LIFETIME(config) \
+	(2*TLS_SESSION_EXPIRATION_TIME(config) > 3600 ? 2*TLS_SESSION_EXPIRATION_TIME(config) : 3600)
 #define DEFAULT_MAX_CACHED_TLS_SESSIONS 64
 
 void tls_cache_init(void *pool, tls_sess_db_st* db);
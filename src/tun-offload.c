@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <minmax.h>
+
+#include <tun-offload.h>
+
+/* When the tun device is in offload mode, the kernel passes TCP
+ * "super-packets" of up to 64kb, together with the segment size the
+ * packet should be split into. These are segmented here, before
+ * encryption, and each segment gets complete IP and TCP headers.
+ */
+
+#define IPPROTO_TCP_NUM 6
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_CWR 0x80
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += ((uint32_t)data[i] << 8) | data[i+1];
+	if (len & 1)
+		sum += (uint32_t)data[len-1] << 8;
+
+	return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum & 0xffff;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	       ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* calculates the TCP checksum of a packet, given the IP header size */
+static void tcp_checksum(uint8_t *pkt, size_t pkt_size, unsigned ip_hlen)
+{
+	uint8_t *tcp = pkt + ip_hlen;
+	size_t tcp_size = pkt_size - ip_hlen;
+	uint32_t sum = 0;
+
+	put16(tcp + 16, 0);
+
+	if ((pkt[0] >> 4) == 4) {
+		sum = csum_add(sum, pkt + 12, 8); /* addresses */
+	} else {
+		sum = csum_add(sum, pkt + 8, 32);
+	}
+	sum += IPPROTO_TCP_NUM;
+	sum += tcp_size;
+
+	sum = csum_add(sum, tcp, tcp_size);
+	put16(tcp + 16, csum_fold(sum));
+}
+
+static void ipv4_checksum(uint8_t *pkt, unsigned ip_hlen)
+{
+	put16(pkt + 10, 0);
+	put16(pkt + 10, csum_fold(csum_add(0, pkt, ip_hlen)));
+}
+
+/* completes a checksum that the kernel left partial */
+static int complete_checksum(const struct tun_vnet_hdr *vh,
+			     uint8_t *pkt, size_t pkt_size)
+{
+	unsigned start = vh->csum_start;
+	unsigned offset = start + vh->csum_offset;
+
+	if (start >= pkt_size || offset + 2 > pkt_size)
+		return -1;
+
+	put16(pkt + offset, csum_fold(csum_add(0, pkt + start, pkt_size - start)));
+	return 0;
+}
+
+/* Splits the packet according to the provided header into packets of
+ * at most out_size bytes. Each packet is written to out, and cb is
+ * called for it.
+ *
+ * Returns zero on success, -1 if the packet cannot be handled, or the
+ * negative value returned by cb.
+ */
+int tun_gso_segment(const struct tun_vnet_hdr *vh,
+		    const uint8_t *pkt, size_t pkt_size,
+		    uint8_t *out, size_t out_size,
+		    tun_segment_func cb, void *priv)
+{
+	unsigned type = vh->gso_type & ~TUN_VNET_GSO_ECN;
+	unsigned ip_hlen, hlen, mss, n, i;
+	size_t payload, off;
+	uint32_t seq;
+	uint16_t id = 0;
+	uint8_t flags;
+	int ret;
+
+	if (pkt_size == 0)
+		return -1;
+
+	if (type == TUN_VNET_GSO_NONE) {
+		if (pkt_size > out_size)
+			return -1;
+		memcpy(out, pkt, pkt_size);
+
+		if ((vh->flags & TUN_VNET_F_NEEDS_CSUM) &&
+		    complete_checksum(vh, out, pkt_size) < 0)
+			return -1;
+
+		ret = cb(priv, out, pkt_size);
+		return (ret < 0) ? ret : 0;
+	}
+
+	if (type == TUN_VNET_GSO_TCPV4) {
+		if (pkt_size < 20 || (pkt[0] >> 4) != 4)
+			return -1;
+		ip_hlen = (pkt[0] & 0x0f) * 4;
+		if (ip_hlen < 20 || pkt[9] != IPPROTO_TCP_NUM)
+			return -1;
+		id = get16(pkt + 4);
+	} else if (type == TUN_VNET_GSO_TCPV6) {
+		/* extension headers are not supported */
+		if (pkt_size < 40 || (pkt[0] >> 4) != 6 || pkt[6] != IPPROTO_TCP_NUM)
+			return -1;
+		ip_hlen = 40;
+	} else {
+		return -1;
+	}
+
+	if (ip_hlen + 20 > pkt_size)
+		return -1;
+
+	hlen = ip_hlen + (pkt[ip_hlen + 12] >> 4) * 4;
+	if (hlen > pkt_size || hlen >= out_size)
+		return -1;
+
+	mss = vh->gso_size;
+	if (mss == 0)
+		return -1;
+	/* segments may be shorter than requested, but never larger */
+	if (hlen + mss > out_size)
+		mss = out_size - hlen;
+
+	seq = get32(pkt + ip_hlen + 4);
+	flags = pkt[ip_hlen + 13];
+	payload = pkt_size - hlen;
+
+	off = 0;
+	i = 0;
+	do {
+		n = MIN(mss, payload - off);
+
+		memcpy(out, pkt, hlen);
+		memcpy(out + hlen, pkt + hlen + off, n);
+
+		put32(out + ip_hlen + 4, seq + off);
+		out[ip_hlen + 13] = flags;
+		if (off + n < payload)
+			out[ip_hlen + 13] &= ~(TCP_FLAG_FIN|TCP_FLAG_PSH);
+		if (off > 0)
+			out[ip_hlen + 13] &= ~TCP_FLAG_CWR;
+
+		if (type == TUN_VNET_GSO_TCPV4) {
+			put16(out + 2, hlen + n);
+			put16(out + 4, id + i);
+			ipv4_checksum(out, ip_hlen);
+		} else {
+			put16(out + 4, hlen + n - ip_hlen);
+		}
+		tcp_checksum(out, hlen + n, ip_hlen);
+
+		ret = cb(priv, out, hlen + n);
+		if (ret < 0)
+			return ret;
+
+		off += n;
+		i++;
+	} while (off < payload);
+
+	return 0;
+}
+
+/* Writes a packet to a device in offload mode. We don't request any
+ * offload for packets towards the kernel; the header is left empty. */
+ssize_t tun_write_vnet(int sockfd, const void *buf, size_t len)
+{
+	struct tun_vnet_hdr vh;
+	struct iovec iov[2];
+	ssize_t ret;
+
+	memset(&vh, 0, sizeof(vh));
+	iov[0].iov_base = &vh;
+	iov[0].iov_len = sizeof(vh);
+	iov[1].iov_base = (void*)buf;
+	iov[1].iov_len = len;
+
+	do {
+		ret = writev(sockfd, iov, 2);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret >= (ssize_t)sizeof(vh))
+		ret -= sizeof(vh);
+	return ret;
+}
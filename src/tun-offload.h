@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TUN_OFFLOAD_H
+# define TUN_OFFLOAD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The offload mode relies on the IFF_VNET_HDR feature of the linux
+ * tun driver. */
+#ifdef __linux__
+# define ENABLE_TUN_OFFLOAD
+#endif
+
+/* The header preceding every packet of an IFF_VNET_HDR device
+ * (struct virtio_net_hdr); in host byte order. */
+struct tun_vnet_hdr {
+	uint8_t flags;
+	uint8_t gso_type;
+	uint16_t hdr_len;
+	uint16_t gso_size;
+	uint16_t csum_start;
+	uint16_t csum_offset;
+};
+
+#define TUN_VNET_F_NEEDS_CSUM 1
+
+#define TUN_VNET_GSO_NONE 0
+#define TUN_VNET_GSO_TCPV4 1
+#define TUN_VNET_GSO_TCPV6 4
+#define TUN_VNET_GSO_ECN 0x80
+
+/* The largest packet read from the device, including the header */
+#define TUN_GSO_BUF_SIZE (65536 + sizeof(struct tun_vnet_hdr))
+
+/* Called for every packet produced by tun_gso_segment(); a negative
+ * return value aborts the segmentation. */
+typedef int (*tun_segment_func)(void *priv, uint8_t *pkt, size_t pkt_size);
+
+int tun_gso_segment(const struct tun_vnet_hdr *vh,
+		    const uint8_t *pkt, size_t pkt_size,
+		    uint8_t *out, size_t out_size,
+		    tun_segment_func cb, void *priv);
+
+ssize_t tun_write_vnet(int sockfd, const void *buf, size_t len);
+
+#endif
@@ -41,6 +41,21 @@
 #elif defined(HAVE_NET_IF_TUN_H)
 # include <net/if_tun.h>
 #endif
+#include <tun-offload.h>
+
+#ifdef ENABLE_TUN_OFFLOAD
+# ifndef IFF_VNET_HDR
+#  define IFF_VNET_HDR 0x4000
+# endif
+# ifndef TUNSETOFFLOAD
+#  define TUNSETOFFLOAD _IOW('T', 208, unsigned int)
+# endif
+# ifndef TUN_F_CSUM
+#  define TUN_F_CSUM 0x01
+#  define TUN_F_TSO4 0x02
+#  define TUN_F_TSO6 0x04
+# endif
+#endif
 
 #include <netdb.h>
 #include <vpn.h>
@@ -484,9 +499,6 @@ int open_tun(main_server_st * s, struct proc_st *proc)
 	struct ifreq ifr;
 	unsigned int t;
 
-	ret = get_ip_leases(s, proc);
-	if (ret < 0)
-		return ret;
 	snprintf(proc->tun_lease.name, sizeof(proc->tun_lease.name), "%s%%d",
 		 s->config->network.name);
 
@@ -507,6 +519,11 @@ int open_tun(main_server_st * s, struct proc_st *proc)
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+#ifdef ENABLE_TUN_OFFLOAD
+	/* the worker expects a header in every packet when this is set */
+	if (s->config->tun_offload)
+		ifr.ifr_flags |= IFF_VNET_HDR;
+#endif
 
 	memcpy(ifr.ifr_name, proc->tun_lease.name, IFNAMSIZ);
 
@@ -520,6 +537,20 @@ int open_tun(main_server_st * s, struct proc_st *proc)
 	mslog(s, proc, LOG_DEBUG, "assigning tun device %s\n",
 	      proc->tun_lease.name);
 
+#ifdef ENABLE_TUN_OFFLOAD
+	if (s->config->tun_offload) {
+		/* allow the kernel to pass us TCP packets of up to 64kb, which
+		 * the worker segments itself. Without it, the device still
+		 * works, albeit with MTU-sized packets. */
+		t = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+		if (ioctl(tunfd, TUNSETOFFLOAD, t) < 0) {
+			e = errno;
+			mslog(s, NULL, LOG_INFO, "%s: TUNSETOFFLOAD: %s\n",
+			      proc->tun_lease.name, strerror(e));
+		}
+	}
+#endif
+
 	/* we no longer use persistent tun */
 	if (ioctl(tunfd, TUNSETPERSIST, (void *)0) < 0) {
 		e = errno;
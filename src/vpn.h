@@ -68,10 +68,15 @@ typedef enum {
 #define DEFAULT_KKDCP_POINTS 1
 #define DEFAULT_MAX_BAN_SCORE (MAX_PASSWORD_TRIES*DEFAULT_PASSWORD_POINTS)
 #define DEFAULT_BAN_RESET_TIME 300
+#define DEFAULT_BAN_IPV4_PREFIX 24
+#define DEFAULT_BAN_IPV6_PREFIX 64
 
 #define MIN_NO_COMPRESS_LIMIT 64
 #define DEFAULT_NO_COMPRESS_LIMIT 256
 
+/* The maximum number of packets read from the TUN device per wakeup */
+#define DEFAULT_TUN_READ_BATCH 16
+
 /* Timeout (secs) for communication between main and sec-mod */
 #define MAIN_SEC_MOD_TIMEOUT 120
 
@@ -131,6 +136,8 @@ extern int syslog_open;
 #define ERR_PEER_TERMINATED -11
 #define ERR_CTL -12
 #define ERR_NO_CMD_FD -13
+#define ERR_WAIT_FOR_PING -14
+#define ERR_AUTH_PENDING -15
 
 #define ERR_WORKER_TERMINATED ERR_PEER_TERMINATED
 
@@ -159,6 +166,7 @@ typedef enum {
 	CMD_SESSION_INFO = 13,
 	CMD_BAN_IP = 16,
 	CMD_BAN_IP_REPLY = 17,
+	CMD_WORKER_STARTUP = 18,
 
 	/* from worker to sec-mod */
 	SM_CMD_AUTH_INIT = 120,
@@ -168,6 +176,10 @@ typedef enum {
 	SM_CMD_SIGN,
 	SM_CMD_CLI_STATS,
 
+	/* from sec-mod to its signer processes */
+	SM_CMD_SIGNER_OP = 140,
+	SM_CMD_SIGNER_STARTED,
+
 	/* from main to sec-mod and vice versa */
 	MIN_SM_MAIN_CMD=239,
 	SM_CMD_AUTH_SESSION_OPEN, /* sync: reply is SM_CMD_AUTH_SESSION_REPLY */
@@ -176,6 +188,7 @@ typedef enum {
 	SM_CMD_AUTH_BAN_IP,
 	SM_CMD_AUTH_BAN_IP_REPLY,
 	SM_CMD_AUTH_CLI_STATS,
+	SM_CMD_SECMOD_STATS, /* async: no reply */
 
 	MAX_SM_MAIN_CMD,
 } cmd_request_t;
@@ -323,6 +336,7 @@ struct cfg_st {
 	time_t cookie_timeout;	/* in seconds */
 	time_t session_timeout;	/* in seconds */
 	unsigned persistent_cookies; /* whether cookies stay valid after disconnect */
+	unsigned tls_session_tickets; /* resume with tickets rather than main's session cache */
 
 	time_t rekey_time;	/* in seconds */
 	unsigned rekey_method; /* REKEY_METHOD_ */
@@ -330,6 +344,9 @@ struct cfg_st {
 	time_t min_reauth_time;	/* after a failed auth, how soon one can reauthenticate -> in seconds */
 	int max_ban_score;	/* the score allowed before a user is banned (see vpn.h) */
 	int ban_reset_time;
+	int max_ban_prefix_score; /* the score allowed before a whole prefix is banned */
+	unsigned ban_ipv4_prefix;
+	unsigned ban_ipv6_prefix;
 
 	unsigned ban_points_wrong_password;
 	unsigned ban_points_connect;
@@ -356,6 +373,10 @@ struct cfg_st {
 	                               * and allow auth to complete in different
 	                               * TCP sessions. */
 	unsigned rate_limit_ms; /* if non zero force a connection every rate_limit milliseconds */
+	unsigned rate_limit_burst; /* the connections accepted at once under rate_limit_ms */
+	unsigned prefork_min_idle; /* if non zero keep idle pre-forked workers */
+	unsigned prefork_max_idle;
+	unsigned sec_mod_signers; /* the number of sec-mod signer processes */
 	unsigned ping_leases; /* non zero if we need to ping prior to leasing */
 
 	size_t rx_per_sec;
@@ -365,6 +386,9 @@ struct cfg_st {
 	char *crl;
 
 	unsigned output_buffer;
+	unsigned tun_read_batch; /* packets to read from tun per wakeup */
+	unsigned udp_gso; /* boolean */
+	unsigned tun_offload; /* boolean */
 	unsigned default_mtu;
 	unsigned predictable_ips; /* boolean */
 
@@ -406,6 +430,7 @@ struct perm_cfg_st {
 
 	char *chroot_dir;	/* where the xml files are served from */
 	char* occtl_socket_file;
+	char* metrics_socket; /* a path, or host:port */
 	char* socket_file_prefix;
 
 	uid_t uid;
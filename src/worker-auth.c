@@ -711,25 +711,15 @@ static int recv_cookie_auth_reply(worker_st * ws)
 	return ret;
 }
 
-/* returns the fd */
+/* returns the fd of the channel to sec-mod; it must not be closed
+ * by the caller */
 int connect_to_secmod(worker_st * ws)
 {
-	int sd, ret, e;
+	int sd, e;
 
-	sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sd = secmod_channel(&ws->secmod_addr, ws->secmod_addr_len);
 	if (sd == -1) {
 		e = errno;
-		oclog(ws, LOG_ERR, "error opening unix socket (for sec-mod) %s",
-		      strerror(e));
-		return -1;
-	}
-
-	ret =
-	    connect(sd, (struct sockaddr *)&ws->secmod_addr,
-		    ws->secmod_addr_len);
-	if (ret < 0) {
-		e = errno;
-		close(sd);
 		oclog(ws, LOG_ERR,
 		      "error connecting to sec-mod socket '%s': %s",
 		      ws->secmod_addr.sun_path, strerror(e));
@@ -1519,10 +1509,9 @@ int post_auth_handler(worker_st * ws, unsigned http_ver)
 	}
 
 	ret = recv_auth_reply(ws, sd, &msg, &pcounter);
-	if (sd != -1) {
-		close(sd);
-		sd = -1;
-	}
+	/* sec-mod closes the connection on failure */
+	if (ret < 0 && ret != ERR_AUTH_CONTINUE)
+		secmod_channel_close();
 
 	if (ret == ERR_AUTH_CONTINUE) {
 		oclog(ws, LOG_DEBUG, "continuing authentication for '%s'",
@@ -1565,8 +1554,6 @@ int post_auth_handler(worker_st * ws, unsigned http_ver)
 
  auth_fail:
 
-	if (sd != -1)
-		close(sd);
 	oclog(ws, LOG_HTTP_DEBUG, "HTTP sending: 401 Unauthorized");
 	cstp_printf(ws,
 		   "HTTP/1.%d 401 Unauthorized\r\nContent-Length: 0\r\nX-Reason: %s\r\n\r\n",
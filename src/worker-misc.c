@@ -154,6 +154,10 @@ int handle_worker_commands(struct worker_st *ws)
 
 				ws->dtls_tptr.fd = fd;
 				set_non_block(fd);
+				dtls_batch_reset(&ws->dtls_tptr);
+
+				/* the old fd was closed; force re-registration in the main loop */
+				ws->ev_dtls_fd = -1;
 
 				oclog(ws, LOG_DEBUG, "received new UDP fd and connected to peer");
 				return 0;
@@ -193,6 +197,51 @@ unsigned check_if_default_route(char **routes, unsigned routes_size)
 	return 0;
 }
 
+/* Waits for the connection to be handed over to a pre-forked worker
+ * by the main process.
+ *
+ * Returns 0 on success.
+ */
+int worker_recv_startup(worker_st * ws)
+{
+	int ret;
+	int socketfd = -1;
+	WorkerStartupMsg *msg = NULL;
+	PROTOBUF_ALLOCATOR(pa, ws);
+
+	ret = recv_socket_msg(ws, ws->cmd_fd, CMD_WORKER_STARTUP, &socketfd,
+			      (void *)&msg,
+			      (unpack_func) worker_startup_msg__unpack, 0);
+	if (ret < 0) {
+		/* the main process has terminated or replaced us */
+		return ret;
+	}
+
+	if (socketfd == -1 ||
+	    msg->remote_addr.len > sizeof(ws->remote_addr) ||
+	    msg->our_addr.len > sizeof(ws->our_addr)) {
+		oclog(ws, LOG_ERR, "received invalid startup message");
+		if (socketfd != -1)
+			close(socketfd);
+		ret = -1;
+		goto cleanup;
+	}
+
+	memcpy(&ws->remote_addr, msg->remote_addr.data, msg->remote_addr.len);
+	ws->remote_addr_len = msg->remote_addr.len;
+	memcpy(&ws->our_addr, msg->our_addr.data, msg->our_addr.len);
+	ws->our_addr_len = msg->our_addr.len;
+	ws->conn_type = msg->sock_type;
+	ws->conn_fd = socketfd;
+	if (msg->has_stats_slot)
+		ws->stats_slot = msg->stats_slot;
+
+	ret = 0;
+ cleanup:
+	worker_startup_msg__free_unpacked(msg, &pa);
+	return ret;
+}
+
 /* Completes the VPN device information.
  * 
  * Returns 0 on success.
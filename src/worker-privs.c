@@ -63,6 +63,12 @@ int disable_system_calls(struct worker_st *ws)
 
 	ADD_SYSCALL(recvmsg, 0);
 	ADD_SYSCALL(sendmsg, 0);
+#ifdef HAVE_RECVMMSG
+	ADD_SYSCALL(recvmmsg, 0);
+#endif
+#ifdef HAVE_SENDMMSG
+	ADD_SYSCALL(sendmmsg, 0);
+#endif
 
 	ADD_SYSCALL(read, 0);
 
@@ -91,6 +97,19 @@ int disable_system_calls(struct worker_st *ws)
 	ADD_SYSCALL(_newselect, 0);
 
 	ADD_SYSCALL(pselect6, 0);
+
+	/* the timed reads of IPC messages use poll(); glibc may
+	 * implement it with ppoll() */
+	ADD_SYSCALL(poll, 0);
+	ADD_SYSCALL(ppoll, 0);
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+	ADD_SYSCALL(epoll_create1, 0);
+	ADD_SYSCALL(epoll_ctl, 0);
+	ADD_SYSCALL(epoll_wait, 0);
+	ADD_SYSCALL(epoll_pwait, 0);
+	ADD_SYSCALL(timerfd_create, 0);
+	ADD_SYSCALL(timerfd_settime, 0);
+#endif
 	ADD_SYSCALL(close, 0);
 	ADD_SYSCALL(exit, 0);
 	ADD_SYSCALL(exit_group, 0);
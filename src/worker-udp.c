@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#ifdef __linux__
+# include <netinet/udp.h>
+#endif
+
+#include <vpn.h>
+#include <worker.h>
+
+/* The batched UDP transport of the DTLS channel. Incoming datagrams
+ * are read in batches with recvmmsg() into a ring, from which GnuTLS
+ * pulls one datagram at a time. While the transport is corked (see
+ * dtls_cork()), outgoing records are queued and sent in a single
+ * sendmmsg() call on dtls_uncork().
+ *
+ * On systems without these calls, every datagram is transferred with
+ * a separate recv() or send().
+ *
+ * When udp-gso is enabled, consecutive queued records of the same size
+ * are sent as a single UDP_SEGMENT (GSO) message, and the kernel splits
+ * them into datagrams. If the kernel refuses, GSO is disabled for the
+ * session and the records are sent individually.
+ */
+
+#if defined(__linux__) && defined(HAVE_SENDMMSG)
+# define ENABLE_UDP_GSO
+# ifndef UDP_SEGMENT
+#  define UDP_SEGMENT 103
+# endif
+# ifndef SOL_UDP
+#  define SOL_UDP 17
+# endif
+#endif
+
+/* the maximum payload of a single GSO message */
+#define MAX_GSO_SIZE 65000
+
+/* on top of the link MTU, to accommodate clients which do not
+ * respect the advertised MTU */
+#define DTLS_SLOT_MARGIN 256
+#define DTLS_MIN_SLOT_SIZE 1500
+
+static dtls_batch_st *batch_new(void *pool, unsigned slot_size)
+{
+	dtls_batch_st *b;
+
+	b = talloc_zero(pool, dtls_batch_st);
+	if (b == NULL)
+		return NULL;
+
+	b->data = talloc_size(b, slot_size * DTLS_BATCH_SIZE);
+	if (b->data == NULL) {
+		talloc_free(b);
+		return NULL;
+	}
+	b->slot_size = slot_size;
+
+	return b;
+}
+
+int dtls_batch_init(struct worker_st *ws)
+{
+	dtls_transport_ptr *p = &ws->dtls_tptr;
+	unsigned slot_size;
+
+	if (p->rx != NULL)
+		return 0;
+
+	slot_size = MAX(ws->vinfo.mtu, DTLS_MIN_SLOT_SIZE) + DTLS_SLOT_MARGIN;
+
+	p->rx = batch_new(ws, slot_size);
+	p->tx = batch_new(ws, slot_size);
+	if (p->rx == NULL || p->tx == NULL) {
+		talloc_free(p->rx);
+		talloc_free(p->tx);
+		p->rx = p->tx = NULL;
+		return -1;
+	}
+
+#ifdef ENABLE_UDP_GSO
+	p->gso = ws->config->udp_gso;
+#endif
+
+	return 0;
+}
+
+/* Drops any buffered datagrams; used when the UDP socket is replaced */
+void dtls_batch_reset(dtls_transport_ptr *p)
+{
+	if (p->rx) {
+		p->rx->count = 0;
+		p->rx->pos = 0;
+	}
+	if (p->tx)
+		p->tx->count = 0;
+}
+
+#ifdef HAVE_RECVMMSG
+static ssize_t batch_fill(dtls_transport_ptr *p)
+{
+	dtls_batch_st *b = p->rx;
+	struct mmsghdr msgs[DTLS_BATCH_SIZE];
+	struct iovec iov[DTLS_BATCH_SIZE];
+	unsigned i;
+	int ret;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < DTLS_BATCH_SIZE; i++) {
+		iov[i].iov_base = b->data + i * b->slot_size;
+		iov[i].iov_len = b->slot_size;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	do {
+		ret = recvmmsg(p->fd, msgs, DTLS_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret <= 0)
+		return ret;
+
+	for (i = 0; i < (unsigned)ret; i++) {
+		b->size[i] = msgs[i].msg_len;
+	}
+	b->count = ret;
+	b->pos = 0;
+
+	return ret;
+}
+#endif
+
+unsigned dtls_batch_pending(dtls_transport_ptr *p)
+{
+	if (p->rx == NULL)
+		return 0;
+	return p->rx->count - p->rx->pos;
+}
+
+ssize_t dtls_batch_recv(dtls_transport_ptr *p, void *data, size_t size)
+{
+#ifdef HAVE_RECVMMSG
+	dtls_batch_st *b = p->rx;
+	ssize_t ret;
+
+	if (b == NULL)
+		return recv(p->fd, data, size, 0);
+
+	if (b->pos >= b->count) {
+		ret = batch_fill(p);
+		if (ret <= 0)
+			return ret;
+	}
+
+	/* datagram semantics; anything that doesn't fit is discarded */
+	ret = MIN(size, b->size[b->pos]);
+	memcpy(data, b->data + b->pos * b->slot_size, ret);
+	b->pos++;
+
+	return ret;
+#else
+	return recv(p->fd, data, size, 0);
+#endif
+}
+
+void dtls_cork(struct worker_st *ws)
+{
+#ifdef HAVE_SENDMMSG
+	if (ws->dtls_tptr.tx != NULL)
+		ws->dtls_tptr.corked = 1;
+#endif
+}
+
+ssize_t dtls_batch_send(dtls_transport_ptr *p, const void *data, size_t size)
+{
+#ifdef HAVE_SENDMMSG
+	dtls_batch_st *b = p->tx;
+	int ret;
+
+	if (p->corked == 0 || b == NULL || size > b->slot_size)
+		return send(p->fd, data, size, 0);
+
+	if (b->count >= DTLS_BATCH_SIZE) {
+		ret = dtls_batch_flush(p);
+		if (ret < 0 && errno != EMSGSIZE)
+			return ret;
+	}
+
+	memcpy(b->data + b->count * b->slot_size, data, size);
+	b->size[b->count] = size;
+	b->count++;
+
+	return size;
+#else
+	return send(p->fd, data, size, 0);
+#endif
+}
+
+#ifdef HAVE_SENDMMSG
+/* Prepares the messages to send the queued records. With GSO, a message
+ * contains a run of records of the same size; only the last record
+ * of a run may be shorter. Returns the number of messages.
+ */
+static unsigned batch_prepare(dtls_transport_ptr *p, struct mmsghdr *msgs,
+			      struct iovec *iov, uint8_t *control)
+{
+	dtls_batch_st *b = p->tx;
+	unsigned i, n = 0, run_size = 0, run_total = 0;
+	struct msghdr *hdr = NULL;
+#ifdef ENABLE_UDP_GSO
+	struct cmsghdr *cmsg;
+	uint16_t segment;
+#endif
+
+	memset(msgs, 0, sizeof(struct mmsghdr) * DTLS_BATCH_SIZE);
+
+	for (i = 0; i < b->count; i++) {
+		iov[i].iov_base = b->data + i * b->slot_size;
+		iov[i].iov_len = b->size[i];
+
+		/* continue the current run if possible */
+		if (p->gso && hdr != NULL && b->size[i] <= run_size &&
+		    run_total + b->size[i] <= MAX_GSO_SIZE) {
+			hdr->msg_iovlen++;
+			run_total += b->size[i];
+			if (b->size[i] < run_size) /* that ends the run */
+				run_size = 0;
+			continue;
+		}
+
+		hdr = &msgs[n++].msg_hdr;
+		hdr->msg_iov = &iov[i];
+		hdr->msg_iovlen = 1;
+		run_size = b->size[i];
+		run_total = b->size[i];
+	}
+
+#ifdef ENABLE_UDP_GSO
+	if (p->gso == 0)
+		return n;
+
+	for (i = 0; i < n; i++) {
+		hdr = &msgs[i].msg_hdr;
+		if (hdr->msg_iovlen <= 1)
+			continue;
+
+		hdr->msg_control = control + i * CMSG_SPACE(sizeof(uint16_t));
+		hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+		cmsg = CMSG_FIRSTHDR(hdr);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		segment = hdr->msg_iov[0].iov_len;
+		memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+	}
+#endif
+
+	return n;
+}
+#endif
+
+/* Sends all the queued records. Returns zero on success, or -1 with
+ * errno set. If any of the records was too large for the path, the
+ * others are sent and errno is set to EMSGSIZE.
+ */
+int dtls_batch_flush(dtls_transport_ptr *p)
+{
+#ifdef HAVE_SENDMMSG
+	dtls_batch_st *b = p->tx;
+	struct mmsghdr msgs[DTLS_BATCH_SIZE];
+	struct iovec iov[DTLS_BATCH_SIZE];
+	uint8_t control[DTLS_BATCH_SIZE * CMSG_SPACE(sizeof(uint16_t))];
+	unsigned sent = 0, too_large = 0, n;
+	int ret, e;
+
+	if (b == NULL || b->count == 0)
+		return 0;
+
+#ifdef ENABLE_UDP_GSO
+ restart:
+#endif
+	n = batch_prepare(p, msgs, iov, control);
+
+	while (sent < n) {
+		ret = sendmmsg(p->fd, msgs + sent, n - sent, 0);
+		if (ret == -1) {
+			e = errno;
+			if (e == EINTR)
+				continue;
+			if (e == EAGAIN) {
+				/* do not cause mayhem */
+				ms_sleep(20);
+				continue;
+			}
+#ifdef ENABLE_UDP_GSO
+			if (p->gso && (e == EIO || e == EINVAL ||
+			    e == ENOPROTOOPT || e == EOPNOTSUPP)) {
+				/* the kernel or the device cannot segment */
+				p->gso = 0;
+				if (sent == 0)
+					goto restart;
+				/* drop the failed message; never send a record twice */
+				sent++;
+				continue;
+			}
+#endif
+			if (e == EMSGSIZE) {
+				/* skip that message */
+				too_large = 1;
+				sent++;
+				continue;
+			}
+			b->count = 0;
+			errno = e;
+			return -1;
+		}
+		sent += ret;
+	}
+	b->count = 0;
+
+	if (too_large) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+int dtls_uncork(struct worker_st *ws)
+{
+	ws->dtls_tptr.corked = 0;
+	return dtls_batch_flush(&ws->dtls_tptr);
+}
@@ -45,6 +45,7 @@
 #include <c-strcase.h>
 #include <c-ctype.h>
 #include <worker-bandwidth.h>
+#include <tun-offload.h>
 
 #if defined(__linux__) &&!defined(IPV6_PATHMTU)
 # define IPV6_PATHMTU 61
@@ -62,6 +63,20 @@
 # define ZERO_COPY
 #endif
 
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+# define USE_EPOLL
+# include <sys/epoll.h>
+# include <sys/timerfd.h>
+#endif
+
+/* the descriptors found ready in the worker's main loop */
+#define WEV_CONN 1
+#define WEV_CMD (1<<1)
+#define WEV_TUN (1<<2)
+#define WEV_DTLS (1<<3)
+#define WEV_TIMER (1<<4)
+#define MAX_WORKER_EVENTS 8
+
 #define MIN_MTU(ws) (((ws)->vinfo.ipv6!=NULL)?1281:257)
 
 #define PERIODIC_CHECK_TIME 30
@@ -111,7 +126,7 @@ inline static ssize_t dtls_pull_buffer_non_empty(gnutls_transport_ptr_t ptr)
 	dtls_transport_ptr *p = ptr;
 	if (p->msg)
 		return 1;
-	return 0;
+	return dtls_batch_pending(p);
 }
 
 static
@@ -130,7 +145,7 @@ ssize_t dtls_pull(gnutls_transport_ptr_t ptr, void *data, size_t size)
 		p->msg = NULL;
 		return need;
 	}
-	return recv(p->fd, data, size, 0);
+	return dtls_batch_recv(p, data, size);
 }
 
 static
@@ -169,7 +184,7 @@ ssize_t dtls_push(gnutls_transport_ptr_t ptr, const void *data, size_t size)
 {
 	dtls_transport_ptr *p = ptr;
 
-	return send(p->fd, data, size, 0);
+	return dtls_batch_send(p, data, size);
 }
 
 static int setup_dtls_connection(struct worker_st *ws)
@@ -230,6 +245,9 @@ static int setup_dtls_connection(struct worker_st *ws)
 		goto fail;
 	}
 
+	if (dtls_batch_init(ws) < 0)
+		oclog(ws, LOG_INFO, "could not allocate the UDP batch buffers");
+
 	gnutls_transport_set_push_function(session, dtls_push);
 	gnutls_transport_set_pull_function(session, dtls_pull);
 	gnutls_transport_set_pull_timeout_function(session, dtls_pull_timeout);
@@ -301,6 +319,13 @@ void ws_add_score_to_ip(worker_st *ws, unsigned points, unsigned final)
 	return;
 }
 
+/* Publishes the tun device stats to the session's slot, if any */
+inline static void update_stats_slot(worker_st * ws)
+{
+	if (ws->stats != NULL)
+		stats_slot_update(ws->stats, ws->tun_bytes_in, ws->tun_bytes_out);
+}
+
 void send_stats_to_secmod(worker_st * ws, time_t now, unsigned discon_reason)
 {
 	CliStatsMsg msg = CLI_STATS_MSG__INIT;
@@ -335,7 +360,8 @@ void send_stats_to_secmod(worker_st * ws, time_t now, unsigned discon_reason)
 		ret = send_msg_to_secmod(ws, sd, SM_CMD_CLI_STATS, &msg,
 				 (pack_size_func)cli_stats_msg__get_packed_size,
 				 (pack_func) cli_stats_msg__pack);
-		close(sd);
+		if (ret < 0)
+			secmod_channel_close();
 
 		if (ret >= 0) {
 			oclog(ws, LOG_DEBUG,
@@ -456,7 +482,18 @@ void vpn_server(struct worker_st *ws)
 
 		gnutls_transport_set_ptr(session,
 				 (gnutls_transport_ptr_t) (long)ws->conn_fd);
-		set_resume_db_funcs(session);
+		if (ws->config->tls_session_tickets != 0 && ws->creds->ticket_key.data != NULL) {
+			/* resumption is handled by the tickets, without the main's session cache;
+			 * unlike the cached sessions, the tickets are not bound to the client's
+			 * address, as they carry no application data */
+			ret = gnutls_session_ticket_enable_server(session, &ws->creds->ticket_key);
+			GNUTLS_FATAL_ERR(ret);
+
+			/* the session keeps its own copy */
+			safe_memset(ws->creds->ticket_key.data, 0, ws->creds->ticket_key.size);
+		} else {
+			set_resume_db_funcs(session);
+		}
 		gnutls_session_set_ptr(session, ws);
 		gnutls_db_set_ptr(session, ws);
 		gnutls_db_set_cache_expiration(session, TLS_SESSION_EXPIRATION_TIME(ws->config));
@@ -759,22 +796,15 @@ void mtu_ok(worker_st * ws)
 			x += r % diff; \
 		}
 
+/* Checks the idle, session and DPD timers, and sends the
+ * statistics to sec-mod when due.
+ */
 static
-int periodic_check(worker_st * ws, unsigned mtu_overhead, struct timespec *tnow,
-		   unsigned dpd)
+int run_periodic_check(worker_st * ws, unsigned mtu_overhead, time_t now,
+		       unsigned dpd)
 {
 	socklen_t sl;
 	int max, e, ret;
-	time_t now = tnow->tv_sec;
-	time_t periodic_check_time = PERIODIC_CHECK_TIME;
-
-	/* modify timers with a fuzzying factor, to prevent all worker processes
-	 * to act at exactly the same time (e.g., after a server restart on which
-	 * all clients reconnect at the same time). */
-	FUZZ(periodic_check_time, 5, tnow->tv_nsec);
-
-	if (now - ws->last_periodic_check < periodic_check_time)
-		return 0;
 
 	if (ws->config->idle_timeout > 0) {
 		if (now - ws->last_nc_msg > ws->config->idle_timeout) {
@@ -798,7 +828,8 @@ int periodic_check(worker_st * ws, unsigned mtu_overhead, struct timespec *tnow,
 		}
 	}
 
-	if (ws->config->stats_report_time > 0 &&
+	/* with a stats slot, sec-mod reads the stats itself */
+	if (ws->stats == NULL && ws->config->stats_report_time > 0 &&
 	    now - ws->last_stats_msg >= ws->config->stats_report_time &&
 	    ws->sid_set) {
 		send_stats_to_secmod(ws, now, 0);
@@ -868,6 +899,138 @@ int periodic_check(worker_st * ws, unsigned mtu_overhead, struct timespec *tnow,
 	return 0;
 }
 
+static
+int periodic_check(worker_st * ws, unsigned mtu_overhead, struct timespec *tnow,
+		   unsigned dpd)
+{
+	time_t now = tnow->tv_sec;
+	time_t periodic_check_time = PERIODIC_CHECK_TIME;
+
+	/* modify timers with a fuzzying factor, to prevent all worker processes
+	 * to act at exactly the same time (e.g., after a server restart on which
+	 * all clients reconnect at the same time). */
+	FUZZ(periodic_check_time, 5, tnow->tv_nsec);
+
+	if (now - ws->last_periodic_check < periodic_check_time)
+		return 0;
+
+	return run_periodic_check(ws, mtu_overhead, now, dpd);
+}
+
+#ifdef USE_EPOLL
+static int worker_ev_add(worker_st * ws, int fd, unsigned id)
+{
+	struct epoll_event ee;
+	int e;
+
+	memset(&ee, 0, sizeof(ee));
+	ee.events = EPOLLIN;
+	ee.data.u32 = id;
+
+	if (epoll_ctl(ws->ev_fd, EPOLL_CTL_ADD, fd, &ee) == -1 && errno != EEXIST) {
+		e = errno;
+		oclog(ws, LOG_ERR, "error adding fd %d to epoll: %s", fd, strerror(e));
+		return -1;
+	}
+	return 0;
+}
+
+/* Sets up the persistent interest set of the main loop. The
+ * periodic checks (DPD, timeouts, stats) are driven by a timerfd
+ * so that they are not evaluated on every wakeup.
+ */
+static int worker_ev_init(worker_st * ws, struct timespec *tnow)
+{
+	struct itimerspec its;
+	time_t periodic_check_time = PERIODIC_CHECK_TIME;
+	int e;
+
+	ws->ev_dtls_fd = -1;
+
+	ws->ev_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ws->ev_fd == -1) {
+		e = errno;
+		oclog(ws, LOG_ERR, "error in epoll_create1(): %s", strerror(e));
+		return -1;
+	}
+
+	ws->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (ws->timer_fd == -1) {
+		e = errno;
+		oclog(ws, LOG_ERR, "error in timerfd_create(): %s", strerror(e));
+		return -1;
+	}
+
+	/* see periodic_check() */
+	FUZZ(periodic_check_time, 5, tnow->tv_nsec);
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = periodic_check_time;
+	its.it_interval.tv_sec = periodic_check_time;
+	if (timerfd_settime(ws->timer_fd, 0, &its, NULL) == -1) {
+		e = errno;
+		oclog(ws, LOG_ERR, "error in timerfd_settime(): %s", strerror(e));
+		return -1;
+	}
+
+	if (worker_ev_add(ws, ws->conn_fd, WEV_CONN) < 0 ||
+	    worker_ev_add(ws, ws->cmd_fd, WEV_CMD) < 0 ||
+	    worker_ev_add(ws, ws->tun_fd, WEV_TUN) < 0 ||
+	    worker_ev_add(ws, ws->timer_fd, WEV_TIMER) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* The UDP descriptor is monitored only when the UDP channel is set up,
+ * and may be replaced by the main process at any time.
+ */
+static int worker_ev_sync_dtls(worker_st * ws)
+{
+	int fd = (ws->udp_state > UP_WAIT_FD) ? ws->dtls_tptr.fd : -1;
+
+	if (fd == ws->ev_dtls_fd)
+		return 0;
+
+	if (ws->ev_dtls_fd != -1)
+		epoll_ctl(ws->ev_fd, EPOLL_CTL_DEL, ws->ev_dtls_fd, NULL);
+	ws->ev_dtls_fd = -1;
+
+	if (fd != -1) {
+		if (worker_ev_add(ws, fd, WEV_DTLS) < 0)
+			return -1;
+		ws->ev_dtls_fd = fd;
+	}
+
+	return 0;
+}
+
+static unsigned worker_ev_wait(worker_st * ws, sigset_t *emptyset, int *err)
+{
+	struct epoll_event events[MAX_WORKER_EVENTS];
+	unsigned ready = 0;
+	uint64_t expirations;
+	int ret, i;
+
+	*err = 0;
+	ret = epoll_pwait(ws->ev_fd, events, MAX_WORKER_EVENTS, -1, emptyset);
+	if (ret == -1) {
+		*err = -1;
+		return 0;
+	}
+
+	for (i = 0; i < ret; i++)
+		ready |= events[i].data.u32;
+
+	if (ready & WEV_TIMER) {
+		if (read(ws->timer_fd, &expirations, sizeof(expirations)) < 0)
+			ready &= ~WEV_TIMER;
+	}
+
+	return ready;
+}
+#endif
+
 #define TOSCLASS(x) (IPTOS_CLASS_CS##x)
 
 static void set_net_priority(worker_st * ws, int fd, int priority)
@@ -1137,34 +1300,18 @@ static int tls_mainloop(struct worker_st *ws, struct timespec *tnow)
 	return ret;
 }
 
-static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
+/* Forwards the packet of l bytes at ws->buffer + 8 to the client.
+ * Returns 1 on success or a negative error code.
+ */
+static int tun_send_packet(struct worker_st *ws, int l, struct timespec *tnow)
 {
-	int ret, l, e;
+	int ret;
 	unsigned tls_retry;
 	int dtls_type = AC_PKT_DATA;
 	int cstp_type = AC_PKT_DATA;
 	gnutls_datum_t dtls_to_send;
 	gnutls_datum_t cstp_to_send;
 
-	l = tun_read(ws->tun_fd, ws->buffer + 8, ws->conn_mtu);
-	if (l < 0) {
-		e = errno;
-
-		if (e != EAGAIN && e != EINTR) {
-			oclog(ws, LOG_ERR,
-			      "received corrupt data from tun (%d): %s",
-			      l, strerror(e));
-			return -1;
-		}
-
-		return 0;
-	}
-
-	if (l == 0) {
-		oclog(ws, LOG_INFO, "TUN device returned zero");
-		return 0;
-	}
-
 
 	dtls_to_send.data = ws->buffer;
 	dtls_to_send.size = l;
@@ -1242,9 +1389,119 @@ static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
 			ret = cstp_send(ws, cstp_to_send.data, cstp_to_send.size + 8);
 			FATAL_ERR_CMD(ws, ret, exit_worker_reason(ws, REASON_ERROR));
 		}
+		update_stats_slot(ws);
 		ws->last_nc_msg = tnow->tv_sec;
 	}
 
+	return 1;
+}
+
+#ifdef ENABLE_TUN_OFFLOAD
+struct tun_segment_ctx {
+	struct worker_st *ws;
+	struct timespec *tnow;
+};
+
+static int tun_segment_cb(void *priv, uint8_t *pkt, size_t pkt_size)
+{
+	struct tun_segment_ctx *ctx = priv;
+
+	/* the segments are written at ws->buffer + 8 */
+	return tun_send_packet(ctx->ws, pkt_size, ctx->tnow);
+}
+#endif
+
+/* Reads and forwards a single packet from the tun device. Returns 1 if
+ * a packet was read, 0 if there was none available, or a negative
+ * error code.
+ */
+static int tun_read_packet(struct worker_st *ws, struct timespec *tnow)
+{
+	int l, e;
+#ifdef ENABLE_TUN_OFFLOAD
+	struct tun_vnet_hdr vh;
+	struct tun_segment_ctx ctx;
+	int ret;
+
+	if (ws->tun_gso_buf != NULL)
+		l = read(ws->tun_fd, ws->tun_gso_buf, TUN_GSO_BUF_SIZE);
+	else
+#endif
+		l = tun_read(ws->tun_fd, ws->buffer + 8, ws->conn_mtu);
+	if (l < 0) {
+		e = errno;
+
+		if (e != EAGAIN && e != EINTR) {
+			oclog(ws, LOG_ERR,
+			      "received corrupt data from tun (%d): %s",
+			      l, strerror(e));
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (l == 0) {
+		oclog(ws, LOG_INFO, "TUN device returned zero");
+		return 0;
+	}
+
+#ifdef ENABLE_TUN_OFFLOAD
+	if (ws->tun_gso_buf != NULL) {
+		if (l <= sizeof(vh)) {
+			oclog(ws, LOG_DEBUG, "TUN device returned a short packet");
+			return 1;
+		}
+		memcpy(&vh, ws->tun_gso_buf, sizeof(vh));
+
+		ctx.ws = ws;
+		ctx.tnow = tnow;
+		ret = tun_gso_segment(&vh, ws->tun_gso_buf + sizeof(vh), l - sizeof(vh),
+				      ws->buffer + 8, ws->conn_mtu, tun_segment_cb, &ctx);
+		if (ret == -1) {
+			oclog(ws, LOG_DEBUG, "could not segment TUN packet of %d bytes (GSO type: %u)",
+			      l, (unsigned)vh.gso_type);
+			return 1;
+		}
+		if (ret < 0)
+			return ret;
+		return 1;
+	}
+#endif
+
+	return tun_send_packet(ws, l, tnow);
+}
+
+/* Drains the tun device up to the configured batch size, so that
+ * the cost of the main loop is amortized over several packets under
+ * bulk transfers.
+ */
+static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
+{
+	unsigned i;
+	int ret = 0, e;
+
+	/* queue the DTLS records and send them at once */
+	if (ws->udp_state == UP_ACTIVE)
+		dtls_cork(ws);
+
+	for (i = 0; i < ws->config->tun_read_batch; i++) {
+		ret = tun_read_packet(ws, tnow);
+		if (ret <= 0)
+			break;
+	}
+
+	if (dtls_uncork(ws) < 0) {
+		e = errno;
+		if (e == EMSGSIZE) {
+			mtu_not_ok(ws);
+		} else {
+			oclog(ws, LOG_ERR, "error sending UDP data: %s", strerror(e));
+		}
+	}
+
+	if (ret < 0)
+		return ret;
 	return 0;
 }
 
@@ -1331,15 +1588,18 @@ static int send_routes(worker_st *ws, struct http_req_st *req,
 static int connect_handler(worker_st * ws)
 {
 	struct http_req_st *req = &ws->req;
+#ifndef USE_EPOLL
 	fd_set rfds;
-	int e, max, ret, t;
-	char *p;
-	unsigned rnd;
-#ifdef HAVE_PSELECT
+# ifdef HAVE_PSELECT
 	struct timespec tv;
-#else
+# else
 	struct timeval tv;
+# endif
 #endif
+	int e, max, ret, t;
+	unsigned ready;
+	char *p;
+	unsigned rnd;
 	unsigned tls_pending, dtls_pending = 0, i;
 	struct timespec tnow;
 	unsigned ip6;
@@ -1719,6 +1979,20 @@ static int connect_handler(worker_st * ws)
 	set_non_block(ws->conn_fd);
 	set_net_priority(ws, ws->conn_fd, ws->config->net_priority);
 
+	/* we drain the tun device in tun_mainloop() */
+	set_non_block(ws->tun_fd);
+
+#ifdef ENABLE_TUN_OFFLOAD
+	if (ws->config->tun_offload) {
+		/* the device was set up for offload by main */
+		ws->tun_gso_buf = talloc_size(ws, TUN_GSO_BUF_SIZE);
+		if (ws->tun_gso_buf == NULL) {
+			oclog(ws, LOG_ERR, "memory error");
+			goto exit;
+		}
+	}
+#endif
+
 	if (ws->udp_state != UP_DISABLED) {
 
 		p = (char *)ws->buffer;
@@ -1867,9 +2141,16 @@ static int connect_handler(worker_st * ws)
 
 	sigprocmask(SIG_BLOCK, &blockset, NULL);
 
+#ifdef USE_EPOLL
+	if (worker_ev_init(ws, &tnow) < 0) {
+		terminate_reason = REASON_ERROR;
+		goto exit;
+	}
+#endif
+
 	/* worker main loop  */
 	for (;;) {
-		FD_ZERO(&rfds);
+		ready = 0;
 
 		if (terminate != 0) {
  terminate:
@@ -1902,7 +2183,34 @@ static int connect_handler(worker_st * ws)
 			dtls_pending = 0;
 		}
 
+#ifdef USE_EPOLL
+		if (worker_ev_sync_dtls(ws) < 0) {
+			terminate_reason = REASON_ERROR;
+			goto exit;
+		}
+
 		if (tls_pending == 0 && dtls_pending == 0) {
+			ready = worker_ev_wait(ws, &emptyset, &ret);
+			if (ret == -1) {
+				if (errno == EINTR)
+					continue;
+				terminate_reason = REASON_ERROR;
+				goto exit;
+			}
+		}
+		gettime(&tnow);
+
+		if (ready & WEV_TIMER) {
+			if (run_periodic_check
+			    (ws, ws->proto_overhead + ws->crypto_overhead, tnow.tv_sec,
+			     ws->config->dpd) < 0) {
+				terminate_reason = REASON_ERROR;
+				goto exit;
+			}
+		}
+#else
+		if (tls_pending == 0 && dtls_pending == 0) {
+			FD_ZERO(&rfds);
 			FD_SET(ws->conn_fd, &rfds);
 			FD_SET(ws->cmd_fd, &rfds);
 			FD_SET(ws->tun_fd, &rfds);
@@ -1932,6 +2240,15 @@ static int connect_handler(worker_st * ws)
 				terminate_reason = REASON_ERROR;
 				goto exit;
 			}
+
+			if (FD_ISSET(ws->conn_fd, &rfds))
+				ready |= WEV_CONN;
+			if (FD_ISSET(ws->cmd_fd, &rfds))
+				ready |= WEV_CMD;
+			if (FD_ISSET(ws->tun_fd, &rfds))
+				ready |= WEV_TUN;
+			if (ws->udp_state > UP_WAIT_FD && FD_ISSET(ws->dtls_tptr.fd, &rfds))
+				ready |= WEV_DTLS;
 		}
 		gettime(&tnow);
 
@@ -1941,9 +2258,10 @@ static int connect_handler(worker_st * ws)
 			terminate_reason = REASON_ERROR;
 			goto exit;
 		}
+#endif
 
 		/* send pending data from tun device */
-		if (FD_ISSET(ws->tun_fd, &rfds)) {
+		if (ready & WEV_TUN) {
 			ret = tun_mainloop(ws, &tnow);
 			if (ret < 0) {
 				terminate_reason = REASON_ERROR;
@@ -1952,7 +2270,7 @@ static int connect_handler(worker_st * ws)
 		}
 
 		/* read pending data from TCP channel */
-		if (FD_ISSET(ws->conn_fd, &rfds) || tls_pending != 0) {
+		if ((ready & WEV_CONN) || tls_pending != 0) {
 			ret = tls_mainloop(ws, &tnow);
 			if (ret < 0) {
 				terminate_reason = REASON_ERROR;
@@ -1962,7 +2280,7 @@ static int connect_handler(worker_st * ws)
 
 		/* read data from UDP channel */
 		if (ws->udp_state > UP_WAIT_FD &&
-		    (FD_ISSET(ws->dtls_tptr.fd, &rfds) || dtls_pending != 0)) {
+		    ((ready & WEV_DTLS) || dtls_pending != 0)) {
 
 			ret = dtls_mainloop(ws, &tnow);
 			if (ret < 0) {
@@ -1972,7 +2290,7 @@ static int connect_handler(worker_st * ws)
 		}
 
 		/* read commands from command fd */
-		if (FD_ISSET(ws->cmd_fd, &rfds)) {
+		if (ready & WEV_CMD) {
 			ret = handle_worker_commands(ws);
 			if (ret == ERR_NO_CMD_FD) {
 				terminate_reason = REASON_ERROR;
@@ -2098,7 +2416,12 @@ static int parse_data(struct worker_st *ws, uint8_t *buf, size_t buf_size,
 	case AC_PKT_DATA:
 		oclog(ws, LOG_TRANSFER_DEBUG, "writing %d byte(s) to TUN",
 		      (int)plain_size);
-		ret = tun_write(ws->tun_fd, plain, plain_size);
+#ifdef ENABLE_TUN_OFFLOAD
+		if (ws->tun_gso_buf != NULL)
+			ret = tun_write_vnet(ws->tun_fd, plain, plain_size);
+		else
+#endif
+			ret = tun_write(ws->tun_fd, plain, plain_size);
 		if (ret == -1) {
 			e = errno;
 			oclog(ws, LOG_ERR, "could not write data to tun: %s",
@@ -2106,6 +2429,7 @@ static int parse_data(struct worker_st *ws, uint8_t *buf, size_t buf_size,
 			return -1;
 		}
 		ws->tun_bytes_in += plain_size;
+		update_stats_slot(ws);
 		ws->last_nc_msg = now;
 
 		break;
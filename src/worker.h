@@ -34,6 +34,7 @@
 #include <common.h>
 #include <str.h>
 #include <worker-bandwidth.h>
+#include <stats-table.h>
 #include <stdbool.h>
 #include <sys/un.h>
 #include <sys/uio.h>
@@ -146,10 +147,28 @@ struct http_req_st {
 	unsigned authorization_size;
 };
 
+/* The number of datagrams transferred per recvmmsg() or sendmmsg() */
+#define DTLS_BATCH_SIZE 16
+
+/* DTLS_BATCH_SIZE datagram slots of slot_size bytes each */
+typedef struct dtls_batch_st {
+	uint8_t *data;
+	unsigned slot_size;
+	unsigned size[DTLS_BATCH_SIZE];
+	unsigned count; /* the filled slots */
+	unsigned pos; /* the next slot to be consumed (rx only) */
+} dtls_batch_st;
+
 typedef struct dtls_transport_ptr {
 	int fd;
 	UdpFdMsg *msg; /* holds the data of the first client hello */
 	int consumed;
+
+	/* see worker-udp.c; NULL when not in use */
+	dtls_batch_st *rx;
+	dtls_batch_st *tx;
+	unsigned corked;
+	unsigned gso; /* whether UDP_SEGMENT is used on tx */
 } dtls_transport_ptr;
 
 #if defined(__FreeBSD__) || defined(__OpenBSD__)
@@ -176,6 +195,12 @@ typedef struct worker_st {
 	int cmd_fd;
 	int conn_fd;
 	sock_type_t conn_type; /* AF_UNIX or something else */
+
+	/* the main loop's epoll and timer descriptors, and the UDP
+	 * descriptor currently registered (-1 when none) */
+	int ev_fd;
+	int timer_fd;
+	int ev_dtls_fd;
 	
 	http_parser *parser;
 	struct cfg_st *config;
@@ -261,6 +286,7 @@ typedef struct worker_st {
 	uint8_t session_id[GNUTLS_MAX_SESSION_ID];
 	unsigned cert_auth_ok;
 	int tun_fd;
+	uint8_t *tun_gso_buf; /* non-NULL in the TUN offload mode */
 
 	/* ban points to be sent on exit */
 	unsigned ban_points;
@@ -269,6 +295,13 @@ typedef struct worker_st {
 	uint64_t tun_bytes_in;
 	uint64_t tun_bytes_out;
 
+	/* the table shared with main, used until the worker maps
+	 * only its own slot; if stats is NULL, the stats are sent
+	 * periodically to sec-mod */
+	struct stats_table_st stats_table;
+	int stats_slot;
+	struct stats_slot_st *stats;
+
 	/* information on the tun device addresses and network */
 	struct vpn_st vinfo;
 	unsigned default_route;
@@ -339,6 +372,7 @@ unsigned check_if_default_route(char **routes, unsigned routes_size);
 
 int send_tun_mtu(worker_st *ws, unsigned int mtu);
 int handle_worker_commands(struct worker_st *ws);
+int worker_recv_startup(worker_st * ws);
 int disable_system_calls(struct worker_st *ws);
 void ocsigaltstack(struct worker_st *ws);
 
@@ -369,6 +403,16 @@ int send_msg_to_main(worker_st *ws, uint8_t cmd,
 
 int parse_proxy_proto_header(struct worker_st *ws, int fd);
 
+/* worker-udp.c */
+int dtls_batch_init(struct worker_st *ws);
+void dtls_batch_reset(dtls_transport_ptr *p);
+unsigned dtls_batch_pending(dtls_transport_ptr *p);
+ssize_t dtls_batch_recv(dtls_transport_ptr *p, void *data, size_t size);
+ssize_t dtls_batch_send(dtls_transport_ptr *p, const void *data, size_t size);
+int dtls_batch_flush(dtls_transport_ptr *p);
+void dtls_cork(struct worker_st *ws);
+int dtls_uncork(struct worker_st *ws);
+
 /* after that time (secs) of inactivity in the UDP part, connection switches to 
  * TCP (if activity occurs there).
  */
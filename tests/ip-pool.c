@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../src/ip-pool.h"
+
+#define POOL_SIZE 1024
+
+static uint8_t used[POOL_SIZE];
+static unsigned calls;
+
+static int avail(void *priv, uint32_t offset)
+{
+	calls++;
+	/* offset 0 is reserved */
+	return offset != 0 && used[offset] == 0;
+}
+
+static uint32_t get(struct ip_pool_st *p)
+{
+	uint32_t o;
+
+	if (ip_pool_get(p, avail, NULL, &o) < 0) {
+		fprintf(stderr, "error in %d: pool exhausted\n", __LINE__);
+		exit(1);
+	}
+	if (o >= POOL_SIZE || used[o] != 0) {
+		fprintf(stderr, "error in %d: offset %u is in use\n", __LINE__, (unsigned)o);
+		exit(1);
+	}
+	used[o] = 1;
+	return o;
+}
+
+static void put(struct ip_pool_st *p, uint32_t o)
+{
+	used[o] = 0;
+	ip_pool_put(p, o);
+}
+
+int main()
+{
+	struct ip_pool_st *p;
+	uint32_t o, i;
+
+	p = ip_pool_new(NULL, POOL_SIZE);
+	if (p == NULL) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* offsets leased out of order are skipped */
+	used[5] = 1;
+	used[700] = 1;
+
+	for (i = 0; i < POOL_SIZE - 3; i++)
+		get(p);
+
+	if (ip_pool_get(p, avail, NULL, &o) != -1) {
+		fprintf(stderr, "error in %d: got %u from a full pool\n", __LINE__, (unsigned)o);
+		exit(1);
+	}
+
+	/* released offsets are re-used in FIFO order */
+	put(p, 100);
+	put(p, 700);
+	put(p, 3);
+
+	if (get(p) != 100 || get(p) != 700 || get(p) != 3) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* an offset leased again before its turn is dropped */
+	put(p, 10);
+	put(p, 20);
+	used[10] = 1;
+	if (get(p) != 20) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* double releases are ignored */
+	put(p, 30);
+	put(p, 30);
+	get(p);
+	if (ip_pool_get(p, avail, NULL, &o) != -1) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* busy offsets are skipped until the pool is exhausted */
+	put(p, 40);
+	put(p, 50);
+	o = get(p);
+	used[o] = 0;
+	if (o != 40 || ip_pool_set_busy(p, o) < 0 || get(p) != 50) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+	if (get(p) != 40) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+	if (ip_pool_get(p, avail, NULL, &o) != -1) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* the cost of allocation does not depend on utilization */
+	for (i = 1; i < POOL_SIZE; i++)
+		put(p, i);
+	calls = 0;
+	for (i = 1; i < POOL_SIZE; i++)
+		get(p);
+	if (calls != POOL_SIZE - 1) {
+		fprintf(stderr, "error in %d: %u calls\n", __LINE__, calls);
+		exit(1);
+	}
+
+	talloc_free(p);
+
+	return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../src/slab.h"
+
+#define MAX_SIZE (4*1024)
+#define ENTRIES 512
+
+static char *bufs[ENTRIES];
+static size_t sizes[ENTRIES];
+
+int main()
+{
+	struct slab_st *slab;
+	size_t pages;
+	unsigned i, j;
+	void *p, *p2;
+
+	slab = slab_new(NULL, MAX_SIZE);
+	if (slab == NULL) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* classes of 256 up to 4096 bytes */
+	if (slab->classes_size != 5 || slab->classes[4].size != MAX_SIZE) {
+		fprintf(stderr, "error in %d: %u classes\n", __LINE__, slab->classes_size);
+		exit(1);
+	}
+
+	if (slab_alloc(slab, MAX_SIZE + 1) != NULL) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* buffers do not overlap */
+	for (i = 0; i < ENTRIES; i++) {
+		sizes[i] = 1 + (i * 97) % MAX_SIZE;
+		bufs[i] = slab_alloc(slab, sizes[i]);
+		if (bufs[i] == NULL) {
+			fprintf(stderr, "error in %d\n", __LINE__);
+			exit(1);
+		}
+		memset(bufs[i], i & 0xff, sizes[i]);
+	}
+
+	for (i = 0; i < ENTRIES; i++) {
+		for (j = 0; j < sizes[i]; j++) {
+			if ((uint8_t)bufs[i][j] != (i & 0xff)) {
+				fprintf(stderr, "error in %d: buffer %u was overwritten\n", __LINE__, i);
+				exit(1);
+			}
+		}
+	}
+
+	/* small buffers are not served from large classes */
+	if (slab->classes[0].used == 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* released buffers are re-used within their class */
+	p = slab_alloc(slab, 100);
+	slab_free(slab, p, 100);
+	p2 = slab_alloc(slab, 200);
+	if (p != p2) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+	slab_free(slab, p2, 200);
+
+	pages = slab->pages;
+	for (i = 0; i < ENTRIES; i++)
+		slab_free(slab, bufs[i], sizes[i]);
+
+	for (i = 0; i < slab->classes_size; i++) {
+		if (slab->classes[i].used != 0) {
+			fprintf(stderr, "error in %d: class %u has %u used\n", __LINE__,
+				i, (unsigned)slab->classes[i].used);
+			exit(1);
+		}
+	}
+
+	/* no new memory is needed to serve the same sizes again */
+	for (i = 0; i < ENTRIES; i++) {
+		bufs[i] = slab_alloc(slab, sizes[i]);
+		if (bufs[i] == NULL) {
+			fprintf(stderr, "error in %d\n", __LINE__);
+			exit(1);
+		}
+	}
+
+	if (slab->pages != pages) {
+		fprintf(stderr, "error in %d: %u vs %u\n", __LINE__,
+			(unsigned)slab->pages, (unsigned)pages);
+		exit(1);
+	}
+
+	talloc_free(slab);
+
+	return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../src/stats-table.h"
+
+#define SIZE 8
+#define UPDATES (1024*1024)
+
+int main()
+{
+	struct stats_table_st t;
+	struct stats_slot_st *p;
+	uint64_t in, out, last = 0;
+	unsigned i, consistent = 0;
+	int slot, slots[SIZE];
+	pid_t pid;
+	int status;
+
+	if (stats_table_init(NULL, &t, SIZE) < 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	for (i = 0; i < SIZE; i++) {
+		slots[i] = stats_table_get(&t);
+		if (slots[i] < 0) {
+			fprintf(stderr, "error in %d\n", __LINE__);
+			exit(1);
+		}
+	}
+
+	if (stats_table_get(&t) != -1) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* released slots are re-used in the order they were released */
+	stats_table_put(&t, slots[3]);
+	stats_table_put(&t, slots[1]);
+	if (stats_table_get(&t) != slots[3] || stats_table_get(&t) != slots[1]) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (stats_table_read(&t, SIZE, &in, &out) != -1 ||
+	    stats_table_read(&t, -1, &in, &out) != -1) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* the slot is updated by a child which has only that slot mapped;
+	 * the snapshots read are never torn */
+	slot = slots[5];
+	pid = fork();
+	if (pid == -1) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (pid == 0) {
+		p = stats_table_restrict(&t, slot);
+		if (p == NULL)
+			exit(1);
+		for (i = 1; i <= UPDATES; i++)
+			stats_slot_update(p, i, (uint64_t)i << 32);
+		exit(0);
+	}
+
+	do {
+		if (stats_table_read(&t, slot, &in, &out) == 0) {
+			if (out != in << 32 || in < last) {
+				fprintf(stderr, "error in %d: %lu/%lu\n", __LINE__,
+					(unsigned long)in, (unsigned long)(out >> 32));
+				kill(pid, SIGTERM);
+				exit(1);
+			}
+			last = in;
+			consistent++;
+		}
+	} while (last < UPDATES && waitpid(pid, &status, WNOHANG) == 0);
+
+	if (waitpid(pid, &status, 0) != pid && last < UPDATES) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (stats_table_read(&t, slot, &in, &out) < 0 || in != UPDATES ||
+	    out != (uint64_t)UPDATES << 32 || consistent == 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* slots are zeroed when handed out */
+	stats_table_put(&t, slot);
+	for (i = 0; i < SIZE; i++) {
+		if (stats_table_get(&t) == slot)
+			break;
+	}
+	if (stats_table_read(&t, slot, &in, &out) < 0 || in != 0 || out != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	stats_table_deinit(&t);
+
+	return 0;
+}
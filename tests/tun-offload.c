@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2015 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../src/tun-offload.h"
+
+#define PAYLOAD_SIZE 3000
+
+struct seg_st {
+	unsigned count;
+	unsigned total;
+	uint32_t first_seq;
+	unsigned ipv6;
+};
+
+static unsigned sum16(const uint8_t *p, size_t len, unsigned sum)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (p[i] << 8) | p[i+1];
+	if (len & 1)
+		sum += p[len-1] << 8;
+	return sum;
+}
+
+static unsigned fold(unsigned sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+static int check_segment(void *priv, uint8_t *pkt, size_t pkt_size)
+{
+	struct seg_st *st = priv;
+	unsigned ip_hlen = st->ipv6 ? 40 : 20;
+	unsigned tcp_size = pkt_size - ip_hlen;
+	unsigned sum;
+	uint32_t seq;
+	unsigned i;
+
+	if (st->ipv6) {
+		if (((pkt[4] << 8) | pkt[5]) != tcp_size) {
+			fprintf(stderr, "error in %d: wrong payload length\n", __LINE__);
+			exit(1);
+		}
+		sum = sum16(pkt + 8, 32, 0);
+	} else {
+		if (((pkt[2] << 8) | pkt[3]) != pkt_size) {
+			fprintf(stderr, "error in %d: wrong total length\n", __LINE__);
+			exit(1);
+		}
+		if (fold(sum16(pkt, 20, 0)) != 0xffff) {
+			fprintf(stderr, "error in %d: wrong IPv4 checksum\n", __LINE__);
+			exit(1);
+		}
+		if (((pkt[4] << 8) | pkt[5]) != 0x1234 + st->count) {
+			fprintf(stderr, "error in %d: wrong IPv4 ID\n", __LINE__);
+			exit(1);
+		}
+		sum = sum16(pkt + 12, 8, 0);
+	}
+
+	sum += 6 + tcp_size;
+	if (fold(sum16(pkt + ip_hlen, tcp_size, sum)) != 0xffff) {
+		fprintf(stderr, "error in %d: wrong TCP checksum\n", __LINE__);
+		exit(1);
+	}
+
+	seq = ((uint32_t)pkt[ip_hlen+4] << 24) | (pkt[ip_hlen+5] << 16) |
+	      (pkt[ip_hlen+6] << 8) | pkt[ip_hlen+7];
+	if (seq != st->first_seq + st->total) {
+		fprintf(stderr, "error in %d: wrong sequence number\n", __LINE__);
+		exit(1);
+	}
+
+	/* FIN only in the last segment */
+	if (st->total + tcp_size - 20 < PAYLOAD_SIZE && (pkt[ip_hlen+13] & 0x01)) {
+		fprintf(stderr, "error in %d: FIN in intermediate segment\n", __LINE__);
+		exit(1);
+	}
+
+	for (i = 0; i < tcp_size - 20; i++) {
+		if (pkt[ip_hlen + 20 + i] != (uint8_t)(st->total + i)) {
+			fprintf(stderr, "error in %d: wrong payload\n", __LINE__);
+			exit(1);
+		}
+	}
+
+	st->total += tcp_size - 20;
+	st->count++;
+	return 0;
+}
+
+static size_t make_packet(uint8_t *pkt, unsigned ipv6)
+{
+	unsigned ip_hlen = ipv6 ? 40 : 20;
+	unsigned i;
+
+	memset(pkt, 0, ip_hlen + 20);
+	if (ipv6) {
+		pkt[0] = 0x60;
+		pkt[6] = 6;
+		pkt[8] = 0xfe;
+		pkt[9] = 0x80;
+		pkt[23] = 1;
+		pkt[24] = 0xfe;
+		pkt[25] = 0x80;
+		pkt[39] = 2;
+	} else {
+		pkt[0] = 0x45;
+		pkt[4] = 0x12;
+		pkt[5] = 0x34;
+		pkt[8] = 64;
+		pkt[9] = 6;
+		pkt[12] = 192; pkt[13] = 168; pkt[14] = 1; pkt[15] = 1;
+		pkt[16] = 192; pkt[17] = 168; pkt[18] = 1; pkt[19] = 2;
+	}
+
+	pkt[ip_hlen + 4] = 0xff; /* sequence number that wraps */
+	pkt[ip_hlen + 5] = 0xff;
+	pkt[ip_hlen + 6] = 0xfc;
+	pkt[ip_hlen + 7] = 0x00;
+	pkt[ip_hlen + 12] = 5 << 4;
+	pkt[ip_hlen + 13] = 0x19; /* FIN|PSH|ACK */
+
+	for (i = 0; i < PAYLOAD_SIZE; i++)
+		pkt[ip_hlen + 20 + i] = (uint8_t)i;
+
+	return ip_hlen + 20 + PAYLOAD_SIZE;
+}
+
+static void test_tcp(unsigned ipv6, unsigned mss, unsigned out_size, unsigned expected)
+{
+	static uint8_t pkt[4096], out[2048];
+	struct tun_vnet_hdr vh;
+	struct seg_st st;
+	size_t size;
+	int ret;
+
+	size = make_packet(pkt, ipv6);
+
+	memset(&vh, 0, sizeof(vh));
+	vh.flags = TUN_VNET_F_NEEDS_CSUM;
+	vh.gso_type = ipv6 ? TUN_VNET_GSO_TCPV6 : TUN_VNET_GSO_TCPV4;
+	vh.gso_size = mss;
+
+	memset(&st, 0, sizeof(st));
+	st.ipv6 = ipv6;
+	st.first_seq = 0xfffffc00;
+
+	ret = tun_gso_segment(&vh, pkt, size, out, out_size, check_segment, &st);
+	if (ret != 0) {
+		fprintf(stderr, "error in %d: %d\n", __LINE__, ret);
+		exit(1);
+	}
+
+	if (st.total != PAYLOAD_SIZE || st.count != expected) {
+		fprintf(stderr, "error in %d: got %u segments, %u bytes\n", __LINE__,
+			st.count, st.total);
+		exit(1);
+	}
+}
+
+static int count_cb(void *priv, uint8_t *pkt, size_t pkt_size)
+{
+	(*(unsigned*)priv)++;
+	return 0;
+}
+
+int main()
+{
+	struct tun_vnet_hdr vh;
+	uint8_t pkt[4096], out[2048];
+	unsigned count = 0;
+	int ret;
+
+	test_tcp(0, 1000, sizeof(out), 3);
+	test_tcp(1, 1000, sizeof(out), 3);
+	test_tcp(0, 1400, sizeof(out), 3);
+
+	/* segments are reduced to fit the output */
+	test_tcp(0, 1400, 540, 6);
+	test_tcp(1, 1400, 560, 6);
+
+	/* a packet without GSO is passed as is */
+	memset(&vh, 0, sizeof(vh));
+	memset(pkt, 0, sizeof(pkt));
+	pkt[0] = 0x45;
+	ret = tun_gso_segment(&vh, pkt, 100, out, sizeof(out), count_cb, &count);
+	if (ret != 0 || count != 1 || memcmp(pkt, out, 100) != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* unsupported GSO types are rejected */
+	vh.gso_type = 3; /* UDP */
+	ret = tun_gso_segment(&vh, pkt, 100, out, sizeof(out), count_cb, &count);
+	if (ret != -1) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	return 0;
+}